@@ -11,8 +11,8 @@ BIN_DIR="../bin"
 PLUGIN_DIR="../plugins"
 echo "">$LOG
 # Build geod executable
-GEOD_SOURCES="data.c data_table.c data_sql.c data_geo.c hashmap.c cmd.c"
-GEOD_SOURCES="$GEOD_SOURCES config.c http.c cache.c handlers.c sync.c json_indexlist.c pluginhst.c"
+GEOD_SOURCES="data.c data_table.c data_sql.c data_geo.c dbresult.c hashmap.c cmd.c"
+GEOD_SOURCES="$GEOD_SOURCES config.c http.c cache.c resultcache.c handlers.c sync.c json_indexlist.c pluginhst.c"
 GEOD_SOURCES="$GEOD_SOURCES geod.c "
 $CC $CFLAGS -o geod $GEOD_SOURCES -lpng -ldl -lpthread -lm -lssl -lcrypto -ljson-c 2>>$LOG
 
@@ -28,11 +28,15 @@ $CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o cgi.so plugin_cgi/plugin_cgi.c 2>>$L
 # Control plugin
 $CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o control.so plugin_control/plugin_control.c sync.c 2>>$LOG
 # WS plugin
-$CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o ws.so plugin_ws/plugin_ws.c plugin_ws/ws.c -lssl -lcrypto -ljson-c 2>>$LOG
+$CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o ws.so dbresult.c plugin_ws/plugin_ws.c plugin_ws/ws.c plugin_ws/wspos.c plugin_ws/wsgrid.c plugin_ws/wssync.c plugin_ws/wsreg.c -lssl -lcrypto -lz -lm -ljson-c 2>>$LOG
 # HTTP Hello plugin
 $CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o http_hello.so plugin_http_hello/plugin_http_hello.c 2>>$LOG
-# Image plugin
-$CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o image.so plugin_image/plugin_image.c -lpng 2>>$LOG
+# Image plugin, lossless WebP encoder when libwebp is installed
+WEBP_FLAGS=""
+if pkg-config --exists libwebp 2>/dev/null; then
+    WEBP_FLAGS="-DHAVE_WEBP $(pkg-config --cflags --libs libwebp)"
+fi
+$CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o image.so plugin_image/plugin_image.c -lpng $WEBP_FLAGS 2>>$LOG
 # Texture plugin
 $CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o texture.so plugin_texture/plugin_texture.c -lm 2>>$LOG
 # map plugin
@@ -44,9 +48,9 @@ $CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o region.so plugin_region/plugin_regio
 # Shape plugin
 $CC $CFLAGS $SHARED_FLAGS $INCLUDE_FLAGS -o shape.so plugin_shape/plugin_shape.c plugin_shape/shape.c plugin_shape/plan.c -lm 2>>$LOG
 # DB MySQL plugin
-$CC -fPIC -shared -g -std=c99 -O0 -o db_mysql.so sync.c plugin_db/plugin_mysql.c -I/usr/include/mysql -I. -I.. -lmysqlclient 2>>$LOG
+$CC -fPIC -shared -g -std=c99 -O0 -o db_mysql.so sync.c dbresult.c plugin_db/plugin_mysql.c plugin_db/dbpool.c plugin_db/dbstmt.c plugin_db/dbuser.c -I/usr/include/mysql -I. -I.. -lmysqlclient 2>>$LOG
 # DB SQLite plugin
-$CC -fPIC -shared -g -std=c99 -O0 -o db_sqlite.so plugin_db/plugin_sqlite.c -I. -I.. $(pkg-config --cflags --libs sqlite3) 2>>$LOG
+$CC -fPIC -shared -g -std=c99 -O0 -o db_sqlite.so dbresult.c plugin_db/plugin_sqlite.c plugin_db/dbstmt.c plugin_db/sqlitepool.c -I. -I.. $(pkg-config --cflags --libs sqlite3) 2>>$LOG
 
 # Move compiled binaries to their destination only on 'install'
 if [[ "$1" == "install" ]]; then
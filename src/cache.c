@@ -71,6 +71,13 @@ void cachedir_init(const char *path) {
 void cachesystem_init(void){
     config_get_string("CACHE", "dir", g_cache_dir, MAX_PATH, CACHE_DIR);
     cachedir_init(g_cache_dir);
+    size_t result_memory = (size_t)config_get_int("CACHE", "result_memory_mb", CACHE_RESULT_MEMORY_DEFAULT / (1024 * 1024)) * 1024 * 1024;
+    if (cache_result_init(result_memory, config_get_int("CACHE", "result_ttl_sec", CACHE_RESULT_TTL_DEFAULT))) {
+        errormsg("Failed to initialize the result cache");
+    }
+}
+void cachesystem_destroy(void){
+    cache_result_destroy();
 }
 // respond with the configured cache dir
 const char* cache_get_dir(void){
@@ -11,6 +11,7 @@
 #ifndef CACHE_H
 #define CACHE_H
 #include "global.h"
+#include "resultcache.h"
 
 
 typedef struct CacheFile {
@@ -29,6 +30,16 @@ typedef struct CacheHostInterface
     int (*file_rename)(CacheFile *cf, const char *name);
     int (*file_exists_recent)(CacheFile *cf);
     int (*file_write)(CacheFile *cf, const void *buf, size_t size);
+    // In-memory results, see resultcache.h
+    int (*result_key)(char *key, size_t size, const char *query, const DbValue *params, int param_count);
+    unsigned long (*result_generation)(void);
+    CacheResult *(*result_get)(const char *key);
+    const void *(*result_data)(const CacheResult *r, size_t *len);
+    void (*result_release)(CacheResult *r);
+    int (*result_put)(const char *key, const char *tags, const void *data, size_t len, int ttl_sec, unsigned long generation);
+    int (*result_invalidate)(const char *table);
+    int (*result_invalidate_sql)(const char *sql);
+    void (*result_stats)(CacheResultStats *st);
 }
 CacheHostInterface;
 
@@ -37,6 +48,7 @@ extern char g_cache_dir[MAX_PATH]; // temoporary export
 
 // main program needs this
 void cachesystem_init(void);
+void cachesystem_destroy(void);
 const char* cache_get_dir(void);
 
 // subsystems
@@ -11,10 +11,11 @@
  *  user data pointer lifetime is actually longer than a
  * user session, therefore the users array indexed element
  * directly provided for other layers, and they can keep
- * and use the pointer during operation. This design pattern
- * is a little bit risky if users array need to be reordered
- * later. So, be carefull when do a refactoring in these
- * implementations... (but the actual one is fast at least)
+ * and use the pointer during operation. The users live in an
+ * arena of fixed size chunks: it grows by new chunks, and
+ * the existing ones never move, so the index (the handle)
+ * and the pointer of a user stay valid. Do not reorder
+ * or compact the users without taking care of this.
  */
 #define _GNU_SOURCE
 #include <time.h>
@@ -23,6 +24,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "global.h"
 #include "sync.h"
@@ -31,27 +33,27 @@
 #include "json_indexlist.h"
 
 #define DATA_GEO_LOCK_TIMEOUT (1000)
+#define GEO_USER_CHUNK (64) // users per arena chunk
+#define GEO_FILE_VERSION (2)
 
 /** internal geo_data instance
  * serializable to a local file (load-store)
- * indexed by session and id , using json hash search */
+ * indexed by session and id, using hash search */
 typedef struct geo_data_t {
     json_indexlist_t session_index;
     json_indexlist_t userid_index;
     size_t users_count;
-    user_data_t users[MAX_USERS];
+    user_data_t **user_chunks;  // arena, GEO_USER_CHUNK users each
+    size_t chunk_count;
     sync_mutex_t *lock_users;
 } geo_data_t;
 
-// file header for load-store format
+// file header for load-store format, the indexes are rebuilt on load
 typedef struct __attribute__((__packed__)) geo_file_header_t {
     unsigned int version;
     size_t user_data_size;
     size_t users_number;
-    size_t json_session_len;
-    size_t json_id_len;
-    uint32_t json_session_crc;
-    uint32_t json_id_crc;
+    uint32_t users_crc;
     uint32_t head_crc; //(without this)
 } geo_file_header_t;
 
@@ -78,6 +80,46 @@ uint32_t crc32c(uint32_t crc, const unsigned char *buf, size_t len)
     }
     return ~crc;
 }
+/** geo_user_at
+ * The user at index of the arena, NULL if its chunk is not allocated.
+ */
+static user_data_t *geo_user_at(geo_data_t *geo_data, size_t index) {
+    size_t chunk = index / GEO_USER_CHUNK;
+    if (chunk >= geo_data->chunk_count) return NULL;
+    return &geo_data->user_chunks[chunk][index % GEO_USER_CHUNK];
+}
+
+/** geo_users_reserve
+ * Allocate the chunks for count users, the existing ones stay in place.
+ * Returns 0 or -1.
+ */
+static int geo_users_reserve(geo_data_t *geo_data, size_t count) {
+    size_t chunks = (count + GEO_USER_CHUNK - 1) / GEO_USER_CHUNK;
+    if (chunks <= geo_data->chunk_count) return 0;
+    user_data_t **dir = realloc(geo_data->user_chunks, chunks * sizeof(user_data_t *));
+    if (!dir) return -1;
+    geo_data->user_chunks = dir;
+    while (geo_data->chunk_count < chunks) {
+        user_data_t *chunk = calloc(GEO_USER_CHUNK, sizeof(user_data_t));
+        if (!chunk) return -1;
+        dir[geo_data->chunk_count++] = chunk;
+    }
+    return 0;
+}
+
+/** geo_users_free
+ * Free the arena.
+ */
+static void geo_users_free(geo_data_t *geo_data) {
+    for (size_t i = 0; i < geo_data->chunk_count; i++) {
+        free(geo_data->user_chunks[i]);
+    }
+    free(geo_data->user_chunks);
+    geo_data->user_chunks = NULL;
+    geo_data->chunk_count = 0;
+    geo_data->users_count = 0;
+}
+
 /** macro, to help file format error handling */
 #define GEOFF_STOP_IF(cond) if (cond){ line = __LINE__; goto stop;}
 
@@ -88,25 +130,23 @@ int geo_store(geo_data_t *geo_data, const char* fname) {
     int line = __LINE__;
     if (fp){
         geo_file_header_t head;
-        head.version = 1;
+        head.version = GEO_FILE_VERSION;
         head.user_data_size = sizeof(user_data_t);
         head.users_number = geo_data->users_count;
-        const char* strss = json_object_to_json_string(geo_data->session_index.list);
-        head.json_session_len= strlen(strss);
-        const char *strsi = json_object_to_json_string(geo_data->userid_index.list);
-        head.json_id_len= strlen(strsi);
-        head.json_session_crc = crc32c(0, (const unsigned char*)strss, head.json_session_len);
-        head.json_id_crc = crc32c(0, (const unsigned char*)strsi, head.json_id_len);
+        head.users_crc = 0;
+        for (size_t i = 0; i < head.users_number; i += GEO_USER_CHUNK) {
+            size_t n = head.users_number - i < GEO_USER_CHUNK ? head.users_number - i : GEO_USER_CHUNK;
+            head.users_crc = crc32c(head.users_crc, (const unsigned char*)geo_user_at(geo_data, i), n * sizeof(user_data_t));
+        }
         head.head_crc = crc32c(0, (const unsigned char*)&head, sizeof(head)-4);
         size_t wn = sizeof(head);
         size_t w = fwrite(&head, 1, wn, fp);
         GEOFF_STOP_IF(w != wn);
-        w = fwrite(geo_data->users, head.user_data_size, head.users_number, fp);
-        GEOFF_STOP_IF(w != head.users_number);
-        w = fwrite(strss, 1, head.json_session_len, fp);
-        GEOFF_STOP_IF(w != head.json_session_len);
-        w = fwrite(strsi, 1, head.json_id_len, fp);
-        GEOFF_STOP_IF(w != head.json_id_len);
+        for (size_t i = 0; i < head.users_number; i += GEO_USER_CHUNK) {
+            size_t n = head.users_number - i < GEO_USER_CHUNK ? head.users_number - i : GEO_USER_CHUNK;
+            w = fwrite(geo_user_at(geo_data, i), head.user_data_size, n, fp);
+            GEOFF_STOP_IF(w != n);
+        }
         res=0;
     }
 stop:
@@ -126,33 +166,32 @@ int geo_load(geo_data_t *geo_data, const char* fname) {
         geo_file_header_t head;
         size_t r = fread(&head, 1, sizeof(geo_file_header_t), fp);
         GEOFF_STOP_IF(r != sizeof(geo_file_header_t));
-        GEOFF_STOP_IF( head.version != 1);
+        GEOFF_STOP_IF( head.version != GEO_FILE_VERSION);
         GEOFF_STOP_IF( head.user_data_size != sizeof(user_data_t));
         uint32_t crc= crc32c(0, (const unsigned char*)&head, sizeof(head)-4);
         GEOFF_STOP_IF (crc != head.head_crc);
         geo_data->users_count = 0; // because we change the users array now
-        r = fread(geo_data->users, head.user_data_size, head.users_number, fp);
-        GEOFF_STOP_IF(r != head.users_number);
-        char *str = malloc(head.json_session_len);
-        GEOFF_STOP_IF(!str);
-        r = fread(str, 1, head.json_session_len, fp);
-        GEOFF_STOP_IF(r != head.json_session_len);
-        crc = crc32c(0, (const unsigned char*)str, head.json_session_len);
-        GEOFF_STOP_IF(crc != head.json_session_crc);
-        json_object *obj = json_tokener_parse(str);
-        json_object_put(geo_data->session_index.list);
-        geo_data->session_index.list = obj;
-        free(str);
-        str= malloc(head.json_id_len);
-        GEOFF_STOP_IF(!str);
-        r = fread(str, 1, head.json_id_len, fp);
-        GEOFF_STOP_IF(r != head.json_id_len);
-        crc = crc32c(0, (const unsigned char*)str, head.json_id_len);
-        GEOFF_STOP_IF(crc != head.json_id_crc);
-        obj = json_tokener_parse(str);
-        json_object_put(geo_data->userid_index.list);
-        geo_data->userid_index.list = obj;
-        free(str);
+        GEOFF_STOP_IF(geo_users_reserve(geo_data, head.users_number));
+        crc = 0;
+        for (size_t i = 0; i < head.users_number; i += GEO_USER_CHUNK) {
+            size_t n = head.users_number - i < GEO_USER_CHUNK ? head.users_number - i : GEO_USER_CHUNK;
+            user_data_t *chunk = geo_user_at(geo_data, i);
+            r = fread(chunk, head.user_data_size, n, fp);
+            GEOFF_STOP_IF(r != n);
+            crc = crc32c(crc, (const unsigned char*)chunk, n * sizeof(user_data_t));
+        }
+        GEOFF_STOP_IF(crc != head.users_crc);
+        json_indexlist_clear(&geo_data->session_index);
+        json_indexlist_clear(&geo_data->userid_index);
+        for (size_t i = 0; i < head.users_number; i++) {
+            user_data_t *user = geo_user_at(geo_data, i);
+            char key[32];
+            user->session_key[MAX_SESSION_KEY_SIZE - 1] = '\0';
+            user->nick[MAX_NICK_SIZE - 1] = '\0';
+            if (user->session_key[0]) json_indexlist_add(&geo_data->session_index, user->session_key, i);
+            snprintf(key, sizeof(key), "%d", user->id);
+            json_indexlist_add(&geo_data->userid_index, key, i);
+        }
         geo_data->users_count = head.users_number;
         res=0; // success without an error.
     }
@@ -170,6 +209,8 @@ int geo_init(geo_data_t *geo_data){
         json_indexlist_init(&geo_data->session_index);
         json_indexlist_init(&geo_data->userid_index);
         geo_data->users_count = 0;
+        geo_data->user_chunks = NULL;
+        geo_data->chunk_count = 0;
         sync_mutex_init(&geo_data->lock_users);
     }else{
         errormsg("Wrong argument in geo_init.");
@@ -183,6 +224,7 @@ void geo_destroy(geo_data_t *geo_data){
     if (geo_data){
         json_indexlist_destroy(&geo_data->session_index);
         json_indexlist_destroy(&geo_data->userid_index);
+        geo_users_free(geo_data);
         sync_mutex_destroy(geo_data->lock_users);
     }else{
         errormsg("Wrong argument in geo_destroy");
@@ -223,11 +265,11 @@ int geo_user_delete_session_key(data_handle_t *dh, const char* session_key){
 
 /** add user internal */
 int geo_add_user_locked(geo_data_t *geo_data, data_handle_t *dh, user_data_t* user, size_t *index){
-    if (geo_data->users_count >= MAX_USERS) {
+    if (geo_users_reserve(geo_data, geo_data->users_count + 1)) {
         return -1;
     }
     *index= geo_data->users_count++;
-    geo_data->users[*index] = *user;
+    *geo_user_at(geo_data, *index) = *user;
     geo_user_add_session_key(dh, user->session_key, *index);
     geo_user_add_user_id_key(dh, user->id, *index);
     return 0;
@@ -238,12 +280,12 @@ int geo_add_user(data_handle_t *dh, user_data_t* user) {
     geo_data_t* geo_data = (geo_data_t* )dh->instance;
     
     if (sync_mutex_lock(geo_data->lock_users, DATA_GEO_LOCK_TIMEOUT)) return -1;
-    if (geo_data->users_count >= MAX_USERS) {
+    if (geo_users_reserve(geo_data, geo_data->users_count + 1)) {
         sync_mutex_unlock(geo_data->lock_users);
         return -1;
     }
     int index= geo_data->users_count++;
-    geo_data->users[index] = *user;
+    *geo_user_at(geo_data, index) = *user;
     // check , if something need to be delete before this?
     geo_user_add_session_key(dh, user->session_key, index);
     geo_user_add_user_id_key(dh, user->id, index);
@@ -260,7 +302,7 @@ int geo_get_user(data_handle_t *dh, int idx, user_data_t **out_user) {
         *out_user = NULL;
         return -1;
     }
-    *out_user = &geo_data->users[idx];
+    *out_user = geo_user_at(geo_data, idx);
     sync_mutex_unlock(geo_data->lock_users);
     return 0;
 }
@@ -296,7 +338,7 @@ user_data_t* geo_find_user_by_session(data_handle_t *dh, const char* session_key
     if (sync_mutex_lock(geo_data->lock_users, DATA_GEO_LOCK_TIMEOUT)) return NULL;
     user_data_t* user_ptr = NULL;
     if (index < geo_data->users_count){
-        user_ptr = &geo_data->users[index];
+        user_ptr = geo_user_at(geo_data, index);
     }
     sync_mutex_unlock(geo_data->lock_users);
     return user_ptr;
@@ -309,7 +351,7 @@ user_data_t* geo_find_user_by_user_id(data_handle_t *dh, int id) {
     if (sync_mutex_lock(geo_data->lock_users, DATA_GEO_LOCK_TIMEOUT)) return NULL;
     user_data_t* user_ptr = NULL;
     if (index < geo_data->users_count){
-        user_ptr = &geo_data->users[index];
+        user_ptr = geo_user_at(geo_data, index);
     }
     sync_mutex_unlock(geo_data->lock_users);
     return user_ptr;
@@ -340,8 +382,8 @@ int geo_set_user(data_handle_t *dh, user_data_t *user) {
     geo_find_user_index_by_user_id(dh, user->id, &anindex_by_user_id);
     if (user->index == GEO_INDEX_INVALID){
         if(anindex_by_user_id != GEO_INDEX_INVALID) {
-            if (anindex_by_session != GEO_INDEX_INVALID) {
-                user_data_t* existing_user_by_session = &geo_data->users[anindex_by_session];
+            if (anindex_by_session < geo_data->users_count) {
+                user_data_t* existing_user_by_session = geo_user_at(geo_data, anindex_by_session);
                 if (existing_user_by_session->id == user->id) {
                     user->index = anindex_by_session;
                     *existing_user_by_session=*user;
@@ -363,7 +405,11 @@ int geo_set_user(data_handle_t *dh, user_data_t *user) {
         }
     }
     if (user->index != GEO_INDEX_INVALID) {
-        geo_data->users[user->index] = *user;
+        if (user->index >= geo_data->users_count) {
+            sync_mutex_unlock(geo_data->lock_users);
+            return -1;
+        }
+        *geo_user_at(geo_data, user->index) = *user;
     }else{
         geo_add_user_locked(geo_data, dh, user, &user->index);
         sync_mutex_unlock(geo_data->lock_users);
@@ -11,19 +11,20 @@
 #define DATA_GEO_H
 #include "data.h"
 
-#define MAX_USERS (100)
 #define MAX_SESSION_KEY_SIZE (64)
 #define MAX_NICK_SIZE (64)
 
 /** user data record type
  * holds one user: session_key, internal index, user_id
- * lat, lon, alt, version, nick name.
+ * lat, lon, alt, heading, time of the last position, version, nick name.
  */
 typedef struct {
     char session_key[MAX_SESSION_KEY_SIZE];
     size_t index;
     int id;
     double lat, lon, alt;
+    double heading;
+    unsigned int pos_timestamp;
     unsigned int version;
     char nick[MAX_NICK_SIZE];
 } user_data_t;
@@ -5,7 +5,8 @@
  * 
  * Data layer sql specific part
  * Key features:
- *  execute query
+ *  execute query, blocking or asynchronous with tickets and callbacks,
+ *  any number of outstanding queries per instance
  */
 #define _GNU_SOURCE
 #include <time.h>
@@ -14,40 +15,50 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define PLUGINHST_STATIC_LINKED
 #include "data.h"
 #include "data_sql.h"
 #include "plugin.h"
 // #include "pluginhst.h"
-#include "sync.h"
 
 volatile int g_data_sql_abort = 0;
 
-#ifndef DATA_SQL_LONG_RUN_LOOP
-#define DATA_SQL_LONG_RUN_LOOP()  {static unsigned int count=0; if (count++ > 0xFFFFFFFFU) break;} // documentation of the possible endless loop.
-#endif // DATA_SQL_LONG_RUN_LOOP
-
-#define DATA_SQL_LOCK_TIMEOUT (1000)
+#define DATA_SQL_WAIT_TIMEOUT (1000)    // ms, of the blocking execute
 
 //this one is preliminary due to later we could move this to a plugin...
 // extern PluginHostInterface g_plugin_host;
 extern PluginHostInterface *g_host; //= &g_plugin_host;
 
-// Updated sql_data_t definition, which is an instance? or user data
-typedef struct {
-    DbQuery *query;
-    sync_mutex_t *lock;
-    sync_cond_t *cond;
-    int ready;
-} sql_internal_db_request_t;
-
 // actually singleton, but lets define the class ype:
 typedef struct sql_data_t{
-    sql_internal_db_request_t request; // maybe multiple requests in the future ?
+    pthread_mutex_t lock;
+    pthread_cond_t idle;            // outstanding dropped to zero
+    int outstanding;                // submitted, not completed yet
+    int max_outstanding;
+    unsigned long submitted;
+    unsigned long completed;
     int initialized;
 }sql_data_t;
 
+// A submitted query, shared by the caller and the db thread
+struct data_sql_ticket {
+    DbQuery query;                  // the own copy, the db writes the result here
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int result;
+    int refs;                       // the db, and the caller if it holds the ticket
+    int abandoned;                  // the caller gave up, no more row callbacks
+    DbRowProc row_proc;             // of the caller
+    void *row_user_data;
+    sql_done_fn done_fn;
+    void *user_data;
+    sql_data_t *inst;
+    char texts[];                   // copy of the bound texts
+};
+
 int data_sql_init();
 void data_sql_destroy();
 int data_sql_load();
@@ -62,39 +73,137 @@ const data_descriptor_class_t g_data_descriptor_sql = {
     .store = data_sql_store,
 };
 
+/** data_sql_deadline
+ * The monotonic time timeout_ms from now.
+ */
+static struct timespec data_sql_deadline(unsigned int timeout_ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000l;
+    if (ts.tv_nsec >= 1000000000l) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000l;
+    }
+    return ts;
+}
+static void data_sql_cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/** data_sql_instance_init
+ * Empty instance, no outstanding query.
+ */
+static void data_sql_instance_init(sql_data_t *inst) {
+    memset(inst, 0, sizeof(*inst));
+    pthread_mutex_init(&inst->lock, NULL);
+    data_sql_cond_init(&inst->idle);
+    inst->initialized = 1;
+}
+
+/** data_sql_unref
+ * Drop a reference of the ticket, the last one frees it.
+ */
+static void data_sql_unref(data_sql_ticket_t *t) {
+    pthread_mutex_lock(&t->lock);
+    int refs = --t->refs;
+    pthread_mutex_unlock(&t->lock);
+    if (refs) return;
+    db_result_free(t->query.result);   // not taken
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+/** data_sql_row_proc
+ * Streaming rows go to the caller's row_proc until it abandons the ticket.
+ */
+static int data_sql_row_proc(const DbRow *row, void *user_data) {
+    data_sql_ticket_t *t = (data_sql_ticket_t *)user_data;
+    int rc = 1;
+    pthread_mutex_lock(&t->lock);
+    if (!t->abandoned) rc = t->row_proc(row, t->row_user_data);
+    pthread_mutex_unlock(&t->lock);
+    return rc;
+}
+
+/** data_sql_queue_callback
+ * Completion from the db thread: the done callback, then the waiters.
+ */
 void data_sql_queue_callback(PluginContext* dbplugin, DbQuery *req, void *user_data){
     (void)dbplugin;
-    (void)req;
-    sql_internal_db_request_t *res = (sql_internal_db_request_t *)user_data;
-    if (!sync_mutex_lock(res->lock, DATA_SQL_LOCK_TIMEOUT)){
-        res->ready = 1;
-        sync_cond_signal(res->cond);
-        sync_mutex_unlock(res->lock);
+    data_sql_ticket_t *t = (data_sql_ticket_t *)user_data;
+    int result = req->result_count;
+    pthread_mutex_lock(&t->lock);
+    int abandoned = t->abandoned;
+    pthread_mutex_unlock(&t->lock);
+    if (t->done_fn && !abandoned) {
+        t->done_fn(t, &t->query, result, t->user_data);
     }
+    pthread_mutex_lock(&t->lock);
+    t->result = result;
+    t->done = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    sql_data_t *inst = t->inst;
+    pthread_mutex_lock(&inst->lock);
+    inst->completed++;
+    if (--inst->outstanding == 0) pthread_cond_broadcast(&inst->idle);
+    pthread_mutex_unlock(&inst->lock);
+    data_sql_unref(t);
 }
 
-sql_internal_db_request_t* data_sql_prepare_instance(sql_data_t *inst, DbQuery *db_query){
-    if (!inst){
-        return NULL;
+/** data_sql_ticket_new
+ * Ticket with a copy of the query and of its bound texts.
+ */
+static data_sql_ticket_t *data_sql_ticket_new(const DbQuery *db_query) {
+    size_t texts = 0;
+    for (int i = 0; i < db_query->param_count && i < DB_QUERY_MAX_PARAMS; i++) {
+        const DbValue *v = &db_query->params[i];
+        if ((v->type == DB_TYPE_TEXT || v->type == DB_TYPE_BLOB) && v->s) texts += v->len + 1;
+    }
+    data_sql_ticket_t *t = calloc(1, sizeof(data_sql_ticket_t) + texts);
+    if (!t) return NULL;
+    DbQuery *q = &t->query;
+    memcpy(q->query, db_query->query, sizeof(q->query));
+    q->flags = db_query->flags & ~DB_QUERY_TRUNCATED;
+    q->param_count = db_query->param_count;
+    memcpy(q->params, db_query->params, sizeof(q->params));
+    char *text = t->texts;
+    for (int i = 0; i < q->param_count && i < DB_QUERY_MAX_PARAMS; i++) {
+        DbValue *v = &q->params[i];
+        if ((v->type == DB_TYPE_TEXT || v->type == DB_TYPE_BLOB) && v->s) {
+            memcpy(text, v->s, v->len);
+            text[v->len] = 0;
+            v->s = text;
+            text += v->len + 1;
+        }
     }
-    if (!db_query){
-        return NULL;
+    if (db_query->row_proc) {
+        t->row_proc = db_query->row_proc;
+        t->row_user_data = db_query->row_user_data;
+        q->row_proc = data_sql_row_proc;
+        q->row_user_data = t;
     }
-    inst->initialized = 1;
-    sql_internal_db_request_t* req = &inst->request;
-    req->ready = 0;
-    db_query->result_count =0;
-    req->query = db_query;
-    return req;
+    pthread_mutex_init(&t->lock, NULL);
+    data_sql_cond_init(&t->cond);
+    return t;
 }
 
-int data_sql_execute(data_handle_t *handle, DbQuery *db_query) {
+int data_sql_submit(data_handle_t *handle, const DbQuery *db_query, DbPriority priority,
+    sql_done_fn done, void *user_data, data_sql_ticket_t **ticket) {
+    if (ticket) *ticket = NULL;
     PluginContext *pcmysql = get_plugin_context("mysql");
     if (!pcmysql) {
         errormsg("Failed to get plugin context for mysql");
         return -1;
     }
-    if (!handle || !handle->instance) {
+    if (!handle || !handle->instance || !db_query) {
         errormsg("Invalid data handle");
         return -1;
     }
@@ -102,37 +211,121 @@ int data_sql_execute(data_handle_t *handle, DbQuery *db_query) {
         errormsg("Failed to start plugin context for mysql");
         return -1;
     }
-    // not fully used until internal pool.. later.
-    sql_data_t* sql_data = (sql_data_t*)handle->instance;
-    sql_internal_db_request_t* req = data_sql_prepare_instance(sql_data, db_query);
-    if (!req) {
-        errormsg("Instance request pull full?");
+    sql_data_t* inst = (sql_data_t*)handle->instance;
+    data_sql_ticket_t *t = data_sql_ticket_new(db_query);
+    if (!t) {
+        errormsg("No memory for the sql ticket");
+        plugin_stop(pcmysql->id);
         return -1;
-    }     
-    // Lock and enqueue
-    if (sync_mutex_lock(req->lock, DATA_SQL_LOCK_TIMEOUT)) {
-        return -2;
     }
+    t->done_fn = done;
+    t->user_data = user_data;
+    t->inst = inst;
+    t->refs = ticket ? 2 : 1;
+    pthread_mutex_lock(&inst->lock);
+    inst->submitted++;
+    if (++inst->outstanding > inst->max_outstanding) inst->max_outstanding = inst->outstanding;
+    pthread_mutex_unlock(&inst->lock);
+    if (ticket) *ticket = t;   // before the request: the completion may come at once
     // g_host->db.  // todo , when db router at the host side is ready, we can use it, but plugin context is needed.
-    pcmysql->db.request(db_query, data_sql_queue_callback, (void*)req); // queue_push(&req);
-    while (!req->ready) {
-        if (g_data_sql_abort) {
-            errormsg("SQL wait aborted globally.");
-            break;
-        }
-        if (sync_cond_wait(req->cond, req->lock, DATA_SQL_LOCK_TIMEOUT)) {
-            break; // todo: return to caller with an error ? or let them know due to result_count is zero anyway...
-        }
-        DATA_SQL_LONG_RUN_LOOP();
+    int rc = 0;
+    if (pcmysql->db.request(&t->query, priority, data_sql_queue_callback, (void*)t)) {
+        // rejected, the callback never comes
+        pthread_mutex_lock(&inst->lock);
+        inst->submitted--;
+        if (--inst->outstanding == 0) pthread_cond_broadcast(&inst->idle);
+        pthread_mutex_unlock(&inst->lock);
+        if (ticket) *ticket = NULL;
+        t->refs = 1;
+        data_sql_unref(t);
+        rc = DATA_SQL_REJECTED;
     }
-    sync_mutex_unlock(req->lock);
-
+    // the request is owned by the plugin's own threads now
     plugin_stop(pcmysql->id);
-    return db_query->result_count;
+    return rc;
+}
+
+int data_sql_wait(data_sql_ticket_t *t, unsigned int timeout_ms) {
+    if (!t) return -1;
+    struct timespec deadline = data_sql_deadline(timeout_ms);
+    pthread_mutex_lock(&t->lock);
+    while (!t->done && !g_data_sql_abort) {
+        if (pthread_cond_timedwait(&t->cond, &t->lock, &deadline) == ETIMEDOUT) break;
+    }
+    int rc = t->done ? t->result : DATA_SQL_TIMEOUT;
+    pthread_mutex_unlock(&t->lock);
+    return rc;
+}
+
+DbQuery *data_sql_ticket_query(data_sql_ticket_t *t) {
+    if (!t) return NULL;
+    pthread_mutex_lock(&t->lock);
+    int done = t->done;
+    pthread_mutex_unlock(&t->lock);
+    return done ? &t->query : NULL;
+}
+
+void data_sql_release(data_sql_ticket_t *t) {
+    if (t) data_sql_unref(t);
+}
+
+/** data_sql_abandon
+ * The caller gives up waiting: its row_proc is not called any more.
+ */
+static void data_sql_abandon(data_sql_ticket_t *t) {
+    pthread_mutex_lock(&t->lock);
+    t->abandoned = 1;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/** data_sql_take
+ * Move the result of the completed ticket into the caller's query.
+ */
+static void data_sql_take(data_sql_ticket_t *t, DbQuery *db_query) {
+    DbQuery *q = &t->query;
+    int rows = q->result_count < DB_QUERY_MAX_ROWS ? q->result_count : DB_QUERY_MAX_ROWS;
+    if (!q->row_proc && !(q->flags & DB_QUERY_TYPED) && rows > 0) {
+        memcpy(db_query->rows, q->rows, (size_t)rows * sizeof(q->rows[0]));
+    }
+    db_query->result_count = q->result_count;
+    db_query->flags = (db_query->flags & ~DB_QUERY_TRUNCATED) | (q->flags & DB_QUERY_TRUNCATED);
+    if (db_query->result != q->result) db_result_free(db_query->result);
+    db_query->result = q->result;
+    q->result = NULL;
+}
+
+/** data_sql_execute_prio
+ * Blocking query through the mysql plugin's queue.
+ * Returns the number of rows, DATA_SQL_REJECTED if the queue is full,
+ * DATA_SQL_TIMEOUT, or another negative value on error.
+ */
+int data_sql_execute_prio(data_handle_t *handle, DbQuery *db_query, DbPriority priority) {
+    data_sql_ticket_t *t;
+    if (!db_query) return -1;
+    int rc = data_sql_submit(handle, db_query, priority, NULL, NULL, &t);
+    if (rc) return rc;
+    rc = data_sql_wait(t, DATA_SQL_WAIT_TIMEOUT);
+    if (rc == DATA_SQL_TIMEOUT) {
+        errormsg("SQL wait %s.", g_data_sql_abort ? "aborted globally" : "timed out");
+        data_sql_abandon(t);
+        db_query->result_count = -1;
+    } else {
+        data_sql_take(t, db_query);
+    }
+    data_sql_release(t);
+    return rc;
+}
+int data_sql_execute(data_handle_t *handle, DbQuery *db_query) {
+    return data_sql_execute_prio(handle, db_query, DB_PRIORITY_NORMAL);
 }
 /** specific api descriptor */
 const data_api_sql_t g_data_api_sql = {
-    .execute = data_sql_execute
+    .execute = data_sql_execute,
+    .execute_prio = data_sql_execute_prio,
+    .submit = data_sql_submit,
+    .wait = data_sql_wait,
+    .query = data_sql_ticket_query,
+    .release = data_sql_release
 };
 
 int data_sql_init() {
@@ -142,7 +335,7 @@ int data_sql_init() {
         fprintf(stderr, "Failed to allocate sql_data\n");
         return -1;
     }
-    sql_data->initialized = 1;
+    data_sql_instance_init(sql_data);
     // g_data_descriptor_sql.init(sql_data, g_data_descriptor_sql.name);
 
     int result = data_register_instance(
@@ -155,11 +348,10 @@ int data_sql_init() {
 
     if (result < 0) {
         fprintf(stderr, "Failed to register sql_data instance\n");
+        pthread_cond_destroy(&sql_data->idle);
+        pthread_mutex_destroy(&sql_data->lock);
         free(sql_data);
         return -1;
-    }else{
-        sync_mutex_init(&sql_data->request.lock);
-        sync_cond_init(&sql_data->request.cond);
     }
     return 0;
 }
@@ -167,9 +359,21 @@ void data_sql_destroy(void) {
     g_data_sql_abort = 1;
     sql_data_t* sql_data = data_get_instance(g_data_descriptor_sql.name);
     if (sql_data) {
-        sync_mutex_destroy(sql_data->request.lock);
-        sync_cond_destroy(sql_data->request.cond);
         data_unregister_instance(g_data_descriptor_sql.name);
+        // the outstanding tickets still count on the instance
+        struct timespec deadline = data_sql_deadline(DATA_SQL_WAIT_TIMEOUT);
+        pthread_mutex_lock(&sql_data->lock);
+        while (sql_data->outstanding) {
+            if (pthread_cond_timedwait(&sql_data->idle, &sql_data->lock, &deadline) == ETIMEDOUT) break;
+        }
+        int outstanding = sql_data->outstanding;
+        pthread_mutex_unlock(&sql_data->lock);
+        if (outstanding) {
+            errormsg("%d sql queries still outstanding, the instance is left", outstanding);
+            return;
+        }
+        pthread_cond_destroy(&sql_data->idle);
+        pthread_mutex_destroy(&sql_data->lock);
         free(sql_data);
     }
 }
@@ -5,7 +5,8 @@
  * 
  * Data layer sql specific part
  * Key features:
- *  execute query
+ *  execute query, blocking or asynchronous with tickets and callbacks,
+ *  any number of outstanding queries per instance
  */
 #ifndef DATA_SQL_H
 #define DATA_SQL_H
@@ -13,9 +14,66 @@
 #include "data.h"
 #include "plugin.h"
 
+// execute result when the db queue rejected the request (overloaded), HTTP 503
+#define DATA_SQL_REJECTED   (-3)
+// the blocking wait ran out of time, the request was abandoned
+#define DATA_SQL_TIMEOUT    (-4)
+
+/** data_sql_ticket_t
+ * One submitted query. The ticket owns a copy of the query (with the bound
+ * texts), so the caller's DbQuery may go away after the submit.
+ */
+typedef struct data_sql_ticket data_sql_ticket_t;
+
+/** sql_done_fn
+ * Completion of a submitted query, called once, from the db thread: it must
+ * not block. result is the number of rows or negative on error. The query
+ * is the ticket's one, the callback may take its result (set it to NULL),
+ * otherwise it is freed with the ticket.
+ */
+typedef void (*sql_done_fn)(data_sql_ticket_t *ticket, DbQuery *query, int result, void *user_data);
+
 typedef int (*sql_execute_fn)(data_handle_t *dh, DbQuery *db_query);
+typedef int (*sql_execute_prio_fn)(data_handle_t *dh, DbQuery *db_query, DbPriority priority);
+typedef int (*sql_submit_fn)(data_handle_t *dh, const DbQuery *db_query, DbPriority priority,
+    sql_done_fn done, void *user_data, data_sql_ticket_t **ticket);
+typedef int (*sql_wait_fn)(data_sql_ticket_t *ticket, unsigned int timeout_ms);
+typedef DbQuery *(*sql_ticket_query_fn)(data_sql_ticket_t *ticket);
+typedef void (*sql_release_fn)(data_sql_ticket_t *ticket);
 typedef struct {
-    sql_execute_fn execute;
+    sql_execute_fn execute;             // blocking, DB_PRIORITY_NORMAL
+    sql_execute_prio_fn execute_prio;   // blocking
+    // asynchronous: submit, then wait for the ticket or get the callback
+    sql_submit_fn submit;
+    sql_wait_fn wait;
+    sql_ticket_query_fn query;
+    sql_release_fn release;
 } data_api_sql_t;
 
+/** data_sql_submit
+ * Queue a copy of the query, it does not wait. done (optional) is called
+ * when it completes. If ticket is not NULL the caller gets a ticket, which
+ * must be given back by data_sql_release, done or not.
+ * Returns 0, DATA_SQL_REJECTED if the queue is full, or -1.
+ */
+int data_sql_submit(data_handle_t *handle, const DbQuery *db_query, DbPriority priority,
+    sql_done_fn done, void *user_data, data_sql_ticket_t **ticket);
+/** data_sql_wait
+ * Wait up to timeout_ms for the ticket. Returns the number of rows, a
+ * negative error, or DATA_SQL_TIMEOUT if it is still running.
+ */
+int data_sql_wait(data_sql_ticket_t *ticket, unsigned int timeout_ms);
+/** data_sql_ticket_query
+ * The completed query of the ticket (rows, result), NULL while it runs.
+ */
+DbQuery *data_sql_ticket_query(data_sql_ticket_t *ticket);
+/** data_sql_release
+ * Give back the ticket. A running query is not stopped, its callbacks still
+ * come, the ticket is freed when it completes.
+ */
+void data_sql_release(data_sql_ticket_t *ticket);
+
+int data_sql_execute(data_handle_t *handle, DbQuery *db_query);
+int data_sql_execute_prio(data_handle_t *handle, DbQuery *db_query, DbPriority priority);
+
 #endif // DATA_SQL_H
\ No newline at end of file
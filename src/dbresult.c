@@ -0,0 +1,264 @@
+/*
+ * File:    dbresult.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-01
+ *
+ * Typed result set of the db queries, see dbresult.h.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "plugin.h"
+#include "dbresult.h"
+
+#define DB_RESULT_BLOCK_SIZE    (4096)
+#define DB_RESULT_MIN_ROWS      (16)
+
+typedef struct DbResultBlock {
+    struct DbResultBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} DbResultBlock;
+
+/** db_result_strdup
+ * Copy len bytes and a terminating zero into the blocks.
+ */
+static const char *db_result_strdup(DbResult *r, const char *s, size_t len) {
+    DbResultBlock *b = r->blocks;
+    if (!b || b->size - b->used < len + 1) {
+        size_t size = len + 1 > DB_RESULT_BLOCK_SIZE ? len + 1 : DB_RESULT_BLOCK_SIZE;
+        b = malloc(sizeof(DbResultBlock) + size);
+        if (!b) return NULL;
+        b->used = 0;
+        b->size = size;
+        b->next = r->blocks;
+        r->blocks = b;
+    }
+    char *d = b->data + b->used;
+    memcpy(d, s, len);
+    d[len] = 0;
+    b->used += len + 1;
+    return d;
+}
+
+DbResult *db_result_new(size_t column_count) {
+    DbResult *r = calloc(1, sizeof(DbResult));
+    if (!r) return NULL;
+    r->column_count = column_count;
+    if (column_count) {
+        r->columns = calloc(column_count, sizeof(DbColumn));
+        if (!r->columns) {
+            free(r);
+            return NULL;
+        }
+        for (size_t i = 0; i < column_count; i++) {
+            r->columns[i].name = "";
+            r->columns[i].type = DB_TYPE_TEXT;
+        }
+    }
+    return r;
+}
+
+void db_result_free(DbResult *r) {
+    if (!r) return;
+    DbResultBlock *b = r->blocks;
+    while (b) {
+        DbResultBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    free(r->columns);
+    free(r->values);
+    free(r);
+}
+
+int db_result_set_column(DbResult *r, size_t col, const char *name, DbType type) {
+    if (!r || col >= r->column_count) return -1;
+    if (name) {
+        name = db_result_strdup(r, name, strlen(name));
+        if (!name) return -1;
+        r->columns[col].name = name;
+    }
+    r->columns[col].type = type;
+    return 0;
+}
+
+int db_result_add_row(DbResult *r, const DbValue *values) {
+    if (!r || (!values && r->column_count)) return -1;
+    if (r->row_count == r->row_capacity) {
+        size_t capacity = r->row_capacity ? r->row_capacity * 2 : DB_RESULT_MIN_ROWS;
+        size_t cells = capacity * (r->column_count ? r->column_count : 1);
+        DbValue *v = realloc(r->values, cells * sizeof(DbValue));
+        if (!v) return -1;
+        r->values = v;
+        r->row_capacity = capacity;
+    }
+    DbValue *row = r->values + r->row_count * r->column_count;
+    for (size_t i = 0; i < r->column_count; i++) {
+        row[i] = values[i];
+        if (values[i].type != DB_TYPE_NULL && values[i].s) {
+            row[i].s = db_result_strdup(r, values[i].s, values[i].len);
+            if (!row[i].s) return -1;
+        }
+    }
+    r->row_count++;
+    return 0;
+}
+
+int db_result_row(const DbResult *r, size_t index, DbRow *row) {
+    if (!r || !row || index >= r->row_count) return -1;
+    row->columns = r->columns;
+    row->column_count = r->column_count;
+    row->values = r->values + index * r->column_count;
+    row->index = index;
+    return 0;
+}
+
+int db_result_column_index(const DbResult *r, const char *name) {
+    if (!r || !name) return -1;
+    for (size_t i = 0; i < r->column_count; i++) {
+        if (r->columns[i].name && !strcmp(r->columns[i].name, name)) return (int)i;
+    }
+    return -1;
+}
+
+static const DbValue *db_row_value(const DbRow *row, size_t col) {
+    if (!row || col >= row->column_count) return NULL;
+    const DbValue *v = &row->values[col];
+    return v->type == DB_TYPE_NULL ? NULL : v;
+}
+
+int db_row_is_null(const DbRow *row, size_t col) {
+    return db_row_value(row, col) == NULL;
+}
+
+long long db_row_int(const DbRow *row, size_t col, long long def) {
+    const DbValue *v = db_row_value(row, col);
+    if (!v) return def;
+    if (v->type == DB_TYPE_INT) return v->i;
+    if (v->type == DB_TYPE_DOUBLE) return (long long)v->d;
+    return v->s ? strtoll(v->s, NULL, 10) : def;
+}
+
+double db_row_double(const DbRow *row, size_t col, double def) {
+    const DbValue *v = db_row_value(row, col);
+    if (!v) return def;
+    if (v->type == DB_TYPE_DOUBLE) return v->d;
+    if (v->type == DB_TYPE_INT) return (double)v->i;
+    return v->s ? strtod(v->s, NULL) : def;
+}
+
+const char *db_row_text(const DbRow *row, size_t col) {
+    const DbValue *v = db_row_value(row, col);
+    return v ? v->s : NULL;
+}
+
+DbValue db_value_parse(DbType type, const char *text, size_t len) {
+    DbValue v;
+    memset(&v, 0, sizeof(v));
+    if (!text) return v;   // DB_TYPE_NULL
+    v.type = type;
+    v.s = text;
+    v.len = len;
+    if (type == DB_TYPE_INT) v.i = strtoll(text, NULL, 10);
+    else if (type == DB_TYPE_DOUBLE) v.d = strtod(text, NULL);
+    else if (type == DB_TYPE_NULL) v.type = DB_TYPE_TEXT;
+    return v;
+}
+
+/** db_query_bind
+ * Append a parameter.
+ */
+static int db_query_bind(DbQuery *q, DbValue v) {
+    if (!q || q->param_count < 0 || q->param_count >= DB_QUERY_MAX_PARAMS) return -1;
+    q->params[q->param_count++] = v;
+    q->flags |= DB_QUERY_PREPARED;
+    return 0;
+}
+
+int db_query_bind_int(DbQuery *q, long long value) {
+    DbValue v;
+    memset(&v, 0, sizeof(v));
+    v.type = DB_TYPE_INT;
+    v.i = value;
+    return db_query_bind(q, v);
+}
+
+int db_query_bind_double(DbQuery *q, double value) {
+    DbValue v;
+    memset(&v, 0, sizeof(v));
+    v.type = DB_TYPE_DOUBLE;
+    v.d = value;
+    return db_query_bind(q, v);
+}
+
+int db_query_bind_text(DbQuery *q, const char *value) {
+    if (!value) return db_query_bind_null(q);
+    DbValue v;
+    memset(&v, 0, sizeof(v));
+    v.type = DB_TYPE_TEXT;
+    v.s = value;
+    v.len = strlen(value);
+    return db_query_bind(q, v);
+}
+
+int db_query_bind_null(DbQuery *q) {
+    DbValue v;
+    memset(&v, 0, sizeof(v));
+    return db_query_bind(q, v);
+}
+
+int db_query_begin(DbQuery *q, const DbColumn *columns, size_t column_count) {
+    if (!q) return -1;
+    q->result_count = 0;
+    q->flags &= ~DB_QUERY_TRUNCATED;
+    if (!(q->flags & DB_QUERY_TYPED) || q->row_proc) return 0;
+    db_result_free(q->result);
+    q->result = db_result_new(column_count);
+    if (!q->result) return -1;
+    for (size_t i = 0; i < column_count; i++) {
+        if (db_result_set_column(q->result, i, columns[i].name, columns[i].type)) return -1;
+    }
+    return 0;
+}
+
+/** db_query_join
+ * Compatibility: the row joined by '|', NULL as empty.
+ */
+static void db_query_join(DbQuery *q, const DbRow *row) {
+    if (q->result_count >= DB_QUERY_MAX_ROWS) {
+        q->flags |= DB_QUERY_TRUNCATED;
+        return;
+    }
+    char *out = q->rows[q->result_count];
+    size_t size = sizeof(q->rows[0]);
+    size_t o = 0;
+    out[0] = 0;
+    for (size_t i = 0; i < row->column_count; i++) {
+        const char *s = db_row_text(row, i);
+        int n = snprintf(out + o, size - o, "%s%s", i ? "|" : "", s ? s : "");
+        if (n < 0 || (size_t)n >= size - o) {
+            q->flags |= DB_QUERY_TRUNCATED;
+            break;
+        }
+        o += (size_t)n;
+    }
+    q->result_count++;
+}
+
+int db_query_row(DbQuery *q, const DbRow *row) {
+    if (!q || !row) return -1;
+    if (q->row_proc) {
+        q->result_count++;
+        return q->row_proc(row, q->row_user_data) ? 1 : 0;
+    }
+    if (q->flags & DB_QUERY_TYPED) {
+        if (!q->result || db_result_add_row(q->result, row->values)) return -1;
+        q->result_count++;
+        return 0;
+    }
+    db_query_join(q, row);
+    return 0;
+}
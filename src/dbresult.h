@@ -0,0 +1,126 @@
+/*
+ * File:    dbresult.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-01
+ *
+ * Typed result set of the db queries
+ * Key features:
+ *  Columns with name and type, NULL aware values, any number of rows.
+ *  A value keeps its text form too, so the accessors convert on demand.
+ *  The strings are copied into blocks which never move, a value stays
+ *  valid until the result is freed.
+ *  The db plugins deliver the rows with db_query_begin / db_query_row,
+ *  which route them by the query's mode:
+ *   - streaming: the row_proc of the query is called for every row,
+ *   - typed: the rows are collected into query->result,
+ *   - compatibility: the first DB_QUERY_MAX_ROWS rows are joined by '|'
+ *     into query->rows, as before; DB_QUERY_TRUNCATED tells if some rows
+ *     or characters did not fit.
+ *  The parameters of a prepared query are bound as DbValues too.
+ */
+#ifndef DBRESULT_H
+#define DBRESULT_H
+
+#include <stddef.h>
+
+typedef enum {
+    DB_TYPE_NULL,
+    DB_TYPE_INT,
+    DB_TYPE_DOUBLE,
+    DB_TYPE_TEXT,
+    DB_TYPE_BLOB
+} DbType;
+
+typedef struct {
+    DbType type;            // DB_TYPE_NULL for a NULL value
+    long long i;            // DB_TYPE_INT
+    double d;               // DB_TYPE_DOUBLE
+    const char *s;          // text form, zero terminated (not for a NULL)
+    size_t len;
+} DbValue;
+
+typedef struct {
+    const char *name;
+    DbType type;
+} DbColumn;
+
+// One row, a view: valid during the row_proc call, or while its result lives.
+typedef struct {
+    const DbColumn *columns;
+    size_t column_count;
+    const DbValue *values;
+    size_t index;
+} DbRow;
+
+// Streaming callback, from the db thread. Nonzero stops the query.
+typedef int (*DbRowProc)(const DbRow *row, void *user_data);
+
+struct DbResultBlock;
+typedef struct DbResult {
+    DbColumn *columns;
+    size_t column_count;
+    DbValue *values;        // row_count * column_count
+    size_t row_count;
+    size_t row_capacity;
+    struct DbResultBlock *blocks;   // the copied strings
+} DbResult;
+
+/** db_result_new
+ * Empty result with column_count unnamed text columns, NULL on error.
+ */
+DbResult *db_result_new(size_t column_count);
+void db_result_free(DbResult *r);
+int db_result_set_column(DbResult *r, size_t col, const char *name, DbType type);
+/** db_result_add_row
+ * Append a row of column_count values, the strings are copied.
+ * Returns 0 or -1.
+ */
+int db_result_add_row(DbResult *r, const DbValue *values);
+/** db_result_row
+ * View of a row, returns -1 if it does not exist.
+ */
+int db_result_row(const DbResult *r, size_t index, DbRow *row);
+/** db_result_column_index
+ * Index of the named column or -1.
+ */
+int db_result_column_index(const DbResult *r, const char *name);
+
+/** db_row_is_null, db_row_int, db_row_double, db_row_text
+ * Typed access of a column, converted from the other types if needed.
+ * NULL values and missing columns give def (or NULL for the text).
+ */
+int db_row_is_null(const DbRow *row, size_t col);
+long long db_row_int(const DbRow *row, size_t col, long long def);
+double db_row_double(const DbRow *row, size_t col, double def);
+const char *db_row_text(const DbRow *row, size_t col);
+
+/** db_value_parse
+ * Typed value from the text form (as the text protocols give it), NULL if
+ * text is NULL. The value points to text.
+ */
+DbValue db_value_parse(DbType type, const char *text, size_t len);
+
+struct DbQuery;
+/** db_query_bind_int, db_query_bind_double, db_query_bind_text, db_query_bind_null
+ * Bind the next '?' parameter of the query and make it a prepared one.
+ * The text is not copied, it must live until the query completes.
+ * Returns 0 or -1 if there are too many parameters.
+ */
+int db_query_bind_int(struct DbQuery *q, long long value);
+int db_query_bind_double(struct DbQuery *q, double value);
+int db_query_bind_text(struct DbQuery *q, const char *value);
+int db_query_bind_null(struct DbQuery *q);
+
+// Producer side, used by the db plugins.
+/** db_query_begin
+ * Start the result of the query with its columns: resets result_count and
+ * creates query->result for a typed query. Returns 0 or -1.
+ */
+int db_query_begin(struct DbQuery *q, const DbColumn *columns, size_t column_count);
+/** db_query_row
+ * Deliver the next row. Returns 0 to continue, 1 if the consumer stopped
+ * the query, -1 on error.
+ */
+int db_query_row(struct DbQuery *q, const DbRow *row);
+
+#endif // DBRESULT_H
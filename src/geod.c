@@ -344,8 +344,7 @@ int image_context_stop(PluginContext *pc){
 }
 int image_create(PluginContext *pc, Image *image, const char *filename, unsigned int width, unsigned int height, ImageBackendType backend, ImageFormat format, ImageBufferFormat buffer_type){
     if (pc){
-        pc->image.create(pc, image, filename, width, height, backend, format, buffer_type);
-        return 0;
+        return pc->image.create(pc, image, filename, width, height, backend, format, buffer_type);
     }else{
         logmsg("No image plugin");
     }
@@ -368,6 +367,18 @@ void image_write_row(PluginContext *pc, Image *image, void *row){
         pc->image.write_row(pc, image, row);
     }
 }
+int image_set_options(PluginContext *pc, Image *image, const ImageEncodeOptions *opt){
+    if (pc && pc->image.set_options) {
+        return pc->image.set_options(pc, image, opt);
+    }
+    return 1;
+}
+unsigned int image_codecs(PluginContext *pc){
+    if (pc && pc->image.codecs) {
+        return pc->image.codecs(pc);
+    }
+    return 1U << ImageCodec_Png;
+}
 
 /**
  * Add a HTTP route 
@@ -397,6 +408,15 @@ void register_ws_routes(PluginContext *pc, int count, const char *routes[]) {
     }
 }
 
+/**
+ * Add JSON message types to the WS protocol, handled by the plugin
+ */
+void register_ws_messages(PluginContext *pc, int count, const char *types[]) {
+    for (int i = 0; i < count; i++){
+        ws_message_register(types[i], pc);
+    }
+}
+
 /**
  * Future implementation, placeholder
  */
@@ -1018,6 +1038,7 @@ int main(int argc, char** argv)
     server_destroy();
     cmd_destroy();
     http_destroy();
+    cachesystem_destroy();
     logmsg("GeoD shutdown.");
     return 0;
 }
@@ -87,13 +87,36 @@ void send_response(int client, int status_code, const char *content_type, const
     }
 }
 
+/** send_data_headers
+ * Sends a binary (not null terminated) body, e.g. an image encoded in memory.
+ * headers: extra header lines, each closed by "\r\n", or NULL.
+ */
+void send_data_headers(int client, int status_code, const char *content_type, const void *data, size_t len, const char *headers) {
+    dprintf(client, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\n%s\r\n",
+        status_code, get_status_text(status_code), content_type, len, headers ? headers : "");
+    if (data && len) {
+        if (http_write(client, (const char *)data, len)) errormsg("There was an error during send_data, write operation.");
+    }
+}
+
+void send_data(int client, int status_code, const char *content_type, const void *data, size_t len) {
+    send_data_headers(client, status_code, content_type, data, len, NULL);
+}
+
 void send_file(int client, const char *content_type, const char *path) {
+    send_file_headers(client, content_type, path, NULL);
+}
+
+/** send_file_headers
+ * Sends a file, with extra header lines like send_data_headers.
+ */
+void send_file_headers(int client, const char *content_type, const char *path, const char *headers) {
     FILE *f = fopen(path, "rb");
     if (!f) {
         dprintf(client, "HTTP/1.1 404 Not Found\r\n\r\n");
         return;
     }
-    dprintf(client, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n\r\n", content_type);
+    dprintf(client, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s\r\n", content_type, headers ? headers : "");
     char buf[BUF_SIZE];
     int error =0;
     size_t n;
@@ -120,6 +143,7 @@ void send_chunk_head(ClientContext *ctx, int status_code, const char *content_ty
 }
 
 void send_chunks(ClientContext *ctx, char* buf, int offset) {
+    if (offset <= 0) return;   // a zero sized chunk would end the body
     char header[32];
     int header_len = snprintf(header, sizeof(header), "%x\r\n", offset);
     int error = http_write(ctx->socket_fd, header, header_len);
@@ -129,7 +153,7 @@ void send_chunks(ClientContext *ctx, char* buf, int offset) {
 }
 
 void send_chunk_end(ClientContext *ctx){
-    int error = write(ctx->socket_fd, "0\r\n\r\n", 5);
+    int error = http_write(ctx->socket_fd, "0\r\n\r\n", 5);
     if (error) errormsg("There was an error during send_chunk_end, write operation.");
 }
 void http_debug_hexdump(const char* prefix, char* buf, int len){
@@ -274,6 +298,9 @@ void parse_request_path_and_params(const char *request, RequestParams *params) {
     params->height = 512;
     params->terrain = 1;
     params->id = 0;
+    params->zlevel = -1;
+    params->zstrategy = -1;
+    params->zfilter = -1;
 
     const char *line = strstr(request, "GET ");
     if (!line) return;
@@ -305,6 +332,10 @@ void parse_request_path_and_params(const char *request, RequestParams *params) {
             else if (sscanf(token, "step=%f", &fval) == 1) params->step = fval;
             else if (sscanf(token, "radius=%f", &fval) == 1) params->radius = fval;
             else if (sscanf(token, "id=%d", &ival) == 1) params->id = ival;
+            else if (sscanf(token, "zlevel=%d", &ival) == 1) params->zlevel = ival;
+            else if (sscanf(token, "zstrategy=%d", &ival) == 1) params->zstrategy = ival;
+            else if (sscanf(token, "zfilter=%d", &ival) == 1) params->zfilter = ival;
+            else if (sscanf(token, "format=%15[a-z]", params->format) == 1) {}
             token = strtok(NULL, "&");
         }
     }
@@ -364,6 +395,50 @@ int http_route_search(const char *route, PluginHttpRequestHandler *prh, PluginCo
     }
     return ret;
 }
+/**
+ * WS message types registered by plugins, the ws plugin routes the unknown
+ * JSON message types here. Same structure as the http routes.
+ */
+#define WS_MESSAGE_MAX_TYPES (64)
+typedef struct{
+    char type[MAX_HTTP_KEY_LEN];
+    PluginContext *pc;
+} WsMessageRoute_t;
+
+WsMessageRoute_t g_ws_message_array[WS_MESSAGE_MAX_TYPES];
+size_t g_ws_message_numbers=0;
+hashmap_t g_ws_message_hashmap;
+sync_mutex_t *g_ws_message_lock;
+
+void ws_message_register(const char *type, PluginContext* pc){
+    if (!sync_mutex_lock(g_ws_message_lock, HTTP_ROUTE_LOCK_TIMEOUT)){
+        size_t index = 0;
+        if (0 == hashmap_search(&g_ws_message_hashmap, type, &index)){
+            g_ws_message_array[index].pc = pc; // registered again, i.e. reloaded
+        }else if (g_ws_message_numbers < WS_MESSAGE_MAX_TYPES){
+            index = g_ws_message_numbers++;
+            WsMessageRoute_t *mr = &g_ws_message_array[index];
+            snprintf(mr->type, sizeof(mr->type), "%s", type);
+            mr->pc = pc;
+            if (hashmap_add(&g_ws_message_hashmap, mr->type, index)){
+                errormsg("hashmap returns error");
+            }
+        }else{
+            errormsg("Too many ws message types, %s is not registered", type);
+        }
+        sync_mutex_unlock(g_ws_message_lock);
+    }else{
+        errormsg("ws_message_register mutex lock error");
+    }
+}
+PluginContext *ws_message_search(const char *type){
+    size_t index = 0;
+    if (0 == hashmap_search(&g_ws_message_hashmap, type, &index)){
+        return g_ws_message_array[index].pc;
+    }
+    return NULL;
+}
+
 // temporary solution , to initialize host's internal handlers
 void handle_status_html(PluginContext* pc, ClientContext *ctx, RequestParams *params);
 void handle_status_json(PluginContext *pc, ClientContext *ctx, RequestParams *params);
@@ -377,9 +452,14 @@ void http_init(){
     http_route_register( "/status.html", handle_status_html, NULL);
     http_route_register( "/status.json", handle_status_json, NULL);
     http_route_register( "/", infopage, NULL);
+    sync_mutex_init(&g_ws_message_lock);
+    hashmap_init(&g_ws_message_hashmap, 128);
 }
 void http_destroy(){
     hashmap_destroy(&g_http_route_hasmap);
     sync_mutex_destroy(g_http_route_lock);
     g_http_route_lock = NULL;
+    hashmap_destroy(&g_ws_message_hashmap);
+    sync_mutex_destroy(g_ws_message_lock);
+    g_ws_message_lock = NULL;
 }
\ No newline at end of file
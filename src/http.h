@@ -32,6 +32,8 @@ typedef struct {
     float alt;
     float step,radius;
     int width, height, id, terrain;
+    int zlevel, zstrategy, zfilter; // image encoder overrides, -1: route default
+    char format[16];                // image format: png, raw, webp. Empty: Accept header
     char path[MAX_HTTP_KEY_LEN];
 } RequestParams;
 
@@ -129,6 +131,9 @@ typedef struct {
 // This part probably will be moved to a separated file later. historical reason...
 extern void send_response(int client, int status_code, const char *content_type, const char *body);
 void send_file(int client, const char *content_type, const char *path);
+void send_data(int client, int status_code, const char *content_type, const void *data, size_t len);
+void send_file_headers(int client, const char *content_type, const char *path, const char *headers);
+void send_data_headers(int client, int status_code, const char *content_type, const void *data, size_t len, const char *headers);
 void send_chunk_head(ClientContext *ctx, int status_code, const char *content_type);
 void send_chunks(ClientContext *ctx, char* buf, int offset);
 void send_chunk_end(ClientContext *ctx);
@@ -141,6 +146,9 @@ void http_init();
 void http_destroy();
 size_t http_route_count();
 int http_route_get_path(size_t index, const char **path);
+struct PluginContext;
+void ws_message_register(const char *type, struct PluginContext *pc);
+struct PluginContext *ws_message_search(const char *type);
 
 #else
 // #define send_chunk_head g_host->http.send_chunk_head
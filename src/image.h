@@ -6,9 +6,17 @@
  * Image abstraction layer
  * Key features:
  *  Lib PNG backend is implemented.
+ *  Memory backend: the same encoders, into a pooled memory buffer.
+ *  Codecs: PNG, raw pixels with a tiny header, lossless WebP (optional, HAVE_WEBP).
+ *  Encoder tuning (zlib level, zlib strategy, PNG row filters).
  */
 #ifndef IMAGE_H
 #define IMAGE_H
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
 struct Image;
 
 // Which backend is used
@@ -31,6 +39,166 @@ typedef enum {
     ImageBuffer_AoS
 } ImageBufferFormat;
 
+// Encoded output format. The backend selects the sink (file or memory).
+typedef enum {
+    ImageCodec_Png = 0,
+    ImageCodec_Raw,     // ImageRawHeader + AoS pixel rows, no compression
+    ImageCodec_WebP,    // lossless, only when the image plugin is built with libwebp
+    ImageCodec_Max
+} ImageCodec;
+
+/** Raw codec header, 16 bytes, little endian
+ * WebGL clients can upload the pixels after the header without decoding.
+ */
+#define IMAGE_RAW_MAGIC "GRAW"
+#define IMAGE_RAW_VERSION (1)
+typedef struct ImageRawHeader {
+    char magic[4];              // IMAGE_RAW_MAGIC
+    unsigned char version;      // IMAGE_RAW_VERSION
+    unsigned char channels;     // 1: grayscale, 3: RGB, 4: RGBA
+    unsigned char reserved[2];
+    unsigned char width[4];     // uint32 LE
+    unsigned char height[4];    // uint32 LE
+} ImageRawHeader;
+
+// zlib strategy, backend independent (mapped to Z_* by the encoder)
+typedef enum {
+    ImageStrategy_Default = 0,
+    ImageStrategy_Filtered,
+    ImageStrategy_HuffmanOnly,
+    ImageStrategy_Rle,
+    ImageStrategy_Fixed
+} ImageCompressionStrategy;
+
+// PNG row filter set, bits can be combined. 0 means the library default.
+#define IMAGE_FILTER_DEFAULT (0x00)
+#define IMAGE_FILTER_NONE    (0x01)
+#define IMAGE_FILTER_SUB     (0x02)
+#define IMAGE_FILTER_UP      (0x04)
+#define IMAGE_FILTER_AVG     (0x08)
+#define IMAGE_FILTER_PAETH   (0x10)
+#define IMAGE_FILTER_ALL     (0x1F)
+
+// zlib level, -1 means the library default
+#define IMAGE_LEVEL_DEFAULT (-1)
+#define IMAGE_LEVEL_FAST    (1)
+#define IMAGE_LEVEL_BEST    (9)
+
+/** Encoder options
+ * Set after image create, before the first row is written.
+ * Dynamic, rarely reused images are cheaper with the fast preset,
+ * long lived cached textures deserve the best one.
+ */
+typedef struct ImageEncodeOptions {
+    int level;                          // -1 or 0..9
+    ImageCompressionStrategy strategy;
+    unsigned int filters;               // IMAGE_FILTER_* bits
+    ImageCodec codec;
+} ImageEncodeOptions;
+
+#define IMAGE_ENCODE_DEFAULT { IMAGE_LEVEL_DEFAULT, ImageStrategy_Default, IMAGE_FILTER_DEFAULT, ImageCodec_Png }
+#define IMAGE_ENCODE_FAST    { IMAGE_LEVEL_FAST, ImageStrategy_Rle, IMAGE_FILTER_SUB, ImageCodec_Png }
+#define IMAGE_ENCODE_BEST    { IMAGE_LEVEL_BEST, ImageStrategy_Filtered, IMAGE_FILTER_ALL, ImageCodec_Png }
+
+static inline const char *image_codec_mime(ImageCodec codec) {
+    switch (codec) {
+        case ImageCodec_Raw: return "application/octet-stream";
+        case ImageCodec_WebP: return "image/webp";
+        case ImageCodec_Png:
+        default: return "image/png";
+    }
+}
+// file extension, also part of the cache keys
+static inline const char *image_codec_ext(ImageCodec codec) {
+    switch (codec) {
+        case ImageCodec_Raw: return "raw";
+        case ImageCodec_WebP: return "webp";
+        case ImageCodec_Png:
+        default: return "png";
+    }
+}
+/** image_codec_negotiate
+ * The format query parameter (png, raw, webp) wins, otherwise the Accept
+ * header is checked. Anything else, or a codec not in the supported bitmask
+ * (1 << ImageCodec_*), falls back to PNG.
+ */
+static inline ImageCodec image_codec_negotiate(const char *format, const char *accept, unsigned int supported) {
+    ImageCodec codec = ImageCodec_Png;
+    if (format && format[0]) {
+        if (!strcmp(format, "raw")) codec = ImageCodec_Raw;
+        else if (!strcmp(format, "webp")) codec = ImageCodec_WebP;
+    } else if (accept) {
+        if (strstr(accept, "image/webp")) codec = ImageCodec_WebP;
+    }
+    if (!(supported & (1U << codec))) codec = ImageCodec_Png;
+    return codec;
+}
+
+// Extra response header when the codec depends on the Accept header.
+#define IMAGE_VARY_ACCEPT "Vary: Accept\r\n"
+
+/** image_codec_negotiate_request
+ * image_codec_negotiate with the Accept header of the request. Without a
+ * format parameter the response depends on Accept, then *vary is set and
+ * the response has to carry IMAGE_VARY_ACCEPT for the shared caches.
+ */
+static inline ImageCodec image_codec_negotiate_request(const HttpRequest *request, const char *format,
+        unsigned int supported, int *vary) {
+    const char *accept = NULL;
+    for (int i = 0; i < request->header_count; i++) {
+        if (strcasecmp(request->headers[i].key, "Accept") == 0) {
+            accept = request->headers[i].value;
+            break;
+        }
+    }
+    *vary = !(format && format[0]);
+    return image_codec_negotiate(format, accept, supported);
+}
+
+/** image_encode_options_override
+ * Overrides the given (route default) options with per-request values.
+ * Negative values are treated as "not given" and keep the original.
+ */
+static inline void image_encode_options_override(ImageEncodeOptions *opt, int level, int strategy, int filters) {
+    if (level >= 0 && level <= 9) opt->level = level;
+    if (strategy >= 0 && strategy <= ImageStrategy_Fixed) opt->strategy = (ImageCompressionStrategy)strategy;
+    if (filters >= 0 && filters <= IMAGE_FILTER_ALL) opt->filters = (unsigned int)filters;
+}
+
+/** image_encode_options_config
+ * Route defaults from the config group: <name>_zlevel, <name>_zstrategy and
+ * <name>_zfilter, the missing keys keep the given options.
+ */
+static inline void image_encode_options_config(ImageEncodeOptions *opt, const char *group, const char *name,
+        int (*config_get_int)(const char *group, const char *key, int default_value)) {
+    char key[64];
+    snprintf(key, sizeof(key), "%s_zlevel", name);
+    int level = config_get_int(group, key, opt->level);
+    snprintf(key, sizeof(key), "%s_zstrategy", name);
+    int strategy = config_get_int(group, key, opt->strategy);
+    snprintf(key, sizeof(key), "%s_zfilter", name);
+    int filters = config_get_int(group, key, opt->filters);
+    image_encode_options_override(opt, level, strategy, filters);
+}
+
+/** image_encode_options_tag
+ * The effective encoder settings as a part of the cache file name, e.g.
+ * "z9s1f31": a request overriding them does not get the file of others.
+ */
+static inline int image_encode_options_tag(const ImageEncodeOptions *opt, char *buf, size_t size) {
+    return snprintf(buf, size, "z%ds%df%u", opt->level, (int)opt->strategy, opt->filters);
+}
+
+/** Encoded image in memory (ImageBackend_Memory)
+ * Given by get_buffer, owned by the image until destroy, which
+ * returns it to the buffer pool of the image plugin.
+ */
+typedef struct ImageMemBuffer {
+    unsigned char *data;
+    size_t size;        // encoded bytes
+    size_t capacity;    // allocated bytes, grows geometrically
+} ImageMemBuffer;
+
 //The abstract image descriptor
 typedef struct Image{
     ImageBackendType backend;
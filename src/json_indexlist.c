@@ -1,16 +1,100 @@
-
-
-#include <json-c/json.h>
+/*
+ * File:    json_indexlist.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-04-10
+ *
+ * Hash searchable list of string keys to indexes, see json_indexlist.h.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
 #include "global.h"
 #include "sync.h"
 #include "json_indexlist.h"
 
 #define JSON_INDEXLIST_LOCK_TIMEOUT (1000)
+#define JSON_INDEXLIST_MIN_CAPACITY (64)
+#define JSON_INDEXLIST_HASH_SEED (5381)
+
+// key of a deleted slot: the probing goes on through it
+static char json_indexlist_deleted[1];
+
+/** json_indexlist_hash
+ * djb2 string hash, like the hashmap of the routes.
+ */
+static size_t json_indexlist_hash(const char *str) {
+    size_t hash = JSON_INDEXLIST_HASH_SEED;
+    int c;
+    while ((c = (unsigned char)*str++))
+        hash = ((hash << 5) + hash) + c;
+    return hash;
+}
+
+/** json_indexlist_find
+ * Slot of the key or GEO_INDEX_INVALID. There is always an empty slot,
+ * the load stays under 3/4.
+ */
+static size_t json_indexlist_find(const json_indexlist_t *list, const char *key, size_t hash) {
+    if (!list->capacity) return GEO_INDEX_INVALID;
+    size_t mask = list->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const json_indexlist_slot_t *s = &list->slots[i];
+        if (!s->key) return GEO_INDEX_INVALID;
+        if (s->key != json_indexlist_deleted && s->hash == hash && !strcmp(s->key, key)) return i;
+    }
+}
+
+/** json_indexlist_insert_slot
+ * First free (empty or deleted) slot of the hash, the key is not in the list.
+ */
+static json_indexlist_slot_t *json_indexlist_insert_slot(json_indexlist_t *list, size_t hash) {
+    size_t mask = list->capacity - 1;
+    size_t i = hash & mask;
+    while (list->slots[i].key && list->slots[i].key != json_indexlist_deleted) {
+        i = (i + 1) & mask;
+    }
+    return &list->slots[i];
+}
+
+/** json_indexlist_rehash
+ * Move the live keys into a new table of capacity slots, the deleted
+ * ones are dropped. Returns 0 or -1.
+ */
+static int json_indexlist_rehash(json_indexlist_t *list, size_t capacity) {
+    json_indexlist_slot_t *old = list->slots;
+    size_t old_capacity = list->capacity;
+    json_indexlist_slot_t *slots = calloc(capacity, sizeof(json_indexlist_slot_t));
+    if (!slots) return -1;
+    list->slots = slots;
+    list->capacity = capacity;
+    list->used = list->count;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i].key || old[i].key == json_indexlist_deleted) continue;
+        *json_indexlist_insert_slot(list, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/** json_indexlist_free_keys
+ * Free the keys and empty every slot.
+ */
+static void json_indexlist_free_keys(json_indexlist_t *list) {
+    for (size_t i = 0; i < list->capacity; i++) {
+        if (list->slots[i].key != json_indexlist_deleted) free(list->slots[i].key);
+    }
+    if (list->slots) memset(list->slots, 0, list->capacity * sizeof(json_indexlist_slot_t));
+    list->count = 0;
+    list->used = 0;
+}
 
 int json_indexlist_init(json_indexlist_t *list){
     int ret;
     if (list){
-        list->list = json_object_new_object();
+        list->slots = NULL;
+        list->capacity = 0;
+        list->count = 0;
+        list->used = 0;
         sync_mutex_init(&list->lock);
         ret = 0;
     }else{
@@ -22,7 +106,10 @@ int json_indexlist_init(json_indexlist_t *list){
 int json_indexlist_destroy(json_indexlist_t *list){
     int ret;
     if (list){
-        json_object_put(list->list);
+        json_indexlist_free_keys(list);
+        free(list->slots);
+        list->slots = NULL;
+        list->capacity = 0;
         sync_mutex_destroy(list->lock);
         ret = 0;
     }else{
@@ -31,16 +118,6 @@ int json_indexlist_destroy(json_indexlist_t *list){
     return ret;
 }
 
-/** safe_size_to_json_int
- * Converts index uint value to json int value, with boundarz check.
- */
-static inline int safe_size_to_json_int(size_t index) {
-    return (index == GEO_INDEX_INVALID) ? -1 :
-           (index < GEO_INDEX_INVALID) && (index <= INT32_MAX) ? (int)index : -2;
-}
-static inline size_t safe_json_int_to_size(int value){
-    return  (value >= 0)? (size_t)value : GEO_INDEX_INVALID;
-}
 int json_indexlist_add(json_indexlist_t *list, const char* key, size_t index){
     if (!list) return -2;
     if (!key) return -2;
@@ -48,8 +125,33 @@ int json_indexlist_add(json_indexlist_t *list, const char* key, size_t index){
         errormsg("Lock timeout");
         return -3;
     }
-    int value = safe_size_to_json_int(index);
-    json_object_object_add(list->list, key, json_object_new_int(value));
+    size_t hash = json_indexlist_hash(key);
+    size_t i = json_indexlist_find(list, key, hash);
+    if (i != GEO_INDEX_INVALID) {
+        list->slots[i].index = index;
+        sync_mutex_unlock(list->lock);
+        return 0;
+    }
+    if ((list->used + 1) * 4 > list->capacity * 3) {
+        // double on real growth, a table full of deleted slots is only rebuilt
+        size_t capacity = JSON_INDEXLIST_MIN_CAPACITY;
+        while ((list->count + 1) * 2 > capacity) capacity *= 2;
+        if (json_indexlist_rehash(list, capacity)) {
+            sync_mutex_unlock(list->lock);
+            return -1;
+        }
+    }
+    char *copy = strdup(key);
+    if (!copy) {
+        sync_mutex_unlock(list->lock);
+        return -1;
+    }
+    json_indexlist_slot_t *s = json_indexlist_insert_slot(list, hash);
+    if (!s->key) list->used++;
+    s->key = copy;
+    s->hash = hash;
+    s->index = index;
+    list->count++;
     sync_mutex_unlock(list->lock);
     return 0;
 }
@@ -63,9 +165,11 @@ int json_indexlist_delete(json_indexlist_t *list, const char * key){
         return -3;
     }
 
-    struct json_object *existing_value = NULL;
-    if (json_object_object_get_ex(list->list, key, &existing_value)) {
-        json_object_object_del(list->list, key);
+    size_t i = json_indexlist_find(list, key, json_indexlist_hash(key));
+    if (i != GEO_INDEX_INVALID) {
+        free(list->slots[i].key);
+        list->slots[i].key = json_indexlist_deleted;
+        list->count--;
         ret = 0;
     }
 
@@ -74,15 +178,25 @@ int json_indexlist_delete(json_indexlist_t *list, const char * key){
 }
 
 int  json_indexlist_search(json_indexlist_t *list, const char * key, size_t *index){
-    struct json_object *idx_obj = NULL;
     int ret = -1;
     if (!list || !key) return -2;
     if (sync_mutex_lock(list->lock, JSON_INDEXLIST_LOCK_TIMEOUT)) return -3;
-    if (json_object_object_get_ex(list->list, key, &idx_obj)) {
-        int idx = json_object_get_int(idx_obj);
-        *index = safe_json_int_to_size(idx);
+    size_t i = json_indexlist_find(list, key, json_indexlist_hash(key));
+    if (i != GEO_INDEX_INVALID) {
+        *index = list->slots[i].index;
         ret = 0;
     }
     sync_mutex_unlock(list->lock);
     return ret;
-}
\ No newline at end of file
+}
+
+int json_indexlist_clear(json_indexlist_t *list){
+    if (!list) return -2;
+    if (sync_mutex_lock(list->lock, JSON_INDEXLIST_LOCK_TIMEOUT)) {
+        errormsg("Lock timeout");
+        return -3;
+    }
+    json_indexlist_free_keys(list);
+    sync_mutex_unlock(list->lock);
+    return 0;
+}
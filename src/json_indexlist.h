@@ -2,27 +2,55 @@
  * File:    json_indexlist.h
  * Author:  Barna Faragó MYND-ideal ltd.
  * Created: 2025-04-10
- * 
- * Part of the Data layer, we can use json implementation for
- * creating and maintaining a hash searchable list.
+ *
+ * Part of the Data layer, a hash searchable list of string keys to
+ * indexes. The name is kept from the former json-c object based
+ * implementation, the storage is native now.
  * Key features:
  *  lock, search, add, delete, init, destroy
+ *  open addressing with linear probing: a search hashes the key once and
+ *  walks a few adjacent slots, it does not allocate. The table grows by
+ *  doubling over 3/4 load, the deleted slots are reused or dropped on a
+ *  rehash.
  */
 #ifndef JSON_INDEXLIST_H_
 #define JSON_INDEXLIST_H_
 
+#include <stddef.h>
 #include "sync.h"
-#include <json-c/json.h>
 
 typedef struct {
-    struct json_object *list;
+    char *key;          // NULL: empty slot
+    size_t hash;
+    size_t index;
+} json_indexlist_slot_t;
+
+typedef struct {
+    json_indexlist_slot_t *slots;
+    size_t capacity;    // power of two, 0 until the first add
+    size_t count;       // live keys
+    size_t used;        // live keys and deleted slots
     sync_mutex_t *lock;
 } json_indexlist_t;
 
 int json_indexlist_init(json_indexlist_t *list);
 int json_indexlist_destroy(json_indexlist_t *list);
+/** json_indexlist_add
+ * Add the key (copied) with the index, or replace the index of the key.
+ * Returns 0, -1 out of memory, -2 wrong argument, -3 lock timeout.
+ */
 int json_indexlist_add(json_indexlist_t *liar, const char* key, size_t index);
+/** json_indexlist_delete
+ * Returns 0, -1 not found, -2 wrong argument, -3 lock timeout.
+ */
 int json_indexlist_delete(json_indexlist_t *list, const char * key);
+/** json_indexlist_search
+ * Returns 0 and the index, -1 not found, -2 wrong argument, -3 lock timeout.
+ */
 int json_indexlist_search(json_indexlist_t *list, const char * key, size_t *index);
+/** json_indexlist_clear
+ * Delete every key, the table is kept for the reuse.
+ */
+int json_indexlist_clear(json_indexlist_t *list);
 
-#endif // JSON_INDEXLIST_H_
\ No newline at end of file
+#endif // JSON_INDEXLIST_H_
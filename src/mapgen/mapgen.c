@@ -403,6 +403,12 @@ ElevClassParam g_elevclass_cold_param[MAPGEN_ELEVCLASS_MAX] = {
     {255, 255, 255} // peak
 };
 
+// Color class lookup table: one entry per 256 elevation steps (the high byte of the i16 elevation).
+// A bucket which contains an edge is marked as split, and falls back to the binary search.
+#define MAPGEN_CLASS_LUT_SHIFT 8
+#define MAPGEN_CLASS_LUT_SIZE (65536 >> MAPGEN_CLASS_LUT_SHIFT)
+#define MAPGEN_CLASS_LUT_SPLIT 0xFF
+
 // The latitude data structure, which is corresponds to a latitude band
 typedef struct {
     float lat;
@@ -412,8 +418,42 @@ typedef struct {
     float base;
     float jet;
     short edges[MAPGEN_ELEVCLASS_MAX];
+    unsigned char class_lut[MAPGEN_CLASS_LUT_SIZE];
 } LatData;
 
+/** Find the color index for a given elevation value
+ * This function uses binary search to find the appropriate color index
+ * for a given elevation value based on the elevation class thresholds.
+ * It returns the index of the color class. Scalare function for one point.
+ */
+static inline int find_color_index(short *edges, short elev) {
+    int lo = 0, hi = MAPGEN_ELEVCLASS_MAX - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (elev <= edges[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/** Build the color class lookup table of a latitude band
+ * The class is monotonic in elevation, so a bucket is uniform when its first
+ * and last elevation have the same class. Only the few buckets holding an edge
+ * are split. Rebuilt with the edges, so a changed palette is picked up too.
+ */
+static inline void init_class_lut(LatData *pLatData) {
+    for (int b = 0; b < MAPGEN_CLASS_LUT_SIZE; b++) {
+        short lo = (short)((b << MAPGEN_CLASS_LUT_SHIFT) - 32768);
+        short hi = (short)(lo + (1 << MAPGEN_CLASS_LUT_SHIFT) - 1);
+        int clo = find_color_index(pLatData->edges, lo);
+        int chi = find_color_index(pLatData->edges, hi);
+        pLatData->class_lut[b] = (clo == chi) ? (unsigned char)clo : MAPGEN_CLASS_LUT_SPLIT;
+    }
+}
+
+
 /** Initialize latitude data structure
  * Calculated once per latitude band, for fast access.
  */
@@ -431,23 +471,17 @@ static inline void init_lat_data(LatData *pLatData, float lat) {
         if (threshold_i > 32767) threshold_i = 32767;
         pLatData->edges[i] = (short)(threshold_i);
     }
+    init_class_lut(pLatData);
 }
 
-/** Find the color index for a given elevation value
- * This function uses binary search to find the appropriate color index
- * for a given elevation value based on the elevation class thresholds.
- * It returns the index of the color class. Scalare function for one point.
+/** Find the color index for a given elevation value, table version
+ * Same result as find_color_index() for every input, the search runs
+ * only in the split buckets.
  */
-static inline int find_color_index(short *edges, short elev) {
-    int lo = 0, hi = MAPGEN_ELEVCLASS_MAX - 1;
-    while (lo < hi) {
-        int mid = (lo + hi) / 2;
-        if (elev <= edges[mid])
-            hi = mid;
-        else
-            lo = mid + 1;
-    }
-    return lo;
+static inline int find_color_index_lut(LatData *pLatData, short elev) {
+    unsigned char cindex = pLatData->class_lut[(unsigned int)(elev + 32768) >> MAPGEN_CLASS_LUT_SHIFT];
+    if (cindex != MAPGEN_CLASS_LUT_SPLIT) return cindex;
+    return find_color_index(pLatData->edges, elev);
 }
 
 /** Find the color index for a given elevation values
@@ -455,9 +489,9 @@ static inline int find_color_index(short *edges, short elev) {
  * It takes an array of elevation values and fills the corresponding color index array.
  * The function is optimized for performance and can handle large arrays efficiently.
  */
-static inline void find_color_index_n(short *edges, short *elev, unsigned char *cindexes, int count) {
+static inline void find_color_index_n(LatData *pLatData, short *elev, unsigned char *cindexes, int count) {
     for(int i = 0; i < count; i++) {
-        cindexes[i] = find_color_index(edges, elev[i]);
+        cindexes[i] = find_color_index_lut(pLatData, elev[i]);
     }
 }
 
@@ -615,7 +649,7 @@ void WorkBiomColor_compute(
     // get and saturate noise to elevation
     unit_short_saturate_n(buf_noise, wrk->elev_ai16, count);
     // find color index
-    find_color_index_n(pLatData->edges, wrk->elev_ai16, wrk->cindex_au8, count);
+    find_color_index_n(pLatData, wrk->elev_ai16, wrk->cindex_au8, count);
     // set map cells to basic values
     for(int i = 0; i < count; i++) {
         pdata[i].flags = 0;
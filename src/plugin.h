@@ -21,6 +21,7 @@ extern "C" {
 #include "image.h"
 #include "cache.h"
 #include "cmd.h"
+#include "dbresult.h"
 
 
 #define PLUGIN_SUCCESS 0
@@ -118,17 +119,24 @@ struct ClientContext;
 typedef struct {
     void (*send_response)(int clientid, int status_code, const char *content_type, const char *body);
     void (*send_file)(int clientid, const char * content_type, const char *path);
-    /*
+    void (*send_data)(int clientid, int status_code, const char *content_type, const void *data, size_t len);
+    // Chunked transfer: the head, any number of chunks (empty ones are skipped), the end.
     void (*send_chunk_head)(struct ClientContext *ctx, int status_code, const char *content_type);
     void (*send_chunks)(struct ClientContext *ctx, char* buf, int offset);
     void (*send_chunk_end)(struct ClientContext *ctx);
-    */
+    // send_file, send_data with extra header lines (each closed by "\r\n"), or NULL.
+    void (*send_file_headers)(int clientid, const char *content_type, const char *path, const char *headers);
+    void (*send_data_headers)(int clientid, int status_code, const char *content_type, const void *data, size_t len, const char *headers);
 } HttpHostInterface;
 
 /** WebSocket interface related API fns */
 typedef struct {
     // other plugins can use this, when ws plugin is loaded...
     void (*handshake)(PCHANDLER pc, WsRequestParams* wsp, const char *msg); // dummy example.
+    // JSON message types of the ws clients, handled by the registering plugin's
+    // ws.message_handler. The ws plugin routes the types it does not know.
+    void (*register_messages)(PCHANDLER pc, int count, const char *types[]);
+    struct PluginContext* (*message_search)(const char *type);
 } WsHostInterface;
 
 /** Image support related API */
@@ -137,8 +145,11 @@ typedef struct {
     int (*context_stop)(PCHANDLER pc);
     int (*create)(PCHANDLER pc, Image *img, const char *filename, unsigned int width, unsigned int height, ImageBackendType backend, ImageFormat format, ImageBufferFormat buffer_format);
     int (*destroy)(PCHANDLER pc, Image *img);
+    // Memory backend: finishes the encoding, gives an ImageMemBuffer* valid until destroy.
     void (*get_buffer)(PCHANDLER pc, Image *img, void **buffer);
     void (*write_row)(PCHANDLER pc, Image *img, void *row);
+    int (*set_options)(PCHANDLER pc, Image *img, const ImageEncodeOptions *opt);
+    unsigned int (*codecs)(PCHANDLER pc); // bitmask of (1 << ImageCodec_*)
 } ImageHostInterface;
 
 typedef void* (*plugin_thread_main_fn)(void*);
@@ -194,8 +205,14 @@ typedef struct {
 
 // WS host side
 typedef void (*PluginWsRequestHandler)(PCHANDLER, ClientContext *ctx, WsRequestParams *params);
+// Answer to the session the message came from.
+typedef void (*PluginWsReplyFn)(void *reply_ctx, const char *txt);
+// A registered message type arrived, msg is the whole JSON text. Returns 0 or negative on error.
+typedef int (*PluginWsMessageHandler)(PCHANDLER, ClientContext *ctx, const char *type, const char *msg, size_t len,
+    PluginWsReplyFn reply, void *reply_ctx);
 typedef struct {
     PluginWsRequestHandler request_handler;
+    PluginWsMessageHandler message_handler;
 } PluginWsFunctions;
 
 // Control
@@ -213,22 +230,60 @@ typedef struct{
 
 // DB host side (preliminary)
 struct DbQuery;
-#define DB_QUERY_MAX_QUERY_LEN (256)
+#define DB_QUERY_MAX_QUERY_LEN (1024)
 #define DB_QUERY_MAX_ROWS (16)
 #define DB_QUERY_MAX_ROW_LEN (512)
 
+// DbQuery flags
+#define DB_QUERY_TYPED      (1) // collect the rows into result
+#define DB_QUERY_TRUNCATED  (2) // set by the db: rows did not fit into the compatibility rows
+#define DB_QUERY_PREPARED   (4) // prepared statement, '?' placeholders, cached per connection
+#define DB_QUERY_MAX_PARAMS (8)
+
+/** A query and its result, see dbresult.h. Zero initialize it.
+ * Without a row_proc or DB_QUERY_TYPED the first rows are joined by '|'
+ * into rows (compatibility). The typed result is allocated by the db, the
+ * caller frees it with db_result_free.
+ * The bound parameters make it a prepared statement, the db keeps it for
+ * the next query of the same text.
+ */
 typedef struct DbQuery{
     char query[DB_QUERY_MAX_QUERY_LEN];
     char rows[DB_QUERY_MAX_ROWS][DB_QUERY_MAX_ROW_LEN];
-    int result_count;
+    int result_count;       // rows delivered, -1 on error
+    int flags;
+    DbResult *result;       // DB_QUERY_TYPED
+    DbRowProc row_proc;     // streaming, called from the db thread
+    void *row_user_data;
+    DbValue params[DB_QUERY_MAX_PARAMS];   // bound by db_query_bind_*, the texts are not copied
+    int param_count;
 } DbQuery;
 
+/** Priority of a db request, the queue serves the lower value first.
+ * Bulk requests can not fill the whole queue, the rest is kept for the
+ * interactive ones (like a login).
+ */
+typedef enum {
+    DB_PRIORITY_INTERACTIVE,
+    DB_PRIORITY_NORMAL,
+    DB_PRIORITY_BULK,
+    DB_PRIORITY_COUNT
+} DbPriority;
+
 typedef void (*QueryResultProc)(PCHANDLER,  DbQuery* query, void *user_data);
-typedef void (*PluginDbRequestHandler)(DbQuery *query, QueryResultProc result_proc, void *user_data);
+/** Queue a request, returns 0 or -1 if it was rejected (queue full or stopped),
+ * the result_proc is not called then.
+ */
+typedef int (*PluginDbRequestHandler)(DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data);
+/** Execute a query on the caller's thread (and its connection), blocking.
+ * Returns the number of rows or -1.
+ */
+typedef int (*PluginDbExecuteHandler)(DbQuery *query);
 typedef void (*PluginDbQueuePush)();
 
 typedef struct {
     PluginDbRequestHandler request;
+    PluginDbExecuteHandler execute;
 } PluginDbFunctions;
 
 /** Image generator subsystem
@@ -240,11 +295,15 @@ typedef int (*PluginImageCreate)(PCHANDLER, Image *image, const char *filename,
 typedef int (*PluginImageDestroy)(PCHANDLER, Image *image);
 typedef void (*PluginImageGetBuffer)(PCHANDLER, Image *image, void** buffer);
 typedef void (*PluginImageWriteRow)(PCHANDLER, Image *image, void* row);
+typedef int (*PluginImageSetOptions)(PCHANDLER, Image *image, const ImageEncodeOptions *opt);
+typedef unsigned int (*PluginImageCodecs)(PCHANDLER);
 typedef struct PluginImageFunctions{
     PluginImageCreate create;
     PluginImageDestroy destroy;
     PluginImageGetBuffer get_buffer;
     PluginImageWriteRow write_row;
+    PluginImageSetOptions set_options;
+    PluginImageCodecs codecs;
 }PluginImageFunctions;
 
 /** PLUGIN API for host
@@ -59,7 +59,9 @@ typedef struct cgi_data_t {
     struct timespec start_time;
     struct timespec end_time;
     char query_signature[MAX_PATH]; // for later hashing or caching
-    CacheFile cache_file;
+    char cache_key[MAX_PATH + 8];   // "cgi:" + query_signature in the result cache
+    int cache_ttl;                  // sec, 0: not cached
+    unsigned long cache_generation; // of the result cache, before the script ran
     char cache_dir[MAX_PATH];   // could be different from the script dir    char cache_filename[MAX_PATH]; // for later caching
     char *result;
     size_t result_length; //last written pos +1 for the zero terminator.
@@ -95,6 +97,7 @@ int cgi_data_init(cgi_data_t* p, PluginContext *pc, ClientContext *ctx, RequestP
     p->ctx = ctx;
     p->params = params;
     p->debug_enabled = g_host->config_get_int("CGI", "debug", 1);
+    p->cache_ttl = g_host->config_get_int("CGI", "cache_ttl_sec", CACHE_TIME);
     res |= configstr("CGI", "script_name","test.php", &p->script_name, tmp, MAX_PATH);  
     res |= configstr("CGI", "script_dir","../www", &p->script_dir, tmp, MAX_PATH);  
     res |= configstr("CGI", "php_path","/usr/bin/php", &p->php_path, tmp, MAX_PATH);  
@@ -252,11 +255,44 @@ int cgi_data_prepare_query(cgi_data_t* p, PluginContext *pc, ClientContext *ctx,
         }
     }
     
-    g_host->cache.file_init(&p->cache_file, p->query_signature);
-    g_host->debugmsg("CGI cache file: %s", p->cache_file.path);
+    snprintf(p->cache_key, sizeof(p->cache_key), "cgi:%s", p->query_signature);
+    g_host->debugmsg("CGI cache key: %s", p->cache_key);
     return 0;
 }
 
+/** cgi_cache_send
+ * Send the cached output of the query if there is one. The entry is the
+ * content type, a zero, then the body. Returns 1 if it was sent.
+ */
+static int cgi_cache_send(cgi_data_t *cgi) {
+    if (cgi->cache_ttl <= 0) return 0;
+    cgi->cache_generation = g_host->cache.result_generation();
+    CacheResult *r = g_host->cache.result_get(cgi->cache_key);
+    if (!r) return 0;
+    size_t len;
+    const char *data = g_host->cache.result_data(r, &len);
+    size_t ct_len = strnlen(data, len);
+    if (ct_len < len) {
+        g_host->http.send_data(cgi->ctx->socket_fd, 200, data, data + ct_len + 1, len - ct_len - 1);
+    }
+    g_host->cache.result_release(r);
+    return ct_len < len;
+}
+
+/** cgi_cache_put
+ * Keep the output of the query for cache_ttl_sec, see cgi_cache_send.
+ */
+static void cgi_cache_put(cgi_data_t *cgi, const char *content_type, const char *body, size_t body_len) {
+    if (cgi->cache_ttl <= 0) return;
+    size_t ct_len = strlen(content_type);
+    char *data = malloc(ct_len + 1 + body_len);
+    if (!data) return;
+    memcpy(data, content_type, ct_len + 1);
+    memcpy(data + ct_len + 1, body, body_len);
+    g_host->cache.result_put(cgi->cache_key, "cgi", data, ct_len + 1 + body_len, cgi->cache_ttl, cgi->cache_generation);
+    free(data);
+}
+
 void handle_cgi_testphp(PluginContext *pc, ClientContext *ctx, RequestParams *params){
     (void)pc;
     (void)params;
@@ -276,10 +312,9 @@ void handle_cgi_testphp(PluginContext *pc, ClientContext *ctx, RequestParams *pa
         return;
     }
     
-    if (g_host->cache.file_exists_recent(&cgi->cache_file)){
-        g_host->http.send_file(ctx->socket_fd, "text/plain", cgi->cache_file.path);
-        g_host->logmsg("CGI sent a cached file. index:%d, pid:%d, file:%s",
-                 cgi->pool_index, cgi->active_pid, cgi->cache_file.path);
+    if (cgi_cache_send(cgi)){
+        g_host->logmsg("CGI sent a cached result. index:%d, key:%s",
+                 cgi->pool_index, cgi->cache_key);
         cgi_data_release(cgi);
         ctx->result_status = CTX_FINISHED_OK;
         return;
@@ -454,8 +489,6 @@ void handle_cgi_testphp(PluginContext *pc, ClientContext *ctx, RequestParams *pa
         cgi->active_pid = pid;
         cgi->state = CGI_STATE_RUNNING;
 
-        // Create Cache file for child output
-        g_host->cache.file_create(&cgi->cache_file);
         cgi_data_close_pipe(cgi, 1, STDERR_FILENO | STDOUT_FILENO);
         
         g_host->debugmsg("Parent waiting for child output (test.php)");
@@ -520,13 +553,13 @@ void handle_cgi_testphp(PluginContext *pc, ClientContext *ctx, RequestParams *pa
             g_host->logmsg("test.php returned Content-Type: %s", content_type);
             g_host->http.send_response(ctx->socket_fd, 200, content_type, body);
             g_host->logmsg("Response sent to client for test.php");
+            if (ctx->result_status != CTX_ERROR) cgi_cache_put(cgi, content_type, body, strlen(body));
         } else {
             g_host->debugmsg("No headers found in output of test.php, treating entire output as plain text.");
             g_host->http.send_response(ctx->socket_fd, 200, "text/plain", cgi->result);
+            if (ctx->result_status != CTX_ERROR) cgi_cache_put(cgi, "text/plain", cgi->result, cgi->result_length);
         }
         g_host->logmsg("Response sent to client for test.php length:%d", cgi->result_length);
-        g_host->cache.file_write(&cgi->cache_file, cgi->result, cgi->result_length);
-        g_host->cache.file_close(&cgi->cache_file);
 
         // Wait for child process and remove from active PID list
         int status;
@@ -535,9 +568,9 @@ void handle_cgi_testphp(PluginContext *pc, ClientContext *ctx, RequestParams *pa
         clock_gettime(CLOCK_MONOTONIC, &cgi->end_time);
         double elapsed_time = (cgi->end_time.tv_sec - cgi->start_time.tv_sec) +
                               (cgi->end_time.tv_nsec - cgi->start_time.tv_nsec) / 1e9;
-        g_host->logmsg("CGI executed %s script, and sent a result. index:%d, pid:%d, file:%s, duration:%.6f",
+        g_host->logmsg("CGI executed %s script, and sent a result. index:%d, pid:%d, key:%s, duration:%.6f",
             cgi->script_name,
-            cgi->pool_index, cgi->active_pid, cgi->cache_file.path, elapsed_time);
+            cgi->pool_index, cgi->active_pid, cgi->cache_key, elapsed_time);
         cgi_data_release(cgi);
         ctx->elapsed_time = elapsed_time;
     }
@@ -0,0 +1,316 @@
+/*
+ * File:    dbpool.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-30
+ *
+ * Connection pool of the database plugins, see dbpool.h.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include "dbpool.h"
+
+#define DBPOOL_MAX_BACKOFF_SHIFT    (16)
+
+static long long dbpool_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+static long long dbpool_now_ms(void) {
+    return dbpool_now_us() / 1000;
+}
+
+/** dbpool_wait
+ * Wait for a signal until the deadline (monotonic ms), forever if negative.
+ */
+static void dbpool_wait(dbpool_t *p, long long deadline_ms) {
+    if (deadline_ms < 0) {
+        pthread_cond_wait(&p->cond, &p->lock);
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = deadline_ms / 1000;
+    ts.tv_nsec = (deadline_ms % 1000) * 1000000l;
+    pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+}
+
+/** dbpool_connected
+ * Account a connect attempt of the worker, under the lock.
+ */
+static void dbpool_connected(dbpool_t *p, dbpool_worker_t *w, void *conn) {
+    long long now = dbpool_now_ms();
+    if (conn) {
+        w->conn = conn;
+        if (w->ever_connected) w->stat.reconnects++;
+        w->ever_connected = 1;
+        w->failures = 0;
+        w->last_used_ms = now;
+        w->stat.connected = 1;
+        w->stat.backoff_ms = 0;
+        p->connected++;
+        return;
+    }
+    unsigned int shift = w->failures < DBPOOL_MAX_BACKOFF_SHIFT ? w->failures : DBPOOL_MAX_BACKOFF_SHIFT;
+    unsigned long long delay = (unsigned long long)p->config.backoff_min_ms << shift;
+    if (delay > p->config.backoff_max_ms) delay = p->config.backoff_max_ms;
+    w->failures++;
+    w->retry_at_ms = now + (long long)delay;
+    w->stat.errors++;
+    w->stat.backoff_ms = (unsigned int)delay;
+}
+
+/** dbpool_disconnect
+ * Forget the broken connection of the worker, under the lock. Returns the
+ * connection to be closed outside the lock. The reconnect is immediate.
+ */
+static void *dbpool_disconnect(dbpool_t *p, dbpool_worker_t *w) {
+    void *conn = w->conn;
+    if (!conn) return NULL;
+    w->conn = NULL;
+    w->retry_at_ms = dbpool_now_ms();
+    w->stat.connected = 0;
+    p->connected--;
+    return conn;
+}
+
+/** dbpool_pop
+ * Take the oldest request of the most urgent priority, under the lock.
+ */
+static dbpool_request_t dbpool_pop(dbpool_t *p) {
+    int prio = 0;
+    while (p->head[prio] < 0) prio++;
+    int n = p->head[prio];
+    dbpool_request_t req = p->queue[n];
+    p->head[prio] = req.next;
+    if (req.next < 0) p->tail[prio] = -1;
+    p->queue[n].next = p->free_node;
+    p->free_node = n;
+    p->count--;
+    dbpool_queue_stat_t *qs = &p->queue_stat;
+    long long wait = dbpool_now_us() - req.queued_us;
+    qs->depth = p->count;
+    qs->started[prio]++;
+    qs->wait_us[prio] += (unsigned long long)wait;
+    if ((unsigned long long)wait > qs->max_wait_us[prio]) qs->max_wait_us[prio] = (unsigned int)wait;
+    return req;
+}
+
+/** dbpool_process
+ * Execute one request on the worker's connection, without the lock.
+ */
+static void dbpool_process(dbpool_t *p, dbpool_worker_t *w, dbpool_request_t *req) {
+    int rows = DBPOOL_EXEC_ERROR;
+    long long start = dbpool_now_us();
+    if (w->conn) {
+        rows = p->backend.execute(w->conn, req->query, p->backend.ctx);
+    }
+    long long took = dbpool_now_us() - start;
+    void *broken = NULL;
+    pthread_mutex_lock(&p->lock);
+    w->stat.queries++;
+    w->stat.busy_us += (unsigned long long)took;
+    if ((unsigned long long)took > w->stat.max_us) w->stat.max_us = (unsigned int)took;
+    if (rows < 0) w->stat.errors++;
+    if (rows == DBPOOL_EXEC_BROKEN) broken = dbpool_disconnect(p, w);
+    w->last_used_ms = dbpool_now_ms();
+    pthread_mutex_unlock(&p->lock);
+    if (broken) p->backend.close(broken, p->backend.ctx);
+    req->query->result_count = rows < 0 ? -1 : rows;
+    req->result_proc(NULL, req->query, req->user_data);
+}
+
+static void *dbpool_worker_main(void *arg) {
+    dbpool_worker_t *w = (dbpool_worker_t *)arg;
+    dbpool_t *p = w->pool;
+    if (p->backend.thread_init) p->backend.thread_init(p->backend.ctx);
+    pthread_mutex_lock(&p->lock);
+    while (p->running) {
+        long long now = dbpool_now_ms();
+        if (!w->conn && now >= w->retry_at_ms) {
+            pthread_mutex_unlock(&p->lock);
+            void *conn = p->backend.connect(p->backend.ctx);
+            pthread_mutex_lock(&p->lock);
+            dbpool_connected(p, w, conn);
+            continue;
+        }
+        // without a connection take the requests only if nobody could
+        // serve them, they fail fast instead of waiting for the database
+        if (p->count && (w->conn || !p->connected)) {
+            dbpool_request_t req = dbpool_pop(p);
+            pthread_mutex_unlock(&p->lock);
+            dbpool_process(p, w, &req);
+            pthread_mutex_lock(&p->lock);
+            continue;
+        }
+        unsigned int health = p->config.health_check_ms;
+        if (w->conn && health && now - w->last_used_ms >= health) {
+            void *conn = w->conn;
+            pthread_mutex_unlock(&p->lock);
+            int alive = !p->backend.ping(conn, p->backend.ctx);
+            pthread_mutex_lock(&p->lock);
+            void *broken = NULL;
+            if (alive) {
+                w->last_used_ms = dbpool_now_ms();
+            } else {
+                w->stat.errors++;
+                broken = dbpool_disconnect(p, w);
+            }
+            if (broken) {
+                pthread_mutex_unlock(&p->lock);
+                p->backend.close(broken, p->backend.ctx);
+                pthread_mutex_lock(&p->lock);
+            }
+            continue;
+        }
+        long long deadline = -1;
+        if (!w->conn) deadline = w->retry_at_ms;
+        else if (health) deadline = w->last_used_ms + health;
+        dbpool_wait(p, deadline);
+    }
+    void *conn = dbpool_disconnect(p, w);
+    pthread_mutex_unlock(&p->lock);
+    if (conn) p->backend.close(conn, p->backend.ctx);
+    if (p->backend.thread_end) p->backend.thread_end(p->backend.ctx);
+    return NULL;
+}
+
+int dbpool_start(dbpool_t *p, const dbpool_config_t *config, const dbpool_backend_t *backend) {
+    if (!p || !config || !backend || !backend->connect || !backend->ping ||
+        !backend->execute || !backend->close) return -1;
+    if (config->workers < 1 || config->workers > DBPOOL_MAX_WORKERS ||
+        config->queue_size < 1 || config->queue_size > INT_MAX) return -1;
+    memset(p, 0, sizeof(*p));
+    p->queue = calloc(config->queue_size, sizeof(dbpool_request_t));
+    if (!p->queue) return -1;
+    p->queue_size = config->queue_size;
+    p->bulk_limit = config->queue_size * DBPOOL_BULK_SHARE / 100;
+    if (!p->bulk_limit) p->bulk_limit = 1;
+    for (size_t i = 0; i < p->queue_size; i++) {
+        p->queue[i].next = (i + 1 < p->queue_size) ? (int)i + 1 : -1;
+    }
+    for (int i = 0; i < DB_PRIORITY_COUNT; i++) {
+        p->head[i] = -1;
+        p->tail[i] = -1;
+    }
+    p->config = *config;
+    if (p->config.backoff_max_ms < p->config.backoff_min_ms) p->config.backoff_max_ms = p->config.backoff_min_ms;
+    p->backend = *backend;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&p->lock, NULL);
+    p->running = 1;
+    pthread_mutex_lock(&p->lock);
+    for (size_t i = 0; i < config->workers; i++) {
+        dbpool_worker_t *w = &p->workers[i];
+        w->pool = p;
+        if (pthread_create(&w->thread, NULL, dbpool_worker_main, w)) break;
+        p->worker_count++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (!p->worker_count) {
+        p->running = 0;
+        free(p->queue);
+        p->queue = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void dbpool_stop(dbpool_t *p) {
+    if (!p || !p->queue) return;
+    pthread_mutex_lock(&p->lock);
+    p->running = 0;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (size_t i = 0; i < p->worker_count; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+    }
+    // the lock stays valid, a late submit is rejected
+    pthread_mutex_lock(&p->lock);
+    size_t count = p->count;
+    dbpool_request_t *pending = count ? malloc(sizeof(dbpool_request_t) * count) : NULL;
+    if (pending) {
+        for (size_t i = 0; i < count; i++) pending[i] = dbpool_pop(p);
+    }
+    while (p->count) {
+        // no memory for the list: one by one, out of the lock
+        dbpool_request_t req = dbpool_pop(p);
+        pthread_mutex_unlock(&p->lock);
+        req.query->result_count = -1;
+        req.result_proc(NULL, req.query, req.user_data);
+        pthread_mutex_lock(&p->lock);
+    }
+    free(p->queue);
+    p->queue = NULL;
+    p->worker_count = 0;
+    pthread_mutex_unlock(&p->lock);
+    // the completions may take the lock, e.g. by a (rejected) resubmit
+    for (size_t i = 0; pending && i < count; i++) {
+        pending[i].query->result_count = -1;
+        pending[i].result_proc(NULL, pending[i].query, pending[i].user_data);
+    }
+    free(pending);
+}
+
+int dbpool_submit(dbpool_t *p, DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data) {
+    if (!p || !query || !result_proc || priority < 0 || priority >= DB_PRIORITY_COUNT) return -1;
+    int rc = -1;
+    pthread_mutex_lock(&p->lock);
+    size_t limit = (priority == DB_PRIORITY_BULK) ? p->bulk_limit : p->queue_size;
+    dbpool_queue_stat_t *qs = &p->queue_stat;
+    if (p->running && p->count < limit) {
+        int n = p->free_node;
+        dbpool_request_t *req = &p->queue[n];
+        p->free_node = req->next;
+        req->query = query;
+        req->result_proc = result_proc;
+        req->user_data = user_data;
+        req->priority = priority;
+        req->queued_us = dbpool_now_us();
+        req->next = -1;
+        if (p->tail[priority] < 0) p->head[priority] = n;
+        else p->queue[p->tail[priority]].next = n;
+        p->tail[priority] = n;
+        p->count++;
+        qs->submitted[priority]++;
+        qs->depth = p->count;
+        if (qs->depth > qs->max_depth) qs->max_depth = qs->depth;
+        // the idle disconnected workers do not take it, wake everybody
+        pthread_cond_broadcast(&p->cond);
+        rc = 0;
+    } else {
+        qs->rejected[priority]++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return rc;
+}
+
+size_t dbpool_queued(dbpool_t *p) {
+    if (!p) return 0;
+    pthread_mutex_lock(&p->lock);
+    size_t n = p->count;
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+size_t dbpool_stats(dbpool_t *p, dbpool_conn_stat_t *stats, size_t max) {
+    if (!p || !stats) return 0;
+    pthread_mutex_lock(&p->lock);
+    size_t n = p->worker_count < max ? p->worker_count : max;
+    for (size_t i = 0; i < n; i++) stats[i] = p->workers[i].stat;
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+void dbpool_queue_stats(dbpool_t *p, dbpool_queue_stat_t *stat) {
+    if (!p || !stat) return;
+    pthread_mutex_lock(&p->lock);
+    *stat = p->queue_stat;
+    pthread_mutex_unlock(&p->lock);
+}
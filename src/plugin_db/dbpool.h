@@ -0,0 +1,143 @@
+/*
+ * File:    dbpool.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-30
+ *
+ * Connection pool of the database plugins
+ * Key features:
+ *  N worker threads, each owns one connection of the backend and pulls the
+ *  requests from one shared queue, so a slow query blocks only its worker.
+ *  The queue is bounded, a request over the limit is rejected to the
+ *  caller instead of dropped. Strict priorities: a worker takes the oldest
+ *  request of the most urgent priority. Bulk requests may fill only
+ *  DBPOOL_BULK_SHARE of the queue. Depth, wait time and rejections are
+ *  counted per priority.
+ *  The idle connections are health checked (ping) periodically, a broken
+ *  or failed connection is reconnected with exponential backoff.
+ *  Per connection statistics: queries, errors, reconnects, busy time.
+ *  The backend is a small vtable, the mysql plugin implements it with
+ *  libmysqlclient, the unit test with an in-process fake.
+ */
+#ifndef DBPOOL_H
+#define DBPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "plugin.h"
+
+#define DBPOOL_MAX_WORKERS      (16)
+#define DBPOOL_BULK_SHARE       (75)    // percent of the queue
+
+// Return values of the backend execute
+#define DBPOOL_EXEC_ERROR       (-1)    // the query failed, the connection is usable
+#define DBPOOL_EXEC_BROKEN      (-2)    // the connection is lost
+
+typedef struct dbpool_backend_t {
+    void *(*connect)(void *ctx);                        // new connection or NULL
+    int (*ping)(void *conn, void *ctx);                 // 0 if alive
+    int (*execute)(void *conn, DbQuery *q, void *ctx);  // number of rows or DBPOOL_EXEC_*
+    void (*close)(void *conn, void *ctx);
+    void (*thread_init)(void *ctx);                     // optional, on the worker threads
+    void (*thread_end)(void *ctx);                      // optional
+    void *ctx;
+} dbpool_backend_t;
+
+typedef struct {
+    size_t workers;
+    size_t queue_size;
+    unsigned int health_check_ms;   // ping of the idle connections, 0: never
+    unsigned int backoff_min_ms;    // first reconnect delay, doubled per failure
+    unsigned int backoff_max_ms;
+} dbpool_config_t;
+
+typedef struct {
+    int connected;
+    unsigned long queries;
+    unsigned long errors;           // failed queries and connects
+    unsigned long reconnects;       // successful connects after the first one
+    unsigned long long busy_us;     // time spent in the queries
+    unsigned int max_us;            // slowest query
+    unsigned int backoff_ms;        // current reconnect delay, 0 if connected
+} dbpool_conn_stat_t;
+
+typedef struct {
+    size_t depth;
+    size_t max_depth;
+    unsigned long submitted[DB_PRIORITY_COUNT];
+    unsigned long rejected[DB_PRIORITY_COUNT];
+    unsigned long started[DB_PRIORITY_COUNT];      // taken by a worker
+    unsigned long long wait_us[DB_PRIORITY_COUNT]; // sum of the queue waits of the started ones
+    unsigned int max_wait_us[DB_PRIORITY_COUNT];
+} dbpool_queue_stat_t;
+
+typedef struct {
+    DbQuery *query;
+    QueryResultProc result_proc;
+    void *user_data;
+    DbPriority priority;
+    long long queued_us;
+    int next;                       // next node in its list, -1: end
+} dbpool_request_t;
+
+struct dbpool_t;
+typedef struct {
+    struct dbpool_t *pool;
+    pthread_t thread;
+    void *conn;
+    int ever_connected;
+    unsigned int failures;          // consecutive connect failures
+    long long retry_at_ms;
+    long long last_used_ms;
+    dbpool_conn_stat_t stat;        // guarded by the pool lock
+} dbpool_worker_t;
+
+typedef struct dbpool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dbpool_request_t *queue;        // queue_size nodes, linked into the lists
+    size_t queue_size;
+    size_t bulk_limit;
+    int free_node;                  // list of the unused nodes
+    int head[DB_PRIORITY_COUNT];    // FIFO per priority
+    int tail[DB_PRIORITY_COUNT];
+    size_t count;
+    dbpool_queue_stat_t queue_stat;
+    dbpool_worker_t workers[DBPOOL_MAX_WORKERS];
+    size_t worker_count;
+    size_t connected;
+    dbpool_backend_t backend;
+    dbpool_config_t config;
+    int running;
+} dbpool_t;
+
+/** dbpool_start
+ * Start the workers, they connect in the background.
+ * Returns 0 or -1.
+ */
+int dbpool_start(dbpool_t *p, const dbpool_config_t *config, const dbpool_backend_t *backend);
+/** dbpool_stop
+ * Stop and join the workers, the queued requests are completed with
+ * result_count -1. The running queries are finished first.
+ */
+void dbpool_stop(dbpool_t *p);
+/** dbpool_submit
+ * Queue a request, the result_proc is called from a worker thread with the
+ * number of rows (or -1 on error) in query->result_count.
+ * Returns -1 if the queue is full (for its priority) or the pool is
+ * stopped, the result_proc is not called then.
+ */
+int dbpool_submit(dbpool_t *p, DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data);
+/** dbpool_queued
+ * Number of the requests waiting for a worker.
+ */
+size_t dbpool_queued(dbpool_t *p);
+/** dbpool_stats
+ * Copy the statistics of the connections, returns their number.
+ */
+size_t dbpool_stats(dbpool_t *p, dbpool_conn_stat_t *stats, size_t max);
+/** dbpool_queue_stats
+ * Copy the statistics of the queue.
+ */
+void dbpool_queue_stats(dbpool_t *p, dbpool_queue_stat_t *stat);
+
+#endif // DBPOOL_H
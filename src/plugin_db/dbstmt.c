@@ -0,0 +1,104 @@
+/*
+ * File:    dbstmt.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-02
+ *
+ * Prepared statement cache of a db connection, see dbstmt.h.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "dbstmt.h"
+
+static unsigned long dbstmt_hash(const char *s) {
+    unsigned long h = 5381;
+    int c;
+    while ((c = (unsigned char)*s++)) h = h * 33 + (unsigned long)c;
+    return h;
+}
+
+static dbstmt_entry_t *dbstmt_find(dbstmt_cache_t *c, const char *sql, unsigned long hash) {
+    for (size_t i = 0; i < c->count; i++) {
+        dbstmt_entry_t *e = &c->entries[i];
+        if (e->hash == hash && !strcmp(e->sql, sql)) return e;
+    }
+    return NULL;
+}
+
+/** dbstmt_remove
+ * Finalize the entry, the last one takes its place.
+ */
+static void dbstmt_remove(dbstmt_cache_t *c, dbstmt_entry_t *e) {
+    if (c->free_stmt) c->free_stmt(e->stmt);
+    free(e->sql);
+    *e = c->entries[--c->count];
+}
+
+int dbstmt_init(dbstmt_cache_t *c, size_t size, dbstmt_free_fn free_stmt) {
+    if (!c) return -1;
+    memset(c, 0, sizeof(*c));
+    if (!size) size = DBSTMT_DEFAULT_SIZE;
+    c->entries = calloc(size, sizeof(dbstmt_entry_t));
+    if (!c->entries) return -1;
+    c->size = size;
+    c->free_stmt = free_stmt;
+    return 0;
+}
+
+void dbstmt_destroy(dbstmt_cache_t *c) {
+    if (!c || !c->entries) return;
+    dbstmt_clear(c);
+    free(c->entries);
+    memset(c, 0, sizeof(*c));
+}
+
+void dbstmt_clear(dbstmt_cache_t *c) {
+    if (!c) return;
+    while (c->count) dbstmt_remove(c, &c->entries[c->count - 1]);
+}
+
+void *dbstmt_get(dbstmt_cache_t *c, const char *sql) {
+    if (!c || !c->entries || !sql) return NULL;
+    dbstmt_entry_t *e = dbstmt_find(c, sql, dbstmt_hash(sql));
+    if (!e) {
+        c->misses++;
+        return NULL;
+    }
+    c->hits++;
+    e->last_use = ++c->tick;
+    return e->stmt;
+}
+
+int dbstmt_put(dbstmt_cache_t *c, const char *sql, void *stmt) {
+    if (!c || !c->entries || !sql || !stmt) {
+        if (c && stmt && c->free_stmt) c->free_stmt(stmt);
+        return -1;
+    }
+    unsigned long hash = dbstmt_hash(sql);
+    dbstmt_entry_t *e = dbstmt_find(c, sql, hash);
+    if (e) dbstmt_remove(c, e);
+    if (c->count == c->size) {
+        dbstmt_entry_t *lru = &c->entries[0];
+        for (size_t i = 1; i < c->count; i++) {
+            if (c->entries[i].last_use < lru->last_use) lru = &c->entries[i];
+        }
+        dbstmt_remove(c, lru);
+    }
+    char *copy = strdup(sql);
+    if (!copy) {
+        if (c->free_stmt) c->free_stmt(stmt);
+        return -1;
+    }
+    e = &c->entries[c->count++];
+    e->sql = copy;
+    e->hash = hash;
+    e->stmt = stmt;
+    e->last_use = ++c->tick;
+    return 0;
+}
+
+void dbstmt_drop(dbstmt_cache_t *c, const char *sql) {
+    if (!c || !c->entries || !sql) return;
+    dbstmt_entry_t *e = dbstmt_find(c, sql, dbstmt_hash(sql));
+    if (e) dbstmt_remove(c, e);
+}
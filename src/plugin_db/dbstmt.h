@@ -0,0 +1,65 @@
+/*
+ * File:    dbstmt.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-02
+ *
+ * Prepared statement cache of a db connection
+ * Key features:
+ *  Keyed by the SQL text, least recently used eviction, the evicted and
+ *  cleared statements are finalized by the callback of the backend.
+ *  One cache belongs to one connection, it has no lock: the connection is
+ *  used by one thread at a time anyway.
+ */
+#ifndef DBSTMT_H
+#define DBSTMT_H
+
+#include <stddef.h>
+
+#define DBSTMT_DEFAULT_SIZE (32)
+
+typedef void (*dbstmt_free_fn)(void *stmt);
+
+typedef struct {
+    char *sql;
+    unsigned long hash;
+    void *stmt;
+    unsigned long last_use;
+} dbstmt_entry_t;
+
+typedef struct {
+    dbstmt_entry_t *entries;
+    size_t size;
+    size_t count;
+    unsigned long tick;
+    dbstmt_free_fn free_stmt;
+    unsigned long hits;
+    unsigned long misses;
+} dbstmt_cache_t;
+
+/** dbstmt_init
+ * Cache of size statements (DBSTMT_DEFAULT_SIZE if 0). Returns 0 or -1.
+ */
+int dbstmt_init(dbstmt_cache_t *c, size_t size, dbstmt_free_fn free_stmt);
+/** dbstmt_destroy
+ * Finalize the statements and free the cache.
+ */
+void dbstmt_destroy(dbstmt_cache_t *c);
+/** dbstmt_clear
+ * Finalize every statement, e.g. before a reconnect.
+ */
+void dbstmt_clear(dbstmt_cache_t *c);
+/** dbstmt_get
+ * Cached statement of the SQL text or NULL (counted as a miss).
+ */
+void *dbstmt_get(dbstmt_cache_t *c, const char *sql);
+/** dbstmt_put
+ * Cache a prepared statement, the least recently used one is finalized if
+ * the cache is full. On error the statement is finalized. Returns 0 or -1.
+ */
+int dbstmt_put(dbstmt_cache_t *c, const char *sql, void *stmt);
+/** dbstmt_drop
+ * Finalize and forget the statement of the SQL text, after an error.
+ */
+void dbstmt_drop(dbstmt_cache_t *c, const char *sql);
+
+#endif // DBSTMT_H
@@ -0,0 +1,114 @@
+/*
+ * File:    dbuser.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-03
+ *
+ * User summary of the /user endpoint, see dbuser.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include "dbuser.h"
+
+// The same row shape for every kind:
+// 'u': kind, id, nick, last_login, email, lat, lon, alt, regions
+// 'p': kind, workers, soldiers, dead
+// 'r': kind, resource_id, name, quantity
+const char *dbuser_summary_sql =
+    "SELECT 'u', u.id, u.nick, u.last_login, u.email, u.lat, u.lon, u.alt,"
+    " (SELECT COUNT(*) FROM user_regions ur WHERE ur.user_id = u.id)"
+    " FROM users u WHERE u.session_id = ?"
+    " UNION ALL"
+    " SELECT 'p',"
+    " SUM(CASE WHEN p.job_id = 2 AND e.status_id != 5 THEN 1 ELSE 0 END),"
+    " SUM(CASE WHEN p.job_id = 3 AND e.status_id != 5 THEN 1 ELSE 0 END),"
+    " SUM(CASE WHEN e.status_id = 5 THEN 1 ELSE 0 END), NULL, NULL, NULL, NULL, NULL"
+    " FROM users u JOIN entities e ON e.user_id = u.id JOIN persons p ON p.entity_id = e.id"
+    " WHERE u.session_id = ?"
+    " UNION ALL"
+    " SELECT 'r', rr.resource_id, res.name, SUM(rr.quantity), NULL, NULL, NULL, NULL, NULL"
+    " FROM users u JOIN user_regions ur ON ur.user_id = u.id"
+    " JOIN region_resources rr ON rr.region_id = ur.region_id"
+    " JOIN resources res ON res.id = rr.resource_id"
+    " WHERE u.session_id = ? GROUP BY rr.resource_id, res.name";
+
+static void dbuser_copy(char *dst, const char *src) {
+    snprintf(dst, DBUSER_TEXT_LEN, "%s", src ? src : "");
+}
+
+/** dbuser_summary_row
+ * Streaming row of the summary query.
+ */
+static int dbuser_summary_row(const DbRow *row, void *user_data) {
+    dbuser_summary_t *s = (dbuser_summary_t *)user_data;
+    const char *kind = db_row_text(row, 0);
+    if (!kind) return 0;
+    if (kind[0] == 'u') {
+        s->found = 1;
+        s->user_id = (int)db_row_int(row, 1, 0);
+        dbuser_copy(s->nick, db_row_text(row, 2));
+        dbuser_copy(s->last_login, db_row_text(row, 3));
+        dbuser_copy(s->email, db_row_text(row, 4));
+        s->lat = db_row_double(row, 5, 0.0);
+        s->lon = db_row_double(row, 6, 0.0);
+        s->alt = db_row_double(row, 7, 0.0);
+        s->region_count = (int)db_row_int(row, 8, 0);
+    } else if (kind[0] == 'p') {
+        s->workers = (int)db_row_int(row, 1, 0);
+        s->soldiers = (int)db_row_int(row, 2, 0);
+        s->dead = (int)db_row_int(row, 3, 0);
+    } else if (kind[0] == 'r' && !s->truncated) {
+        const char *name = db_row_text(row, 2);
+        const char *quantity = db_row_text(row, 3);
+        size_t room = sizeof(s->resources) - s->resources_len;
+        int n = snprintf(s->resources + s->resources_len, room,
+            "%s{\"id\":%lld,\"name\":\"%s\",\"quantity\":%s}",
+            s->resource_count ? "," : "", db_row_int(row, 1, 0),
+            name ? name : "", quantity ? quantity : "0");
+        if (n < 0 || (size_t)n >= room) {
+            s->resources[s->resources_len] = 0;   // whole items only
+            s->truncated = 1;
+        } else {
+            s->resources_len += (size_t)n;
+            s->resource_count++;
+        }
+    }
+    return 0;
+}
+
+int dbuser_summary_query(DbQuery *q, dbuser_summary_t *s, const char *session_id) {
+    if (!q || !s || !session_id) return -1;
+    memset(s, 0, sizeof(*s));
+    snprintf(q->query, sizeof(q->query), "%s", dbuser_summary_sql);
+    q->row_proc = dbuser_summary_row;
+    q->row_user_data = s;
+    // the key for every part of the union
+    for (int i = 0; i < DBUSER_QUERY_PARAMS; i++) {
+        if (db_query_bind_text(q, session_id)) return -1;
+    }
+    return 0;
+}
+
+int dbuser_summary_json(const dbuser_summary_t *s, const char *session_id, char *out, size_t size) {
+    int n = snprintf(out, size,
+        "{\n"
+        "\"session_id\": \"%s\",\n"
+        "\"user_id\": %d,\n"
+        "\"nick\": \"%s\",\n"
+        "\"last_login\": \"%s\",\n"
+        "\"email\": \"%s\",\n"
+        "\"region_count\": %d,\n"
+        "\"workers\": %d,\n"
+        "\"soldiers\": %d,\n"
+        "\"dead\": %d,\n"
+        "\"lat\": %.4f,\n"
+        "\"lon\": %.4f,\n"
+        "\"alt\": %.4f,\n"
+        "\"resources\": [%s]\n"
+        "}\n",
+        session_id, s->user_id, s->nick, s->last_login, s->email,
+        s->region_count, s->workers, s->soldiers, s->dead,
+        s->lat, s->lon, s->alt, s->resources);
+    if (n < 0 || (size_t)n >= size) return -1;
+    return n;
+}
@@ -0,0 +1,50 @@
+/*
+ * File:    dbuser.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-03
+ *
+ * User summary of the /user endpoint
+ * Key features:
+ *  One statement, one round trip: the user row ('u'), the person counters
+ *  ('p') and one row per resource ('r'), each selected by the session key.
+ *  The rows are consumed while they stream, the JSON is assembled from
+ *  this single pass. Plain SQL, it runs on MySQL and on SQLite too.
+ */
+#ifndef DBUSER_H
+#define DBUSER_H
+
+#include <stddef.h>
+#include "../plugin.h"
+
+#define DBUSER_TEXT_LEN         (60)
+#define DBUSER_RESOURCES_LEN    (2048)
+#define DBUSER_QUERY_PARAMS     (3)     // the session key of each part
+
+typedef struct {
+    int found;
+    int user_id;
+    char nick[DBUSER_TEXT_LEN];
+    char last_login[DBUSER_TEXT_LEN];
+    char email[DBUSER_TEXT_LEN];
+    double lat, lon, alt;
+    int region_count;
+    int workers, soldiers, dead;
+    int resource_count;
+    int truncated;                      // some resources did not fit
+    size_t resources_len;
+    char resources[DBUSER_RESOURCES_LEN];   // the items of the JSON array
+} dbuser_summary_t;
+
+extern const char *dbuser_summary_sql;
+
+/** dbuser_summary_query
+ * Set up the prepared, streaming query of the session into q (zeroed
+ * before), its rows are collected into s. Returns 0 or -1.
+ */
+int dbuser_summary_query(DbQuery *q, dbuser_summary_t *s, const char *session_id);
+/** dbuser_summary_json
+ * The /user response body. Returns its length, or -1 if it did not fit.
+ */
+int dbuser_summary_json(const dbuser_summary_t *s, const char *session_id, char *out, size_t size);
+
+#endif // DBUSER_H
@@ -14,10 +14,28 @@
 #include <pthread.h>
 #include <errno.h>
 #include "sync.h"
+#include "dbpool.h"
+#include "dbstmt.h"
+#include "dbuser.h"
 
 #include <mysql/mysql.h>
-
-#define DB_MYSQL_MAX_QUEUE_SIZE (16)
+#include <mysql/errmsg.h>
+
+// the flags of MYSQL_BIND are my_bool in the older and the MariaDB clients
+#if defined(LIBMARIADB) || defined(MARIADB_BASE_VERSION) || (defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID < 80000)
+typedef my_bool mysql_flag_t;
+#else
+#include <stdbool.h>
+typedef bool mysql_flag_t;
+#endif
+
+#define DB_MYSQL_QUEUE_SIZE (256)
+#define DB_MYSQL_POOL_SIZE (4)
+#define DB_MYSQL_HEALTH_CHECK_SEC (30)
+#define DB_MYSQL_BACKOFF_MIN_MS (250)
+#define DB_MYSQL_BACKOFF_MAX_MS (30000)
+#define DB_MYSQL_STMT_BUFFER (256)   // initial result buffer of a prepared statement column
+#define MYSQL_USER_CACHE_TTL (10)   // sec, the /user responses in the result cache
 #define QUEUE_LOCK_TIMEOUT (20ul)  // 20ms
 #define QUEUE_WAIT_TIMEOUT (100ul) // 100ms
 
@@ -26,19 +44,11 @@
 static pthread_key_t mysql_conn_key;
 static pthread_once_t mysql_key_once = PTHREAD_ONCE_INIT;
 static __thread int db_connection_valid = 0;
+static __thread dbstmt_cache_t db_stmts;   // prepared statements of the thread-local connection
 
-// mysql internal
-typedef struct QueryRequest {
-    DbQuery *query;
-    QueryResultProc result_proc;
-    void *user_data;
-} QueryRequest;
-
-// the main queue thred is a singleton, we save the mutex and cond here
+// the queue thread is a singleton, it supervises the pool, we save its control here
 static PluginThreadControl *g_queue_control = NULL;
-static QueryRequest queue[DB_MYSQL_MAX_QUEUE_SIZE];
-static int queue_size = 0;
-static int queue_head = 0;
+static dbpool_t g_pool;
 
 const PluginHostInterface *g_host;
 
@@ -83,9 +93,19 @@ int plugin_det_str_dump(char* buf, int len){
     buf[0]=0;
     for (int i=0; i<det_max; i++){
         if (g_dets[i]){
-            o+= snprintf(buf, len - o, "%d:%03d %03d ", i, g_dets[i], g_detlines[i]);
+            o+= snprintf(buf + o, len - o, "%d:%03d %03d ", i, g_dets[i], g_detlines[i]);
         }
     }
+    dbpool_queue_stat_t qs;
+    dbpool_queue_stats(&g_pool, &qs);
+    unsigned long rejected = 0;
+    for (int i = 0; i < DB_PRIORITY_COUNT; i++) rejected += qs.rejected[i];
+    o+= snprintf(buf + o, len - o, "queue:%d max:%d rejected:%lu wait ms", (int)qs.depth, (int)qs.max_depth, rejected);
+    for (int i = 0; i < DB_PRIORITY_COUNT; i++) {
+        unsigned int avg = qs.started[i] ? (unsigned int)(qs.wait_us[i] / qs.started[i] / 1000) : 0;
+        o+= snprintf(buf + o, len - o, " p%d:%u/%u", i, avg, qs.max_wait_us[i] / 1000);
+    }
+    o+= snprintf(buf + o, len - o, " ");
     o+=sync_det_str_dump(buf+o, len-o);
     return o;
 }
@@ -135,6 +155,7 @@ static int db_thread_end() {
     MYSQL *conn = db_conn();
     if (conn) {
         g_host->debugmsg("db_thread_end(): closing MySQL connection %p", conn);
+        dbstmt_destroy(&db_stmts);
         mysql_close(conn);
         pthread_setspecific(mysql_conn_key, NULL);
         db_connection_valid = 0;
@@ -145,6 +166,35 @@ static int db_thread_end() {
     return 0;
 }
 
+/** db_real_connect
+ * Connect an initialized handle with the [MYSQL] settings.
+ * Returns 0, -1 if the connect failed, -2 if the character set failed.
+ */
+static int db_real_connect(MYSQL *conn) {
+    char db_host[32];
+    char db_user[16];
+    char db_password[32];
+    char db_database[32];
+    int db_port;
+    g_host->config_get_string("MYSQL", "db_host", db_host, 32, "localhost");
+    g_host->config_get_string("MYSQL", "db_user", db_user, 16, "geod");
+    g_host->config_get_string("MYSQL", "db_password", db_password, 32, "geo123");
+    g_host->config_get_string("MYSQL", "db_database", db_database, 32, "geo");
+    db_port = g_host->config_get_int("MYSQL", "db_port", 3306);
+    if (mysql_real_connect(conn, db_host, db_user, db_password, db_database, db_port, NULL, 0) == NULL) {
+        reportDet(det_connect, __LINE__);
+        g_host->errormsg("mysql_real_connect(%s, %s, , %s, %d) failed: %s", db_host, db_user, db_database, db_port, mysql_error(conn));
+        return -1;
+    }
+    if (mysql_set_character_set(conn, "utf8") != 0) {
+        reportDet(det_character_set, __LINE__);
+        g_host->errormsg("mysql_set_character_set() failed: %s", mysql_error(conn));
+        return -2;
+    }
+    g_host->logmsg("mysql_real_connect(%s, %s, , %s, %d) ok", db_host, db_user, db_database, db_port);
+    return 0;
+}
+
 int db_open(MYSQL **conn) {
     if (NULL == conn) {
         g_host->errormsg("db_open() failed: NULL connection pointer");
@@ -159,34 +209,20 @@ int db_open(MYSQL **conn) {
         return -1;
     }
 
-    char db_host[32];
-    char db_user[16];
-    char db_password[32];
-    char db_database[32];
-    int db_port;
     if (!g_host){
         reportDet(det_init, __LINE__);
         return -1;
     }
     db_connection_valid = 0;
-    g_host->config_get_string("MYSQL", "db_host", db_host, 32, "localhost");
-    g_host->config_get_string("MYSQL", "db_user", db_user, 16, "geod");
-    g_host->config_get_string("MYSQL", "db_password", db_password, 32, "geo123");
-    g_host->config_get_string("MYSQL", "db_database", db_database, 32, "geo");
-    db_port = g_host->config_get_int("MYSQL", "db_port", 3306);
-    if (mysql_real_connect(*conn, db_host, db_user, db_password, db_database, db_port, NULL, 0) == NULL) {
-        reportDet(det_connect, __LINE__);
-        g_host->errormsg("mysql_real_connect(%s, %s, , %s, %d) failed: %s", db_host, db_user, db_database, db_port, mysql_error(*conn));
+    dbstmt_clear(&db_stmts);   // the statements die with the old session
+    int rc = db_real_connect(*conn);
+    if (rc == -1) {
         pthread_setspecific(mysql_conn_key, NULL);
-        return -1;
     }
-    if (mysql_set_character_set(*conn, "utf8") != 0) {
-        reportDet(det_character_set, __LINE__);
-        g_host->errormsg("mysql_set_character_set() failed: %s", mysql_error(*conn));
+    if (rc) {
         return -1;
     }
     db_connection_valid = 1;
-    g_host->logmsg("mysql_real_connect(%s, %s, , %s, %d) ok", db_host, db_user, db_database, db_port);
     return 0;
 }
 
@@ -211,6 +247,7 @@ int db_close(MYSQL *conn) {
     if (g_mysql_con_permanent) return 0;
     if (conn) {
         db_connection_valid = 0;
+        dbstmt_clear(&db_stmts);
         mysql_close(conn);
         pthread_setspecific(mysql_conn_key, NULL);
         return 0;
@@ -218,115 +255,406 @@ int db_close(MYSQL *conn) {
     return -1;
 }
 
-static QueryRequest queue_pop() {
-    if (queue_size > 0) {
-        QueryRequest req = queue[queue_head];
-        queue_head = (queue_head + 1) % (sizeof(queue) / sizeof(queue[0]));
-        queue_size--;
-        return req;
-    }
-    QueryRequest empty_req = {0};
-    return empty_req;
+static void mysql_stmt_free(void *stmt) {
+    mysql_stmt_close((MYSQL_STMT *)stmt);
+}
+static size_t mysql_stmt_cache_size(void) {
+    return (size_t)g_host->config_get_int("MYSQL", "stmt_cache_size", DBSTMT_DEFAULT_SIZE);
 }
-static void queue_pop_all() {
-    while (queue_size > 0) {
-        queue_pop();
+
+// Pool backend: every worker owns a MYSQL handle, not the thread-local one,
+// together with the prepared statements of that session
+typedef struct {
+    MYSQL *mysql;
+    dbstmt_cache_t stmts;
+} mysql_conn_t;
+
+static void *mysql_pool_connect(void *ctx) {
+    (void)ctx;
+    mysql_conn_t *mc = calloc(1, sizeof(mysql_conn_t));
+    if (NULL == mc) {
+        reportDet(det_memory, __LINE__);
+        return NULL;
+    }
+    mc->mysql = mysql_init(NULL);
+    if (NULL == mc->mysql) {
+        reportDet(det_init, __LINE__);
+        free(mc);
+        return NULL;
+    }
+    if (db_real_connect(mc->mysql) || dbstmt_init(&mc->stmts, mysql_stmt_cache_size(), mysql_stmt_free)) {
+        mysql_close(mc->mysql);
+        free(mc);
+        return NULL;
     }
+    return mc;
 }
-static void queue_clear() {
-    if (!g_queue_control) return;
-    if (!sync_mutex_lock(g_queue_control->mutex, QUEUE_LOCK_TIMEOUT)){
-        queue_pop_all();
-        sync_mutex_unlock(g_queue_control->mutex);
-    }else{
-        reportDet(det_lock, __LINE__);
-        errormsg("queue_clear lock failure");
+static int mysql_pool_ping(void *conn, void *ctx) {
+    (void)ctx;
+    MYSQL *mysql = ((mysql_conn_t *)conn)->mysql;
+    if (mysql_ping(mysql)) {
+        reportDet(det_conn_invalid, __LINE__);
+        g_host->logmsg("mysql_ping() failed: %s", mysql_error(mysql));
+        return -1;
     }
+    return 0;
 }
-static int queue_is_empty() {
-    return queue_size == 0;
+static int mysql_errno_lost(unsigned int err) {
+    return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
 }
-static void queue_push(QueryRequest *req) {
-    if (!g_queue_control || !g_queue_control->keep_running){
-        debugmsg("Queue already stoped, but there is more push coming...");
-        return;
+static int mysql_pool_lost(MYSQL *conn) {
+    return mysql_errno_lost(mysql_errno(conn));
+}
+/** mysql_column_type
+ * Type of a result column by its field type.
+ */
+static DbType mysql_column_type(const MYSQL_FIELD *f) {
+    switch (f->type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_YEAR:
+        return DB_TYPE_INT;
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+        return DB_TYPE_DOUBLE;
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+    case MYSQL_TYPE_BLOB:
+        return f->charsetnr == 63 ? DB_TYPE_BLOB : DB_TYPE_TEXT;   // 63: binary
+    default:
+        return DB_TYPE_TEXT;
+    }
+}
+
+/** mysql_run_text
+ * Run the query and deliver its rows unbuffered, so a large result is
+ * streamed to the consumer, see db_query_row.
+ */
+static int mysql_run_text(MYSQL *conn, DbQuery *dbq) {
+    if (mysql_query(conn, dbq->query)) {
+        reportDet(det_query, __LINE__);
+        g_host->logmsg("Failed to execute query: %s (%s)", dbq->query, mysql_error(conn));
+        return mysql_pool_lost(conn) ? DBPOOL_EXEC_BROKEN : DBPOOL_EXEC_ERROR;
     }
-    if (!sync_mutex_lock(g_queue_control->mutex, QUEUE_LOCK_TIMEOUT)){
-        if (queue_size < sizeof(queue) / sizeof(queue[0])) {
-            queue[(queue_head + queue_size) % (sizeof(queue) / sizeof(queue[0]))] = *req;
-            queue_size++;
-            sync_cond_signal(g_queue_control->cond);
-        } else {
-            reportDet(det_queue_full, __LINE__);
-            g_host->logmsg("Queue is full, dropping request");
+    MYSQL_RES *result = mysql_use_result(conn);
+    if (result == NULL) {
+        if (mysql_field_count(conn) == 0) {
+            return db_query_begin(dbq, NULL, 0) ? DBPOOL_EXEC_ERROR : 0;   // not a select
         }
-        sync_mutex_unlock(g_queue_control->mutex);
-    }else{
-        reportDet(det_lock, __LINE__);
-        errormsg("queue_push lock failure");
+        reportDet(det_result, __LINE__);
+        g_host->logmsg("mysql_use_result() failed: %s", mysql_error(conn));
+        return mysql_pool_lost(conn) ? DBPOOL_EXEC_BROKEN : DBPOOL_EXEC_ERROR;
+    }
+    int rc = 0;
+    unsigned int num_fields = mysql_num_fields(result);
+    MYSQL_FIELD *fields = mysql_fetch_fields(result);
+    DbColumn *columns = calloc(num_fields ? num_fields : 1, sizeof(DbColumn));
+    DbValue *values = calloc(num_fields ? num_fields : 1, sizeof(DbValue));
+    if (!columns || !values) {
+        reportDet(det_memory, __LINE__);
+        rc = DBPOOL_EXEC_ERROR;
+    } else {
+        for (unsigned int i = 0; i < num_fields; i++) {
+            columns[i].name = fields[i].name;
+            columns[i].type = mysql_column_type(&fields[i]);
+        }
+        if (db_query_begin(dbq, columns, num_fields)) rc = DBPOOL_EXEC_ERROR;
+    }
+    DbRow row = { columns, num_fields, values, 0 };
+    MYSQL_ROW mrow;
+    while (!rc && (mrow = mysql_fetch_row(result))) {
+        unsigned long *lengths = mysql_fetch_lengths(result);
+        for (unsigned int i = 0; i < num_fields; i++) {
+            values[i] = db_value_parse(columns[i].type, mrow[i], lengths[i]);
+        }
+        int r = db_query_row(dbq, &row);
+        if (r < 0) rc = DBPOOL_EXEC_ERROR;
+        if (r) break;   // stopped by the consumer, mysql_free_result drains the rest
+        row.index++;
     }
-}
-void plugin_mysql_db_request_handler(DbQuery *query, QueryResultProc result_proc, void *user_data) {
-    QueryRequest req ;
-    req.query = query;
-    req.result_proc = result_proc;
-    req.user_data = user_data;
-    queue_push(&req); //will copy it in the queue
+    if (!rc && mysql_errno(conn)) {
+        reportDet(det_result, __LINE__);
+        g_host->logmsg("mysql_fetch_row() failed: %s", mysql_error(conn));
+        rc = mysql_pool_lost(conn) ? DBPOOL_EXEC_BROKEN : DBPOOL_EXEC_ERROR;
+    }
+    mysql_free_result(result);
+    free(columns);
+    free(values);
+    return rc ? rc : dbq->result_count;
 }
 
-static void process_request(QueryRequest *req) {
-    MYSQL *conn = db_conn();
-    if (conn == NULL) {
-        reportDet(det_conn_invalid, __LINE__);
-        g_host->logmsg("Failed to get MySQL connection");
-        return;
+/** mysql_stmt_bind_params
+ * MYSQL_BIND of the bound parameters, they point into the query.
+ */
+static void mysql_stmt_bind_params(DbQuery *dbq, MYSQL_BIND *binds) {
+    memset(binds, 0, sizeof(MYSQL_BIND) * DB_QUERY_MAX_PARAMS);
+    for (int i = 0; i < dbq->param_count; i++) {
+        DbValue *v = &dbq->params[i];
+        switch (v->type) {
+        case DB_TYPE_INT:
+            binds[i].buffer_type = MYSQL_TYPE_LONGLONG;
+            binds[i].buffer = &v->i;
+            break;
+        case DB_TYPE_DOUBLE:
+            binds[i].buffer_type = MYSQL_TYPE_DOUBLE;
+            binds[i].buffer = &v->d;
+            break;
+        case DB_TYPE_TEXT:
+        case DB_TYPE_BLOB:
+            binds[i].buffer_type = v->type == DB_TYPE_TEXT ? MYSQL_TYPE_STRING : MYSQL_TYPE_BLOB;
+            binds[i].buffer = (void *)v->s;
+            binds[i].buffer_length = (unsigned long)v->len;
+            break;
+        default:
+            binds[i].buffer_type = MYSQL_TYPE_NULL;
+            break;
+        }
     }
+}
+
+// result column of a prepared statement, fetched as text
+typedef struct {
+    char *buffer;
+    unsigned long length;
+    mysql_flag_t is_null;
+    mysql_flag_t error;
+} mysql_stmt_column_t;
 
-    DbQuery *dbq = req->query;
-    if (!dbq) {
+/** mysql_stmt_prepared
+ * The cached statement of the query text, or a newly prepared one.
+ * Returns NULL on error, *rc tells if the connection was lost.
+ */
+static MYSQL_STMT *mysql_stmt_prepared(MYSQL *conn, dbstmt_cache_t *stmts, DbQuery *dbq, int *rc) {
+    MYSQL_STMT *stmt = (MYSQL_STMT *)dbstmt_get(stmts, dbq->query);
+    *rc = DBPOOL_EXEC_ERROR;
+    if (stmt) return stmt;
+    stmt = mysql_stmt_init(conn);
+    if (!stmt) {
+        reportDet(det_memory, __LINE__);
+        return NULL;
+    }
+    if (mysql_stmt_prepare(stmt, dbq->query, (unsigned long)strlen(dbq->query))) {
         reportDet(det_query, __LINE__);
-        g_host->logmsg("Internal query error.");
-         return;
+        g_host->logmsg("mysql_stmt_prepare() failed: %s (%s)", dbq->query, mysql_stmt_error(stmt));
+        if (mysql_errno_lost(mysql_stmt_errno(stmt))) *rc = DBPOOL_EXEC_BROKEN;
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+    if (dbstmt_put(stmts, dbq->query, stmt)) {   // closed by the cache
+        reportDet(det_memory, __LINE__);
+        return NULL;
     }
+    return stmt;
+}
 
-    if (db_query(conn, dbq->query) != 0) {
-        reportDet(det_query, __LINE__);
-        g_host->logmsg("Failed to execute query: %s", dbq->query);
-        db_close(conn);
-        return;
+/** mysql_run_prepared
+ * Execute the cached prepared statement of the query with its parameters.
+ * The columns are fetched as text into growing buffers and parsed by the
+ * type of the field, the same way as the text protocol rows.
+ */
+static int mysql_run_prepared(MYSQL *conn, dbstmt_cache_t *stmts, DbQuery *dbq) {
+    int rc;
+    MYSQL_STMT *stmt = mysql_stmt_prepared(conn, stmts, dbq, &rc);
+    if (!stmt) return rc;
+    if (mysql_stmt_param_count(stmt) != (unsigned long)dbq->param_count) {
+        reportDet(det_args, __LINE__);
+        g_host->logmsg("Parameter count mismatch: %s (%d bound)", dbq->query, dbq->param_count);
+        return DBPOOL_EXEC_ERROR;
     }
-    MYSQL_RES *result = mysql_store_result(conn);
-    if (result == NULL) {
+    MYSQL_BIND params[DB_QUERY_MAX_PARAMS];
+    mysql_stmt_bind_params(dbq, params);
+    if ((dbq->param_count && mysql_stmt_bind_param(stmt, params)) || mysql_stmt_execute(stmt)) {
+        reportDet(det_query, __LINE__);
+        g_host->logmsg("Failed to execute statement: %s (%s)", dbq->query, mysql_stmt_error(stmt));
+        rc = mysql_errno_lost(mysql_stmt_errno(stmt)) ? DBPOOL_EXEC_BROKEN : DBPOOL_EXEC_ERROR;
+        dbstmt_drop(stmts, dbq->query);
+        return rc;
+    }
+    MYSQL_RES *meta = mysql_stmt_result_metadata(stmt);
+    if (meta == NULL) {
+        return db_query_begin(dbq, NULL, 0) ? DBPOOL_EXEC_ERROR : 0;   // not a select
+    }
+    rc = 0;
+    unsigned int num_fields = mysql_num_fields(meta);
+    MYSQL_FIELD *fields = mysql_fetch_fields(meta);
+    size_t n = num_fields ? num_fields : 1;
+    DbColumn *columns = calloc(n, sizeof(DbColumn));
+    DbValue *values = calloc(n, sizeof(DbValue));
+    MYSQL_BIND *binds = calloc(n, sizeof(MYSQL_BIND));
+    mysql_stmt_column_t *cols = calloc(n, sizeof(mysql_stmt_column_t));
+    if (!columns || !values || !binds || !cols) {
+        reportDet(det_memory, __LINE__);
+        rc = DBPOOL_EXEC_ERROR;
+    }
+    for (unsigned int i = 0; !rc && i < num_fields; i++) {
+        columns[i].name = fields[i].name;
+        columns[i].type = mysql_column_type(&fields[i]);
+        cols[i].buffer = malloc(DB_MYSQL_STMT_BUFFER);
+        if (!cols[i].buffer) {
+            reportDet(det_memory, __LINE__);
+            rc = DBPOOL_EXEC_ERROR;
+            break;
+        }
+        binds[i].buffer_type = MYSQL_TYPE_STRING;
+        binds[i].buffer = cols[i].buffer;
+        binds[i].buffer_length = DB_MYSQL_STMT_BUFFER - 1;   // room for the terminator
+        binds[i].length = &cols[i].length;
+        binds[i].is_null = &cols[i].is_null;
+        binds[i].error = &cols[i].error;
+    }
+    if (!rc && (mysql_stmt_bind_result(stmt, binds) || db_query_begin(dbq, columns, num_fields))) {
         reportDet(det_result, __LINE__);
-        g_host->logmsg("mysql_store_result() failed: %s", mysql_error(conn));
-        db_close(conn);
-        return;
-    }
-    int row_index = 0;
-    int num_fields = mysql_num_fields(result);
-    MYSQL_ROW row;
-    while ((row = mysql_fetch_row(result)) && row_index < DB_QUERY_MAX_ROWS) {
-        int offset = 0;
-        for (int i = 0; i < num_fields; ++i) {
-            char *row_out = dbq->rows[row_index];
-            int row_out_size = sizeof(dbq->rows[row_index]);
-            if (i > 0) offset += snprintf(row_out + offset, row_out_size - offset, "|");
-            offset += snprintf(row_out + offset, row_out_size - offset, "%s", row[i] ? row[i] : "");
+        rc = DBPOOL_EXEC_ERROR;
+    }
+    DbRow row = { columns, num_fields, values, 0 };
+    while (!rc) {
+        int f = mysql_stmt_fetch(stmt);
+        if (f == MYSQL_NO_DATA) break;
+        if (f == 1) {
+            reportDet(det_result, __LINE__);
+            g_host->logmsg("mysql_stmt_fetch() failed: %s", mysql_stmt_error(stmt));
+            rc = mysql_errno_lost(mysql_stmt_errno(stmt)) ? DBPOOL_EXEC_BROKEN : DBPOOL_EXEC_ERROR;
+            break;
+        }
+        int rebind = 0;
+        for (unsigned int i = 0; !rc && i < num_fields; i++) {
+            if (cols[i].is_null) {
+                values[i] = db_value_parse(columns[i].type, NULL, 0);
+                continue;
+            }
+            if (cols[i].length > binds[i].buffer_length) {
+                // MYSQL_DATA_TRUNCATED: grow the buffer, fetch the column again
+                char *b = realloc(cols[i].buffer, cols[i].length + 1);
+                if (!b) {
+                    reportDet(det_memory, __LINE__);
+                    rc = DBPOOL_EXEC_ERROR;
+                    break;
+                }
+                cols[i].buffer = b;
+                binds[i].buffer = b;
+                binds[i].buffer_length = cols[i].length;
+                if (mysql_stmt_fetch_column(stmt, &binds[i], i, 0)) {
+                    reportDet(det_result, __LINE__);
+                    rc = DBPOOL_EXEC_ERROR;
+                    break;
+                }
+                rebind = 1;
+            }
+            cols[i].buffer[cols[i].length] = 0;
+            values[i] = db_value_parse(columns[i].type, cols[i].buffer, cols[i].length);
         }
-        row_index++;
+        if (rc) break;
+        int r = db_query_row(dbq, &row);
+        if (r < 0) rc = DBPOOL_EXEC_ERROR;
+        if (r) break;   // stopped by the consumer, mysql_stmt_free_result drains the rest
+        if (rebind && mysql_stmt_bind_result(stmt, binds)) rc = DBPOOL_EXEC_ERROR;
+        row.index++;
+    }
+    mysql_stmt_free_result(stmt);
+    mysql_free_result(meta);
+    for (unsigned int i = 0; cols && i < num_fields; i++) free(cols[i].buffer);
+    free(cols);
+    free(binds);
+    free(columns);
+    free(values);
+    return rc ? rc : dbq->result_count;
+}
+
+/** mysql_run
+ * Run a query on the connection, a prepared one with the statements of the
+ * connection. A write drops the cached results of its tables.
+ * Returns the rows, DBPOOL_EXEC_ERROR or DBPOOL_EXEC_BROKEN.
+ */
+static int mysql_run(MYSQL *conn, dbstmt_cache_t *stmts, DbQuery *dbq) {
+    int rc;
+    if (dbq->flags & DB_QUERY_PREPARED) rc = mysql_run_prepared(conn, stmts, dbq);
+    else rc = mysql_run_text(conn, dbq);
+    g_host->cache.result_invalidate_sql(dbq->query);
+    return rc;
+}
+
+static int mysql_pool_execute(void *c, DbQuery *dbq, void *ctx) {
+    (void)ctx;
+    mysql_conn_t *mc = (mysql_conn_t *)c;
+    return mysql_run(mc->mysql, &mc->stmts, dbq);
+}
+static void mysql_pool_close(void *conn, void *ctx) {
+    (void)ctx;
+    mysql_conn_t *mc = (mysql_conn_t *)conn;
+    dbstmt_destroy(&mc->stmts);   // before the connection
+    mysql_close(mc->mysql);
+    free(mc);
+}
+static void mysql_pool_thread_init(void *ctx) {
+    (void)ctx;
+    mysql_thread_init();
+}
+static void mysql_pool_thread_end(void *ctx) {
+    (void)ctx;
+    mysql_thread_end();
+}
+static const dbpool_backend_t g_mysql_backend = {
+    .connect = mysql_pool_connect,
+    .ping = mysql_pool_ping,
+    .execute = mysql_pool_execute,
+    .close = mysql_pool_close,
+    .thread_init = mysql_pool_thread_init,
+    .thread_end = mysql_pool_thread_end,
+};
+
+int plugin_mysql_db_request_handler(DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data) {
+    if (!g_queue_control || !g_queue_control->keep_running){
+        debugmsg("Queue already stoped, but there is more push coming...");
+        return -1;
     }
-    dbq->result_count = row_index;
-    req->result_proc(NULL, dbq, req->user_data);
-    mysql_free_result(result);
+    if (dbpool_submit(&g_pool, query, priority, result_proc, user_data)) {
+        reportDet(det_queue_full, __LINE__);
+        g_host->logmsg("Queue is full, request rejected (priority %d)", (int)priority);
+        return -1;
+    }
+    return 0;
 }
 
+/** plugin_mysql_db_execute
+ * Blocking query on the thread-local connection of the caller.
+ */
+int plugin_mysql_db_execute(DbQuery *query) {
+    if (!query) return -1;
+    MYSQL *conn = db_conn();
+    if (!conn) return -1;
+    if (!db_connection_valid && db_open(&conn)) {
+        reportDet(det_conn_invalid, __LINE__);
+        return -1;
+    }
+    if (!db_stmts.entries && dbstmt_init(&db_stmts, mysql_stmt_cache_size(), mysql_stmt_free)) {
+        reportDet(det_memory, __LINE__);
+        return -1;
+    }
+    int rc = mysql_run(conn, &db_stmts, query);
+    if (rc == DBPOOL_EXEC_BROKEN) db_connection_valid = 0;   // reconnected by the next query
+    if (rc < 0) {
+        query->result_count = -1;
+        return -1;
+    }
+    return rc;
+}
+
+/** mysql_thread_main
+ * The own thread of the plugin supervises the pool: starts the workers,
+ * then stops and joins them when the host stops this thread.
+ */
 void *mysql_thread_main(void *arg) {
     PluginContext *pc = (PluginContext*)arg;
     g_host->thread.enter_own(pc);
     // pthread_setname_np("mysql_queue");
-    db_thread_init();
     if (g_queue_control == NULL){
-        // actually we need these two globally due to the db api has no pc
+        // actually we need this globally due to the db api has no pc
         // yeah, the index may depends on implementation, but now 0...
         g_queue_control = &pc->thread.own_threads[0].control;
     }else{
@@ -341,51 +669,34 @@ void *mysql_thread_main(void *arg) {
     }
 
     PluginThreadControl *control= g_queue_control;
-    control->keep_running = 1;
-    MYSQL *conn = db_conn();
-    int tick =0;
-    if (db_open(&conn) != 0) {
-        reportDet(det_conn_invalid, __LINE__);
-        g_host->logmsg("Failed to open MySQL connection");
+    dbpool_config_t config = {
+        .workers = (size_t)g_host->config_get_int("MYSQL", "pool_size", DB_MYSQL_POOL_SIZE),
+        .queue_size = (size_t)g_host->config_get_int("MYSQL", "queue_size", DB_MYSQL_QUEUE_SIZE),
+        .health_check_ms = 1000u * (unsigned int)g_host->config_get_int("MYSQL", "health_check_sec", DB_MYSQL_HEALTH_CHECK_SEC),
+        .backoff_min_ms = (unsigned int)g_host->config_get_int("MYSQL", "reconnect_min_ms", DB_MYSQL_BACKOFF_MIN_MS),
+        .backoff_max_ms = (unsigned int)g_host->config_get_int("MYSQL", "reconnect_max_ms", DB_MYSQL_BACKOFF_MAX_MS),
+    };
+    if (dbpool_start(&g_pool, &config, &g_mysql_backend) != 0) {
+        reportDet(det_init, __LINE__);
+        g_host->errormsg("Failed to start the MySQL pool of %d connections", (int)config.workers);
     } else {
+        g_host->logmsg("MySQL pool of %d connections started", (int)config.workers);
+        control->keep_running = 1;
         while (control->keep_running) {
-            int retWait= 0;
-            int is_empty = 1;
             if (!sync_mutex_lock(control->mutex, QUEUE_LOCK_TIMEOUT)){
-                do{
-                    is_empty = queue_is_empty();
-                    if (ETIMEDOUT == retWait){
-                        break;  // lets do something else
-                    }
-                    if (is_empty){
-                        //wait for signal or timeout, this will automaticcally unlock while sleep, and lock when waken
-                        retWait = sync_cond_wait(control->cond, control->mutex, QUEUE_WAIT_TIMEOUT);
-                    }
-                } while (control->keep_running && is_empty);
-                if (control->keep_running && !is_empty){
-                    //not empty, process the queue
-                    QueryRequest req = queue_pop();
-                    sync_mutex_unlock(control->mutex);
-                    process_request(&req);  // db_query etc, but it is unlocked state.
-                }else{
-                    sync_mutex_unlock(control->mutex); // unlock anyway.
-                }
-                if (ETIMEDOUT == retWait){
-                    // additionally do some home work...
-                    tick++;
-                    if (0==tick % 10){
-                        // g_host->debugmsg("mysql thread idle");
-                    }
+                if (control->keep_running){
+                    // woken by the host when it stops the thread
+                    sync_cond_wait(control->cond, control->mutex, QUEUE_WAIT_TIMEOUT);
                 }
+                sync_mutex_unlock(control->mutex);
             }else{
                 g_host->debugmsg("main mysql thread was not able to acquire lock");
                 sleep(1); //retry later, or wait until the thread is running actually...
             }
         }
-        db_close(conn);
+        dbpool_stop(&g_pool);
     }
     g_host->debugmsg("main loop left");
-    db_thread_end();
     g_host->thread.exit_own(pc);
     g_host->debugmsg("Thread left");
     return NULL;
@@ -399,6 +710,7 @@ int plugin_init(PluginContext* pc, const PluginHostInterface *host) {
     pc->stat.det_str_dump = plugin_det_str_dump;
     pc->stat.stat_clear = plugin_stat_clear;
     pc->db.request = plugin_mysql_db_request_handler;
+    pc->db.execute = plugin_mysql_db_execute;
     pc->http.request_handler = (void*) handle_mysql;
     if (g_host->thread.create_own(pc, mysql_thread_main, "mysql_queue")){
         reportDet(det_init, __LINE__);
@@ -423,149 +735,93 @@ int plugin_thread_finish(PluginContext *ctx) {
     return db_thread_end();   // mandatory!
 }
 
-// Helper: Lookup user info by session_id
-static int get_user_info(MYSQL *conn, const char *session_id, int *user_id, char *nick, char *last_login, char *email, float *lat, float *lon, float *alt) {
-    char query[256];
-    snprintf(query, sizeof(query), "SELECT id, nick, last_login, email, lat, lon, alt FROM users WHERE session_id = '%s'", session_id);
-    if (db_query(conn, query) != 0) return -1;
-    MYSQL_RES *result = mysql_store_result(conn);
-    if (!result) return -1;
-    MYSQL_ROW row = mysql_fetch_row(result);
-    if (row) {
-        *user_id = atoi(row[0]);
-        strncpy(nick, row[1], 59);
-        strncpy(last_login, row[2], 59);
-        strncpy(email, row[3], 59);
-        *lat = row[4] ? atof(row[4]) : 0.0;
-        *lon = row[5] ? atof(row[5]) : 0.0;
-        *alt = row[6] ? atof(row[6]) : 0.0;
+/** handle_user
+ * The user summary of the session in one round trip, see dbuser.h.
+ * The response is kept in the result cache for user_cache_ttl_sec, the
+ * writes to the tables of the query drop it earlier.
+ */
+void handle_user(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
+    (void)pc; (void)params;
+    DbQuery q = {0};
+    dbuser_summary_t summary;
+    char key[CACHE_RESULT_KEY_LEN];
+    int ttl = g_host->config_get_int("MYSQL", "user_cache_ttl_sec", MYSQL_USER_CACHE_TTL);
+    if (dbuser_summary_query(&q, &summary, ctx->request.session_id)) {
+        g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "MySQL query error");
+        return;
     }
-    mysql_free_result(result);
-    return 0;
-}
-
-// Helper: Count regions for user
-static int get_region_count(MYSQL *conn, int user_id) {
-    char query[128];
-    snprintf(query, sizeof(query), "SELECT COUNT(*) FROM user_regions WHERE user_id = %d", user_id);
-    if (db_query(conn, query) != 0) return -1;
-    MYSQL_RES *result = mysql_store_result(conn);
-    if (!result) return -1;
-    MYSQL_ROW row = mysql_fetch_row(result);
-    int count = row ? atoi(row[0]) : 0;
-    mysql_free_result(result);
-    return count;
-}
-
-// Helper: Get person stats (workers, soldiers, dead)
-static void get_person_stats(MYSQL *conn, int user_id, int *workers, int *soldiers, int *dead) {
-    char query[512];
-    snprintf(query, sizeof(query),
-        "SELECT "
-        "SUM(CASE WHEN p.job_id = 2 AND e.status_id != 5 THEN 1 ELSE 0 END),"
-        "SUM(CASE WHEN p.job_id = 3 AND e.status_id != 5 THEN 1 ELSE 0 END),"
-        "SUM(CASE WHEN e.status_id = 5 THEN 1 ELSE 0 END) "
-        "FROM persons p JOIN entities e ON p.entity_id = e.id "
-        "WHERE e.user_id = %d", user_id);
-    *workers = *soldiers = *dead = 0;
-    if (db_query(conn, query) == 0) {
-        MYSQL_RES *res = mysql_store_result(conn);
-        if (res) {
-            MYSQL_ROW row = mysql_fetch_row(res);
-            if (row) {
-                *workers = row[0] ? atoi(row[0]) : 0;
-                *soldiers = row[1] ? atoi(row[1]) : 0;
-                *dead = row[2] ? atoi(row[2]) : 0;
-            }
-            mysql_free_result(res);
+    unsigned long generation = g_host->cache.result_generation();   // before the read
+    int use_cache = ttl > 0 && g_host->cache.result_key(key, sizeof(key), q.query, q.params, q.param_count) >= 0;
+    if (use_cache) {
+        CacheResult *r = g_host->cache.result_get(key);
+        if (r) {
+            size_t len;
+            const void *data = g_host->cache.result_data(r, &len);
+            g_host->http.send_data(ctx->socket_fd, 200, "application/json", data, len);
+            g_host->cache.result_release(r);
+            return;
         }
     }
-}
-
-// Helper: Append region resources as JSON array
-static int append_region_resources_json(MYSQL *conn, int user_id, char *out, int out_size) {
-    char query[512];
-    snprintf(query, sizeof(query),
-        "SELECT rr.resource_id, res.name, SUM(rr.quantity) "
-        "FROM user_regions ur "
-        "JOIN region_resources rr ON rr.region_id = ur.region_id "
-        "JOIN resources res ON res.id = rr.resource_id "
-        "WHERE ur.user_id = %d "
-        "GROUP BY rr.resource_id, res.name", user_id);
-    if (db_query(conn, query) != 0) return 0;
-    MYSQL_RES *res = mysql_store_result(conn);
-    if (!res) return 0;
-    MYSQL_ROW row;
-    int written = snprintf(out, out_size, "\"resources\": [");
-    int first = 1;
-    while ((row = mysql_fetch_row(res))) {
-        if (!first) written += snprintf(out + written, out_size - written, ",");
-        written += snprintf(out + written, out_size - written,
-            "{\"id\":%s,\"name\":\"%s\",\"quantity\":%s}",
-            row[0], row[1], row[2]);
-        first = 0;
-    }
-    written += snprintf(out + written, out_size - written, "]");
-    mysql_free_result(res);
-    return written;
-}
-
-void handle_user(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
-    (void)pc; (void)params;
     MYSQL *conn = db_conn();
-    if (!conn || db_open(&conn) != 0) {
+    if (!conn || (!db_connection_valid && db_open(&conn) != 0)) {
         g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "MySQL connection error");
         return;
     }
-
-    int user_id = 0;
-    char nick[60]="", last_login[60]="", email[60]="";
-    float lat, lon, alt;
-    if (get_user_info(conn, ctx->request.session_id, &user_id, nick, last_login, email, &lat, &lon, &alt) != 0) {
+    if (plugin_mysql_db_execute(&q) < 0) {
+        g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "MySQL query error");
+        return;
+    }
+    if (!summary.found) {
         g_host->http.send_response(ctx->socket_fd, 403, "text/plain", "Invalid session");
         return;
     }
-
-    int region_count = get_region_count(conn, user_id);
-    int workers, soldiers, dead;
-    get_person_stats(conn, user_id, &workers, &soldiers, &dead);
-
+    if (summary.truncated) {
+        g_host->logmsg("/user: resources of user %d truncated", summary.user_id);
+    }
     char body[4096];
-    int offset = snprintf(body, sizeof(body),
-        "{\n"
-        "\"session_id\": \"%s\",\n"
-        "\"user_id\": %d,\n"
-        "\"nick\": \"%s\",\n"
-        "\"last_login\": \"%s\",\n"
-        "\"email\": \"%s\",\n"
-        "\"region_count\": %d,\n"
-        "\"workers\": %d,\n"
-        "\"soldiers\": %d,\n"
-        "\"dead\": %d,\n"
-        "\"lat\": %.4f,\n"
-        "\"lon\": %.4f,\n"
-        "\"alt\": %.4f,\n",
-        ctx->request.session_id, user_id, nick, last_login, email,
-        region_count, workers, soldiers, dead, lat, lon, alt);
-
-    offset += append_region_resources_json(conn, user_id, body + offset, sizeof(body) - offset);
-    offset += snprintf(body + offset, sizeof(body) - offset, "\n}\n");
-
+    int len = dbuser_summary_json(&summary, ctx->request.session_id, body, sizeof(body));
+    if (len < 0) {
+        g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "Response too large");
+        return;
+    }
+    if (use_cache) g_host->cache.result_put(key, NULL, body, (size_t)len, ttl, generation);
     g_host->http.send_response(ctx->socket_fd, 200, "application/json", body);
 }
 void handle_mysql_status(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc; // Unused parameter
     (void)params; // Unused parameter
     (void)ctx; // Unused parameter
-    char body[512];
+    char body[4096];
     int offset = 0;
     offset += snprintf(body + offset, sizeof(body) - offset, "{\n");
-    offset += snprintf(body + offset, sizeof(body) - offset, "\"queue_size\": %d,\n", queue_size);
+    offset += snprintf(body + offset, sizeof(body) - offset, "\"queue_size\": %d,\n", (int)dbpool_queued(&g_pool));
     int rr=0;
     if (g_queue_control){
         rr = g_queue_control->keep_running;
     }
-    offset += snprintf(body + offset, sizeof(body) - offset, "\"queue_running\": %d\n", rr);
+    offset += snprintf(body + offset, sizeof(body) - offset, "\"queue_running\": %d,\n", rr);
+    dbpool_queue_stat_t qs;
+    dbpool_queue_stats(&g_pool, &qs);
+    offset += snprintf(body + offset, sizeof(body) - offset, "\"queue_max_depth\": %d,\n\"queue\": [\n", (int)qs.max_depth);
+    for (int i = 0; i < DB_PRIORITY_COUNT; i++) {
+        unsigned int avg = qs.started[i] ? (unsigned int)(qs.wait_us[i] / qs.started[i]) : 0;
+        offset += snprintf(body + offset, sizeof(body) - offset,
+            "  {\"priority\":%d, \"submitted\":%lu, \"rejected\":%lu, \"wait_avg_us\":%u, \"wait_max_us\":%u}%s\n",
+            i, qs.submitted[i], qs.rejected[i], avg, qs.max_wait_us[i], (i + 1 < DB_PRIORITY_COUNT) ? "," : "");
+    }
+    offset += snprintf(body + offset, sizeof(body) - offset, "],\n");
+    dbpool_conn_stat_t stats[DBPOOL_MAX_WORKERS];
+    size_t n = dbpool_stats(&g_pool, stats, DBPOOL_MAX_WORKERS);
+    offset += snprintf(body + offset, sizeof(body) - offset, "\"connections\": [\n");
+    for (size_t i = 0; i < n; i++) {
+        dbpool_conn_stat_t *st = &stats[i];
+        offset += snprintf(body + offset, sizeof(body) - offset,
+            "  {\"connected\":%d, \"queries\":%lu, \"errors\":%lu, \"reconnects\":%lu, "
+            "\"busy_ms\":%llu, \"max_ms\":%u, \"backoff_ms\":%u}%s\n",
+            st->connected, st->queries, st->errors, st->reconnects,
+            st->busy_us / 1000, st->max_us / 1000, st->backoff_ms, (i + 1 < n) ? "," : "");
+    }
+    offset += snprintf(body + offset, sizeof(body) - offset, "]\n");
     offset += snprintf(body + offset, sizeof(body) - offset, "}\n");
     g_host->http.send_response(ctx->socket_fd, 200, "application/json", body);
     g_host->logmsg("%s mysql status request", ctx->client_ip);
@@ -649,7 +905,7 @@ int plugin_register(PluginContext *pc, const PluginHostInterface *host) {
 int plugin_event(PluginContext *pc, PluginEventType event, const PluginEventContext* ctx) {
     (void)ctx;
     if (event == PLUGIN_EVENT_STANDBY) {
-        if (!queue_is_empty()) {
+        if (dbpool_queued(&g_pool)) {
             return 1;   // If queue is not empty, return 1 to indicate that the plugin should continue processing events
         }
     }
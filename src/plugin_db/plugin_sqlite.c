@@ -8,22 +8,35 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sqlite3.h>
-#define MAX_QUERY_LEN (1024)
-static sqlite3 *g_sqlite_db = NULL;
-static pthread_mutex_t sqlite_mutex = PTHREAD_MUTEX_INITIALIZER;
+#include "dbstmt.h"
+#include "sqlitepool.h"
+#define SQLITE_READERS_DEFAULT (4)
+#define SQLITE_RUN_NEEDS_WRITER (-2)
+static sqlitepool_t g_sqlite_pool;     // one writer, the readers in WAL mode
 const PluginHostInterface *g_host;
 void handle_sqlite_status(PluginContext *pc, ClientContext *ctx, RequestParams *params);
 void handle_sqlite_query(PluginContext *pc, ClientContext *ctx, RequestParams *params);
-void handle_sqlite_query_chunked(PluginContext *pc, ClientContext *ctx, RequestParams *params);
 void handle_sqlite(PluginContext *pc, ClientContext *ctx, RequestParams *params);
 
+#define SQLITE_STREAM_CHUNK (16 * 1024)
+#define SQLITE_TEE_MAX      (4 * 1024 * 1024)   // larger results are not cached
+
+// A query result on its way to the client, as chunked JSON.
 typedef struct {
-    char query[MAX_QUERY_LEN];
-    CacheFile cache_file;
-} sqlite_result_data_t;
+    ClientContext *ctx;
+    int tee;                // a copy is collected for the result cache
+    char *copy;
+    size_t copy_len;
+    size_t copy_size;
+    char *body;             // SQLITE_STREAM_CHUNK bytes
+    size_t offset;
+    size_t sent;
+    int rows;
+    int started;            // the head is sent
+} sqlite_stream_t;
 
 static void (*http_routes[])(PluginContext *, ClientContext *, RequestParams *) = {
-    handle_sqlite_status, handle_sqlite_query //, handle_sqlite_query_chunked
+    handle_sqlite_status, handle_sqlite_query
 };
 const char* plugin_http_get_routes[]={"/sqlite", "/sqlite/query"};
 int plugin_http_get_routes_count = 2;
@@ -32,26 +45,29 @@ static int sqlite_open() {
     const char *filename = "geo.db"; // Default db name
     char db_file[256];
     g_host->config_get_string("SQLITE", "db_file", db_file, sizeof(db_file), filename);
-    if (sqlite3_open(db_file, &g_sqlite_db) != SQLITE_OK) {
-        g_host->logmsg("sqlite_open() failed: %s", sqlite3_errmsg(g_sqlite_db));
+    int readers = g_host->config_get_int("SQLITE", "readers", SQLITE_READERS_DEFAULT);
+    size_t stmt_cache_size = (size_t)g_host->config_get_int("SQLITE", "stmt_cache_size", DBSTMT_DEFAULT_SIZE);
+    int busy_timeout_ms = g_host->config_get_int("SQLITE", "busy_timeout_ms", SQLITEPOOL_BUSY_TIMEOUT_MS);
+    if (sqlitepool_open(&g_sqlite_pool, db_file, readers > 0 ? (size_t)readers : 0, stmt_cache_size, busy_timeout_ms)) {
+        g_host->logmsg("sqlite_open() failed: %s", db_file);
         return -1;
     }
-    g_host->logmsg("sqlite_open(): opened %s", db_file);
+    g_host->logmsg("sqlite_open(): opened %s, %d readers%s", db_file,
+        (int)g_sqlite_pool.reader_count, g_sqlite_pool.wal ? " (WAL)" : "");
     return 0;
 }
 
 static void sqlite_close() {
-    if (g_sqlite_db) {
-        sqlite3_close(g_sqlite_db);
-        g_sqlite_db = NULL;
-    }
+    sqlitepool_close(&g_sqlite_pool);
 }
 
 static int sqlite_exec_query(const char *query) {
     char *errmsg = NULL;
-    pthread_mutex_lock(&sqlite_mutex);
-    int rc = sqlite3_exec(g_sqlite_db, query, NULL, NULL, &errmsg);
-    pthread_mutex_unlock(&sqlite_mutex);
+    sqlitepool_conn_t *c = sqlitepool_acquire(&g_sqlite_pool, 1);
+    if (!c) return -1;
+    int rc = sqlite3_exec(c->db, query, NULL, NULL, &errmsg);
+    sqlitepool_release(&g_sqlite_pool, c);
+    g_host->cache.result_invalidate_sql(query);
     if (rc != SQLITE_OK) {
         g_host->logmsg("sqlite_exec_query() failed: %s", errmsg);
         sqlite3_free(errmsg);
@@ -60,8 +76,148 @@ static int sqlite_exec_query(const char *query) {
     return 0;
 }
 
+/** sqlite_column_type
+ * Type of a result column by its declared type (the SQLite affinity rules).
+ */
+static DbType sqlite_column_type(sqlite3_stmt *stmt, int col) {
+    const char *decl = sqlite3_column_decltype(stmt, col);
+    if (!decl) {
+        switch (sqlite3_column_type(stmt, col)) {   // an expression: by the value
+        case SQLITE_INTEGER: return DB_TYPE_INT;
+        case SQLITE_FLOAT: return DB_TYPE_DOUBLE;
+        case SQLITE_BLOB: return DB_TYPE_BLOB;
+        default: return DB_TYPE_TEXT;
+        }
+    }
+    if (sqlite3_strglob("*[Ii][Nn][Tt]*", decl) == 0) return DB_TYPE_INT;
+    if (sqlite3_strglob("*[Cc][Hh][Aa][Rr]*", decl) == 0 ||
+        sqlite3_strglob("*[Cc][Ll][Oo][Bb]*", decl) == 0 ||
+        sqlite3_strglob("*[Tt][Ee][Xx][Tt]*", decl) == 0) return DB_TYPE_TEXT;
+    if (sqlite3_strglob("*[Bb][Ll][Oo][Bb]*", decl) == 0) return DB_TYPE_BLOB;
+    if (sqlite3_strglob("*[Rr][Ee][Aa][Ll]*", decl) == 0 ||
+        sqlite3_strglob("*[Ff][Ll][Oo][Aa]*", decl) == 0 ||
+        sqlite3_strglob("*[Dd][Oo][Uu][Bb]*", decl) == 0) return DB_TYPE_DOUBLE;
+    return DB_TYPE_TEXT;
+}
+
+/** sqlite_bind_params
+ * Bind the parameters of the query, the texts are not copied.
+ */
+static int sqlite_bind_params(sqlite3_stmt *stmt, const DbQuery *q) {
+    if (sqlite3_bind_parameter_count(stmt) != q->param_count) return SQLITE_RANGE;
+    for (int i = 0; i < q->param_count; i++) {
+        const DbValue *v = &q->params[i];
+        int rc;
+        switch (v->type) {
+        case DB_TYPE_INT: rc = sqlite3_bind_int64(stmt, i + 1, (sqlite3_int64)v->i); break;
+        case DB_TYPE_DOUBLE: rc = sqlite3_bind_double(stmt, i + 1, v->d); break;
+        case DB_TYPE_TEXT: rc = sqlite3_bind_text(stmt, i + 1, v->s, (int)v->len, SQLITE_STATIC); break;
+        case DB_TYPE_BLOB: rc = sqlite3_bind_blob(stmt, i + 1, v->s, (int)v->len, SQLITE_STATIC); break;
+        default: rc = sqlite3_bind_null(stmt, i + 1); break;
+        }
+        if (rc != SQLITE_OK) return rc;
+    }
+    return SQLITE_OK;
+}
+
+/** sqlite_run
+ * Run the query on the acquired connection c. A prepared query keeps its
+ * statement in the cache of the connection, the others are finalized.
+ * A statement which writes is not run on a reader, it gives back
+ * SQLITE_RUN_NEEDS_WRITER.
+ * Returns the number of rows or -1.
+ */
+static int sqlite_run(sqlitepool_conn_t *c, DbQuery *q) {
+    int prepared = (q->flags & DB_QUERY_PREPARED) != 0;
+    sqlite3_stmt *stmt = prepared ? (sqlite3_stmt *)dbstmt_get(&c->stmts, q->query) : NULL;
+    if (!stmt) {
+        if (sqlite3_prepare_v2(c->db, q->query, -1, &stmt, NULL) != SQLITE_OK) {
+            g_host->logmsg("sqlite3_prepare_v2() failed: %s (%s)", q->query, sqlite3_errmsg(c->db));
+            return -1;
+        }
+        if (c->readonly && !sqlite3_stmt_readonly(stmt)) {
+            sqlite3_finalize(stmt);
+            return SQLITE_RUN_NEEDS_WRITER;
+        }
+        if (prepared && dbstmt_put(&c->stmts, q->query, stmt)) return -1;   // finalized by the cache
+    }
+    if (sqlite_bind_params(stmt, q) != SQLITE_OK) {
+        g_host->logmsg("Failed to bind the parameters: %s (%d bound)", q->query, q->param_count);
+        if (prepared) dbstmt_drop(&c->stmts, q->query);
+        else sqlite3_finalize(stmt);
+        return -1;
+    }
+    int num_cols = sqlite3_column_count(stmt);
+    size_t n = num_cols > 0 ? (size_t)num_cols : 1;
+    DbColumn *columns = calloc(n, sizeof(DbColumn));
+    DbValue *values = calloc(n, sizeof(DbValue));
+    int rc = (!columns || !values) ? -1 : 0;
+    int step = sqlite3_step(stmt);
+    for (int i = 0; !rc && i < num_cols; i++) {
+        columns[i].name = sqlite3_column_name(stmt, i);
+        columns[i].type = sqlite_column_type(stmt, i);
+    }
+    if (!rc && db_query_begin(q, columns, (size_t)num_cols)) rc = -1;
+    DbRow row = { columns, (size_t)num_cols, values, 0 };
+    while (!rc && step == SQLITE_ROW) {
+        for (int i = 0; i < num_cols; i++) {
+            const char *text = NULL;
+            if (sqlite3_column_type(stmt, i) == SQLITE_BLOB) {
+                text = (const char *)sqlite3_column_blob(stmt, i);
+            } else if (sqlite3_column_type(stmt, i) != SQLITE_NULL) {
+                text = (const char *)sqlite3_column_text(stmt, i);
+            }
+            values[i] = db_value_parse(columns[i].type, text, (size_t)sqlite3_column_bytes(stmt, i));
+        }
+        int r = db_query_row(q, &row);
+        if (r < 0) rc = -1;
+        if (r) break;
+        row.index++;
+        step = sqlite3_step(stmt);
+    }
+    if (!rc && step != SQLITE_ROW && step != SQLITE_DONE) {
+        g_host->logmsg("sqlite3_step() failed: %s (%s)", q->query, sqlite3_errmsg(c->db));
+        rc = -1;
+    }
+    if (prepared) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    } else {
+        sqlite3_finalize(stmt);
+    }
+    free(columns);
+    free(values);
+    return rc ? -1 : q->result_count;
+}
+
+/** plugin_sqlite_db_execute
+ * Blocking query: a SELECT on a free reader, the rest on the writer.
+ * A reader hands back what turns out to write, it is run on the writer.
+ */
+int plugin_sqlite_db_execute(DbQuery *query) {
+    if (!query) return -1;
+    int rc = -1;
+    sqlitepool_conn_t *c = sqlitepool_acquire(&g_sqlite_pool, !sqlitepool_is_read(query->query));
+    if (c) {
+        rc = sqlite_run(c, query);
+        sqlitepool_release(&g_sqlite_pool, c);
+    }
+    if (rc == SQLITE_RUN_NEEDS_WRITER) {
+        rc = -1;
+        c = sqlitepool_acquire(&g_sqlite_pool, 1);
+        if (c) {
+            rc = sqlite_run(c, query);
+            sqlitepool_release(&g_sqlite_pool, c);
+        }
+    }
+    g_host->cache.result_invalidate_sql(query->query);   // after a write
+    if (rc < 0) query->result_count = -1;
+    return rc;
+}
+
 int plugin_init(PluginContext* pc, const PluginHostInterface *host) {
     g_host = host;
+    pc->db.execute = plugin_sqlite_db_execute;
     pc->http.request_handler= handle_sqlite;
     if (sqlite_open() != 0) {
         return PLUGIN_ERROR;
@@ -89,175 +245,188 @@ void handle_sqlite_status(PluginContext *pc, ClientContext *ctx, RequestParams *
     (void)pc; // Unused parameter
     (void)params; // Unused parameter
     (void)ctx; // Unused parameter
-    char body[512];
+    char body[1024];
     int offset = 0;
+    unsigned long queries, hits, misses, reads, writes, read_waits;
+    sqlitepool_stats(&g_sqlite_pool, &queries, &hits, &misses);
+    pthread_mutex_lock(&g_sqlite_pool.lock);
+    reads = g_sqlite_pool.reads;
+    writes = g_sqlite_pool.writes;
+    read_waits = g_sqlite_pool.read_waits;
+    pthread_mutex_unlock(&g_sqlite_pool.lock);
     offset += snprintf(body + offset, sizeof(body) - offset, "{\n");
+    offset += snprintf(body + offset, sizeof(body) - offset,
+        "\"pool\": {\"readers\": %d, \"wal\": %d, \"reads\": %lu, \"writes\": %lu, \"read_waits\": %lu, \"queries\": %lu},\n",
+        (int)g_sqlite_pool.reader_count, g_sqlite_pool.wal, reads, writes, read_waits, queries);
+    offset += snprintf(body + offset, sizeof(body) - offset, "\"stmt_cache\": {\"hits\": %lu, \"misses\": %lu},\n",
+        hits, misses);
+    CacheResultStats rs;
+    g_host->cache.result_stats(&rs);
+    offset += snprintf(body + offset, sizeof(body) - offset,
+        "\"result_cache\": {\"count\": %lu, \"bytes\": %lu, \"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, \"invalidations\": %lu, \"stale\": %lu}\n",
+        (unsigned long)rs.count, (unsigned long)rs.bytes, rs.hits, rs.misses, rs.evictions, rs.invalidations, rs.stale);
     //offset += snprintf(body + offset, sizeof(body) - offset, "\"queue_size\": %d,\n", queue_size);
     //offset += snprintf(body + offset, sizeof(body) - offset, "\"queue_running\": %d\n", g_mysql_thread_running);
     offset += snprintf(body + offset, sizeof(body) - offset, "}\n");
     g_host->http.send_response(ctx->socket_fd, 200, "application/json", body);
     g_host->logmsg("%s sqlite status request", ctx->client_ip);
 }
-/*
-void handle_sqlite_query_chunked(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
-    (void)pc; // Unused parameter
-    (void)params; // Unused parameter
-    (void)ctx; // Unused parameter
-    const char *query = "SELECT lat,lon,elevation,population,name FROM regions LIMIT 10000";
-    
-    if (NULL == g_sqlite_db) {
-        g_host->logmsg("Failed to open SQLite connection");
-        g_host->http.send_response(ctx->socket_fd, 200, "text/plain", "Failed to open SQLite connection on client thread.");
-    } else {
-        sqlite3_stmt *stmt;
-        int rc;
-        rc= sqlite3_prepare_v2(g_sqlite_db, query, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) {
-            g_host->logmsg("sqlite3_prepare_v2() failed: %s", sqlite3_errmsg(g_sqlite_db));
-            pthread_mutex_unlock(&sqlite_mutex);
-            g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "Query preparation failed");
+/** sqlite_stream_tee
+ * Keep a copy of the sent part for the result cache, while it is not too
+ * large.
+ */
+static void sqlite_stream_tee(sqlite_stream_t *s) {
+    if (s->copy_len + s->offset > s->copy_size) {
+        size_t size = s->copy_size ? s->copy_size * 2 : 4 * SQLITE_STREAM_CHUNK;
+        while (size < s->copy_len + s->offset) size *= 2;
+        char *copy = size <= SQLITE_TEE_MAX ? realloc(s->copy, size) : NULL;
+        if (!copy) {
+            free(s->copy);
+            s->copy = NULL;
+            s->tee = 0;
             return;
         }
-        int offset = 0;
-        int row_count = 0;
-        int num_cols = sqlite3_column_count(stmt);
+        s->copy = copy;
+        s->copy_size = size;
+    }
+    memcpy(s->copy + s->copy_len, s->body, s->offset);
+    s->copy_len += s->offset;
+}
 
-        size_t body_size = 1024 *8; // saccolt méret kb. 100 rekordhoz
-        char *body = malloc(body_size);
-        if (!body) {
-            g_host->logmsg("Failed to allocate memory for response body");
-            sqlite3_finalize(stmt);
-            pthread_mutex_unlock(&sqlite_mutex);
-            g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "Memory allocation failed");
-            return;
-        }
-        send_chunk_head(ctx, 200, "application/json");
-        offset += snprintf(body + offset, body_size - offset, "{\"res\":[\n");
+/** sqlite_stream_flush
+ * Send the buffered part of the body as a chunk, and tee it.
+ */
+static void sqlite_stream_flush(sqlite_stream_t *s) {
+    if (!s->offset) return;
+    g_host->http.send_chunks(s->ctx, s->body, (int)s->offset);
+    if (s->tee) sqlite_stream_tee(s);
+    s->sent += s->offset;
+    s->offset = 0;
+}
 
-        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-            
-            if (row_count++ > 0) {
-                offset += snprintf(body + offset, body_size - offset, ",\n");
-            }
-            offset += snprintf(body + offset, body_size - offset, "  {");
-            for (int i = 0; i < num_cols; i++) {
-                if (i > 0) {
-                    offset += snprintf(body + offset, body_size - offset, ", ");
-                }
-                const char *col_name = sqlite3_column_name(stmt, i);
-                const char *col_text = (const char *)sqlite3_column_text(stmt, i);
-                offset += snprintf(body + offset, body_size - offset,
-                                   "\"%s\":\"%s\"", col_name, col_text ? col_text : "");
-            }
-            offset += snprintf(body + offset, body_size - offset, "}");
-            if ((double)offset >= body_size * 0.9) {
-                send_chunks(ctx, body, offset);
-                offset=0;
-            }
-        }
+static void sqlite_stream_put(sqlite_stream_t *s, const char *data, size_t len) {
+    while (len) {
+        size_t n = SQLITE_STREAM_CHUNK - s->offset;
+        if (n > len) n = len;
+        memcpy(s->body + s->offset, data, n);
+        s->offset += n;
+        data += n;
+        len -= n;
+        if (s->offset == SQLITE_STREAM_CHUNK) sqlite_stream_flush(s);
+    }
+}
 
-        offset += snprintf(body + offset, body_size - offset, "]}\n");
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&sqlite_mutex);
-        send_chunks(ctx, body, offset);
-        send_chunk_end(ctx);
-        g_host->logmsg("Sqlite request sent: %d", offset);
-        free(body);
+static void sqlite_stream_puts(sqlite_stream_t *s, const char *str) {
+    sqlite_stream_put(s, str, strlen(str));
+}
+
+/** sqlite_stream_string
+ * A JSON string, escaped.
+ */
+static void sqlite_stream_string(sqlite_stream_t *s, const char *str) {
+    const char *run = str;
+    char esc[8];
+    sqlite_stream_put(s, "\"", 1);
+    for (; *str; str++) {
+        unsigned char ch = (unsigned char)*str;
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+        sqlite_stream_put(s, run, (size_t)(str - run));
+        if (ch == '"' || ch == '\\') snprintf(esc, sizeof(esc), "\\%c", ch);
+        else if (ch == '\n') snprintf(esc, sizeof(esc), "\\n");
+        else snprintf(esc, sizeof(esc), "\\u%04x", ch);
+        sqlite_stream_puts(s, esc);
+        run = str + 1;
     }
+    sqlite_stream_put(s, run, (size_t)(str - run));
+    sqlite_stream_put(s, "\"", 1);
 }
-*/
-unsigned long sdbm_hash(const char *str) {
-    unsigned long hash = 0;
-    int c;
-    while ((c = *str++))
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    return hash;
+
+/** sqlite_stream_start
+ * The response head and the start of the body, before the first row.
+ */
+static void sqlite_stream_start(sqlite_stream_t *s) {
+    if (s->started) return;
+    s->started = 1;
+    g_host->http.send_chunk_head(s->ctx, 200, "application/json");
+    sqlite_stream_puts(s, "{\"res\":[\n");
 }
 
-int get_db_cache_filename(char*buf, int buflen, const char* db, const char* table, const char *query ){
-    return snprintf(buf, buflen, "%s_%s_%08lx.json", db, table, sdbm_hash(query));
+/** sqlite_stream_row
+ * Row callback of the query: serialized into the buffer, which goes out
+ * whenever it is full, while the statement is still stepped.
+ */
+static int sqlite_stream_row(const DbRow *row, void *user_data) {
+    sqlite_stream_t *s = (sqlite_stream_t *)user_data;
+    sqlite_stream_start(s);
+    sqlite_stream_puts(s, s->rows++ ? ",\n  {" : "  {");
+    for (size_t i = 0; i < row->column_count; i++) {
+        const char *text = db_row_text(row, i);
+        if (i) sqlite_stream_puts(s, ", ");
+        sqlite_stream_string(s, row->columns[i].name);
+        sqlite_stream_put(s, ":", 1);
+        sqlite_stream_string(s, text ? text : "");
+    }
+    sqlite_stream_put(s, "}", 1);
+    return 0;
 }
 
+/** handle_sqlite_query
+ * The rows are sent as chunked JSON while the query runs. With query_cache
+ * a cached result is sent from memory instead, and a fresh one is teed into
+ * the result cache of the host on the way; the writes of the plugin
+ * invalidate it by the table.
+ */
 void handle_sqlite_query(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc; // Unused parameter
     (void)params; // Unused parameter
-    (void)ctx; // Unused parameter
-    sqlite_result_data_t res_data;
-    sqlite_result_data_t *rp = &res_data;
-
-    const char *myquery = "SELECT lat,lon,elevation,population,name FROM regions LIMIT 10000";
-    strcpy(rp->query, myquery);
+    char key[CACHE_RESULT_KEY_LEN];
+    DbQuery q;
+    memset(&q, 0, sizeof(q));
+    snprintf(q.query, sizeof(q.query), "%s", "SELECT lat,lon,elevation,population,name FROM regions LIMIT 10000");
 
-    char cache_filename[255];
-    const char* tablename="regions";
-    get_db_cache_filename(cache_filename, sizeof(cache_filename), "sqlite", tablename, rp->query);
-    g_host->cache.file_init(&rp->cache_file, cache_filename);
-    
-    if (!g_host->cache.file_exists_recent(&rp->cache_file)){
-        if (g_host->cache.file_create(&rp->cache_file) < 1){
-            g_host->logmsg("Failed to open cache file for writing");
-        }else{
-            if (NULL == g_sqlite_db) {
-                g_host->logmsg("Failed to open SQLite connection");
-                g_host->http.send_response(ctx->socket_fd, 200, "text/plain", "Failed to open SQLite connection on client thread.");
-                g_host->cache.file_close(&rp->cache_file);
-                return;
-            } else {
-                sqlite3_stmt *stmt;
-                int rc;
-                rc= sqlite3_prepare_v2(g_sqlite_db, rp->query, -1, &stmt, NULL);
-                if (rc != SQLITE_OK) {
-                    g_host->logmsg("sqlite3_prepare_v2() failed: %s", sqlite3_errmsg(g_sqlite_db));
-                    pthread_mutex_unlock(&sqlite_mutex);
-                    g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "Query preparation failed");
-                    g_host->cache.file_close(&rp->cache_file);
-                    return;
-                }
-                int offset = 0;
-                int row_count = 0;
-                int num_cols = sqlite3_column_count(stmt);
-                size_t body_size = 1024 *8; // saccolt méret kb. 100 rekordhoz
-                char *body = malloc(body_size);
-                if (!body) {
-                    g_host->logmsg("Failed to allocate memory for response body");
-                    sqlite3_finalize(stmt);
-                    pthread_mutex_unlock(&sqlite_mutex);
-                    g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "Memory allocation failed");
-                    g_host->cache.file_close(&rp->cache_file);
-                    return;
-                }
-                offset += snprintf(body + offset, body_size - offset, "{\"res\":[\n");
-                while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-                    if (row_count++ > 0) {
-                        offset += snprintf(body + offset, body_size - offset, ",\n");
-                    }
-                    offset += snprintf(body + offset, body_size - offset, "  {");
-                    for (int i = 0; i < num_cols; i++) {
-                        if (i > 0) {
-                            offset += snprintf(body + offset, body_size - offset, ", ");
-                        }
-                        const char *col_name = sqlite3_column_name(stmt, i);
-                        const char *col_text = (const char *)sqlite3_column_text(stmt, i);
-                        offset += snprintf(body + offset, body_size - offset,
-                                           "\"%s\":\"%s\"", col_name, col_text ? col_text : "");
-                    }
-                    offset += snprintf(body + offset, body_size - offset, "}");
-                    if ((double)offset >= body_size * 0.9) {
-                        g_host->cache.file_write(&rp->cache_file, body, offset);
-                        offset=0;
-                    }
-                }
-                offset += snprintf(body + offset, body_size - offset, "]}\n");
-                sqlite3_finalize(stmt);
-                pthread_mutex_unlock(&sqlite_mutex);
-                g_host->cache.file_write(&rp->cache_file, body, offset);
-                g_host->cache.file_close(&rp->cache_file);
-
-                free(body);
-            }
+    unsigned long generation = g_host->cache.result_generation();   // before the read
+    int use_cache = g_host->config_get_int("SQLITE", "query_cache", 1) &&
+        g_host->cache.result_key(key, sizeof(key), q.query, q.params, q.param_count) >= 0;
+    if (use_cache) {
+        CacheResult *r = g_host->cache.result_get(key);
+        if (r) {
+            size_t len;
+            const void *data = g_host->cache.result_data(r, &len);
+            g_host->http.send_data(ctx->socket_fd, 200, "application/json", data, len);
+            g_host->cache.result_release(r);
+            return;
         }
     }
-    g_host->http.send_file(ctx->socket_fd, "application/json", rp->cache_file.path);
+
+    sqlite_stream_t s;
+    memset(&s, 0, sizeof(s));
+    s.ctx = ctx;
+    s.tee = use_cache;
+    s.body = malloc(SQLITE_STREAM_CHUNK);
+    if (!s.body) {
+        g_host->logmsg("Failed to allocate memory for response body");
+        g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "Memory allocation failed");
+        return;
+    }
+    q.flags = DB_QUERY_PREPARED;   // the same text every time, keep its statement
+    q.row_proc = sqlite_stream_row;
+    q.row_user_data = &s;
+    int rc = plugin_sqlite_db_execute(&q);
+    if (rc < 0 && !s.started) {
+        // nothing is sent yet, a proper error
+        free(s.body);
+        free(s.copy);
+        g_host->http.send_response(ctx->socket_fd, 500, "text/plain", "Query failed");
+        return;
+    }
+    sqlite_stream_start(&s);   // no rows: an empty list
+    sqlite_stream_puts(&s, rc < 0 ? "],\"error\":\"query failed\"}\n" : "]}\n");
+    sqlite_stream_flush(&s);
+    g_host->http.send_chunk_end(ctx);
+    if (s.tee && rc >= 0) g_host->cache.result_put(key, NULL, s.copy, s.copy_len, 0, generation);
+    free(s.copy);
+    free(s.body);
+    g_host->logmsg("%s sqlite query sent: %d rows, %lu bytes", ctx->client_ip, s.rows, (unsigned long)s.sent);
 }
 void handle_sqlite(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc; // Unused parameter
@@ -0,0 +1,153 @@
+/*
+ * File:    sqlitepool.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-04
+ *
+ * SQLite connections of the sqlite plugin, see sqlitepool.h.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "sqlitepool.h"
+
+static void sqlitepool_stmt_free(void *stmt) {
+    sqlite3_finalize((sqlite3_stmt *)stmt);
+}
+
+/** sqlitepool_conn_open
+ * One connection, the pool serializes its use: no mutex in SQLite.
+ */
+static int sqlitepool_conn_open(sqlitepool_conn_t *c, const char *file, int readonly, size_t stmt_cache_size, int busy_timeout_ms) {
+    int flags = SQLITE_OPEN_NOMUTEX | (readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    memset(c, 0, sizeof(*c));
+    c->readonly = readonly;
+    if (sqlite3_open_v2(file, &c->db, flags, NULL) != SQLITE_OK) {
+        sqlite3_close(c->db);
+        c->db = NULL;
+        return -1;
+    }
+    sqlite3_busy_timeout(c->db, busy_timeout_ms);
+    if (dbstmt_init(&c->stmts, stmt_cache_size, sqlitepool_stmt_free)) {
+        sqlite3_close(c->db);
+        c->db = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void sqlitepool_conn_close(sqlitepool_conn_t *c) {
+    if (!c->db) return;
+    dbstmt_destroy(&c->stmts);   // finalized before the close
+    sqlite3_close(c->db);
+    c->db = NULL;
+}
+
+/** sqlitepool_enable_wal
+ * WAL mode of the file, persistent. Returns 1 if it is on.
+ */
+static int sqlitepool_enable_wal(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int wal = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA journal_mode=WAL", -1, &stmt, NULL) != SQLITE_OK) return 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *mode = (const char *)sqlite3_column_text(stmt, 0);
+        wal = mode && !strcasecmp(mode, "wal");
+    }
+    sqlite3_finalize(stmt);
+    if (wal) sqlite3_exec(db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+    return wal;
+}
+
+int sqlitepool_open(sqlitepool_t *p, const char *file, size_t readers, size_t stmt_cache_size, int busy_timeout_ms) {
+    if (!p || !file) return -1;
+    memset(p, 0, sizeof(*p));
+    if (busy_timeout_ms <= 0) busy_timeout_ms = SQLITEPOOL_BUSY_TIMEOUT_MS;
+    if (sqlitepool_conn_open(&p->writer, file, 0, stmt_cache_size, busy_timeout_ms)) return -1;
+    pthread_mutex_init(&p->write_lock, NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->open = 1;
+    // the readers need a shared file, and WAL so that they do not block the writer
+    if (!strcmp(file, ":memory:") || !*file) readers = 0;
+    if (readers) p->wal = sqlitepool_enable_wal(p->writer.db);
+    if (!p->wal) readers = 0;
+    if (readers > SQLITEPOOL_MAX_READERS) readers = SQLITEPOOL_MAX_READERS;
+    for (size_t i = 0; i < readers; i++) {
+        if (sqlitepool_conn_open(&p->readers[i], file, 1, stmt_cache_size, busy_timeout_ms)) break;
+        p->idle[p->idle_count++] = &p->readers[i];
+        p->reader_count++;
+    }
+    return 0;
+}
+
+void sqlitepool_close(sqlitepool_t *p) {
+    if (!p || !p->open) return;
+    for (size_t i = 0; i < p->reader_count; i++) sqlitepool_conn_close(&p->readers[i]);
+    sqlitepool_conn_close(&p->writer);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->write_lock);
+    p->open = 0;
+}
+
+sqlitepool_conn_t *sqlitepool_acquire(sqlitepool_t *p, int write) {
+    if (!p || !p->open) return NULL;
+    if (write || !p->reader_count) {
+        pthread_mutex_lock(&p->write_lock);
+        pthread_mutex_lock(&p->lock);
+        if (write) p->writes++;
+        else p->reads++;
+        pthread_mutex_unlock(&p->lock);
+        return &p->writer;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (!p->idle_count) p->read_waits++;
+    while (!p->idle_count) pthread_cond_wait(&p->cond, &p->lock);
+    sqlitepool_conn_t *c = p->idle[--p->idle_count];
+    p->reads++;
+    pthread_mutex_unlock(&p->lock);
+    return c;
+}
+
+void sqlitepool_release(sqlitepool_t *p, sqlitepool_conn_t *c) {
+    if (!p || !c) return;
+    pthread_mutex_lock(&p->lock);
+    c->queries++;
+    c->stmt_hits = c->stmts.hits;
+    c->stmt_misses = c->stmts.misses;
+    if (c == &p->writer) {
+        pthread_mutex_unlock(&p->lock);
+        pthread_mutex_unlock(&p->write_lock);
+        return;
+    }
+    p->idle[p->idle_count++] = c;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void sqlitepool_stats(sqlitepool_t *p, unsigned long *queries, unsigned long *stmt_hits, unsigned long *stmt_misses) {
+    unsigned long q = 0, h = 0, m = 0;
+    if (p && p->open) {
+        pthread_mutex_lock(&p->lock);
+        q = p->writer.queries;
+        h = p->writer.stmt_hits;
+        m = p->writer.stmt_misses;
+        for (size_t i = 0; i < p->reader_count; i++) {
+            q += p->readers[i].queries;
+            h += p->readers[i].stmt_hits;
+            m += p->readers[i].stmt_misses;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (queries) *queries = q;
+    if (stmt_hits) *stmt_hits = h;
+    if (stmt_misses) *stmt_misses = m;
+}
+
+int sqlitepool_is_read(const char *sql) {
+    if (!sql) return 0;
+    while (isspace((unsigned char)*sql) || *sql == '(') sql++;
+    return !strncasecmp(sql, "SELECT", 6);
+}
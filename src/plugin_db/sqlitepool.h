@@ -0,0 +1,79 @@
+/*
+ * File:    sqlitepool.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-04
+ *
+ * SQLite connections of the sqlite plugin
+ * Key features:
+ *  One writer connection and a pool of read-only connections on the same
+ *  database file in WAL mode: the readers run in parallel with each other
+ *  and with the writer, only the writes are serialized.
+ *  Every connection has its own prepared statement cache (dbstmt.h), a
+ *  connection is used by one thread at a time.
+ *  Without readers (0, or an in-memory database) everything goes to the
+ *  writer, as with a single connection.
+ */
+#ifndef SQLITEPOOL_H
+#define SQLITEPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "dbstmt.h"
+
+#define SQLITEPOOL_MAX_READERS      (32)
+#define SQLITEPOOL_BUSY_TIMEOUT_MS  (2000)
+
+typedef struct {
+    sqlite3 *db;
+    dbstmt_cache_t stmts;
+    int readonly;
+    // under the lock of the pool, for the status
+    unsigned long queries;
+    unsigned long stmt_hits;
+    unsigned long stmt_misses;
+} sqlitepool_conn_t;
+
+typedef struct {
+    sqlitepool_conn_t writer;
+    pthread_mutex_t write_lock;             // held while the writer is used
+    sqlitepool_conn_t readers[SQLITEPOOL_MAX_READERS];
+    size_t reader_count;
+    sqlitepool_conn_t *idle[SQLITEPOOL_MAX_READERS];   // free readers, a stack
+    size_t idle_count;
+    pthread_mutex_t lock;                   // idle readers and the counters
+    pthread_cond_t cond;                    // a reader was released
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long read_waits;               // no free reader, had to wait
+    int wal;
+    int open;
+} sqlitepool_t;
+
+/** sqlitepool_open
+ * Open the writer (creates the file) and the readers, switch to WAL.
+ * busy_timeout_ms is how long a connection waits for a lock of the file
+ * (SQLITEPOOL_BUSY_TIMEOUT_MS if 0). Returns 0 or -1.
+ */
+int sqlitepool_open(sqlitepool_t *p, const char *file, size_t readers, size_t stmt_cache_size, int busy_timeout_ms);
+/** sqlitepool_close
+ * Finalize the statements and close every connection, none may be in use.
+ */
+void sqlitepool_close(sqlitepool_t *p);
+/** sqlitepool_acquire
+ * A free reader, or the writer for a write (or if there are no readers).
+ * Blocks until one is free. Returns NULL if the pool is not open.
+ */
+sqlitepool_conn_t *sqlitepool_acquire(sqlitepool_t *p, int write);
+void sqlitepool_release(sqlitepool_t *p, sqlitepool_conn_t *c);
+/** sqlitepool_stats
+ * Totals of the connections: queries, statement cache hits and misses.
+ */
+void sqlitepool_stats(sqlitepool_t *p, unsigned long *queries, unsigned long *stmt_hits, unsigned long *stmt_misses);
+/** sqlitepool_is_read
+ * Guess from the text if the statement only reads: the ones starting with
+ * SELECT go to a reader. The reader still checks the prepared statement.
+ */
+int sqlitepool_is_read(const char *sql);
+
+#endif // SQLITEPOOL_H
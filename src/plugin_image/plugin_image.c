@@ -2,43 +2,61 @@
  * File:    plugin_image.c
  * Author:  Barna Faragó MYND-ideal ltd.
  * Created: 2025-05-02
- * 
+ *
  * Image plugin
- * 
- */ 
+ * Key features:
+ *  Encoders: PNG (libpng), raw pixels with a tiny header, lossless WebP
+ *  (libwebp, only when built with HAVE_WEBP).
+ *  Sinks: a file (ImageBackend_Png) or a memory buffer (ImageBackend_Memory).
+ *  Memory buffers are pooled.
+ *  Each encoder has its own png_struct, error handler (setjmp) and allocator
+ *  hooks, so concurrent encodes run in parallel, without a global lock.
+ */
+#define _GNU_SOURCE
 #include "image.h"
 #include "plugin.h"
-#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
-#include <time.h>
-#include <errno.h>
+#include <setjmp.h>
 #include <png.h>
-
+#include <zlib.h>
+#ifdef HAVE_WEBP
+#include <webp/encode.h>
+#endif
 
 typedef struct {
     unsigned long width, height;
+    unsigned int channels;
+    ImageCodec codec;
+    // sink
     FILE *fp;
-    png_structp png_ptr;
-    png_infop info_ptr;
     const char *filename;
     char tmp_filename[MAX_PATH];
-} PngImage;
-
-#if PNG_LIBPNG_VER >= 10600
-    // libpng 1.6.40 and later
-    #define HAVE_OLD_PNG 0
-    #define PNG_CRITICAL_START
-    #define PNG_CRITICAL_END
-#else
-    // libpng 1.4.0 and earlier
-    #define HAVE_OLD_PNG 1
-    // multithread safe before v1.4.0 see github issue
-    pthread_mutex_t png_mutex = PTHREAD_MUTEX_INITIALIZER;
-    #define PNG_CRITICAL_START() image_mutex_timedlock(&png_mutex, 20000UL)
-    #define PNG_CRITICAL_END() pthread_mutex_unlock(&png_mutex)
-#endif
+    ImageMemBuffer *mem;    // memory sink, NULL when writing a file
+    // png codec
+    png_structp png_ptr;
+    png_infop info_ptr;
+    size_t png_mem;         // bytes allocated by libpng for this encoder
+    size_t png_mem_peak;
+    // webp codec, the rows are collected, the encoder needs the whole image
+    unsigned char *pixels;
+    unsigned long rows_written; // all codecs
+    unsigned char header_written;
+    unsigned char finished;
+    unsigned char failed;
+} ImageEncoder;
+
+#define IMAGE_BUFFER_POOL_SIZE (8)
+#define IMAGE_BUFFER_INITIAL_SIZE (64 * 1024)
+#define IMAGE_BUFFER_POOL_MAX_SIZE (8 * 1024 * 1024) // bigger ones are freed instead of pooled
+static ImageMemBuffer *g_buffer_pool[IMAGE_BUFFER_POOL_SIZE];
+static int g_buffer_pool_count = 0;
+static pthread_mutex_t g_buffer_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// libpng allocations of one encoder above this fail (png_error), instead of growing unbounded
+#define IMAGE_PNG_MEM_LIMIT (64 * 1024 * 1024)
 
 const PluginHostInterface *g_host;
 void handle_image(PluginContext *ctx, ClientContext *client, RequestParams *params);
@@ -50,62 +68,418 @@ int g_http_routes_count = 1;
 
 /** The backend PNG related functions. */
 void print_png_version() {
-    if (g_host) g_host->debugmsg("libpng version (static, dynamic, mutex): %s, %s, %s", PNG_LIBPNG_VER_STRING, png_libpng_ver, HAVE_OLD_PNG ? "yes" : "no");
-}
-int image_mutex_timedlock(pthread_mutex_t *lock, const unsigned long timeout_ms) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += timeout_ms / 1000;
-    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
-    if (ts.tv_nsec >= 1000000000) {
-        ts.tv_sec++;
-        ts.tv_nsec -= 1000000000;
-    }
-    int res= pthread_mutex_timedlock(lock, &ts);
-    if (res == ETIMEDOUT) {
-        g_host->errormsg("Mutex lock timed out");
-    } else if (res != 0) {
-        g_host->errormsg("Mutex lock failed: %d", res);
-    }   
-    return res;
-}
-int PngImage_init(PngImage *img, int width, int height, const char *filename, unsigned char color_type) {
-    img->width = width;
-    img->height = height;
-    img->filename = filename;
-    img->tmp_filename[0] = '\0';
-    snprintf(img->tmp_filename, sizeof(img->tmp_filename), "%s_", filename);
-    g_host->debugmsg("Opening PNG file for writing. %s", img->tmp_filename);
-    img->fp = fopen(img->tmp_filename, "wb");
-    if (!img->fp) {
-        g_host->errormsg("Failed to open PNG file for writing. %s", filename);
-        return 1;
-    }
-    PNG_CRITICAL_START();
-    img->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    img->info_ptr = png_create_info_struct(img->png_ptr);
-    if (!img->png_ptr || !img->info_ptr) {
-        fclose(img->fp);
+    if (g_host) g_host->debugmsg("libpng version (static, dynamic): %s, %s", PNG_LIBPNG_VER_STRING, png_libpng_ver);
+}
+
+/** Memory buffer pool */
+static ImageMemBuffer *ImageMemBuffer_acquire(void) {
+    ImageMemBuffer *buf = NULL;
+    pthread_mutex_lock(&g_buffer_pool_mutex);
+    if (g_buffer_pool_count > 0) {
+        buf = g_buffer_pool[--g_buffer_pool_count];
+    }
+    pthread_mutex_unlock(&g_buffer_pool_mutex);
+    if (!buf) {
+        buf = calloc(1, sizeof(ImageMemBuffer));
+        if (!buf) return NULL;
+    }
+    buf->size = 0;
+    return buf;
+}
+static void ImageMemBuffer_free(ImageMemBuffer *buf) {
+    free(buf->data);
+    free(buf);
+}
+static void ImageMemBuffer_release(ImageMemBuffer *buf) {
+    if (!buf) return;
+    if (buf->capacity <= IMAGE_BUFFER_POOL_MAX_SIZE) {
+        pthread_mutex_lock(&g_buffer_pool_mutex);
+        if (g_buffer_pool_count < IMAGE_BUFFER_POOL_SIZE) {
+            g_buffer_pool[g_buffer_pool_count++] = buf;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&g_buffer_pool_mutex);
+    }
+    if (buf) ImageMemBuffer_free(buf);
+}
+static void ImageMemBuffer_pool_clear(void) {
+    pthread_mutex_lock(&g_buffer_pool_mutex);
+    while (g_buffer_pool_count > 0) {
+        ImageMemBuffer_free(g_buffer_pool[--g_buffer_pool_count]);
+    }
+    pthread_mutex_unlock(&g_buffer_pool_mutex);
+}
+/** ImageMemBuffer_reserve
+ * Doubles the capacity until `need` bytes fit, so appends are amortized O(1).
+ */
+static int ImageMemBuffer_reserve(ImageMemBuffer *buf, size_t need) {
+    if (need <= buf->capacity) return 0;
+    size_t capacity = buf->capacity ? buf->capacity : IMAGE_BUFFER_INITIAL_SIZE;
+    while (capacity < need) capacity *= 2;
+    unsigned char *data = realloc(buf->data, capacity);
+    if (!data) return -1;
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+/** Sink: the encoded bytes go to the file or to the memory buffer. */
+static void ImageEncoder_sink_write(ImageEncoder *enc, const void *data, size_t length) {
+    if (enc->failed) return;
+    if (enc->fp) {
+        if (fwrite(data, 1, length, enc->fp) != length) enc->failed = 1;
+        return;
+    }
+    if (ImageMemBuffer_reserve(enc->mem, enc->mem->size + length)) {
+        enc->failed = 1; // the result is dropped in get_buffer
+        return;
+    }
+    memcpy(enc->mem->data + enc->mem->size, data, length);
+    enc->mem->size += length;
+}
+static void PngImage_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+    ImageEncoder_sink_write((ImageEncoder *)png_get_io_ptr(png_ptr), data, length);
+}
+static void PngImage_flush(png_structp png_ptr) {
+    (void)png_ptr;
+}
+/** libpng error handler
+ * Never returns, jumps back to the setjmp of the encoder call in progress.
+ * The jmp_buf lives in the png_struct of the encoder, there is no shared state.
+ */
+static void PngImage_error(png_structp png_ptr, png_const_charp msg) {
+    ImageEncoder *enc = (ImageEncoder *)png_get_error_ptr(png_ptr);
+    g_host->errormsg("libpng error: %s (%s)", msg, enc ? enc->filename : "");
+    longjmp(png_jmpbuf(png_ptr), 1);
+}
+static void PngImage_warning(png_structp png_ptr, png_const_charp msg) {
+    (void)png_ptr;
+    g_host->debugmsg("libpng warning: %s", msg);
+}
+/** libpng allocator hooks
+ * Accounted per encoder, a size prefix keeps the free side exact.
+ */
+typedef union {
+    size_t size;
+    long double align; // keeps the user block aligned like malloc
+} PngMemHeader;
+static png_voidp PngImage_malloc(png_structp png_ptr, png_alloc_size_t size) {
+    ImageEncoder *enc = (ImageEncoder *)png_get_mem_ptr(png_ptr);
+    if (enc && enc->png_mem + size > IMAGE_PNG_MEM_LIMIT) return NULL;
+    PngMemHeader *hdr = malloc(sizeof(PngMemHeader) + size);
+    if (!hdr) return NULL;
+    hdr->size = size;
+    if (enc) {
+        enc->png_mem += size;
+        if (enc->png_mem > enc->png_mem_peak) enc->png_mem_peak = enc->png_mem;
+    }
+    return hdr + 1;
+}
+static void PngImage_free(png_structp png_ptr, png_voidp ptr) {
+    if (!ptr) return;
+    PngMemHeader *hdr = (PngMemHeader *)ptr - 1;
+    ImageEncoder *enc = (ImageEncoder *)png_get_mem_ptr(png_ptr);
+    if (enc) enc->png_mem -= hdr->size;
+    free(hdr);
+}
+
+/** PngImage_init
+ * Creates the libpng structures, the header is written with the first row.
+ */
+static int PngImage_init(ImageEncoder *enc) {
+    enc->png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, enc, PngImage_error, PngImage_warning,
+                                             enc, PngImage_malloc, PngImage_free);
+    enc->info_ptr = enc->png_ptr ? png_create_info_struct(enc->png_ptr) : NULL;
+    if (!enc->png_ptr || !enc->info_ptr) {
+        png_destroy_write_struct(&enc->png_ptr, &enc->info_ptr);
         g_host->errormsg("Failed to create PNG structures.");
         return 2;
     }
-    png_init_io(img->png_ptr, img->fp);
-    png_set_IHDR(img->png_ptr, img->info_ptr, img->width, img->height,
+    if (setjmp(png_jmpbuf(enc->png_ptr))) {
+        png_destroy_write_struct(&enc->png_ptr, &enc->info_ptr);
+        return 3;
+    }
+    // after the setjmp, a local set before it could be clobbered
+    int color_type;
+    switch (enc->channels) {
+        case 4: color_type = PNG_COLOR_TYPE_RGBA; break;
+        case 1: color_type = PNG_COLOR_TYPE_GRAY; break;
+        case 3:
+        default:
+            color_type = PNG_COLOR_TYPE_RGB; break;
+    }
+    png_set_write_fn(enc->png_ptr, enc, PngImage_write, PngImage_flush);
+    png_set_IHDR(enc->png_ptr, enc->info_ptr, enc->width, enc->height,
                  8, color_type, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(img->png_ptr, img->info_ptr);
     return 0;
 }
-void PngImage_finish(PngImage *img) {
-    g_host->debugmsg("Finished writing PNG file. %s to %s", img->tmp_filename, img->filename);
-    png_write_end(img->png_ptr, NULL);
-    png_destroy_write_struct(&img->png_ptr, &img->info_ptr);
-    fclose(img->fp);
-    int res=rename(img->tmp_filename, img->filename);
-    if (res != 0) {
-        g_host->errormsg("Failed to rename %s to %s", img->tmp_filename, img->filename);
+static void PngImage_destroy(ImageEncoder *enc) {
+    if (!enc->png_ptr) return;
+    png_destroy_write_struct(&enc->png_ptr, &enc->info_ptr);
+}
+/** PngImage_set_options
+ * Applies zlib level, strategy and row filters. Older libpng versions init
+ * the deflate stream when IHDR is written, so it must precede the header.
+ */
+static void PngImage_set_options(ImageEncoder *enc, const ImageEncodeOptions *opt) {
+    if (setjmp(png_jmpbuf(enc->png_ptr))) {
+        enc->failed = 1;
+        return;
+    }
+    int level = opt->level;
+    if (level < 0 || level > 9) level = Z_DEFAULT_COMPRESSION;
+    png_set_compression_level(enc->png_ptr, level);
+    int strategy;
+    switch (opt->strategy) {
+        case ImageStrategy_Filtered: strategy = Z_FILTERED; break;
+        case ImageStrategy_HuffmanOnly: strategy = Z_HUFFMAN_ONLY; break;
+        case ImageStrategy_Rle: strategy = Z_RLE; break;
+        case ImageStrategy_Fixed: strategy = Z_FIXED; break;
+        case ImageStrategy_Default:
+        default:
+            strategy = Z_DEFAULT_STRATEGY; break;
+    }
+    png_set_compression_strategy(enc->png_ptr, strategy);
+    if (opt->filters) {
+        int filters = 0;
+        if (opt->filters & IMAGE_FILTER_NONE) filters |= PNG_FILTER_NONE;
+        if (opt->filters & IMAGE_FILTER_SUB) filters |= PNG_FILTER_SUB;
+        if (opt->filters & IMAGE_FILTER_UP) filters |= PNG_FILTER_UP;
+        if (opt->filters & IMAGE_FILTER_AVG) filters |= PNG_FILTER_AVG;
+        if (opt->filters & IMAGE_FILTER_PAETH) filters |= PNG_FILTER_PAETH;
+        png_set_filter(enc->png_ptr, PNG_FILTER_TYPE_BASE, filters);
+    }
+}
+
+/** libpng calls, each one catches the errors of its own encoder */
+static void PngImage_write_info(ImageEncoder *enc) {
+    if (setjmp(png_jmpbuf(enc->png_ptr))) {
+        enc->failed = 1;
+        return;
+    }
+    png_write_info(enc->png_ptr, enc->info_ptr);
+}
+static void PngImage_write_row(ImageEncoder *enc, void *row) {
+    if (setjmp(png_jmpbuf(enc->png_ptr))) {
+        enc->failed = 1;
+        return;
+    }
+    png_write_row(enc->png_ptr, row);
+}
+static void PngImage_write_end(ImageEncoder *enc) {
+    if (setjmp(png_jmpbuf(enc->png_ptr))) {
+        enc->failed = 1;
+        return;
+    }
+    png_write_end(enc->png_ptr, NULL);
+}
+
+/** Raw codec */
+static void RawImage_write_header(ImageEncoder *enc) {
+    ImageRawHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_RAW_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGE_RAW_VERSION;
+    hdr.channels = (unsigned char)enc->channels;
+    for (int i = 0; i < 4; i++) {
+        hdr.width[i] = (unsigned char)(enc->width >> (8 * i));
+        hdr.height[i] = (unsigned char)(enc->height >> (8 * i));
+    }
+    ImageEncoder_sink_write(enc, &hdr, sizeof(hdr));
+}
+
+/** WebP codec */
+#ifdef HAVE_WEBP
+static int WebPImage_init(ImageEncoder *enc) {
+    enc->pixels = malloc((size_t)enc->width * enc->height * enc->channels);
+    if (!enc->pixels) {
+        g_host->errormsg("Failed to allocate WebP pixel buffer.");
+        return 2;
+    }
+    return 0;
+}
+static void WebPImage_finish(ImageEncoder *enc) {
+    uint8_t *out = NULL;
+    size_t size = 0;
+    int w = (int)enc->width, h = (int)enc->height;
+    if (enc->channels == 4) {
+        size = WebPEncodeLosslessRGBA(enc->pixels, w, h, w * 4, &out);
+    } else if (enc->channels == 3) {
+        size = WebPEncodeLosslessRGB(enc->pixels, w, h, w * 3, &out);
+    } else {
+        // WebP has no grayscale input, expand to RGB
+        unsigned char *rgb = malloc((size_t)w * h * 3);
+        if (rgb) {
+            for (size_t i = 0; i < (size_t)w * h; i++) {
+                rgb[i * 3 + 0] = rgb[i * 3 + 1] = rgb[i * 3 + 2] = enc->pixels[i];
+            }
+            size = WebPEncodeLosslessRGB(rgb, w, h, w * 3, &out);
+            free(rgb);
+        }
+    }
+    if (size && out) {
+        ImageEncoder_sink_write(enc, out, size);
+    } else {
+        enc->failed = 1;
     }
-    PNG_CRITICAL_END();
+    WebPFree(out);
+    free(enc->pixels);
+    enc->pixels = NULL;
+}
+#endif
+
+/** image_codecs
+ * Bitmask of the available codecs, (1 << ImageCodec_*).
+ */
+unsigned int image_codecs(PluginContext *pc) {
+    (void)pc; // Unused parameter
+    unsigned int codecs = (1U << ImageCodec_Png) | (1U << ImageCodec_Raw);
+#ifdef HAVE_WEBP
+    codecs |= 1U << ImageCodec_WebP;
+#endif
+    return codecs;
+}
+
+/** ImageEncoder_init
+ * Opens the temporary file, or acquires a pooled buffer when filename is NULL.
+ * The codec is PNG, until set_options selects an other one.
+ */
+static int ImageEncoder_init(ImageEncoder *enc, int width, int height, unsigned int channels, const char *filename) {
+    memset(enc, 0, sizeof(ImageEncoder));
+    enc->width = width;
+    enc->height = height;
+    enc->channels = channels;
+    enc->codec = ImageCodec_Png;
+    enc->filename = filename ? filename : "(memory)";
+    if (filename) {
+        snprintf(enc->tmp_filename, sizeof(enc->tmp_filename), "%s_", filename);
+        g_host->debugmsg("Opening image file for writing. %s", enc->tmp_filename);
+        enc->fp = fopen(enc->tmp_filename, "wb");
+        if (!enc->fp) {
+            g_host->errormsg("Failed to open image file for writing. %s", filename);
+            return 1;
+        }
+    } else {
+        enc->mem = ImageMemBuffer_acquire();
+        if (!enc->mem) {
+            g_host->errormsg("Failed to allocate image memory buffer.");
+            return 1;
+        }
+    }
+    if (PngImage_init(enc)) {
+        if (enc->fp) fclose(enc->fp);
+        remove(enc->tmp_filename);
+        ImageMemBuffer_release(enc->mem);
+        return 2;
+    }
+    return 0;
+}
+static int ImageEncoder_set_options(ImageEncoder *enc, const ImageEncodeOptions *opt) {
+    if (enc->header_written || enc->finished) {
+        g_host->errormsg("Image options must be set before the first row. %s", enc->filename);
+        return -1;
+    }
+    if (!(image_codecs(NULL) & (1U << opt->codec))) {
+        g_host->errormsg("Image codec not supported: %d", opt->codec);
+        return -2;
+    }
+    if (opt->codec != enc->codec) {
+        if (enc->codec == ImageCodec_Png) PngImage_destroy(enc);
+#ifdef HAVE_WEBP
+        if (enc->codec == ImageCodec_WebP) {
+            free(enc->pixels);
+            enc->pixels = NULL;
+        }
+#endif
+        enc->codec = opt->codec;
+        int res = 0;
+        switch (enc->codec) {
+            case ImageCodec_Png: res = PngImage_init(enc); break;
+#ifdef HAVE_WEBP
+            case ImageCodec_WebP: res = WebPImage_init(enc); break;
+#endif
+            default: break;
+        }
+        if (res) {
+            enc->failed = 1;
+            return -3;
+        }
+    }
+    if (enc->codec == ImageCodec_Png) PngImage_set_options(enc, opt);
+    return 0;
+}
+static inline void ImageEncoder_write_header(ImageEncoder *enc) {
+    if (enc->header_written) return;
+    enc->header_written = 1;
+    switch (enc->codec) {
+        case ImageCodec_Png: PngImage_write_info(enc); break;
+        case ImageCodec_Raw: RawImage_write_header(enc); break;
+        default: break;
+    }
+}
+static void ImageEncoder_write_row(ImageEncoder *enc, void *row) {
+    if (enc->finished || enc->failed || enc->rows_written >= enc->height) return;
+    ImageEncoder_write_header(enc);
+    if (enc->failed) return;
+    switch (enc->codec) {
+        case ImageCodec_Png:
+            PngImage_write_row(enc, row);
+            break;
+        case ImageCodec_Raw:
+            ImageEncoder_sink_write(enc, row, (size_t)enc->width * enc->channels);
+            break;
+#ifdef HAVE_WEBP
+        case ImageCodec_WebP:
+            memcpy(enc->pixels + (size_t)enc->width * enc->channels * enc->rows_written, row,
+                (size_t)enc->width * enc->channels);
+            break;
+#endif
+        default: break;
+    }
+    enc->rows_written++;
+}
+/** ImageEncoder_finish
+ * Completes the stream. The file is renamed to its final name, the memory
+ * buffer is kept until ImageEncoder_release.
+ */
+static void ImageEncoder_finish(ImageEncoder *enc) {
+    if (enc->finished) return;
+    enc->finished = 1;
+    if (enc->rows_written != enc->height) {
+        // an incomplete image is not stored (and libpng would abort on it)
+        g_host->errormsg("Image incomplete, %lu of %lu rows. %s", enc->rows_written, enc->height, enc->filename);
+        enc->failed = 1;
+    }
+    if (!enc->failed) ImageEncoder_write_header(enc);
+    switch (enc->codec) {
+        case ImageCodec_Png:
+            if (!enc->failed) PngImage_write_end(enc);
+            PngImage_destroy(enc);
+            break;
+#ifdef HAVE_WEBP
+        case ImageCodec_WebP:
+            if (enc->pixels) WebPImage_finish(enc);
+            break;
+#endif
+        default: break;
+    }
+    if (enc->fp) {
+        g_host->debugmsg("Finished writing image file. %s to %s", enc->tmp_filename, enc->filename);
+        fclose(enc->fp);
+        enc->fp = NULL;
+        if (enc->failed) {
+            g_host->errormsg("Failed to write %s", enc->tmp_filename);
+            remove(enc->tmp_filename);
+        } else if (rename(enc->tmp_filename, enc->filename) != 0) {
+            g_host->errormsg("Failed to rename %s to %s", enc->tmp_filename, enc->filename);
+        }
+    }
+}
+static void ImageEncoder_release(ImageEncoder *enc) {
+    ImageEncoder_finish(enc);
+    ImageMemBuffer_release(enc->mem);
+    enc->mem = NULL;
 }
 
 /** Image */
@@ -116,21 +490,26 @@ int image_create(PluginContext *pc, Image* img, const char *filename, unsigned i
     img->buffer_format=buffer_type;
     img->width=width;
     img->height=height;
-    if (backend == ImageBackend_Png) {
-        int pngcolor;
+    img->backend_data=NULL;
+    if (backend == ImageBackend_Png || backend == ImageBackend_Memory) {
+        unsigned int channels;
         switch(format){
-            case ImageFormat_RGBA: pngcolor=PNG_COLOR_TYPE_RGBA; break;
-            case ImageFormat_Grayscale: pngcolor=PNG_COLOR_TYPE_GRAY; break;
+            case ImageFormat_RGBA: channels=4; break;
+            case ImageFormat_Grayscale: channels=1; break;
             case ImageFormat_RGB:
             default:
-                pngcolor=PNG_COLOR_TYPE_RGB; break;
+                channels=3; break;
         }
-        PngImage *pngimg= malloc(sizeof(PngImage));
-        if (PngImage_init(pngimg, width, height, filename, pngcolor)) {
-            g_host->errormsg("Failed to initialize PNG image.");
+        if (backend == ImageBackend_Memory) filename = NULL;
+        else if (!filename) return -1;
+        ImageEncoder *enc= malloc(sizeof(ImageEncoder));
+        if (!enc) return -2;
+        if (ImageEncoder_init(enc, width, height, channels, filename)) {
+            g_host->errormsg("Failed to initialize image encoder.");
+            free(enc);
             return -2;
         }
-        img->backend_data=pngimg;
+        img->backend_data=enc;
         return 0;
     }else{
         g_host->errormsg("Backend not supported");
@@ -140,25 +519,43 @@ int image_create(PluginContext *pc, Image* img, const char *filename, unsigned i
 }
 int image_destroy(PluginContext *pc, Image* img){
     (void)pc; // Unused parameter
-    if (img->backend == ImageBackend_Png) {
-        PngImage *pngimg=(PngImage*)img->backend_data;
-        g_host->logmsg("PngImage_finish: %s", pngimg->filename);
-        PngImage_finish(pngimg);
-        free(pngimg);
+    if (img->backend == ImageBackend_Png || img->backend == ImageBackend_Memory) {
+        ImageEncoder *enc=(ImageEncoder*)img->backend_data;
+        if (!enc) return -1;
+        g_host->logmsg("ImageEncoder_finish: %s", enc->filename);
+        ImageEncoder_release(enc);
+        free(enc);
+        img->backend_data = NULL;
     }
     return 0;
 }
+/** image_get_buffer
+ * Memory backend: completes the encoding and gives the ImageMemBuffer.
+ * It is valid until image_destroy. NULL for file backends or on failure.
+ */
 void image_get_buffer(PluginContext *pc, Image* img, void** buffer){
     (void)pc; // Unused parameter
-    (void)img; // Unused parameter
-    (void)buffer; // Unused parameter
+    if (!buffer) return;
+    *buffer = NULL;
+    if (img->backend == ImageBackend_Memory) {
+        ImageEncoder *enc=(ImageEncoder*)img->backend_data;
+        ImageEncoder_finish(enc);
+        if (!enc->failed) *buffer = enc->mem;
+    }
 }
 void image_write_row(PluginContext *pc, Image* img, void* row){
     (void)pc; // Unused parameter
-    if (img->backend == ImageBackend_Png) {
-        PngImage *pngimg=(PngImage*)img->backend_data;
-        png_write_row(pngimg->png_ptr, row);
+    if (img->backend == ImageBackend_Png || img->backend == ImageBackend_Memory) {
+        ImageEncoder_write_row((ImageEncoder*)img->backend_data, row);
+    }
+}
+int image_set_options(PluginContext *pc, Image* img, const ImageEncodeOptions *opt){
+    (void)pc; // Unused parameter
+    if (!img || !opt) return -1;
+    if (img->backend == ImageBackend_Png || img->backend == ImageBackend_Memory) {
+        return ImageEncoder_set_options((ImageEncoder*)img->backend_data, opt);
     }
+    return -1;
 }
 
 void handle_image(PluginContext *pc, ClientContext *ctx, RequestParams *params){
@@ -166,7 +563,8 @@ void handle_image(PluginContext *pc, ClientContext *ctx, RequestParams *params){
     (void)ctx; // Unused parameter
     (void)params; // Unused parameter
     char body[1024];
-    snprintf(body, 1024, "{\"libpng version\":\"%s\"}", png_libpng_ver );
+    snprintf(body, 1024, "{\"libpng version\":\"%s\",\"webp\":%s}", png_libpng_ver,
+        (image_codecs(pc) & (1U << ImageCodec_WebP)) ? "true" : "false");
     g_host->http.send_response(ctx->socket_fd, 200, "application/json", body);
 }
 void handle_http(PluginContext *pc, ClientContext *ctx, RequestParams *params){
@@ -197,10 +595,13 @@ int plugin_init(PluginContext* pc, const PluginHostInterface *host) {
     pc->image.destroy = image_destroy;
     pc->image.get_buffer = image_get_buffer;
     pc->image.write_row = image_write_row;
+    pc->image.set_options = image_set_options;
+    pc->image.codecs = image_codecs;
     return PLUGIN_SUCCESS;
 }
 void plugin_finish(PluginContext* pc) {
     // Cleanup code here
     pc->http.request_handler = NULL;
+    ImageMemBuffer_pool_clear();
     // Free any allocated resources
-}
\ No newline at end of file
+}
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #ifndef M_PI
 #define M_PI 3.14159265358979323846 /* pi */
@@ -12,6 +13,12 @@ const PluginHostInterface *g_host;
 static const char *g_routes[] = { "/localmap", "/localelevation", "/localcloud" };
 char g_cache_dir[MAX_PATH];
 
+// Local maps depend on the position, rarely reused, so the fast encoder is the default.
+// Overridable from the [LOCALMAP] config group, e.g. localmap_zlevel=6, and per request.
+static ImageEncodeOptions g_route_encode[] = {
+    IMAGE_ENCODE_FAST, IMAGE_ENCODE_FAST, IMAGE_ENCODE_FAST
+};
+
 static inline void setPixel(unsigned char *row, unsigned long pixel_offset, int mode, TerrainInfo* info) {
     switch(mode){
         case 1:
@@ -48,6 +55,21 @@ static inline void setPixel(unsigned char *row, unsigned long pixel_offset, int
 
     }
 }
+/** store_cache_file
+ * Writes an image encoded in memory to the file cache, after it was sent.
+ */
+static void store_cache_file(const char *filename, const ImageMemBuffer *buf) {
+    char tmp_filename[MAX_PATH + 2];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s_", filename);
+    FILE *fp = fopen(tmp_filename, "wb");
+    if (!fp) return;
+    size_t written = fwrite(buf->data, 1, buf->size, fp);
+    fclose(fp);
+    if (written != buf->size || rename(tmp_filename, filename)) {
+        g_host->errormsg("Failed to store local map: %s", filename);
+        remove(tmp_filename);
+    }
+}
 void handle_localmap(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc;
     int mode=0;
@@ -80,12 +102,21 @@ void handle_localmap(PluginContext *pc, ClientContext *ctx, RequestParams *param
         
     }
     char filename[MAX_PATH];
-    snprintf(filename, sizeof(filename), "%s/%s_lat%.2f_lon%.2f_r%.1f_%dx%d.png",
+    int vary = 0;
+    ImageCodec codec = image_codec_negotiate_request(&ctx->request, params->format,
+        g_host->image.codecs(g_host->get_plugin_context("image")), &vary);
+    ImageEncodeOptions opt = g_route_encode[mode];
+    image_encode_options_override(&opt, params->zlevel, params->zstrategy, params->zfilter);
+    opt.codec = codec;
+    char ztag[32];
+    image_encode_options_tag(&opt, ztag, sizeof(ztag));
+    snprintf(filename, sizeof(filename), "%s/%s_lat%.2f_lon%.2f_r%.1f_%dx%d_%s.%s",
         g_cache_dir,
         fname,
         params->lat_min, params->lon_min, params->radius,
-        params->width, params->height);
+        params->width, params->height, ztag, image_codec_ext(codec));
 
+    int sent = 0;
     if (!g_host->file_exists_recent(filename, CACHE_TIME)) {
         g_host->logmsg("Generating local top-down map: %s", filename);
 
@@ -99,8 +130,10 @@ void handle_localmap(PluginContext *pc, ClientContext *ctx, RequestParams *param
             g_host->image.context_start(pcimg);
             Image img;
 
-            if (!g_host->image.create(pcimg, &img, filename, params->width, params->height,
-                                       ImageBackend_Png, image_format, ImageBuffer_AoS)) {
+            // Encoded in memory and sent from there, the cache file is written after the response.
+            if (!g_host->image.create(pcimg, &img, NULL, params->width, params->height,
+                                       ImageBackend_Memory, image_format, ImageBuffer_AoS)) {
+                g_host->image.set_options(pcimg, &img, &opt);
                 float lat0 = params->lat_min;
                 float lon0 = params->lon_min;
                 float delta = params->radius;
@@ -156,7 +189,14 @@ void handle_localmap(PluginContext *pc, ClientContext *ctx, RequestParams *param
                     
                 }
                 free(row);
-                g_host->image.destroy(pcimg, &img);
+                ImageMemBuffer *buf = NULL;
+                g_host->image.get_buffer(pcimg, &img, (void **)&buf);
+                if (buf) {
+                    g_host->http.send_data_headers(ctx->socket_fd, 200, image_codec_mime(codec), buf->data, buf->size, vary ? IMAGE_VARY_ACCEPT : NULL);
+                    sent = 1;
+                    store_cache_file(filename, buf);
+                }
+                g_host->image.destroy(pcimg, &img); // returns the buffer to the pool
                 g_host->logmsg("Local map PNG generated: %s", filename);
             }
             g_host->image.context_stop(pcimg);
@@ -165,7 +205,7 @@ void handle_localmap(PluginContext *pc, ClientContext *ctx, RequestParams *param
     } else {
         g_host->logmsg("Using cached local map: %s", filename);
     }
-    g_host->http.send_file(ctx->socket_fd, "image/png", filename);
+    if (!sent) g_host->http.send_file_headers(ctx->socket_fd, image_codec_mime(codec), filename, vary ? IMAGE_VARY_ACCEPT : NULL);
 }
 
 void handle_http(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
@@ -183,6 +223,9 @@ int plugin_register(PluginContext *pc, const PluginHostInterface *host) {
 int plugin_init(PluginContext *pc, const PluginHostInterface *host) {
     g_host = host;
     g_host->config_get_string("CACHE", "dir", g_cache_dir, MAX_PATH, CACHE_DIR);
+    for (int i = 0; i < 3; i++) {
+        image_encode_options_config(&g_route_encode[i], "LOCALMAP", g_routes[i] + 1, g_host->config_get_int);
+    }
     pc->http.request_handler = (void *)handle_http;
     return PLUGIN_SUCCESS;
 }
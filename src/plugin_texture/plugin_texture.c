@@ -3,7 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <strings.h>
 #include <math.h>
 #ifndef M_PI
 #define M_PI 3.14159265358979323846 /* pi */
@@ -112,13 +112,37 @@ static void (*g_http_handlers[])(PluginContext *, ClientContext *, RequestParams
 const char* g_http_routes[]={"/biome", "/elevation", "/clouds", "/pano"};
 int g_http_routes_count = 4;
 
+// Per-route encoder defaults, same order as the routes. Global textures are cached
+// for a long time, so compress them hard. Pano is camera dependent, encode it fast.
+// Overridable from the [TEXTURE] config group, e.g. biome_zlevel=6, and per request.
+static ImageEncodeOptions g_route_encode[] = {
+    IMAGE_ENCODE_BEST, IMAGE_ENCODE_BEST, IMAGE_ENCODE_BEST, IMAGE_ENCODE_FAST
+};
+
+/** route_encode
+ * Effective encoder options of the request: the route default, overridden by
+ * the request. They are part of the cache file name, see image_encode_options_tag.
+ */
+static ImageEncodeOptions route_encode(int route, RequestParams *params, ImageCodec codec) {
+    ImageEncodeOptions opt = g_route_encode[route];
+    image_encode_options_override(&opt, params->zlevel, params->zstrategy, params->zfilter);
+    opt.codec = codec;
+    return opt;
+}
+
 void handle_biome(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc;
+    int vary = 0;
+    ImageCodec codec = image_codec_negotiate_request(&ctx->request, params->format,
+        g_host->image.codecs(g_host->get_plugin_context("image")), &vary);
+    ImageEncodeOptions opt = route_encode(0, params, codec);
+    char ztag[32];
+    image_encode_options_tag(&opt, ztag, sizeof(ztag));
     char filename[MAX_PATH];
-    snprintf(filename, sizeof(filename), "%s/biome_lat%.2f_lon%.2f_%dx%d.png",
+    snprintf(filename, sizeof(filename), "%s/biome_lat%.2f_lon%.2f_%dx%d_%s.%s",
         g_cache_dir,
         params->lat_min, params->lon_min, 
-        params->width, params->height);
+        params->width, params->height, ztag, image_codec_ext(codec));
     if (!g_host->file_exists_recent(filename, CACHE_TIME)) {
         g_host->logmsg("Generating new biome PNG: %s", filename);
         
@@ -135,6 +159,7 @@ void handle_biome(PluginContext *pc, ClientContext *ctx, RequestParams *params)
             Image img;
             int res=g_host->image.create(pcimg, &img, filename, params->width, params->height, ImageBackend_Png, ImageFormat_RGB, ImageBuffer_AoS);
             if (!res){
+                g_host->image.set_options(pcimg, &img, &opt);
                 for (unsigned int y = 0; y < img.height; y++) {
                     unsigned char *row = malloc(3 * img.width);
                     float lat = params->lat_max - ((params->lat_max - params->lat_min) / img.height) * y;
@@ -162,16 +187,22 @@ void handle_biome(PluginContext *pc, ClientContext *ctx, RequestParams *params)
     } else {
         g_host->logmsg("Using cached Biome PNG: %s", filename);
     }
-    g_host->http.send_file(ctx->socket_fd, "image/png", filename);
+    g_host->http.send_file_headers(ctx->socket_fd, image_codec_mime(codec), filename, vary ? IMAGE_VARY_ACCEPT : NULL);
 }
 
 void handle_elevation(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc;
+    int vary = 0;
+    ImageCodec codec = image_codec_negotiate_request(&ctx->request, params->format,
+        g_host->image.codecs(g_host->get_plugin_context("image")), &vary);
+    ImageEncodeOptions opt = route_encode(1, params, codec);
+    char ztag[32];
+    image_encode_options_tag(&opt, ztag, sizeof(ztag));
     char filename[MAX_PATH];
-    snprintf(filename, sizeof(filename), "%s/elevation_lat%.2f_lon%.2f_%dx%d.png",
+    snprintf(filename, sizeof(filename), "%s/elevation_lat%.2f_lon%.2f_%dx%d_%s.%s",
         g_cache_dir,
         params->lat_min, params->lon_min, 
-        params->width, params->height);
+        params->width, params->height, ztag, image_codec_ext(codec));
     if (!g_host->file_exists_recent(filename, CACHE_TIME)) {
         g_host->logmsg("Generating new elevation PNG: %s", filename);
         
@@ -185,6 +216,7 @@ void handle_elevation(PluginContext *pc, ClientContext *ctx, RequestParams *para
             g_host->image.context_start(pcimg);
             Image img;
             if (!g_host->image.create(pcimg, &img, filename, params->width, params->height, ImageBackend_Png, ImageFormat_Grayscale, ImageBuffer_AoS)){
+                g_host->image.set_options(pcimg, &img, &opt);
                 for (unsigned int y = 0; y < img.height; y++) {
                     unsigned char *row = malloc(1 * img.width);
                     float lat = params->lat_max - ((params->lat_max - params->lat_min) / img.height) * y;
@@ -209,16 +241,22 @@ void handle_elevation(PluginContext *pc, ClientContext *ctx, RequestParams *para
     } else {
         g_host->logmsg("Using cached Elevation PNG: %s", filename);
     }
-    g_host->http.send_file(ctx->socket_fd, "image/png", filename);
+    g_host->http.send_file_headers(ctx->socket_fd, image_codec_mime(codec), filename, vary ? IMAGE_VARY_ACCEPT : NULL);
 }
 
 void handle_clouds(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc;
+    int vary = 0;
+    ImageCodec codec = image_codec_negotiate_request(&ctx->request, params->format,
+        g_host->image.codecs(g_host->get_plugin_context("image")), &vary);
+    ImageEncodeOptions opt = route_encode(2, params, codec);
+    char ztag[32];
+    image_encode_options_tag(&opt, ztag, sizeof(ztag));
     char filename[MAX_PATH];
-    snprintf(filename, sizeof(filename), "%s/clouds_lat%.2f_lon%.2f_%dx%d.png",
+    snprintf(filename, sizeof(filename), "%s/clouds_lat%.2f_lon%.2f_%dx%d_%s.%s",
         g_cache_dir,
         params->lat_min, params->lon_min, 
-        params->width, params->height);
+        params->width, params->height, ztag, image_codec_ext(codec));
     if (!g_host->file_exists_recent(filename, CACHE_TIME)) {
         g_host->logmsg("Generating new clouds PNG: %s", filename);
         
@@ -232,6 +270,7 @@ void handle_clouds(PluginContext *pc, ClientContext *ctx, RequestParams *params)
             g_host->image.context_start(pcimg);
             Image img;
             if (!g_host->image.create(pcimg, &img, filename, params->width, params->height, ImageBackend_Png, ImageFormat_RGBA, ImageBuffer_AoS)){
+                g_host->image.set_options(pcimg, &img, &opt);
                 for (unsigned int y = 0; y < img.height; y++) {
                     unsigned char *row = malloc(4 * img.width);
                     float lat = params->lat_max - ((params->lat_max - params->lat_min) / img.height) * y;
@@ -256,16 +295,22 @@ void handle_clouds(PluginContext *pc, ClientContext *ctx, RequestParams *params)
     } else {
         g_host->logmsg("Using cached Clouds PNG: %s", filename);
     }
-    g_host->http.send_file(ctx->socket_fd, "image/png", filename);
+    g_host->http.send_file_headers(ctx->socket_fd, image_codec_mime(codec), filename, vary ? IMAGE_VARY_ACCEPT : NULL);
 }
 
 void handle_pano(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     (void)pc;
+    int vary = 0;
+    ImageCodec codec = image_codec_negotiate_request(&ctx->request, params->format,
+        g_host->image.codecs(g_host->get_plugin_context("image")), &vary);
+    ImageEncodeOptions opt = route_encode(3, params, codec);
+    char ztag[32];
+    image_encode_options_tag(&opt, ztag, sizeof(ztag));
     char filename[MAX_PATH];
-    snprintf(filename, sizeof(filename), "%s/pano_lat%.2f_lon%.2f_alt=%.4f_%dx%d.png",
+    snprintf(filename, sizeof(filename), "%s/pano_lat%.2f_lon%.2f_alt=%.4f_%dx%d_%s.%s",
         g_cache_dir,
         params->lat_min, params->lon_min, params->alt,
-        params->width, params->height);
+        params->width, params->height, ztag, image_codec_ext(codec));
     if (!g_host->file_exists_recent(filename, CACHE_TIME)) {
         g_host->logmsg("Generating new clouds PNG: %s", filename);
         
@@ -279,6 +324,7 @@ void handle_pano(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
             g_host->image.context_start(pcimg);
             Image img;
             if (!g_host->image.create(pcimg, &img, filename, params->width, params->height, ImageBackend_Png, ImageFormat_RGB, ImageBuffer_AoS)){
+                g_host->image.set_options(pcimg, &img, &opt);
                 float R = 1.0;                  // earth radius
                 float Rcloud= 1.5;               // 1.2;              // cloud radius
                 float lat0 = params->lat_min;   //camera standpoint latitude
@@ -418,7 +464,7 @@ void handle_pano(PluginContext *pc, ClientContext *ctx, RequestParams *params) {
     } else {
         g_host->logmsg("Using cached Pano PNG: %s", filename);
     }
-    g_host->http.send_file(ctx->socket_fd, "image/png", filename);
+    g_host->http.send_file_headers(ctx->socket_fd, image_codec_mime(codec), filename, vary ? IMAGE_VARY_ACCEPT : NULL);
 }
 void handle_http(PluginContext *pc, ClientContext *ctx, RequestParams *params){
     (void)pc; // Unused parameter
@@ -444,6 +490,9 @@ int plugin_register(PluginContext *pc, const PluginHostInterface *host) {
 int plugin_init(PluginContext* pc, const PluginHostInterface *host) {
     g_host = host;
     g_host->config_get_string("CACHE", "dir", g_cache_dir, MAX_PATH, CACHE_DIR);
+    for (int i = 0; i < g_http_routes_count; i++) {
+        image_encode_options_config(&g_route_encode[i], "TEXTURE", g_http_routes[i] + 1, g_host->config_get_int);
+    }
     pc->http.request_handler = (void*) handle_http;
     return PLUGIN_SUCCESS;
 }
@@ -20,6 +20,7 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include <openssl/sha.h>
 #include <openssl/bio.h>
@@ -28,6 +29,10 @@
 
 #include <json-c/json.h>
 #include "ws.h"
+#include "wspos.h"
+#include "wsgrid.h"
+#include "wssync.h"
+#include "wsreg.h"
 
 #include "../plugin.h"
 #include "../data.h"
@@ -35,7 +40,8 @@
 #include "../data_sql.h"
 #include "cmd.h"
 
-#define MAX_APPSESSION (100)
+#define MAX_APPSESSION (100)  // initial capacity of the session registry
+#define WSAPP_KEY_POSITION (1)  // coalesce key kind of the user position frames
 
 typedef enum WsTypeId_t
 {
@@ -81,17 +87,18 @@ typedef struct
     struct ws_session_t *s;
     user_data_t *user;
     int alive;
+    int pos_binary;     // position messages in binary frames, see wspos.h
+    double interest_km; // radius of the area of interest around the user
+    wssync_vector_t synced;     // last versions sent, see wssync.h
+    long long last_sync_ms;
+    size_t slot;        // registry slot, the slot in the interest grid too
 } AppContext_t;
 
-typedef struct{
-    size_t session_count;
-    AppContext_t sessions[MAX_APPSESSION];
-    //todo : lock
-} wsapp_singleton_t;
+// Handler of a predefined JSON command, see g_wstype_handlers.
+typedef CommandResult_t (*wsapp_json_handler_fn)(AppContext_t *actx, struct json_object *parsed);
 
-wsapp_singleton_t g_wsapp;
-size_t wsapp_session_count();
-AppContext_t *wsapp_session_get(size_t index);
+// The application sessions, keyed by ws session and by user, see wsreg.h
+static wsreg_t g_wsreg;
 AppContext_t *wsapp_session_create(ws_session_t *s);
 void wsapp_session_destroy(ws_session_t *s);
 void broadcast_chat_message(user_data_t *sender, const char *msg);
@@ -122,6 +129,24 @@ static const CommandEntry g_plugin_ws_control_cmds[] = {
 static const int g_plugin_ws_control_count = 2;
 
 const char *g_ws_routes[1] = {"id_dont_know_yet"};
+
+// Subprotocols the handshake accepts, in preference order.
+static const char *const g_ws_protocols[] = {"geo", NULL};
+// permessage-deflate settings, from the [WS] config section
+static ws_deflate_config_t g_ws_deflate = {
+    .enabled = 1, .level = 6, .window_bits = 15, .context_takeover = 1, .threshold = 256
+};
+// Positions of the sessions' users, slot is the index of the AppContext_t.
+// The position messages only go to the sessions within the area of interest.
+static wsgrid_t g_wsgrid;
+static double g_ws_interest_km = 500.0;   // radius of the area of interest, the max of the sessions
+// Versions of the synchronized entities, the sessions get the deltas.
+static wssync_store_t g_wssync[WSSYNC_KIND_MAX];
+static const char *const g_wssync_names[WSSYNC_KIND_MAX] = {
+    [WSSYNC_USERS] = "users"
+};
+#define WSSYNC_CHUNK (64)   // changes per sync message
+static int g_ws_sync_interval_ms = 1000;
 int g_ws_routess_count = 1;
 
 void ws_control_test(ClientContext *ctx)
@@ -135,36 +160,35 @@ void ws_control_test(ClientContext *ctx)
     g_host->debugmsg("Sec-WebSocket-Accept: %s", keyaccept);
     return;
 }
+static int ws_conrol_list_visit(void *item, void *arg){
+    AppContext_t *a = (AppContext_t *)item;
+    ClientContext *ctx = (ClientContext *)arg;
+    if (a->alive){
+        ws_session_t *s= a->s;
+        int flen=0;
+        ws_get_info(s, &flen);
+        dprintf(ctx->socket_fd,
+            "WS Session ip:%s ", //frame_len:%zuk",
+            a->ctx->client_ip // , s->frame_capacity/1024
+        );
+        char buf[BUF_SIZE];
+        ws_measure_dump_str(a->s, buf, sizeof(buf));
+        dprintf(ctx->socket_fd, "%s", buf );
+        if (a->user){
+            user_data_t *u= a->user;
+            dprintf(ctx->socket_fd, "user: %d/%zu (%s), pos: (%0.2f, %0.2f, %0.2f) session:%s v:%d",
+                u->id, u->index, u->nick,
+                u->lat, u->lon, u->alt,
+                u->session_key, u->version
+            );
+        }
+    }
+    return 0;
+}
 void ws_conrol_list(ClientContext *ctx){
-    size_t sc = wsapp_session_count();
-    if (sc < 1){
+    if (!wsreg_foreach(&g_wsreg, ws_conrol_list_visit, ctx)){
         dprintf(ctx->socket_fd,
             "There were no session seen.\n");
-    }else{
-        for (size_t i=0; i < sc; i++){
-            AppContext_t *a = wsapp_session_get(i);
-            if (!a) continue; // not possible, but...
-            if (a->alive){
-                ws_session_t *s= a->s;
-                int flen=0;
-                ws_get_info(s, &flen);
-                dprintf(ctx->socket_fd,
-                    "WS Session ip:%s ", //frame_len:%zuk",
-                    a->ctx->client_ip // , s->frame_capacity/1024
-                );
-                char buf[BUF_SIZE];
-                ws_measure_dump_str(a->s, buf, sizeof(buf));
-                dprintf(ctx->socket_fd, "%s", buf );
-                if (a->user){
-                    user_data_t *u= a->user;
-                    dprintf(ctx->socket_fd, "user: %d/%zu (%s), pos: (%0.2f, %0.2f, %0.2f) session:%s v:%d",
-                        u->id, u->index, u->nick,
-                        u->lat, u->lon, u->alt,
-                        u->session_key, u->version
-                    );
-                }
-            }
-        }
     }
 }
 
@@ -206,6 +230,46 @@ void ws_control_handler(PluginContext *pc, ClientContext *ctx, char *cmd, int ar
     return;
 }
 
+typedef struct {
+    char *buf;
+    size_t size;
+    int o;
+} ws_http_page_t;
+
+static int ws_http_handler_visit(void *item, void *arg)
+{
+    AppContext_t *a = (AppContext_t *)item;
+    ws_http_page_t *page = (ws_http_page_t *)arg;
+    char *buf = page->buf;
+    int o = page->o;
+    if (!a->alive) return 0;
+
+    char stats[BUF_SIZE] = {0};
+    ws_measure_dump_str(a->s, stats, sizeof(stats));
+    int flen =0;
+    ws_get_info(a->s, &flen);
+    o += snprintf(buf + o, page->size - o,
+        "<tr><td>%s</td><td>%d</td><td>",
+        a->ctx->client_ip, flen);
+
+    if (a->user) {
+        user_data_t *u = a->user;
+        o += snprintf(buf + o, page->size - o,
+            "ID: %d/%zu (%s), Pos: (%.2f, %.2f, %.2f), Session: %s, V: %d",
+            u->id, u->index, u->nick,
+            u->lat, u->lon, u->alt,
+            u->session_key, u->version);
+    } else {
+        o += snprintf(buf + o, page->size - o, "N/A");
+    }
+
+    o += snprintf(buf + o, page->size - o,
+        "</td><td><pre>%s</pre></td></tr>", stats);
+    page->o = o;
+    // the rest of the sessions would not fit
+    return (size_t)o >= page->size;
+}
+
 /* When a http route match with the provided list, a client request
 // will land here, to provides some meaingful response on http protocol.
 */
@@ -222,37 +286,13 @@ void ws_http_handler(PluginContext *pc, ClientContext *ctx, RequestParams *param
         "<h1>WebSocket Statistics</h1>"
         "<table border='1'><tr><th>IP</th><th>Frame Capacity (kB)</th><th>User Info</th><th>Stats</th></tr>");
 
-    size_t sc = wsapp_session_count();
-    if (sc == 0) {
+    ws_http_page_t page = { buf, sizeof(buf), o };
+    if (!wsreg_foreach(&g_wsreg, ws_http_handler_visit, &page)) {
         o += snprintf(buf + o, sizeof(buf) - o, "<tr><td colspan='4'>No active WebSocket sessions.</td></tr>");
     }else{
-        for (size_t i = 0; i < sc; i++) {
-            AppContext_t *a = wsapp_session_get(i);
-            if (!a || !a->alive) continue;
-
-            char stats[BUF_SIZE] = {0};
-            ws_measure_dump_str(a->s, stats, sizeof(stats));
-            int flen =0;
-            ws_get_info(a->s, &flen);
-            o += snprintf(buf + o, sizeof(buf) - o,
-                "<tr><td>%s</td><td>%d</td><td>",
-                a->ctx->client_ip, flen);
-
-            if (a->user) {
-                user_data_t *u = a->user;
-                o += snprintf(buf + o, sizeof(buf) - o,
-                    "ID: %d/%zu (%s), Pos: (%.2f, %.2f, %.2f), Session: %s, V: %d",
-                    u->id, u->index, u->nick,
-                    u->lat, u->lon, u->alt,
-                    u->session_key, u->version);
-            } else {
-                o += snprintf(buf + o, sizeof(buf) - o, "N/A");
-            }
-
-            o += snprintf(buf + o, sizeof(buf) - o,
-                "</td><td><pre>%s</pre></td></tr>", stats);
-        }
+        o = page.o;
     }
+    if ((size_t)o >= sizeof(buf)) o = sizeof(buf) - 1;
     o += snprintf(buf + o, sizeof(buf) - o, "</table></body></html>");
 
     g_host->http.send_response(ctx->socket_fd, 200, "text/html", buf);
@@ -275,6 +315,7 @@ void ws_send_json_user_data(AppContext_t *actx, user_data_t *user_data)
         json_object_object_add(obj, "lon", json_object_new_double(user_data->lon));
         json_object_object_add(obj, "alt", json_object_new_double(user_data->alt));
         json_object_object_add(obj, "version", json_object_new_int(user_data->version));
+        json_object_object_add(obj, "pos_format", json_object_new_string(actx->pos_binary ? WSPOS_FORMAT_NAME : "json"));
         ws_send_json(actx, obj);
         json_object_put(obj);
     }
@@ -293,18 +334,305 @@ void wsapp_send_json_error(AppContext_t* actx, const char* message){
     json_object_put(obj);
 }
 
-void ws_parse_sql_user(char *row, user_data_t *nuser)
+/** wsapp_pos_record
+ * Position record of a user, for the binary and the JSON encoding as well.
+ */
+static void wsapp_pos_record(const user_data_t *u, wspos_record_t *r)
 {
-    char *f = strtok(row, "|");
-    nuser->id = atoi(f);
-    f = strtok(NULL, "|");
-    strcpy(nuser->nick, f);
-    f = strtok(NULL, "|");
-    nuser->lat = atof(f);
-    f = strtok(NULL, "|");
-    nuser->lon = atof(f);
-    f = strtok(NULL, "|");
-    nuser->alt = atof(f);
+    r->user_id = (uint32_t)u->id;
+    r->lat = u->lat;
+    r->lon = u->lon;
+    r->heading = u->heading;
+    r->timestamp = u->pos_timestamp;
+}
+
+/** wsapp_positions_binary
+ * Encode a users_pos message of wspos.h, the caller frees the buffer.
+ * NULL if it does not fit into a message (over WSPOS_MAX_RECORDS).
+ */
+static unsigned char *wsapp_positions_binary(user_data_t *const *users, size_t count, size_t *len)
+{
+    wspos_record_t r;
+    *len = wspos_message_size(count);
+    unsigned char *buf = malloc(*len);
+    if (!buf) return NULL;
+    int n = wspos_encode_header(buf, *len, WSPOS_KIND_USERS_POS, count);
+    size_t o = (size_t)n;
+    for (size_t i = 0; n >= 0 && i < count; i++) {
+        wsapp_pos_record(users[i], &r);
+        n = wspos_encode_record(buf + o, *len - o, &r);
+        o += (size_t)n;
+    }
+    if (n < 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/** wsapp_positions_json
+ * Build the JSON form of a users_pos message, the caller puts it.
+ */
+static struct json_object *wsapp_positions_json(user_data_t *const *users, size_t count)
+{
+    struct json_object *obj = json_object_new_object();
+    struct json_object *arr = json_object_new_array();
+    json_object_object_add(obj, "type", json_object_new_string("users_pos"));
+    for (size_t i = 0; i < count; i++) {
+        struct json_object *u = json_object_new_object();
+        json_object_object_add(u, "user_id", json_object_new_int(users[i]->id));
+        json_object_object_add(u, "lat", json_object_new_double(users[i]->lat));
+        json_object_object_add(u, "lon", json_object_new_double(users[i]->lon));
+        json_object_object_add(u, "alt", json_object_new_double(users[i]->alt));
+        json_object_object_add(u, "heading", json_object_new_double(users[i]->heading));
+        json_object_object_add(u, "timestamp", json_object_new_int64(users[i]->pos_timestamp));
+        json_object_array_add(arr, u);
+    }
+    json_object_object_add(obj, "users", arr);
+    return obj;
+}
+
+/** wsapp_send_positions
+ * Send the positions of the users in the format negotiated by the session.
+ */
+static CommandResult_t wsapp_send_positions(AppContext_t *actx, user_data_t *const *users, size_t count)
+{
+    if (actx->pos_binary) {
+        size_t len = 0;
+        unsigned char *buf = wsapp_positions_binary(users, count, &len);
+        if (!buf) return CR_ERROR;
+        int ret = ws_send_binary_message(actx->s, buf, len);
+        free(buf);
+        return ret ? CR_ERROR : CR_PROCESSED;
+    }
+    struct json_object *obj = wsapp_positions_json(users, count);
+    ws_send_json(actx, obj);
+    json_object_put(obj);
+    return CR_PROCESSED;
+}
+
+/** wsapp_slot
+ * Registry slot of the app session, the slot of its user in the interest grid.
+ */
+static size_t wsapp_slot(const AppContext_t *actx)
+{
+    return actx->slot;
+}
+
+/** wsapp_broadcast_user_pos
+ * Send the new position of a user to the sessions whose area of interest
+ * contains it. Encoded once per format, the frames are shared.
+ */
+static void wsapp_broadcast_user_pos(AppContext_t *sender, user_data_t *user)
+{
+    size_t max = wsreg_capacity(&g_wsreg);
+    size_t *slots = max ? malloc(sizeof(size_t) * max) : NULL;
+    if (!slots) return;
+    size_t n = wsgrid_query(&g_wsgrid, user->lat, user->lon, g_ws_interest_km, slots, max);
+    ws_frame_t *frames[2] = { NULL, NULL }; // json, binary
+    for (size_t i = 0; i < n; i++) {
+        // acquired, it is not freed while the frame is queued
+        AppContext_t *a = wsreg_get(&g_wsreg, slots[i]);
+        double lat, lon;
+        if (!a) continue;
+        if (a == sender || !a->alive || !a->user || !a->s ||
+            (a->interest_km < g_ws_interest_km &&
+            (wsgrid_position(&g_wsgrid, slots[i], &lat, &lon) ||
+            wsgrid_distance_km(lat, lon, user->lat, user->lon) > a->interest_km))) {
+            wsreg_release(a);
+            continue;
+        }
+        int f = a->pos_binary ? 1 : 0;
+        if (!frames[f]) {
+            if (f) {
+                size_t len = 0;
+                unsigned char *buf = wsapp_positions_binary(&user, 1, &len);
+                if (buf) frames[f] = ws_frame_create_binary(buf, len);
+                free(buf);
+            } else {
+                struct json_object *obj = wsapp_positions_json(&user, 1);
+                frames[f] = ws_frame_create_text(json_object_to_json_string(obj));
+                json_object_put(obj);
+            }
+            // a newer position of the same user replaces it in a slow queue
+            ws_frame_set_key(frames[f], WS_FRAME_KEY(WSAPP_KEY_POSITION, user->id));
+        }
+        if (frames[f]) ws_send_shared_frame(a->s, frames[f]);
+        wsreg_release(a);
+    }
+    free(slots);
+    if (frames[0]) ws_frame_release(frames[0]);
+    if (frames[1]) ws_frame_release(frames[1]);
+}
+
+/** wsapp_update_user_pos
+ * Store the new position of the session's user, alt is optional.
+ */
+static CommandResult_t wsapp_update_user_pos(AppContext_t *actx, double lat, double lon, const double *alt, double heading)
+{
+    if (!actx->user) {
+        wsapp_send_json_error(actx, "User not identified");
+        return CR_ERROR;
+    }
+    if (!(lat >= -90.0 && lat <= 90.0 && lon >= -180.0 && lon <= 180.0)) {
+        debugmsg("Position out of range: %f %f", lat, lon);
+        return CR_ERROR;
+    }
+    data_handle_t *dh = data_get_handle_by_name("geo");
+    if (dh == NULL)
+    {
+        errormsg("No geo data handle found");
+        return CR_ERROR;
+    }
+    data_api_geo_t *geoapi = (data_api_geo_t *)dh->specific_api;
+    user_data_t u = *actx->user;
+    u.lat = lat;
+    u.lon = lon;
+    if (alt) u.alt = *alt;
+    u.heading = (heading == heading) ? heading : 0.0;
+    u.pos_timestamp = (unsigned int)time(NULL);
+    u.version++;
+    if (geoapi->set_user(dh, &u)) {
+        errormsg("User position could not be stored");
+        return CR_ERROR;
+    }
+    wsgrid_update(&g_wsgrid, wsapp_slot(actx), u.lat, u.lon);
+    wsapp_broadcast_user_pos(actx, &u);
+    return CR_PROCESSED;
+}
+
+/** wsapp_send_user_pos
+ * Answer the position of one user.
+ */
+static CommandResult_t wsapp_send_user_pos(AppContext_t *actx, int user_id)
+{
+    data_handle_t *dh = data_get_handle_by_name("geo");
+    if (dh == NULL)
+    {
+        errormsg("No geo data handle found");
+        return CR_ERROR;
+    }
+    data_api_geo_t *geoapi = (data_api_geo_t *)dh->specific_api;
+    user_data_t *user = geoapi->find_user_by_user_id(dh, user_id);
+    if (!user) {
+        wsapp_send_json_error(actx, "Unknown user");
+        return CR_ERROR;
+    }
+    return wsapp_send_positions(actx, &user, 1);
+}
+
+/** wsapp_send_users_pos
+ * Answer the positions of the users within the area of interest of the
+ * session. Empty until the session's own position is known.
+ */
+static CommandResult_t wsapp_send_users_pos(AppContext_t *actx)
+{
+    size_t max = wsreg_capacity(&g_wsreg);
+    size_t *slots = max ? malloc(sizeof(size_t) * max) : NULL;
+    user_data_t **users = max ? malloc(sizeof(user_data_t *) * max) : NULL;
+    size_t count = 0, n = 0;
+    double lat, lon;
+    if (slots && users && !wsgrid_position(&g_wsgrid, wsapp_slot(actx), &lat, &lon)) {
+        n = wsgrid_query(&g_wsgrid, lat, lon, actx->interest_km, slots, max);
+    }
+    for (size_t i = 0; i < n; i++) {
+        AppContext_t *a = wsreg_get(&g_wsreg, slots[i]);
+        if (a && a->alive && a->user) users[count++] = a->user;
+        wsreg_release(a);
+    }
+    CommandResult_t res = wsapp_send_positions(actx, users, count);
+    free(slots);
+    free(users);
+    return res;
+}
+
+/** wsapp_entity_changed
+ * Producers report the created or changed entities here, the sessions
+ * get them with their next delta.
+ */
+static void wsapp_entity_changed(wssync_kind_t kind, int id)
+{
+    if (kind < WSSYNC_KIND_MAX) wssync_touch(&g_wssync[kind], id);
+}
+static void wsapp_entity_removed(wssync_kind_t kind, int id)
+{
+    if (kind < WSSYNC_KIND_MAX) wssync_remove(&g_wssync[kind], id);
+}
+
+/** wsapp_sync_kind
+ * Send the changes of one kind since the last version sent to the session:
+ * {"type":"sync","kind":..,"full":..,"version":..,"changed":[..],"removed":[..]}
+ * Users are sent with their identity, the positions have their own messages.
+ */
+static void wsapp_sync_kind(AppContext_t *actx, wssync_kind_t kind)
+{
+    wssync_change_t changes[WSSYNC_CHUNK];
+    data_handle_t *dh = NULL;
+    data_api_geo_t *geoapi = NULL;
+    size_t n;
+    do {
+        uint32_t upto = actx->synced.sent[kind];
+        int full = 0;
+        n = wssync_delta(&g_wssync[kind], actx->synced.sent[kind], changes, WSSYNC_CHUNK, &upto, &full);
+        if (!n && !(full && upto)) {
+            // nothing changed, or nothing ever existed
+            actx->synced.sent[kind] = upto;
+            return;
+        }
+        struct json_object *obj = json_object_new_object();
+        struct json_object *changed = json_object_new_array();
+        struct json_object *removed = json_object_new_array();
+        json_object_object_add(obj, "type", json_object_new_string("sync"));
+        json_object_object_add(obj, "kind", json_object_new_string(g_wssync_names[kind]));
+        json_object_object_add(obj, "full", json_object_new_boolean(full));
+        json_object_object_add(obj, "version", json_object_new_int64(upto));
+        for (size_t i = 0; i < n; i++) {
+            if (changes[i].deleted) {
+                json_object_array_add(removed, json_object_new_int(changes[i].id));
+                continue;
+            }
+            struct json_object *e = json_object_new_object();
+            json_object_object_add(e, "id", json_object_new_int(changes[i].id));
+            json_object_object_add(e, "version", json_object_new_int64(changes[i].version));
+            if (kind == WSSYNC_USERS) {
+                if (!geoapi && (dh = data_get_handle_by_name("geo")) != NULL) {
+                    geoapi = (data_api_geo_t *)dh->specific_api;
+                }
+                user_data_t *u = geoapi ? geoapi->find_user_by_user_id(dh, changes[i].id) : NULL;
+                if (u) json_object_object_add(e, "nick", json_object_new_string(u->nick));
+            }
+            json_object_array_add(changed, e);
+        }
+        json_object_object_add(obj, "changed", changed);
+        json_object_object_add(obj, "removed", removed);
+        ws_send_json(actx, obj);
+        json_object_put(obj);
+        actx->synced.sent[kind] = upto;
+    } while (n == WSSYNC_CHUNK);
+}
+
+/** wsapp_sync_session
+ * Bring the session up to date in every kind. A zero version vector means
+ * a full resend, that is the first sync and the refresh request.
+ */
+static void wsapp_sync_session(AppContext_t *actx)
+{
+    for (int k = 0; k < WSSYNC_KIND_MAX; k++) {
+        wsapp_sync_kind(actx, (wssync_kind_t)k);
+    }
+}
+
+/** ws_user_from_sql_row
+ * User from a row of "select id, nick, lat, lon, alt".
+ */
+void ws_user_from_sql_row(const DbRow *row, user_data_t *nuser)
+{
+    const char *nick = db_row_text(row, 1);
+    nuser->id = (int)db_row_int(row, 0, -1);
+    snprintf(nuser->nick, sizeof(nuser->nick), "%s", nick ? nick : "");
+    nuser->lat = db_row_double(row, 2, 0.0);
+    nuser->lon = db_row_double(row, 3, 0.0);
+    nuser->alt = db_row_double(row, 4, 0.0);
 }
 
 CommandResult_t ws_get_user_from_sql_by_session_key(const char *session_key, user_data_t *puser)
@@ -320,10 +648,28 @@ CommandResult_t ws_get_user_from_sql_by_session_key(const char *session_key, use
     {
         errormsg("No sql data handle found");
     }
-    DbQuery q;
-    snprintf(q.query, sizeof(q.query), "select id, nick, lat, lon, alt from users where session_id = '%s' LIMIT 2", session_key);
-    int rrc = sqlapi->execute(sqlh, &q);
-    if (rrc < 0)
+    DbQuery q = {0};
+    q.flags = DB_QUERY_TYPED;
+    // bound, never quoted into the text: the key comes from the client
+    snprintf(q.query, sizeof(q.query), "select id, nick, lat, lon, alt from users where session_id = ? LIMIT 2");
+    db_query_bind_text(&q, session_key);
+    // a login is interactive, it goes ahead of the bulk queries
+    int rrc = sqlapi->execute_prio(sqlh, &q, DB_PRIORITY_INTERACTIVE);
+    DbRow row;
+    if (rrc > 0 && db_result_row(q.result, 0, &row))
+    {
+        rrc = -1;   // not a typed result
+    }
+    if (rrc <= 0)
+    {
+        db_result_free(q.result);
+    }
+    if (rrc == DATA_SQL_REJECTED)
+    {
+        errormsg("Database overloaded, login rejected");
+        return CR_ERROR;
+    }
+    else if (rrc < 0)
     {
         errormsg("Query internal error");
         return CR_ERROR;
@@ -337,8 +683,8 @@ CommandResult_t ws_get_user_from_sql_by_session_key(const char *session_key, use
     {
         debugmsg("More than one user found for session key %s", session_key);
     }
-    char *row = q.rows[0];
-    ws_parse_sql_user(row, puser);
+    ws_user_from_sql_row(&row, puser);
+    db_result_free(q.result);
     logmsg("User %s logged in with session key %s. User id %d, lat %f, lon %f, alt %f",
            puser->nick, session_key,
            puser->id,
@@ -358,10 +704,27 @@ CommandResult_t ws_get_user_from_sql_by_user_id(int user_id, user_data_t *puser)
     {
         errormsg("No sql data handle found");
     }
-    DbQuery q;
-    snprintf(q.query, sizeof(q.query), "select id, nick, lat, lon, alt from users where id = %d LIMIT 1", user_id);
-    int rrc = sqlapi->execute(sqlh, &q);
-    if (rrc < 0)
+    DbQuery q = {0};
+    q.flags = DB_QUERY_TYPED;
+    snprintf(q.query, sizeof(q.query), "select id, nick, lat, lon, alt from users where id = ? LIMIT 1");
+    db_query_bind_int(&q, user_id);
+    // a login is interactive, it goes ahead of the bulk queries
+    int rrc = sqlapi->execute_prio(sqlh, &q, DB_PRIORITY_INTERACTIVE);
+    DbRow row;
+    if (rrc > 0 && db_result_row(q.result, 0, &row))
+    {
+        rrc = -1;   // not a typed result
+    }
+    if (rrc <= 0)
+    {
+        db_result_free(q.result);
+    }
+    if (rrc == DATA_SQL_REJECTED)
+    {
+        errormsg("Database overloaded, login rejected");
+        return CR_ERROR;
+    }
+    else if (rrc < 0)
     {
         errormsg("Query internal error");
         return CR_ERROR;
@@ -371,9 +734,8 @@ CommandResult_t ws_get_user_from_sql_by_user_id(int user_id, user_data_t *puser)
         errormsg("No user found for session key %s", user_id);
         return CR_ERROR;
     }
-    char *row = q.rows[0];
-
-    ws_parse_sql_user(row, puser);
+    ws_user_from_sql_row(&row, puser);
+    db_result_free(q.result);
     logmsg("User %s logged in with session key %s. User id %d, lat %f, lon %f, alt %f",
            puser->nick, puser->session_key,
            puser->id,
@@ -381,51 +743,67 @@ CommandResult_t ws_get_user_from_sql_by_user_id(int user_id, user_data_t *puser)
     return CR_PROCESSED;
 }
 
-size_t wsapp_session_count(){
-    return g_wsapp.session_count;
-}
-AppContext_t *wsapp_session_get(size_t index){
-    return &g_wsapp.sessions[index];
-}
-AppContext_t *wsapp_session_find(ws_session_t *s){
-    int sc= wsapp_session_count();
-    if (sc < 1) return NULL;
-    if (sc >= MAX_APPSESSION) return NULL;
-
-    for (int i=0; i < MAX_APPSESSION; i++){
-        AppContext_t *p = wsapp_session_get(i);
-        if (p->s == s){
-            return p;
-        }
-    }
-    return NULL;
+/** wsapp_session_free
+ * Last release of an app session: nobody queues to its ws session anymore.
+ */
+static void wsapp_session_free(void *item){
+    AppContext_t *a = (AppContext_t *)item;
+    ws_session_destroy(a->s);
 }
+/** wsapp_session_create
+ * Register the app session of a new ws session, it is visible to the other
+ * sessions fully initialized. The interest grid follows the registry's size.
+ */
 AppContext_t *wsapp_session_create(ws_session_t *s){
-    //todo: lock
-    int sc= wsapp_session_count();
-    if (sc < MAX_APPSESSION){
-        AppContext_t *p = &g_wsapp.sessions[sc];
-        g_wsapp.session_count++;
-        p->s = s;
-        return  p;
-    }else{
-        for (int i=0; i<MAX_APPSESSION; i++){
-            AppContext_t *x= &g_wsapp.sessions[i];
-            if ((x->ctx->socket_fd < 0) || (x->alive == 0)) // todo: where is the connection status?
-            { 
-                //reusable...
-                x->s = s;
-                return x;
-            }
-        }
+    AppContext_t init;
+    memset(&init, 0, sizeof(init));
+    init.s = s;
+    init.ctx = ws_getClientContext(s);
+    init.alive = 1;
+    init.interest_km = g_ws_interest_km;
+    AppContext_t *p = wsreg_add(&g_wsreg, s, &init, sizeof(init));
+    if (!p) return NULL;
+    p->slot = wsreg_slot(p);
+    if (wsgrid_reserve(&g_wsgrid, p->slot + 1)) {
+        g_host->errormsg("WebSocket interest grid could not grow");
     }
-    return NULL;
+    return p;
 }
+/** wsapp_session_destroy
+ * Unregister the app session, its ws session is destroyed with the last
+ * reference, maybe by a broadcast still sending to it.
+ */
 void wsapp_session_destroy(ws_session_t *s) {
-    AppContext_t *a= wsapp_session_find(s);
-    if (a){
-        a->alive = 0;
+    AppContext_t *a= wsreg_find(&g_wsreg, s);
+    if (!a) return;
+    a->alive = 0;
+    wsgrid_remove(&g_wsgrid, wsapp_slot(a));
+    wsreg_set_user(&g_wsreg, s, WSREG_NO_USER);
+    if (a->user) {
+        // the user leaves the roster with the last session
+        AppContext_t *x = wsreg_find_user(&g_wsreg, a->user->id);
+        if (x) wsreg_release(x);
+        else wsapp_entity_removed(WSSYNC_USERS, a->user->id);
     }
+    wsreg_release(a);
+    wsreg_remove(&g_wsreg, s);
+}
+
+typedef struct {
+    user_data_t *sender;
+    ws_frame_t *frame;
+} wsapp_chat_visit_t;
+
+static int wsapp_chat_visit(void *item, void *arg) {
+    AppContext_t *a = (AppContext_t *)item;
+    wsapp_chat_visit_t *v = (wsapp_chat_visit_t *)arg;
+    if (a->alive){
+        ws_session_t * s= a->s;
+        if (s && a->user && a->user->id != v->sender->id) {
+            ws_send_shared_frame(s, v->frame);
+        }
+    }
+    return 0;
 }
 void broadcast_chat_message(user_data_t *sender, const char *msg) {
     json_object *chat_packet = json_object_new_object();
@@ -435,166 +813,299 @@ void broadcast_chat_message(user_data_t *sender, const char *msg) {
     json_object_object_add(chat_packet, "message", json_object_new_string(msg));
     json_object_object_add(chat_packet, "timestamp", json_object_new_int(time(NULL)));
 
-    const char *json_str = json_object_to_json_string(chat_packet);
+    // serialized and framed once, every recipient queues the same frame
+    ws_frame_t *frame = ws_frame_create_text(json_object_to_json_string(chat_packet));
+    json_object_put(chat_packet);
+    if (!frame) return;
 
-    for (size_t i = 0; i < wsapp_session_count(); ++i) {
-        AppContext_t *a = wsapp_session_get(i);
-        if (a->alive){
-            ws_session_t * s= a->s;
-            if (s && a->user && a->user->id != sender->id) {
-                // todo: some output queue would be better
-                ws_send_text_message(s, json_str);
-            }
-        }
-    }
+    // under the read lock of the registry, the other broadcasts run meanwhile
+    wsapp_chat_visit_t v = { sender, frame };
+    wsreg_foreach(&g_wsreg, wsapp_chat_visit, &v);
+    ws_frame_release(frame);
+}
 
-    json_object_put(chat_packet);
+/** JSON command handlers
+ * One function for each predefined message type, see g_wstype_handlers.
+ */
+static CommandResult_t wsapp_on_refresh(AppContext_t *actx, struct json_object *parsed)
+{
+    (void)parsed;
+    // will set the known last version to 0, so all update will be sent.
+    memset(&actx->synced, 0, sizeof(actx->synced));
+    wsapp_sync_session(actx);
+    return CR_PROCESSED;
 }
+static CommandResult_t wsapp_on_chat_message(AppContext_t *actx, struct json_object *parsed)
+{
+    struct json_object *msg_obj;
+    if (!json_object_object_get_ex(parsed, "message", &msg_obj)) {
+        wsapp_send_json_error(actx, "Missing chat message text");
+        return CR_ERROR;
+    }
 
-CommandResult_t ws_json_command(AppContext_t *actx, WsTypeId_t wst, struct json_object *parsed)
+    const char *msg = json_object_get_string(msg_obj);
+    if (!actx->user) {
+        wsapp_send_json_error(actx, "User not identified");
+        return CR_ERROR;
+    }
+
+    // Opció: ide kerülhet audit log is a DB-be
+    broadcast_chat_message(actx->user, msg);
+    return CR_PROCESSED;
+}
+static CommandResult_t wsapp_on_update_user_pos(AppContext_t *actx, struct json_object *parsed)
+{
+    struct json_object *lat_obj, *lon_obj, *alt_obj, *heading_obj;
+    if (!json_object_object_get_ex(parsed, "lat", &lat_obj) ||
+        !json_object_object_get_ex(parsed, "lon", &lon_obj)) {
+        wsapp_send_json_error(actx, "Missing position");
+        return CR_ERROR;
+    }
+    double alt = 0.0;
+    int has_alt = json_object_object_get_ex(parsed, "alt", &alt_obj);
+    if (has_alt) alt = json_object_get_double(alt_obj);
+    double heading = json_object_object_get_ex(parsed, "heading", &heading_obj) ?
+        json_object_get_double(heading_obj) : 0.0;
+    return wsapp_update_user_pos(actx, json_object_get_double(lat_obj), json_object_get_double(lon_obj),
+        has_alt ? &alt : NULL, heading);
+}
+static CommandResult_t wsapp_on_get_user_pos(AppContext_t *actx, struct json_object *parsed)
+{
+    struct json_object *user_id_obj;
+    if (!json_object_object_get_ex(parsed, "user_id", &user_id_obj)) {
+        wsapp_send_json_error(actx, "Missing user_id");
+        return CR_ERROR;
+    }
+    return wsapp_send_user_pos(actx, json_object_get_int(user_id_obj));
+}
+static CommandResult_t wsapp_on_users_pos(AppContext_t *actx, struct json_object *parsed)
+{
+    (void)parsed;
+    return wsapp_send_users_pos(actx);
+}
+static CommandResult_t wsapp_on_hello(AppContext_t *actx, struct json_object *parsed)
 {
-    if (!actx) return CR_ERROR;
     ClientContext *ctx = actx->ctx;
-    CommandResult_t result = CR_UNKNOWN;
-    switch (wst)
+    data_handle_t *dh = data_get_handle_by_name("geo");
+    if (dh == NULL)
     {
-    case WST_REFRESH:
-        // will set the known last version to 0, so all update will be sent.
-        break;
-    case WST_CHAT_MESSAGE:{
-            struct json_object *msg_obj;
-            if (!json_object_object_get_ex(parsed, "message", &msg_obj)) {
-                wsapp_send_json_error(actx, "Missing chat message text");
-                return CR_ERROR;
-            }
-        
-            const char *msg = json_object_get_string(msg_obj);
-            if (!actx->user) {
-                wsapp_send_json_error(actx, "User not identified");
-                return CR_ERROR;
-            }
-        
-            // Opció: ide kerülhet audit log is a DB-be
-            broadcast_chat_message(actx->user, msg);
-            return CR_PROCESSED;
-        }
-        break;
-    case WST_UPDATE_USER_POS:
-        // todo:session and user management needed.
-        break;
-    case WST_HELLO:
+        errormsg("No geo data handle found");
+        return CR_ERROR;
+    }
+    data_api_geo_t *geoapi = (data_api_geo_t *)dh->specific_api;
+    const char *session_key = ctx->request.session_id;
+    if (strlen(session_key) == 0)
     {
-        data_handle_t *dh = data_get_handle_by_name("geo");
-        if (dh == NULL)
+        debugmsg("There was no session in the header. Get from ws.");
+        struct json_object *session_id_obj;
+        if (json_object_object_get_ex(parsed, "session_id", &session_id_obj))
         {
-            errormsg("No geo data handle found");
-            return CR_ERROR;
+            session_key = json_object_get_string(session_id_obj);
         }
-        data_api_geo_t *geoapi = (data_api_geo_t *)dh->specific_api;
-        const char *session_key = ctx->request.session_id;
-        if (strlen(session_key) == 0)
-        {
-            debugmsg("There was no session in the header. Get from ws.");
-            struct json_object *session_id_obj;
-            if (json_object_object_get_ex(parsed, "session_id", &session_id_obj))
-            {
-                session_key = json_object_get_string(session_id_obj);
-            }
-        }
-        if (!session_key)
+    }
+    if (!session_key)
+    {
+        errormsg("There was no session_key.");
+        return CR_ERROR;
+    }
+    if ((strlen(session_key) < 5) || (strlen(session_key) > 50))
+    {
+        errormsg("The session_key was wrong.");
+        return CR_ERROR;
+    }
+    int user_id = -1;
+    struct json_object *user_id_obj;
+    if (json_object_object_get_ex(parsed, "user_id", &user_id_obj))
+    {
+        int ws_user_id = json_object_get_int(user_id_obj);
+        if ((ws_user_id >= 0) && (ws_user_id <= 9999))
         {
-            errormsg("There was no session_key.");
-            return CR_ERROR;
+            user_id = ws_user_id; // plausible
         }
-        if ((strlen(session_key) < 5) || (strlen(session_key) > 50))
+        else
         {
-            errormsg("The session_key was wrong.");
+            errormsg("The user_id was wrong.");
             return CR_ERROR;
         }
-        int user_id = -1;
-        struct json_object *user_id_obj;
-        if (json_object_object_get_ex(parsed, "user_id", &user_id_obj))
-        {
-            int ws_user_id = json_object_get_int(user_id_obj);
-            if ((ws_user_id >= 0) && (ws_user_id <= 9999))
-            {
-                user_id = ws_user_id; // plausible
-            }
-            else
-            {
-                errormsg("The user_id was wrong.");
-                return CR_ERROR;
-            }
-        }
-        if (user_id < 0)
+    }
+    // position format: binary when the client knows our schema version
+    struct json_object *formats_obj;
+    actx->pos_binary = 0;
+    if (json_object_object_get_ex(parsed, "pos_formats", &formats_obj) &&
+        json_object_is_type(formats_obj, json_type_array))
+    {
+        size_t n = json_object_array_length(formats_obj);
+        for (size_t i = 0; i < n; i++)
         {
-            // todo: is it part of the helo protocol ?
-            errormsg("The user_id was wrong in the hello protocol.");
-            // return CR_ERROR; // if it is not part, the check otherwise
+            const char *f = json_object_get_string(json_object_array_get_idx(formats_obj, i));
+            if (f && strcmp(f, WSPOS_FORMAT_NAME) == 0) actx->pos_binary = 1;
         }
-        user_data_t *user = geoapi->find_user_by_session(dh, session_key);
-        if (user == NULL)
+    }
+    // area of interest, the client may ask for a smaller one
+    struct json_object *interest_obj;
+    actx->interest_km = g_ws_interest_km;
+    if (json_object_object_get_ex(parsed, "interest_km", &interest_obj))
+    {
+        double km = json_object_get_double(interest_obj);
+        if (km > 0.0 && km < g_ws_interest_km) actx->interest_km = km;
+    }
+    if (user_id < 0)
+    {
+        // todo: is it part of the helo protocol ?
+        errormsg("The user_id was wrong in the hello protocol.");
+        // return CR_ERROR; // if it is not part, the check otherwise
+    }
+    user_data_t *user = geoapi->find_user_by_session(dh, session_key);
+    if (user == NULL)
+    {
+        user_data_t nuser;
+        strncpy(nuser.session_key, session_key, sizeof(nuser.session_key));
+        // there was no session yet seen here, but user_id is needed.
+        if (user_id >= 0)
         {
-            user_data_t nuser;
-            strncpy(nuser.session_key, session_key, sizeof(nuser.session_key));
-            // there was no session yet seen here, but user_id is needed.
-            if (user_id >= 0)
+            user = geoapi->find_user_by_user_id(dh, user_id);
+            if (user)
             {
-                user = geoapi->find_user_by_user_id(dh, user_id);
-                if (user)
-                {
-                    // the user was already here, but different session key (?)
-                    geoapi->set_user(dh, user);
-                }
-                else
-                {
-                    ws_get_user_from_sql_by_user_id(user_id, &nuser);
-                    geoapi->add_user(dh, &nuser);
-                }
+                // the user was already here, but different session key (?)
+                geoapi->set_user(dh, user);
             }
             else
             {
-                ws_get_user_from_sql_by_session_key(session_key, &nuser);
+                ws_get_user_from_sql_by_user_id(user_id, &nuser);
                 geoapi->add_user(dh, &nuser);
             }
         }
-        if (user)
-        {
-            user_id = user->id;
-            ws_send_json_user_data(actx, user);
-            // this user pointer's lifetime depends on data_geo implementation,
-            // actually it is longer than the session. Later id shall be stored.
-            actx->user = user; 
-            result = CR_PROCESSED;
-        }
         else
         {
-            errormsg("There was no user for the session_key.");
-            return CR_ERROR;
+            ws_get_user_from_sql_by_session_key(session_key, &nuser);
+            geoapi->add_user(dh, &nuser);
         }
     }
-    break;
-    case WST_DISCONNECT:
-        g_host->debugmsg("Client requested quit");
-        result = CR_QUIT;
-        break;
-    case WST_PING:
+    if (user)
     {
-        g_host->debugmsg("Application-level ping received, sending pong");
-        ws_send_json_pong(actx);
-        result = CR_PROCESSED;
+        user_id = user->id;
+        ws_send_json_user_data(actx, user);
+        // this user pointer's lifetime depends on data_geo implementation,
+        // actually it is longer than the session. Later id shall be stored.
+        actx->user = user; 
+        wsreg_set_user(&g_wsreg, actx->s, user->id);
+        wsgrid_update(&g_wsgrid, wsapp_slot(actx), user->lat, user->lon);
+        wsapp_entity_changed(WSSYNC_USERS, user->id);
+        return CR_PROCESSED;
     }
-    break;
-    case WST_PONG:
-        g_host->debugmsg("Application-level pong received");
-        result = CR_PROCESSED;
-        break;
+    else
+    {
+        errormsg("There was no user for the session_key.");
+        return CR_ERROR;
+    }
+}
+static CommandResult_t wsapp_on_disconnect(AppContext_t *actx, struct json_object *parsed)
+{
+    (void)actx;
+    (void)parsed;
+    g_host->debugmsg("Client requested quit");
+    return CR_QUIT;
+}
+static CommandResult_t wsapp_on_ping(AppContext_t *actx, struct json_object *parsed)
+{
+    (void)parsed;
+    g_host->debugmsg("Application-level ping received, sending pong");
+    ws_send_json_pong(actx);
+    return CR_PROCESSED;
+}
+static CommandResult_t wsapp_on_pong(AppContext_t *actx, struct json_object *parsed)
+{
+    (void)actx;
+    (void)parsed;
+    g_host->debugmsg("Application-level pong received");
+    return CR_PROCESSED;
+}
 
-    case WST_NOP:
-    default:
-        break;
+// Handlers of the predefined commands, NULL: not implemented (CR_UNKNOWN).
+static const wsapp_json_handler_fn g_wstype_handlers[WST_MAX_ID] = {
+    [WST_REFRESH] = wsapp_on_refresh,
+    [WST_HELLO] = wsapp_on_hello,
+    [WST_CHAT_MESSAGE] = wsapp_on_chat_message,
+    [WST_UPDATE_USER_POS] = wsapp_on_update_user_pos,
+    [WST_GET_USER_POS] = wsapp_on_get_user_pos,
+    [WST_USERS_POS] = wsapp_on_users_pos,
+    [WST_DISCONNECT] = wsapp_on_disconnect,
+    [WST_PING] = wsapp_on_ping,
+    [WST_PONG] = wsapp_on_pong
+};
+
+/** Type name hash
+ * Open addressing over g_wstype_names, built once. The slots hold the
+ * WsTypeId_t + 1, 0 is empty. The names are case insensitive.
+ */
+#define WSTYPE_HASH_SIZE (64) // power of two, at least twice WST_MAX_ID
+static unsigned char g_wstype_hash[WSTYPE_HASH_SIZE];
+static pthread_once_t g_wstype_hash_once = PTHREAD_ONCE_INIT;
+
+static unsigned int wsapp_type_hash(const char *type)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    for (; *type; type++) {
+        h ^= (unsigned char)tolower((unsigned char)*type);
+        h *= 16777619u;
+    }
+    return h;
+}
+static void wsapp_type_hash_init(void)
+{
+    for (int i = 0; i < WST_MAX_ID; i++) {
+        unsigned int k = wsapp_type_hash(g_wstype_names[i]) & (WSTYPE_HASH_SIZE - 1);
+        while (g_wstype_hash[k]) k = (k + 1) & (WSTYPE_HASH_SIZE - 1);
+        g_wstype_hash[k] = (unsigned char)(i + 1);
+    }
+}
+
+/** wsapp_type_lookup
+ * Message type name to id, WST_MAX_ID if it is not a predefined one.
+ */
+WsTypeId_t wsapp_type_lookup(const char *type)
+{
+    pthread_once(&g_wstype_hash_once, wsapp_type_hash_init);
+    unsigned int k = wsapp_type_hash(type) & (WSTYPE_HASH_SIZE - 1);
+    for (; g_wstype_hash[k]; k = (k + 1) & (WSTYPE_HASH_SIZE - 1)) {
+        int i = g_wstype_hash[k] - 1;
+        if (strcasecmp(type, g_wstype_names[i]) == 0) return (WsTypeId_t)i;
+    }
+    return WST_MAX_ID;
+}
+
+CommandResult_t ws_json_command(AppContext_t *actx, WsTypeId_t wst, struct json_object *parsed)
+{
+    if (!actx || wst >= WST_MAX_ID) return CR_ERROR;
+    wsapp_json_handler_fn handler = g_wstype_handlers[wst];
+    return handler ? handler(actx, parsed) : CR_UNKNOWN;
+}
+
+static void wsapp_reply(void *reply_ctx, const char *txt)
+{
+    AppContext_t *actx = (AppContext_t *)reply_ctx;
+    ws_send_text_message(actx->s, txt);
+}
+
+/** wsapp_plugin_command
+ * A message type registered by another plugin through the host, the
+ * plugin is started for the time of the call.
+ */
+static CommandResult_t wsapp_plugin_command(AppContext_t *actx, const char *type, const char *txt, size_t len)
+{
+    if (!g_host->ws.message_search) return CR_UNKNOWN;
+    PluginContext *pc = g_host->ws.message_search(type);
+    if (!pc) return CR_UNKNOWN;
+    if (g_host->start(pc->id)) {
+        g_host->errormsg("Plugin %s is busy", pc->name);
+        return CR_ERROR;
+    }
+    CommandResult_t res = CR_UNKNOWN;
+    if (pc->ws.message_handler) {
+        res = pc->ws.message_handler(pc, actx->ctx, type, txt, len, wsapp_reply, actx) ? CR_ERROR : CR_PROCESSED;
     }
-    return result;
+    g_host->stop(pc->id);
+    return res;
 }
 
 /** plugin_ws_OnTextFrame
@@ -602,18 +1113,18 @@ CommandResult_t ws_json_command(AppContext_t *actx, WsTypeId_t wst, struct json_
  */
 CommandResult_t plugin_ws_OnTextFrame(struct ws_session_t *s, const char *txt, size_t len, void *user_data)
 {
-    (void)len;
-    (void)user_data;
     CommandResult_t res = CR_UNKNOWN;
-    // TODO: later, s shall contains the actx as well, but now lets find it!
-    AppContext_t *actx = wsapp_session_find(s);
+    // the app session is the user data of the ws session, or looked up
+    AppContext_t *actx = (AppContext_t*)user_data;
+    AppContext_t *found = NULL;
     if (!actx){
-        actx= (AppContext_t*)user_data;
+        actx = found = wsreg_find(&g_wsreg, s);
     }
     struct json_object *parsed = json_tokener_parse((const char *)txt);
     if (!parsed)
     {
         g_host->debugmsg("Invalid JSON received");
+        wsreg_release(found);
         res = CR_ERROR;
         return res;
     }
@@ -623,33 +1134,62 @@ CommandResult_t plugin_ws_OnTextFrame(struct ws_session_t *s, const char *txt, s
     {
         const char *type = json_object_get_string(type_obj);
         g_host->debugmsg("Received message type: %s", type);
-
-        // todo: replace this with hashmap implementation.
-        for (int i = 0; i < WST_MAX_ID; i++)
-        {
-            WsTypeId_t wst = (WsTypeId_t)i;
-            const char *name = g_wstype_names[i];
-            if (strcasecmp(type, name) == 0)
-            {
-
-                res = ws_json_command(actx, wst, parsed);
-                if (res != CR_UNKNOWN)
-                {
-                    break;
-                }
-            }
+        WsTypeId_t wst = wsapp_type_lookup(type);
+        if (wst < WST_MAX_ID) {
+            res = ws_json_command(actx, wst, parsed);
+        } else if (actx) {
+            res = wsapp_plugin_command(actx, type, txt, len);
         }
     }
     json_object_put(parsed); // cleanup
+    wsreg_release(found);
     return res;              // or maybe handled, bot nothing more to knonw here...
 }
+/** plugin_ws_OnBinaryFrame
+ * Process the received binary packets, the position protocol of wspos.h
+ */
 CommandResult_t plugin_ws_OnBinaryFrame(ClientContext *ctx, const unsigned char *buf, size_t len, void *user_data)
 {
     (void)ctx;
-    (void)buf;
-    (void)len;
-    (void)user_data;
-    return CR_PROCESSED;
+    AppContext_t *actx = (AppContext_t *)user_data;
+    wspos_kind_t kind;
+    size_t count = 0;
+    wspos_record_t r;
+    if (!actx || wspos_decode_header(buf, len, &kind, &count))
+    {
+        g_host->debugmsg("Invalid binary message received");
+        return CR_ERROR;
+    }
+    switch (kind)
+    {
+    case WSPOS_KIND_UPDATE_USER_POS:
+        if (count != 1) return CR_ERROR;
+        wspos_decode_record(buf, 0, &r);
+        return wsapp_update_user_pos(actx, r.lat, r.lon, NULL, r.heading);
+    case WSPOS_KIND_GET_USER_POS:
+        if (count != 1) return CR_ERROR;
+        wspos_decode_record(buf, 0, &r);
+        return wsapp_send_user_pos(actx, (int)r.user_id);
+    case WSPOS_KIND_USERS_POS:
+        return wsapp_send_users_pos(actx);
+    }
+    return CR_UNKNOWN;
+}
+
+/** plugin_ws_OnIdle
+ * Periodic delta sync of the session, after the hello.
+ */
+void plugin_ws_OnIdle(struct ws_session_t *s, void *user_data)
+{
+    (void)s;
+    AppContext_t *actx = (AppContext_t *)user_data;
+    if (!actx || !actx->user) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    if (now - actx->last_sync_ms < g_ws_sync_interval_ms) return;
+    actx->last_sync_ms = now;
+    wsapp_sync_session(actx);
 }
 
 void ws_ws_handler(PluginContext *pc, ClientContext *ctx, WsRequestParams *wsparams)
@@ -657,44 +1197,21 @@ void ws_ws_handler(PluginContext *pc, ClientContext *ctx, WsRequestParams *wspar
     (void)pc;
     (void)wsparams; // collects all inputs
 
-    const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    const char *key = NULL;
-    for (int i = 0; i < ctx->request.header_count; i++)
-    {
-        if (strcasecmp(ctx->request.headers[i].key, "Sec-WebSocket-Key") == 0)
-        {
-            key = ctx->request.headers[i].value;
-            break;
-        }
+    /* step1, validate the upgrade request, negotiate the subprotocol and
+     * the compression, then answer the handshake.
+     */
+    ws_upgrade_t up;
+    int status = ws_parse_upgrade(&ctx->request, g_ws_protocols, &g_ws_deflate, &up);
+    char resp[BUF_SIZE];
+    int o = ws_upgrade_response(&up, status, resp, sizeof(resp));
+    if (o > 0) {
+        dprintf(ctx->socket_fd, "%.*s", o, resp);
     }
-    if (!key)
-    {
-        g_host->debugmsg("Sec-WebSocket-Key not found");
-        g_host->http.send_response(ctx->socket_fd, 400, "text/plain", "Missing Sec-WebSocket-Key");
+    if (status != 101 || o <= 0) {
+        g_host->debugmsg("WebSocket upgrade refused: %d", status);
         return;
     }
 
-    g_host->debugmsg("Sec-WebSocket-Key: %s", key);
-    /* step1, process http headers and get "Sec-WebSocket-Key" keyed value.
-     *  so, we need to add http proto headers to the WS as well, I guess..
-     */
-    // Optionally test RFC 6455 key generation:
-    char keyaccept[128] = {0};
-    int keyacceptlen = sizeof(keyaccept);
-    ws_gen_acception_key(guid, key, keyaccept, keyacceptlen);
-    char resp[BUF_SIZE];
-    int rml = sizeof(resp);
-    int o = 0;
-    const char *fmt =
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %s\r\n\r\n";
-    o += snprintf(resp + o, rml - o, fmt, keyaccept);
-
-    // send response header
-    dprintf(ctx->socket_fd, "%s", resp);
-    
     /** step2, change from HTTP to WS protocol.
      * 
      */
@@ -703,14 +1220,29 @@ void ws_ws_handler(PluginContext *pc, ClientContext *ctx, WsRequestParams *wspar
     // the Application layer's callback to WS layer
     static const WsProcessorApi_t g_WsCallbacks = {
         .onWsBinaryFrame = plugin_ws_OnBinaryFrame,
-        .onWsTextFrame = plugin_ws_OnTextFrame};
+        .onWsTextFrame = plugin_ws_OnTextFrame,
+        .onWsIdle = plugin_ws_OnIdle};
 
     ws_session_t *s= ws_session_create(ctx, &g_WsCallbacks, NULL );
+    if (!s) {
+        g_host->errormsg("WebSocket session allocation failed");
+        return;
+    }
+    if (ws_session_set_deflate(s, &up, &g_ws_deflate)) {
+        g_host->errormsg("WebSocket compression setup failed");
+        ws_session_destroy(s);
+        return;
+    }
     AppContext_t *actx= wsapp_session_create(s);
+    if (!actx) {
+        g_host->errormsg("WebSocket application session allocation failed");
+        ws_session_destroy(s);
+        return;
+    }
     ws_set_user_data(s, (void*)actx);
     ws_handle_ws_loop(s);
+    // ws session is destroyed with the last reference, see wsapp_session_free
     wsapp_session_destroy(s);
-    ws_session_destroy(s);
 }
 
 int plugin_register(PluginContext *pc, const PluginHostInterface *host)
@@ -736,15 +1268,27 @@ int plugin_thread_finish(PluginContext *ctx)
     // this will be run for each connection, when finished.
     return 0;
 }
+/** ws_control_stat
+ * Session count and the evictions of the liveness checks.
+ */
+static void ws_control_stat(ClientContext *ctx){
+    dprintf(ctx->socket_fd,
+        "WS sessions: %zu, evicted: %lu pong timeout, %lu idle\n",
+        wsreg_count(&g_wsreg),
+        ws_evictions(WS_EVICT_PONG_TIMEOUT),
+        ws_evictions(WS_EVICT_IDLE));
+}
 static int plugin_ws_execute_command(PluginContext *pc, ClientContext *ctx, CommandEntry *pe, char* cmd){
     (void)pc;
-    (void)ctx;
     (void)cmd;
     int ret=-1;
     if (pe){
         switch (pe->handlerid){
             case CMD_WS_SOMETHING: ret = 0; break;
-            case CMD_WS_STAT: ret=0; break;
+            case CMD_WS_STAT:
+                if (ctx) ws_control_stat(ctx);
+                ret=0;
+                break;
         }
     }
     return ret;
@@ -758,6 +1302,42 @@ int plugin_init(PluginContext *pc, const PluginHostInterface *host)
 
     pc->http.request_handler = ws_http_handler;
     pc->ws.request_handler = ws_ws_handler;
+    // outbound queue of the sessions, policy 0: drop oldest, 1: coalesce, 2: disconnect
+    ws_set_queue_config(
+        g_host->config_get_int("WS", "out_queue_frames", 0),
+        g_host->config_get_int("WS", "out_queue_bytes", 0),
+        (ws_queue_policy_t)g_host->config_get_int("WS", "out_queue_policy", WS_QUEUE_DROP_OLDEST));
+    // protocol level ping, the sessions without pong or data are evicted, 0 disables
+    ws_set_liveness_config(
+        g_host->config_get_int("WS", "ping_interval_sec", 10),
+        g_host->config_get_int("WS", "pong_timeout_sec", 30),
+        g_host->config_get_int("WS", "idle_timeout_sec", 0));
+    // permessage-deflate, messages shorter than the threshold are not compressed
+    g_ws_deflate.enabled = g_host->config_get_int("WS", "deflate", 1);
+    g_ws_deflate.level = g_host->config_get_int("WS", "deflate_level", 6);
+    g_ws_deflate.window_bits = g_host->config_get_int("WS", "deflate_window_bits", 15);
+    g_ws_deflate.context_takeover = g_host->config_get_int("WS", "deflate_context_takeover", 1);
+    g_ws_deflate.threshold = (size_t)g_host->config_get_int("WS", "deflate_threshold", 256);
+    // area of interest of the position messages
+    int interest_km = g_host->config_get_int("WS", "interest_radius_km", 500);
+    int cell_deg = g_host->config_get_int("WS", "interest_cell_deg", 2);
+    g_ws_interest_km = interest_km > 0 ? interest_km : 500;
+    if (wsreg_init(&g_wsreg, MAX_APPSESSION, wsapp_session_free)) {
+        g_host->errormsg("WebSocket session registry allocation failed");
+        return PLUGIN_ERROR;
+    }
+    if (wsgrid_init(&g_wsgrid, cell_deg > 0 ? cell_deg : 2, MAX_APPSESSION)) {
+        g_host->errormsg("WebSocket interest grid allocation failed");
+        wsreg_destroy(&g_wsreg);
+        return PLUGIN_ERROR;
+    }
+    // delta sync of the entities, the period of the sessions' updates
+    int sync_ms = g_host->config_get_int("WS", "sync_interval_ms", 1000);
+    g_ws_sync_interval_ms = sync_ms > 0 ? sync_ms : 1000;
+    int tombstones = g_host->config_get_int("WS", "sync_tombstones", WSSYNC_TOMBSTONE_MAX);
+    for (int k = 0; k < WSSYNC_KIND_MAX; k++) {
+        wssync_init(&g_wssync[k], tombstones > 0 ? (size_t)tombstones : WSSYNC_TOMBSTONE_MAX);
+    }
     g_sleep_is_needed = 0;
     g_keep_running = 1;
     g_is_running = 0; // incremented by the handler, if needed.
@@ -769,6 +1349,12 @@ void plugin_finish(PluginContext *pc)
     (void)pc;
     // Will runs once, when plugin unloaded.
     pc->http.request_handler = NULL;
+    wsreg_destroy(&g_wsreg);
+    ws_frame_pool_clear();
+    wsgrid_destroy(&g_wsgrid);
+    for (int k = 0; k < WSSYNC_KIND_MAX; k++) {
+        wssync_destroy(&g_wssync[k]);
+    }
 }
 // Plugin event handler implementation
 int plugin_event(PluginContext *pc, PluginEventType event, const PluginEventContext *ctx)
@@ -34,17 +34,20 @@
  * buffer length max value to a practical value. These all could help
  * against Deny of Service type attacks.
  * The socket shall be non_blocking. In case of more bytes needed
- * according to the protocol and actual frame, then usleep executed on
- * this task. In case of the frame fragmented by MTU, handled.
+ * according to the protocol and actual frame, the session thread waits
+ * in epoll for the socket (or its wake eventfd), there is no polling.
+ * Outgoing frames are queued per session, any thread can enqueue, and
+ * the session thread flushes them when the socket is writable. The queue
+ * is bounded, a slow client is handled by the configured overflow policy,
+ * so it never blocks the sender. In case of the frame fragmented by MTU, handled.
  * In case of router/switch device MTU allows multiple telegram to be
  * merged (more frame arrives in one read), handled.
  * Handshake (secret negotiation is implemented)
  * 
  * TODO: (implementation is ongoing) Known limitations:
- * - The continous transmission OP:0 & FIN is partially implemented, 
- * it is ready only at header decoder side, and not yet tested.
- * But this one is rearly used. Typically applicable for binary
- * streaming use-case only.
+ * - The continous transmission OP:0 & FIN is implemented, fragments
+ * are collected and delivered as one message, control frames can
+ * come between them (RFC 6455, 5.4).
  * 
  * - There is a plan to add more statistics, there are only textual
  * debug logs at this point. Update: some statistics implemented...
@@ -64,17 +67,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
  
 #include <openssl/sha.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
+#include <zlib.h>
 
 // #include <json-c/json.h> 
 
@@ -101,22 +115,44 @@
 /**
  * Timing related control
  */
-// In case of more bytes needed, but read does not provided any, wait in usleep.
-#define WS_READ_SLEEP_TIME_US (10*1000) // 10ms
-#define WS_WRITE_SLEEP_TIME_US (1*1000)  // 1ms
+// Longest wait for socket events, the shutdown request is checked this often.
+#define WS_EVENT_MAX_WAIT_MS (1000)
 #define WS_FRAME_SHRINK_TIMEOUT_SEC (60)    // one minute
 #define WS_LL_SEND_PING_SEC (10) // 10 sec
+#define WS_PONG_TIMEOUT_SEC (30) // a ping unanswered this long closes the session
+#define WS_IDLE_TIMEOUT_SEC (0)  // no data frame this long closes the session, 0: never
 #define WS_AGGREGATION_TIME_SEC (5) // calculate statistics in 5sec, can be 60sec later...
 
 /**
- * OPCODE related constants
- */
-#define WS_OP_CONTINUATION_FRAME    (0)
-#define WS_OP_TEXT_FRAME            (1)
-#define WS_OP_BINARY_FRAME          (2)
-#define WS_OP_CONNECTION_CLOSE      (3)
-#define WS_OP_PING                  (9)
-#define WS_OP_PONG                  (10)
+ * Outbound queue defaults, see ws_set_queue_config()
+ */
+#define WS_OUTQ_MAX_FRAMES      (64)
+#define WS_OUTQ_MAX_BYTES       (1024 * 1024)
+// Control frames (ping, pong, close) are not limited by max frames, they have some room above.
+#define WS_OUTQ_CONTROL_RESERVE (8)
+
+/**
+ * Outbound frame pool: frames up to this payload size are recycled, not freed.
+ */
+#define WS_FRAME_POOL_PAYLOAD   (4096 - WS_FRAME_HEADROOM)
+#define WS_FRAME_POOL_MAX       (256)
+// Frames written by one writev call
+#define WS_FLUSH_IOV_MAX        (16)
+// Control frame payload limit (RFC 6455, 5.5)
+#define WS_CONTROL_PAYLOAD_MAX  (125)
+
+// RFC 6455 handshake
+#define WS_GUID                 "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_VERSION              (13)
+// RFC 7692: the sync flush tail which is stripped from every compressed message
+static const unsigned char g_ws_deflate_tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+// raw deflate of zlib can not do a 256 byte window
+#define WS_DEFLATE_MIN_WINDOW_BITS (9)
+#define WS_DEFLATE_MAX_WINDOW_BITS (15)
+
+/**
+ * OPCODE related constants, the known ones are in ws.h
+ */
 #define WS_RESERVED_OPCODE_MASK ((1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7) | (1 << 11) | (1 << 12) | (1 << 13) | (1 << 14) | (1 << 15))
 
 // globals
@@ -140,9 +176,56 @@ static const char * g_wsm_labels[WSM_MAX_ID]={
     [WSM_ERROR_ABSOLUTE_MAX_REACHED] = "EAM",
     [WSM_ERROR_MEMORY_ALLOCATION] = "EMA",
     [WSM_ERROR_RESERVED] = "ERs",
-    [WSM_ERROR_PROTOCOL_ABORT] = "EPA"
+    [WSM_ERROR_PROTOCOL_ABORT] = "EPA",
+    [WSM_QUEUE_DROP] = "QDr",
+    [WSM_QUEUE_COALESCE] = "QCo",
+    [WSM_ERROR_QUEUE_OVERFLOW] = "EQO",
+    [WSM_RTT_MS] = "RTT"
 };
 
+// upper bounds of the RTT histogram buckets, the last one is unbounded
+static const unsigned int g_ws_rtt_bounds_ms[WS_RTT_BUCKETS - 1] = { 10, 25, 50, 100, 250, 500, 1000 };
+
+static size_t g_ws_outq_max_frames = WS_OUTQ_MAX_FRAMES;
+static size_t g_ws_outq_max_bytes = WS_OUTQ_MAX_BYTES;
+static ws_queue_policy_t g_ws_outq_policy = WS_QUEUE_DROP_OLDEST;
+static int g_ws_ping_interval = WS_LL_SEND_PING_SEC;
+static int g_ws_pong_timeout = WS_PONG_TIMEOUT_SEC;
+static int g_ws_idle_timeout = WS_IDLE_TIMEOUT_SEC;
+static unsigned long g_ws_evictions[WS_EVICT_MAX];
+
+/** ws_set_queue_config
+ * Outbound queue limits of the sessions created later. Zero keeps the default.
+ */
+void ws_set_queue_config(size_t max_frames, size_t max_bytes, ws_queue_policy_t policy){
+    g_ws_outq_max_frames = max_frames ? max_frames : WS_OUTQ_MAX_FRAMES;
+    g_ws_outq_max_bytes = max_bytes ? max_bytes : WS_OUTQ_MAX_BYTES;
+    g_ws_outq_policy = (policy < WS_QUEUE_POLICY_MAX) ? policy : WS_QUEUE_DROP_OLDEST;
+}
+
+/** ws_set_liveness_config
+ * Ping period and eviction thresholds of the sessions created later.
+ */
+void ws_set_liveness_config(int ping_interval_sec, int pong_timeout_sec, int idle_timeout_sec){
+    g_ws_ping_interval = ping_interval_sec > 0 ? ping_interval_sec : WS_LL_SEND_PING_SEC;
+    g_ws_pong_timeout = pong_timeout_sec > 0 ? pong_timeout_sec : 0;
+    g_ws_idle_timeout = idle_timeout_sec > 0 ? idle_timeout_sec : 0;
+}
+
+unsigned long ws_evictions(ws_evict_reason_t reason){
+    if (reason >= WS_EVICT_MAX) return 0;
+    return __atomic_load_n(&g_ws_evictions[reason], __ATOMIC_RELAXED);
+}
+
+/** ws_now_ms
+ * Monotonic milliseconds, the ping payload and the RTT.
+ */
+static long long ws_now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /** ws_measure_clear
  * Clear counters
  */
@@ -193,28 +276,49 @@ void ws_measure(ws_session_t *s, ws_measurement_id id){
     ws_measure_add(s, id, 1);
 }
 
+/** ws_measure_rtt
+ * Record a round trip time: the RTT measurement holds the last value, its
+ * min/max/avg are aggregated as the counters, and the histogram counts it.
+ */
+void ws_measure_rtt(ws_session_t *s, unsigned int rtt_ms){
+    ws_onemeasurement *p= &s->measure.actual[WSM_RTT_MS];
+    ws_measure_add(s, WSM_RTT_MS, (int)(rtt_ms > 0xFFFEu ? 0xFFFEu : rtt_ms) - p->counter);
+    s->rtt_ms = rtt_ms;
+    int b = 0;
+    while (b < WS_RTT_BUCKETS - 1 && rtt_ms >= g_ws_rtt_bounds_ms[b]) b++;
+    s->rtt_hist[b]++;
+}
+
 /** ws_measure_dump_str
  * Dump the textual output of a session's statistics
  */
 int ws_measure_dump_str(ws_session_t *s, char *buf, size_t len){
-    if (!s) return 0;
-    int o=0;
-    o+=snprintf(buf, len - o, "WS session ");
+    if (!s || !len) return 0;
+    size_t o=0;
+    o+=snprintf(buf, len, "WS session ");
     ClientContext *ctx= s->ctx;
-    if (ctx){
+    if (ctx && o < len){
         if (ctx->client_ip[0] != 0) {
-            o+=snprintf(buf, len - o, "ip:%s ", ctx->client_ip);
+            o+=snprintf(buf + o, len - o, "ip:%s ", ctx->client_ip);
         }
     }
-    for (int i=0; i<WSM_MAX_ID; i++){
+    for (int i=0; i<WSM_MAX_ID && o < len; i++){
         ws_onemeasurement *p = &s->measure.actual[i];
-        o+=snprintf(buf, len - o, "%s: %d", g_wsm_labels[i], s->measure.avg[i]);
-        if (p->max > p->min){
-            o+=snprintf(buf, len - o, "(%d - %d) ", s->measure.actual[i].min, s->measure.actual[i].max);
+        o+=snprintf(buf + o, len - o, "%s: %d", g_wsm_labels[i], s->measure.avg[i]);
+        if (p->max > p->min && o < len){
+            o+=snprintf(buf + o, len - o, "(%d - %d) ", s->measure.actual[i].min, s->measure.actual[i].max);
+        }
+    }
+    if (o < len) o+=snprintf(buf + o, len - o, " avg (min - max)\nRTT ms last:%u", s->rtt_ms);
+    for (int b=0; b<WS_RTT_BUCKETS && o < len; b++){
+        if (b < WS_RTT_BUCKETS - 1) {
+            o+=snprintf(buf + o, len - o, " <%u:%u", g_ws_rtt_bounds_ms[b], s->rtt_hist[b]);
+        } else {
+            o+=snprintf(buf + o, len - o, " >=%u:%u", g_ws_rtt_bounds_ms[b - 1], s->rtt_hist[b]);
         }
     }
-    o+=snprintf(buf, len - o, " avg (min - max)\n");
-    return o;
+    if (o < len) o+=snprintf(buf + o, len - o, "\n");
+    return (int)(o < len ? o : len - 1);
 }
 /** ws_gen_acception_key
  * acception_key protocol, part of the handshake phase.
@@ -248,68 +352,495 @@ int ws_gen_acception_key(const char* guid, const char* input_key, char* out_buf,
     return 0;
 }
 
+/** ws_header_get
+ * First value of a request header, NULL if missing.
+ */
+static const char *ws_header_get(const HttpRequest *req, const char *key) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (strcasecmp(req->headers[i].key, key) == 0) return req->headers[i].value;
+    }
+    return NULL;
+}
+
+/** ws_token_trim
+ * Strip the white space around a list element, in place.
+ */
+static char *ws_token_trim(char *t) {
+    while (*t == ' ' || *t == '\t') t++;
+    size_t n = strlen(t);
+    while (n && (t[n - 1] == ' ' || t[n - 1] == '\t')) t[--n] = 0;
+    return t;
+}
+
+/** ws_header_has_token
+ * Whether one of the comma separated values of the header(s) is the token.
+ */
+static int ws_header_has_token(const HttpRequest *req, const char *key, const char *token) {
+    char buf[MAX_HTTP_VALUE_LEN];
+    for (int i = 0; i < req->header_count; i++) {
+        if (strcasecmp(req->headers[i].key, key)) continue;
+        snprintf(buf, sizeof(buf), "%s", req->headers[i].value);
+        char *save = NULL;
+        for (char *t = strtok_r(buf, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+            if (strcasecmp(ws_token_trim(t), token) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+/** ws_key_valid
+ * Sec-WebSocket-Key is the base64 form of 16 bytes: 22 characters and "==".
+ * The last character holds only 2 bits, the rest of them must be zero.
+ */
+static int ws_key_valid(const char *key) {
+    if (!key || strlen(key) != 24 || strcmp(key + 22, "==")) return 0;
+    for (int i = 0; i < 22; i++) {
+        if (!isalnum((unsigned char)key[i]) && key[i] != '+' && key[i] != '/') return 0;
+    }
+    return strchr("AQgw", key[21]) != NULL;
+}
+
+/** ws_window_bits
+ * Parse a max_window_bits parameter value (may be quoted), -1 if invalid.
+ */
+static int ws_window_bits(const char *v) {
+    char buf[8];
+    size_t n = strlen(v);
+    if (n >= 2 && v[0] == '"' && v[n - 1] == '"') {
+        v++;
+        n -= 2;
+    }
+    if (n < 1 || n > 2) return -1;
+    memcpy(buf, v, n);
+    buf[n] = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!isdigit((unsigned char)buf[i])) return -1;
+    }
+    int bits = atoi(buf);
+    return (bits >= 8 && bits <= WS_DEFLATE_MAX_WINDOW_BITS) ? bits : -1;
+}
+
+/** ws_deflate_offer
+ * Check one permessage-deflate offer, and fill the accepted parameters.
+ * Returns 1 if the offer is accepted, 0 if declined (unknown, duplicated or
+ * invalid parameter, or a window what zlib can not do).
+ */
+static int ws_deflate_offer(char *offer, const ws_deflate_config_t *dc, ws_upgrade_t *up) {
+    char *save = NULL;
+    char *t = strtok_r(offer, ";", &save);
+    if (!t || strcasecmp(ws_token_trim(t), "permessage-deflate")) return 0;
+    int seen_snct = 0, seen_cnct = 0, seen_smwb = 0, seen_cmwb = 0;
+    int server_bits = WS_DEFLATE_MAX_WINDOW_BITS;
+    while ((t = strtok_r(NULL, ";", &save))) {
+        char *value = strchr(t, '=');
+        if (value) *value++ = 0;
+        char *name = ws_token_trim(t);
+        if (value) value = ws_token_trim(value);
+        if (strcasecmp(name, "server_no_context_takeover") == 0) {
+            if (seen_snct++ || value) return 0;
+        } else if (strcasecmp(name, "client_no_context_takeover") == 0) {
+            if (seen_cnct++ || value) return 0;
+        } else if (strcasecmp(name, "server_max_window_bits") == 0) {
+            if (seen_smwb++ || !value) return 0;
+            server_bits = ws_window_bits(value);
+            if (server_bits < WS_DEFLATE_MIN_WINDOW_BITS) return 0;
+        } else if (strcasecmp(name, "client_max_window_bits") == 0) {
+            // the client may limit its own window, we inflate with the largest one anyway
+            if (seen_cmwb++ || (value && ws_window_bits(value) < 0)) return 0;
+        } else {
+            return 0;
+        }
+    }
+    int bits = dc->window_bits;
+    if (bits < WS_DEFLATE_MIN_WINDOW_BITS || bits > WS_DEFLATE_MAX_WINDOW_BITS) bits = WS_DEFLATE_MAX_WINDOW_BITS;
+    if (server_bits < bits) bits = server_bits;
+    up->deflate = 1;
+    up->server_no_context_takeover = seen_snct || !dc->context_takeover;
+    up->client_no_context_takeover = seen_cnct || !dc->context_takeover;
+    up->server_max_window_bits = bits;
+    return 1;
+}
+
+/** ws_parse_upgrade
+ * Validates the opening handshake of RFC 6455 4.2.1, and negotiates the
+ * extensions and the subprotocol. Returns the HTTP status to answer with.
+ */
+int ws_parse_upgrade(const HttpRequest *req, const char *const *protocols, const ws_deflate_config_t *dc, ws_upgrade_t *up) {
+    if (!req || !up) return 400;
+    memset(up, 0, sizeof(*up));
+    if (strcmp(req->method, "GET")) {
+        g_host->debugmsg("WebSocket upgrade with method %s", req->method);
+        return 400;
+    }
+    const char *host = ws_header_get(req, "Host");
+    if (!host || !*host ||
+        !ws_header_has_token(req, "Upgrade", "websocket") ||
+        !ws_header_has_token(req, "Connection", "Upgrade")) {
+        g_host->debugmsg("WebSocket upgrade headers missing");
+        return 400;
+    }
+    const char *version = ws_header_get(req, "Sec-WebSocket-Version");
+    if (!version || atoi(version) != WS_VERSION) {
+        g_host->debugmsg("WebSocket version not supported: %s", version ? version : "(none)");
+        return 426;
+    }
+    const char *key = ws_header_get(req, "Sec-WebSocket-Key");
+    if (!ws_key_valid(key)) {
+        g_host->debugmsg("Sec-WebSocket-Key invalid");
+        return 400;
+    }
+    ws_gen_acception_key(WS_GUID, key, up->accept_key, sizeof(up->accept_key));
+
+    // subprotocol: the first one from the client's list which we know
+    char buf[MAX_HTTP_VALUE_LEN];
+    for (int i = 0; protocols && !up->protocol[0] && i < req->header_count; i++) {
+        if (strcasecmp(req->headers[i].key, "Sec-WebSocket-Protocol")) continue;
+        snprintf(buf, sizeof(buf), "%s", req->headers[i].value);
+        char *save = NULL;
+        for (char *t = strtok_r(buf, ",", &save); t && !up->protocol[0]; t = strtok_r(NULL, ",", &save)) {
+            t = ws_token_trim(t);
+            for (int p = 0; protocols[p]; p++) {
+                if (strcmp(t, protocols[p]) == 0) {
+                    snprintf(up->protocol, sizeof(up->protocol), "%s", protocols[p]);
+                    break;
+                }
+            }
+        }
+    }
+    // extensions: the first acceptable permessage-deflate offer, others are declined
+    for (int i = 0; dc && dc->enabled && !up->deflate && i < req->header_count; i++) {
+        if (strcasecmp(req->headers[i].key, "Sec-WebSocket-Extensions")) continue;
+        snprintf(buf, sizeof(buf), "%s", req->headers[i].value);
+        char *offer = buf;
+        while (offer && !up->deflate) {
+            char *next = strchr(offer, ',');
+            if (next) *next++ = 0;
+            ws_deflate_offer(offer, dc, up);
+            offer = next;
+        }
+    }
+    return 101;
+}
+
+/** ws_upgrade_response
+ * Build the handshake response for the status of ws_parse_upgrade().
+ * Returns the length, or -1 if the buffer is too short.
+ */
+int ws_upgrade_response(const ws_upgrade_t *up, int status, char *buf, size_t len) {
+    int o;
+    if (status == 101 && up) {
+        o = snprintf(buf, len,
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: %s\r\n", up->accept_key);
+        if (o > 0 && up->protocol[0] && (size_t)o < len) {
+            o += snprintf(buf + o, len - o, "Sec-WebSocket-Protocol: %s\r\n", up->protocol);
+        }
+        if (o > 0 && up->deflate && (size_t)o < len) {
+            o += snprintf(buf + o, len - o, "Sec-WebSocket-Extensions: permessage-deflate%s%s",
+                up->server_no_context_takeover ? "; server_no_context_takeover" : "",
+                up->client_no_context_takeover ? "; client_no_context_takeover" : "");
+            if ((size_t)o < len && up->server_max_window_bits < WS_DEFLATE_MAX_WINDOW_BITS) {
+                o += snprintf(buf + o, len - o, "; server_max_window_bits=%d", up->server_max_window_bits);
+            }
+            if ((size_t)o < len) o += snprintf(buf + o, len - o, "\r\n");
+        }
+        if (o > 0 && (size_t)o < len) o += snprintf(buf + o, len - o, "\r\n");
+    } else if (status == 426) {
+        o = snprintf(buf, len,
+            "HTTP/1.1 426 Upgrade Required\r\n"
+            "Sec-WebSocket-Version: %d\r\n"
+            "Content-Length: 0\r\n\r\n", WS_VERSION);
+    } else {
+        o = snprintf(buf, len, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+    }
+    return (o < 0 || (size_t)o >= len) ? -1 : o;
+}
+
 /** */
 ClientContext* ws_getClientContext(ws_session_t *s)
 {
     return s->ctx;
 }
-/** ws_send_all
- * Send frame to the client in one block at the lowes layer.
- * This implementation is needed due to NON block sockets could reach
- * a full state, when write returns by Error status.
- * Different machanism also possible:
- * a) framing as multi frame
- * b) write queue
- */
-ssize_t ws_send_all(ws_session_t *s, const void *buf, size_t len) {
-    if (!s || !s->ctx || !buf || !len) return -1;
-    int fd = s->ctx->socket_fd;
-    size_t total_sent = 0;
-    const char *ptr = buf;
-    while (total_sent < len) {
-        ssize_t sent = write(fd, ptr + total_sent, len - total_sent);
-        if (sent < 0) {
+static pthread_mutex_t g_ws_frame_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static ws_frame_t *g_ws_frame_pool[WS_FRAME_POOL_MAX];
+static int g_ws_frame_pool_count = 0;
+
+/** ws_frame_reserve
+ * Get a frame with room for payload_capacity bytes, with one reference.
+ * Small frames come from the pool, so the usual traffic does not hit the allocator.
+ */
+ws_frame_t *ws_frame_reserve(size_t payload_capacity) {
+    ws_frame_t *f = NULL;
+    if (payload_capacity <= WS_FRAME_POOL_PAYLOAD) {
+        payload_capacity = WS_FRAME_POOL_PAYLOAD;
+        pthread_mutex_lock(&g_ws_frame_pool_lock);
+        if (g_ws_frame_pool_count > 0) {
+            f = g_ws_frame_pool[--g_ws_frame_pool_count];
+        }
+        pthread_mutex_unlock(&g_ws_frame_pool_lock);
+    }
+    if (!f) {
+        f = malloc(sizeof(ws_frame_t) + WS_FRAME_HEADROOM + payload_capacity);
+        if (!f) return NULL;
+        f->capacity = payload_capacity;
+    }
+    f->refcount = 1;
+    f->offset = WS_FRAME_HEADROOM;
+    f->len = 0;
+    f->key = 0;
+    f->opcode = 0;
+    f->flags = 0;
+    return f;
+}
+
+/** ws_frame_payload
+ * Where the payload shall be written, before ws_frame_commit().
+ */
+unsigned char *ws_frame_payload(ws_frame_t *f) {
+    return f ? f->data + WS_FRAME_HEADROOM : NULL;
+}
+
+/** ws_frame_set_key
+ * Coalesce key, see ws.h. Set by the producer before the frame is shared.
+ */
+void ws_frame_set_key(ws_frame_t *f, uint32_t key) {
+    if (f) f->key = key;
+}
+
+/** ws_frame_release
+ * Drop one reference, the last one recycles or frees the frame. Any thread.
+ */
+void ws_frame_release(ws_frame_t *f) {
+    if (!f || __sync_sub_and_fetch(&f->refcount, 1) != 0) return;
+    if (f->capacity == WS_FRAME_POOL_PAYLOAD) {
+        pthread_mutex_lock(&g_ws_frame_pool_lock);
+        if (g_ws_frame_pool_count < WS_FRAME_POOL_MAX) {
+            g_ws_frame_pool[g_ws_frame_pool_count++] = f;
+            f = NULL;
+        }
+        pthread_mutex_unlock(&g_ws_frame_pool_lock);
+    }
+    free(f);
+}
+
+/** ws_frame_pool_clear
+ * Free the recycled frames, at plugin unload.
+ */
+void ws_frame_pool_clear(void) {
+    pthread_mutex_lock(&g_ws_frame_pool_lock);
+    while (g_ws_frame_pool_count > 0) {
+        free(g_ws_frame_pool[--g_ws_frame_pool_count]);
+    }
+    pthread_mutex_unlock(&g_ws_frame_pool_lock);
+}
+
+/** ws_writev_nosignal
+ * Non blocking scatter-gather write to the peer. A closed peer must not raise
+ * SIGPIPE in the daemon, pipes (unit tests) fall back to plain writev.
+ */
+static ssize_t ws_writev_nosignal(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+    ssize_t n = sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno == ENOTSOCK) {
+        n = writev(fd, iov, iovcnt);
+    }
+    return n;
+}
+
+/** ws_wake
+ * Wake up the session thread, to flush the queue or to notice the overflow.
+ */
+static void ws_wake(ws_session_t *s) {
+    if (s->wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t n = write(s->wake_fd, &one, sizeof(one));
+        (void)n; // the counter is only a signal, EAGAIN means already signaled
+    }
+}
+
+/** ws_queue_remove
+ * Remove the n-th (from head) entry of the outbound queue. Lock is held by the caller.
+ */
+static void ws_queue_remove(ws_session_t *s, size_t n) {
+    size_t idx = (s->out_head + n) % s->out_capacity;
+    s->out_bytes -= s->outq[idx]->len;
+    ws_frame_release(s->outq[idx]);
+    if (n == 0) {
+        s->out_head = (s->out_head + 1) % s->out_capacity;
+        s->out_sent = 0;
+    } else {
+        for (size_t i = n; i + 1 < s->out_count; i++) {
+            size_t dst = (s->out_head + i) % s->out_capacity;
+            size_t src = (s->out_head + i + 1) % s->out_capacity;
+            s->outq[dst] = s->outq[src];
+        }
+    }
+    s->out_count--;
+}
+
+/** ws_queue_find_removable
+ * Search a data frame which can be dropped: not in flight, not a control frame.
+ * Oldest first, or newest first with the same coalesce key. Returns -1 if none.
+ */
+static long ws_queue_find_removable(ws_session_t *s, int newest, uint32_t key) {
+    for (size_t k = 0; k < s->out_count; k++) {
+        size_t n = newest ? s->out_count - 1 - k : k;
+        ws_frame_t *e = s->outq[(s->out_head + n) % s->out_capacity];
+        if (n == 0 && s->out_sent > 0) continue; // partially written, must be completed
+        if (e->opcode & 0x08) continue; // control frame
+        if (e->flags & WS_FRAME_KEEP) continue; // part of the compression context
+        if (newest && e->key != key) continue;
+        return (long)n;
+    }
+    return -1;
+}
+
+/** ws_queue_frame
+ * Append a complete frame to the outbound queue of the session, the queue
+ * takes over the caller's reference. Can be called from any thread, never blocks
+ * on the socket. When the queue is over the limit, the session's policy decides.
+ * Returns 0 on success, -1 if the frame was not queued.
+ */
+int ws_queue_frame(ws_session_t *s, ws_frame_t *f) {
+    if (!f) return -1;
+    if (!s || !s->outq) {
+        ws_frame_release(f);
+        return -1;
+    }
+    size_t len = f->len;
+    int control = (f->opcode & 0x08) != 0;
+    int ret = 0;
+    pthread_mutex_lock(&s->out_lock);
+    if (s->out_overflow || s->out_closed) {
+        ret = -1;
+    }
+    while (!ret && !control && s->out_count > 0 &&
+        (s->out_count >= s->out_max_frames || s->out_bytes + len > s->out_max_bytes)) {
+        long n = -1;
+        if (s->out_policy == WS_QUEUE_DISCONNECT) {
+            s->out_overflow = 1;
+            ws_measure(s, WSM_ERROR_QUEUE_OVERFLOW);
+            ret = -1;
+            break;
+        }
+        if (s->out_policy == WS_QUEUE_COALESCE && f->key) {
+            n = ws_queue_find_removable(s, 1, f->key);
+            if (n >= 0) ws_measure(s, WSM_QUEUE_COALESCE);
+        }
+        if (n < 0) {
+            n = ws_queue_find_removable(s, 0, 0);
+            if (n >= 0) ws_measure(s, WSM_QUEUE_DROP);
+        }
+        if (n < 0) break; // only the frame in flight is there, accept the new one
+        ws_queue_remove(s, (size_t)n);
+    }
+    if (!ret && s->out_count >= s->out_capacity) {
+        ws_measure(s, WSM_QUEUE_DROP);
+        ret = -1;
+    }
+    if (ret && !s->out_closed && (f->flags & WS_FRAME_KEEP)) {
+        // the peer's decompressor would miss this message from its context
+        s->out_overflow = 1;
+    }
+    if (!ret) {
+        s->outq[(s->out_head + s->out_count) % s->out_capacity] = f;
+        s->out_count++;
+        s->out_bytes += len;
+        f = NULL;
+    }
+    pthread_mutex_unlock(&s->out_lock);
+    if (f) ws_frame_release(f);
+    ws_wake(s);
+    return ret;
+}
+
+/** ws_flush_out
+ * Write the queued frames while the socket accepts them, several frames
+ * in one writev. Called by the session thread only. Returns 0 if the queue
+ * is empty, 1 if the socket is full (wait for writable), -1 on error.
+ */
+int ws_flush_out(ws_session_t *s) {
+    if (!s || !s->outq || !s->ctx) return -1;
+    int ret = 0;
+    pthread_mutex_lock(&s->out_lock);
+    while (s->out_count) {
+        struct iovec iov[WS_FLUSH_IOV_MAX];
+        int iovcnt = 0;
+        for (size_t k = 0; k < s->out_count && iovcnt < WS_FLUSH_IOV_MAX; k++) {
+            ws_frame_t *f = s->outq[(s->out_head + k) % s->out_capacity];
+            size_t skip = k ? 0 : s->out_sent;
+            iov[iovcnt].iov_base = f->data + f->offset + skip;
+            iov[iovcnt].iov_len = f->len - skip;
+            iovcnt++;
+        }
+        ssize_t n = ws_writev_nosignal(s->ctx->socket_fd, iov, iovcnt);
+        if (n < 0) {
             if (errno == EINTR) continue;
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(WS_WRITE_SLEEP_TIME_US);
                 ws_measure(s, WSM_SLEEP_TX);
-                continue;
+                ret = 1;
+            } else {
+                ret = -1;
             }
-            return -1; // error
+            break;
+        }
+        size_t left = (size_t)n;
+        while (left && s->out_count) {
+            ws_frame_t *f = s->outq[s->out_head];
+            size_t rem = f->len - s->out_sent;
+            if (left < rem) {
+                s->out_sent += left;
+                break;
+            }
+            left -= rem;
+            ws_measure(s, WSM_FRAME_TX);
+            ws_measure_add(s, WSM_BYTES_TX, f->len);
+            ws_queue_remove(s, 0);
         }
-        total_sent += sent;
     }
-    return total_sent;
+    pthread_mutex_unlock(&s->out_lock);
+    return ret;
 }
+
 /** ws_send_frame
  * Send frame to the client. Please use this function all-the-time, due to 
- * the statistics, and the lower layer integration.
+ * the statistics, and the lower layer integration. The frame is copied to
+ * the outbound queue, the actual write happens on the session thread.
  */
 int ws_send_frame(ws_session_t *s, char *buf, size_t len){
-    int ret = ws_send_all(s, buf, len);
-    ws_measure(s, WSM_FRAME_TX);
-    ws_measure_add(s, WSM_BYTES_TX, len);
-    return ret;
+    if (!s || !buf || !len) return -1;
+    ws_frame_t *f = ws_frame_reserve(len);
+    if (!f) return -1;
+    memcpy(ws_frame_payload(f), buf, len); // already framed, no header
+    f->len = len;
+    f->opcode = (unsigned char)buf[0] & 0x0F;
+    return ws_queue_frame(s, f);
 }
 
 /** ws_build_frame
- * Build a frame around the tx payload.
+ * Build a frame around the tx payload, without copy: the server side
+ * (unmasked, FIN) header is written in front of the payload, into the
+ * headroom reserved by the caller (WS_FRAME_HEADROOM is always enough).
+ * Returns -1 if the headroom is too short for this payload length.
  */
-int ws_build_frame(const unsigned char *payload, size_t payload_len, unsigned char opcode, char **out_buf, size_t *out_len) {
-    size_t header_len = 2;
-    size_t total_len = 0;
-    unsigned char header[10];
+int ws_build_frame(unsigned char *payload, size_t payload_len, unsigned char opcode, size_t headroom,
+        unsigned char **out_frame, size_t *out_len) {
+    size_t header_len = (payload_len <= 125) ? 2 : (payload_len <= 0xFFFF) ? 4 : 10;
+    if (headroom < header_len) return -1;
+    unsigned char *header = payload - header_len;
 
     header[0] = 0x80 | (opcode & 0x0F); // FIN=1, opcode
-
     if (payload_len <= 125) {
         header[1] = (unsigned char)payload_len;
-        header_len = 2;
     } else if (payload_len <= 0xFFFF) {
         header[1] = 126;
         header[2] = (payload_len >> 8) & 0xFF;
         header[3] = payload_len & 0xFF;
-        header_len = 4;
     } else {
         header[1] = 127;
         memset(&header[2], 0, 4); // high 32 bit zero
@@ -317,37 +848,115 @@ int ws_build_frame(const unsigned char *payload, size_t payload_len, unsigned ch
         header[7] = (payload_len >> 16) & 0xFF;
         header[8] = (payload_len >> 8) & 0xFF;
         header[9] = payload_len & 0xFF;
-        header_len = 10;
     }
+    *out_frame = header;
+    *out_len = header_len + payload_len;
+    return 0;
+}
+
+/** ws_frame_commit
+ * Frame the payload written into a reserved frame.
+ */
+int ws_frame_commit(ws_frame_t *f, size_t payload_len, unsigned char opcode) {
+    if (!f || payload_len > f->capacity) return -1;
+    unsigned char *frame = NULL;
+    if (ws_build_frame(f->data + WS_FRAME_HEADROOM, payload_len, opcode, WS_FRAME_HEADROOM, &frame, &f->len)) {
+        return -1;
+    }
+    f->offset = (size_t)(frame - f->data);
+    f->opcode = opcode & 0x0F;
+    return 0;
+}
 
-    total_len = header_len + payload_len;
-    char *buf = malloc(total_len);
-    if (!buf) return -1;
+/** ws_frame_create
+ * Frame a payload into a shared, immutable frame with one reference.
+ */
+static ws_frame_t *ws_frame_create(const unsigned char *payload, size_t payload_len, unsigned char opcode) {
+    ws_frame_t *f = ws_frame_reserve(payload_len);
+    if (!f) return NULL;
+    if (payload_len) memcpy(ws_frame_payload(f), payload, payload_len);
+    ws_frame_commit(f, payload_len, opcode);
+    return f;
+}
 
-    memcpy(buf, header, header_len);
-    memcpy(buf + header_len, payload, payload_len);
+ws_frame_t *ws_frame_create_text(const char *msg) {
+    if (!msg) return NULL;
+    return ws_frame_create((const unsigned char*)msg, strlen(msg), WS_OP_TEXT_FRAME);
+}
 
-    *out_buf = buf;
-    *out_len = total_len;
-    return 0;
+ws_frame_t *ws_frame_create_binary(const unsigned char *buf, size_t len) {
+    if (!buf || !len) return NULL;
+    return ws_frame_create(buf, len, WS_OP_BINARY_FRAME);
 }
 
-/** ws_send_binary_message
- * Sends a binary message on a WS session.
+/** ws_send_shared_frame
+ * Queue a shared frame on a session, the session takes its own reference.
  */
-int ws_send_binary_message(ws_session_t *s, const unsigned char *buf, size_t len){
-    if (!buf || !s || !len) return -1;
-    char *frame = NULL;
-    size_t frame_len = 0;
+int ws_send_shared_frame(ws_session_t *s, ws_frame_t *f) {
+    if (!s || !f) return -1;
+    __sync_fetch_and_add(&f->refcount, 1);
+    return ws_queue_frame(s, f);
+}
+
+/** ws_deflate_frame
+ * Compress a message into a frame with RSV1 set, called under zout_lock.
+ * Returns NULL if the output would not fit, the stream is reset then.
+ */
+static ws_frame_t *ws_deflate_frame(ws_session_t *s, const unsigned char *payload, size_t len, unsigned char opcode) {
+    z_stream *z = s->zout;
+    size_t capacity = deflateBound(z, len) + 16; // the bound is for Z_FINISH, sync flush adds a few bytes
+    ws_frame_t *f = ws_frame_reserve(capacity);
+    if (!f) return NULL;
+    z->next_in = (Bytef *)payload;
+    z->avail_in = (uInt)len;
+    z->next_out = ws_frame_payload(f);
+    z->avail_out = (uInt)f->capacity;
+    int zr = deflate(z, Z_SYNC_FLUSH);
+    size_t out_len = f->capacity - z->avail_out;
+    if (zr != Z_OK || z->avail_in || !z->avail_out || out_len < 4 ||
+        memcmp(ws_frame_payload(f) + out_len - 4, g_ws_deflate_tail, 4)) {
+        ws_frame_release(f);
+        deflateReset(z);
+        return NULL;
+    }
+    if (s->deflate_out_reset) deflateReset(z);
+    ws_frame_commit(f, out_len - 4, opcode);
+    f->data[f->offset] |= 0x40; // RSV1: compressed message
+    if (!s->deflate_out_reset) f->flags |= WS_FRAME_KEEP;
+    return f;
+}
 
-    if (ws_build_frame(buf, len, WS_OP_BINARY_FRAME, &frame, &frame_len) < 0) {
+/** ws_send_message
+ * Frame and queue one message. With permessage-deflate the messages from the
+ * threshold are compressed; compressing and queueing is atomic, the order on
+ * the wire must be the order of the compression context.
+ */
+static int ws_send_message(ws_session_t *s, const unsigned char *payload, size_t len, unsigned char opcode) {
+    if (s->zout && len >= s->deflate_threshold) {
+        pthread_mutex_lock(&s->zout_lock);
+        ws_frame_t *f = ws_deflate_frame(s, payload, len, opcode);
+        if (f) {
+            int ret = ws_queue_frame(s, f);
+            pthread_mutex_unlock(&s->zout_lock);
+            return ret;
+        }
+        pthread_mutex_unlock(&s->zout_lock);
+        // fall back to an uncompressed frame, it does not touch the context
+    }
+    ws_frame_t *f = ws_frame_create(payload, len, opcode);
+    if (!f) {
         g_host->errormsg("WebSocket build frame failed");
         return -1;
     }
+    return ws_queue_frame(s, f);
+}
 
-    int ret = ws_send_frame(s, frame, frame_len);
-    free(frame);
-    return ret;
+/** ws_send_binary_message
+ * Sends a binary message on a WS session.
+ */
+int ws_send_binary_message(ws_session_t *s, const unsigned char *buf, size_t len){
+    if (!buf || !s || !len) return -1;
+    return ws_send_message(s, buf, len, WS_OP_BINARY_FRAME);
 }
 
 /** ws_send_text_message
@@ -355,18 +964,47 @@ int ws_send_binary_message(ws_session_t *s, const unsigned char *buf, size_t len
  */
 int ws_send_text_message(ws_session_t *s, const char *msg) {
     if (!msg || !s) return -1;
-    size_t len = strlen(msg);
-    char *frame = NULL;
-    size_t frame_len = 0;
+    return ws_send_message(s, (const unsigned char*)msg, strlen(msg), WS_OP_TEXT_FRAME);
+}
 
-    if (ws_build_frame((const unsigned char*)msg, len, WS_OP_TEXT_FRAME, &frame, &frame_len) < 0) {
-        g_host->errormsg("WebSocket build frame failed");
-        return -1;
+/** ws_mask_bytes
+ * XOR the bytes with the 4 byte mask, phase is the index of the first byte
+ * in the masked payload. The head is done bytewise until the pointer is
+ * aligned, then the mask is rotated by the head length into a word, and the
+ * body runs 32/16/8 bytes per iteration (AVX2/SSE2/uint64).
+ */
+void ws_mask_bytes(unsigned char *p, size_t len, const unsigned char *mask, size_t phase) {
+    while (len && ((uintptr_t)p & 7)) {
+        *p++ ^= mask[phase++ & 3];
+        len--;
+    }
+    unsigned char m8[8];
+    for (int i = 0; i < 8; i++) m8[i] = mask[(phase + i) & 3];
+    uint64_t m64;
+    memcpy(&m64, m8, sizeof(m64));
+#if defined(__AVX2__)
+    __m256i m256 = _mm256_set1_epi64x((long long)m64);
+    for (; len >= 32; p += 32, len -= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        _mm256_storeu_si256((__m256i *)p, _mm256_xor_si256(v, m256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i m128 = _mm_set1_epi64x((long long)m64);
+    for (; len >= 16; p += 16, len -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        _mm_storeu_si128((__m128i *)p, _mm_xor_si128(v, m128));
+    }
+#endif
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= m64;
+        memcpy(p, &v, sizeof(v));
+    }
+    for (size_t i = 0; i < len; i++) {
+        p[i] ^= m8[i];
     }
-
-    int ret = ws_send_frame(s, frame, frame_len);
-    free(frame);
-    return ret;
 }
 
 /** ws_mask_payload
@@ -377,9 +1015,166 @@ int ws_send_text_message(ws_session_t *s, const char *msg) {
 void ws_mask_payload(ws_session_t *s){
     if (s->mask_size < 1) return;
     unsigned char *mask = (unsigned char*)&s->frame[s->mask_offset];
-    for (size_t i = 0; i < s->payload_len; i++) {
-        s->payload[i] ^= mask[i % 4];
+    ws_mask_bytes(s->payload, s->payload_len, mask, 0);
+}
+
+/** ws_message_append
+ * Collect the payload of a fragmented message, returns -1 over the limit.
+ */
+static int ws_message_append(ws_session_t *s) {
+    size_t need = s->msg_len + s->payload_len;
+    if (need > WS_FRAME_ABSOLUTE_MAX_BUF_LENGTH) {
+        ws_measure(s, WSM_ERROR_ABSOLUTE_MAX_REACHED);
+        return -1;
+    }
+    if (need > s->msg_capacity) {
+        size_t cap = ((need + BUF_SIZE - 1) / BUF_SIZE) * BUF_SIZE;
+        unsigned char *m = realloc(s->msg, cap);
+        if (!m) {
+            ws_measure(s, WSM_ERROR_MEMORY_ALLOCATION);
+            return -1;
+        }
+        s->msg = m;
+        s->msg_capacity = cap;
+    }
+    memcpy(s->msg + s->msg_len, s->payload, s->payload_len);
+    s->msg_len = need;
+    return 0;
+}
+
+/** ws_inflate_message
+ * Decompress a complete message (RFC 7692 7.2.2: the sync flush tail is
+ * appended before inflating). The result is in s->inflated, limited like
+ * the incoming frames. Returns the length or -1.
+ */
+static long ws_inflate_message(ws_session_t *s, const unsigned char *in, size_t len) {
+    z_stream *z = s->zin;
+    size_t o = 0;
+    int end = 0;
+    for (int pass = 0; pass < 2 && !end; pass++) {
+        z->next_in = (Bytef *)(pass ? g_ws_deflate_tail : in);
+        z->avail_in = pass ? sizeof(g_ws_deflate_tail) : (uInt)len;
+        for (;;) {
+            if (o == s->inflated_capacity) {
+                size_t cap = s->inflated_capacity ? s->inflated_capacity * 2 : BUF_SIZE;
+                if (cap > WS_FRAME_ABSOLUTE_MAX_BUF_LENGTH) {
+                    ws_measure(s, WSM_ERROR_ABSOLUTE_MAX_REACHED);
+                    return -1;
+                }
+                unsigned char *m = realloc(s->inflated, cap);
+                if (!m) {
+                    ws_measure(s, WSM_ERROR_MEMORY_ALLOCATION);
+                    return -1;
+                }
+                s->inflated = m;
+                s->inflated_capacity = cap;
+            }
+            z->next_out = s->inflated + o;
+            z->avail_out = (uInt)(s->inflated_capacity - o);
+            int zr = inflate(z, Z_SYNC_FLUSH);
+            o = s->inflated_capacity - z->avail_out;
+            if (zr == Z_STREAM_END) {
+                // final block from the peer, the context ends with it
+                inflateReset(z);
+                end = 1;
+                break;
+            }
+            if (zr != Z_OK && zr != Z_BUF_ERROR) {
+                ws_measure(s, WSM_ERROR_PROTOCOL_ABORT);
+                g_host->debugmsg("WebSocket inflate failed: %d", zr);
+                return -1;
+            }
+            if (z->avail_out) break; // all the input is consumed
+        }
     }
+    if (s->deflate_in_reset && !end) inflateReset(z);
+    return (long)o;
+}
+
+/** ws_send_control
+ * Queue a control frame (pong, close) with the given payload.
+ */
+static int ws_send_control(ws_session_t *s, unsigned char opcode, const unsigned char *payload, size_t len) {
+    if (len > WS_CONTROL_PAYLOAD_MAX) len = WS_CONTROL_PAYLOAD_MAX;
+    ws_frame_t *f = ws_frame_create(payload, len, opcode);
+    if (!f) return -1;
+    return ws_queue_frame(s, f);
+}
+
+/** ws_send_ping
+ * Queue a ping with the monotonic send time as its payload. While a ping is
+ * unanswered no new one is sent, the pong timeout counts from the first.
+ */
+static int ws_send_ping(ws_session_t *s) {
+    if (s->ping_sent_ms) return 0;
+    long long now_ms = ws_now_ms();
+    unsigned char payload[8];
+    for (int i = 0; i < 8; i++) payload[i] = (unsigned char)((unsigned long long)now_ms >> (56 - 8 * i));
+    if (ws_send_control(s, WS_OP_PING, payload, sizeof(payload))) return -1;
+    s->ping_sent_ms = now_ms;
+    g_host->debugmsg("Ping sent to client");
+    return 0;
+}
+
+/** ws_pong_received
+ * Measure the RTT when the pong echoes the unanswered ping, unmasked payload.
+ * Unsolicited pongs (RFC 6455 5.5.3) and stale ones are only counted.
+ */
+static void ws_pong_received(ws_session_t *s) {
+    if (!s->ping_sent_ms || s->payload_len != 8) return;
+    unsigned long long sent = 0;
+    for (int i = 0; i < 8; i++) sent = (sent << 8) | s->payload[i];
+    if ((long long)sent != s->ping_sent_ms) return;
+    long long rtt = ws_now_ms() - s->ping_sent_ms;
+    s->ping_sent_ms = 0;
+    ws_measure_rtt(s, rtt > 0 ? (unsigned int)rtt : 0);
+}
+
+/** ws_check_liveness
+ * Returns the reason to evict the session, WS_EVICT_MAX if it is alive.
+ */
+static ws_evict_reason_t ws_check_liveness(ws_session_t *s, time_t now) {
+    if (s->pong_timeout > 0 && s->ping_sent_ms &&
+        ws_now_ms() - s->ping_sent_ms >= (long long)s->pong_timeout * 1000) {
+        return WS_EVICT_PONG_TIMEOUT;
+    }
+    if (s->idle_timeout > 0 && now - s->last_data_rx >= s->idle_timeout) {
+        return WS_EVICT_IDLE;
+    }
+    return WS_EVICT_MAX;
+}
+
+/** ws_evict
+ * Close the session from the server side with 1001 (going away), the loop
+ * flushes it best effort, a half-open peer never gets it anyway.
+ */
+static void ws_evict(ws_session_t *s, ws_evict_reason_t reason) {
+    static const unsigned char going_away[2] = { 0x03, 0xE9 }; // 1001
+    g_host->debugmsg("WebSocket session evicted: %s",
+        reason == WS_EVICT_PONG_TIMEOUT ? "pong timeout" : "idle timeout");
+    __atomic_add_fetch(&g_ws_evictions[reason], 1, __ATOMIC_RELAXED);
+    ws_send_control(s, WS_OP_CONNECTION_CLOSE, going_away, sizeof(going_away));
+    s->state = WS_STATE_DONE;
+}
+
+/** ws_keepalive
+ * Evict the dead session, or ping the peer when it is time. Runs whenever
+ * the loop wakes up, also in the middle of an incomplete frame: a peer
+ * which stalls there would hold the thread forever.
+ * Returns 1 if the session was evicted.
+ */
+static int ws_keepalive(ws_session_t *s, time_t now) {
+    ws_evict_reason_t reason = ws_check_liveness(s, now);
+    if (reason < WS_EVICT_MAX) {
+        ws_evict(s, reason);
+        return 1;
+    }
+    // Low level ping request sending to peer, carries its send time for the RTT
+    if (now - s->last_ping_sent >= s->ping_interval) {
+        ws_send_ping(s);
+        s->last_ping_sent = now;
+    }
+    return 0;
 }
 
 /** ws_check_frame_need_to_grow()
@@ -492,6 +1287,10 @@ static int ws_parse_header(ws_session_t *s) {
     s->fin = (s->frame[0] & 0x80) != 0;
     s->opcode = s->frame[0] & 0x0F;
     s->mask_size = mask_len;
+    // RSV1 is the compressed flag of permessage-deflate, on the first frame of a data message
+    if (rsv == 4 && s->zin && (s->opcode == WS_OP_TEXT_FRAME || s->opcode == WS_OP_BINARY_FRAME)) {
+        rsv = 0;
+    }
     if (rsv) {
         ws_measure(s, WSM_ERROR_RESERVED);
         g_host->debugmsg("Header RSV:%d bit set, connection shall fallen.", rsv);
@@ -510,7 +1309,7 @@ static int ws_parse_header(ws_session_t *s) {
             return 0; // wait for more bytes
         }
         // Now safe to read extended payload length
-        uint16_t extended_payload_len = (s->frame[2] << 8) | s->frame[3];
+        uint16_t extended_payload_len = ((unsigned char)s->frame[2] << 8) | (unsigned char)s->frame[3];
         s->payload_len = extended_payload_len;
         s->mask_offset = base_header_len + extended_payload_len_len;
         s->frame_len = s->mask_offset + s->mask_size + s->payload_len;
@@ -546,25 +1345,44 @@ static int ws_parse_header(ws_session_t *s) {
         return 0; // read more for full frame
     }
 
-    if (s->opcode == WS_OP_CONTINUATION_FRAME && !s->fragmented) {
-        ws_measure(s, WSM_ERROR_PROTOCOL_ABORT);
-        g_host->debugmsg("Unexpected continuation frame without initial fragmented message");
-        return -1;
-    } else if ((s->opcode == WS_OP_TEXT_FRAME || s->opcode == WS_OP_BINARY_FRAME) && !s->fin) {
-        s->fragmented = 1;
-        s->original_opcode = s->opcode;
-    } else if (s->opcode != WS_OP_CONTINUATION_FRAME) {
-        s->fragmented = 0;
+    if (s->opcode == WS_OP_CONTINUATION_FRAME) {
+        if (!s->fragmented) {
+            ws_measure(s, WSM_ERROR_PROTOCOL_ABORT);
+            g_host->debugmsg("Unexpected continuation frame without initial fragmented message");
+            return -1;
+        }
+    } else if (s->opcode == WS_OP_TEXT_FRAME || s->opcode == WS_OP_BINARY_FRAME) {
+        if (s->fragmented) {
+            ws_measure(s, WSM_ERROR_PROTOCOL_ABORT);
+            g_host->debugmsg("New message inside a fragmented one");
+            return -1;
+        }
+        if (!s->fin) {
+            s->fragmented = 1;
+            s->original_opcode = s->opcode;
+        }
+        s->msg_compressed = (s->frame[0] & 0x40) != 0;
+    } else if (s->opcode & 0x08) {
+        // control frames may come between fragments, but can not be fragmented
+        if (!s->fin || s->payload_len > WS_CONTROL_PAYLOAD_MAX) {
+            ws_measure(s, WSM_ERROR_PROTOCOL_ABORT);
+            g_host->debugmsg("Invalid control frame OP:%d len:%zu", s->opcode, s->payload_len);
+            return -1;
+        }
     }
     s->payload = (unsigned char*)&s->frame[s->mask_offset + s->mask_size];
     return 1;
 }
 
+// ws_state_step() result: nothing to do until the socket becomes readable.
+#define WS_STEP_WAIT (2)
+
 /** ws_state_step
  * WS Final State Machine processor
  * Need to be called cyclically, only process one step at one call.
- * The execution time in all the steps are limited, the longer one
- * probably the Read phase, when usleep executed state is possible.
+ * The execution time in all the steps are limited, none of them blocks.
+ * Returns 0 to stop, 1 to continue, WS_STEP_WAIT when the socket has no
+ * more bytes, then the caller waits for readiness before the next step.
  */
 static int ws_state_step(ws_session_t *s) {
     switch (s->state) {
@@ -577,14 +1395,19 @@ static int ws_state_step(ws_session_t *s) {
                 switch (s->opcode) {
                     case WS_OP_CONNECTION_CLOSE:
                         g_host->debugmsg("WebSocket close frame received");
+                        // echo the status code, the loop flushes it before the socket is closed
+                        ws_mask_payload(s);
+                        ws_send_control(s, WS_OP_CONNECTION_CLOSE, s->payload, s->payload_len >= 2 ? 2 : 0);
                         s->state = WS_STATE_DONE;
                         return 0;
                     break;
                     case WS_OP_PING:{
                         g_host->debugmsg("Ping received from client");
                         ws_measure(s, WSM_LL_PING);
+                        // the pong carries the application data of the ping
+                        ws_mask_payload(s);
+                        ws_send_control(s, WS_OP_PONG, s->payload, s->payload_len);
                         ws_check_frame_unprocessed(s);
-                        s->ping_received = 1;
                         return 1;
                     }
                     break;
@@ -592,14 +1415,16 @@ static int ws_state_step(ws_session_t *s) {
                     case WS_OP_PONG:
                         g_host->debugmsg("Pong received from client");
                         ws_measure(s, WSM_LL_PONG);
+                        ws_mask_payload(s);
+                        ws_pong_received(s);
                         ws_check_frame_unprocessed(s);
-                        //todo: save the timestamp
                         return 1;
             
                     case WS_OP_TEXT_FRAME:
                     case WS_OP_BINARY_FRAME:
                     case WS_OP_CONTINUATION_FRAME:
                         s->state = WS_STATE_MASK_AND_DECODE;
+                        s->last_data_rx = time(NULL);
                         ws_measure(s, WSM_FRAME_RX);
                         ws_measure_add(s,WSM_BYTES_RX, s->frame_len);
                         return 1;
@@ -630,13 +1455,7 @@ static int ws_state_step(ws_session_t *s) {
                 //s->last_pong_sent = now;
                 s->ping_received = 0;
             }
-            // Low level ping request sending to peer, but yeah probably we need another state for this...
-            if (now - s->last_ping_sent >= WS_LL_SEND_PING_SEC) {
-                char ping_msg[] = { 0x89, 0x00 };
-                ws_send_frame(s, ping_msg, sizeof(ping_msg));
-                g_host->debugmsg("Ping sent to client");
-                s->last_ping_sent = now;
-            }
+            if (ws_keepalive(s, now)) return 0;
             // do a periodic measurement aggregation
             if (now - s->last_aggregation >= WS_AGGREGATION_TIME_SEC){
                 ws_measure_aggregate(s);
@@ -644,7 +1463,7 @@ static int ws_state_step(ws_session_t *s) {
                 // just for development phase, dump out some statistics to log...
                 char buf[BUF_SIZE];
                 ws_measure_dump_str(s, buf, sizeof(buf));
-                g_host->debugmsg("Stat: ", buf);
+                g_host->debugmsg("Stat: %s", buf);
             }
             // frame memory allocation grow/shrink management after a timeout for sure...
             if (now - s->last_frame_memory_checked >= WS_FRAME_SHRINK_TIMEOUT_SEC){
@@ -652,6 +1471,10 @@ static int ws_state_step(ws_session_t *s) {
                 ws_check_frame_need_to_shrink(s);
                 s->last_frame_memory_checked =now;
             }
+            // periodic tasks of the application layer
+            if (s->onWsIdle){
+                s->onWsIdle(s, s->user_data);
+            }
             s->state =WS_STATE_READ_HEADER;
             return 1;
         }
@@ -663,14 +1486,17 @@ static int ws_state_step(ws_session_t *s) {
                 // ws_measure(s, WSM_ERROR_PROTOCOL_ABORT); // already counted, add this only if needed
                 return 0;
             }
-            ssize_t len = read(s->ctx->socket_fd, s->frame + s->frame_offset, BUF_SIZE - s->frame_offset);
+            ssize_t len = read(s->ctx->socket_fd, s->frame + s->frame_offset, s->frame_capacity - s->frame_offset);
             if (len < 0) {
+                if (errno == EINTR) return 1;
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
                     // The connection is open, this layer needs more bytes, but kernel buffer is empty now.
-                    // This thread can not do more, than wait in a sleep.
+                    if (s->ping_received) {
+                        s->state = WS_STATE_IDLE; // answer first
+                        return 1;
+                    }
                     ws_measure(s, WSM_SLEEP_RX);
-                    usleep(WS_READ_SLEEP_TIME_US);
-                    return 1;
+                    return WS_STEP_WAIT;
                 } else {
                     g_host->debugmsg("WebSocket read error: %s", strerror(errno));
                     ws_measure(s, WSM_ERROR_PROTOCOL_ABORT);
@@ -698,15 +1524,43 @@ static int ws_state_step(ws_session_t *s) {
 
         case WS_STATE_PROCESS_FRAME: {
             CommandResult_t cr = CR_UNKNOWN;
-            if (s->opcode == WS_OP_TEXT_FRAME) {
-                g_host->debugmsg("WS text message: %.*s", (int)s->payload_len, s->payload);
+            unsigned char opcode = s->opcode;
+            const unsigned char *data = s->payload;
+            size_t data_len = s->payload_len;
+            if (s->fragmented) {
+                // fragmented message: collect until FIN, then deliver as one
+                if (ws_message_append(s)) {
+                    s->state = WS_STATE_ERROR;
+                    return 0;
+                }
+                if (!s->fin) {
+                    ws_check_frame_unprocessed(s);
+                    return 1;
+                }
+                opcode = s->original_opcode;
+                data = s->msg;
+                data_len = s->msg_len;
+                s->fragmented = 0;
+                s->msg_len = 0;
+            }
+            if (s->msg_compressed && (opcode == WS_OP_TEXT_FRAME || opcode == WS_OP_BINARY_FRAME)) {
+                long n = ws_inflate_message(s, data, data_len);
+                if (n < 0) {
+                    s->state = WS_STATE_ERROR;
+                    return 0;
+                }
+                data = s->inflated;
+                data_len = (size_t)n;
+            }
+            if (opcode == WS_OP_TEXT_FRAME) {
+                g_host->debugmsg("WS text message: %.*s", (int)data_len, data);
                 if (s->onWsTextFrame){
-                    cr = s->onWsTextFrame(s, (const char*)s->payload, s->payload_len, s->user_data);
+                    cr = s->onWsTextFrame(s, (const char*)data, data_len, s->user_data);
                 }
-            }else if (s->opcode == WS_OP_BINARY_FRAME) {
+            }else if (opcode == WS_OP_BINARY_FRAME) {
                 g_host->debugmsg("WS binary message");
                 if (s->onWsBinaryFrame){
-                    cr = s->onWsBinaryFrame(s->ctx, s->payload, s->payload_len, s->user_data);
+                    cr = s->onWsBinaryFrame(s->ctx, data, data_len, s->user_data);
                 }
             }
             switch (cr){
@@ -732,7 +1586,7 @@ static int ws_state_step(ws_session_t *s) {
             char response[BUF_SIZE];
             size_t response_len = 0;
             response[0] = 0x81;
-            if (s->payload_len <= 125) {
+            if (s->opcode == WS_OP_TEXT_FRAME && s->payload_len <= 125 && !s->msg_compressed) {
                 response[1] = (unsigned char)s->payload_len;
                 memcpy(&response[2], s->payload, s->payload_len);
                 response_len = 2 + s->payload_len;
@@ -750,21 +1604,127 @@ static int ws_state_step(ws_session_t *s) {
     }
 }
 
+/** ws_session_events_open
+ * Set up the readiness sources of the session: epoll on the socket and
+ * an eventfd, which wakes the thread when an other thread queued a frame.
+ */
+static int ws_session_events_open(ws_session_t *s) {
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0) return -1;
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->wake_fd < 0) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = s->wake_fd };
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &ev)) return -1;
+    s->epoll_events = EPOLLIN | EPOLLRDHUP;
+    ev.events = s->epoll_events;
+    ev.data.fd = s->ctx->socket_fd;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->ctx->socket_fd, &ev)) return -1;
+    return 0;
+}
+
+static void ws_session_events_close(ws_session_t *s) {
+    if (s->epoll_fd >= 0) close(s->epoll_fd);
+    if (s->wake_fd >= 0) close(s->wake_fd);
+    s->epoll_fd = -1;
+    s->wake_fd = -1;
+}
+
+/** ws_wait_events
+ * Block until the socket is readable, writable while frames are pending,
+ * the session is woken up, or the next periodic task is due.
+ * Returns -1 on error.
+ */
+static int ws_wait_events(ws_session_t *s, int want_write) {
+    unsigned int events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    if (events != s->epoll_events) {
+        struct epoll_event ev = { .events = events, .data.fd = s->ctx->socket_fd };
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, s->ctx->socket_fd, &ev)) return -1;
+        s->epoll_events = events;
+    }
+    time_t now = time(NULL);
+    long timeout_ms = (long)(s->last_ping_sent + s->ping_interval - now) * 1000;
+    if (timeout_ms < 0) timeout_ms = 0;
+    if (timeout_ms > WS_EVENT_MAX_WAIT_MS) timeout_ms = WS_EVENT_MAX_WAIT_MS;
+    struct epoll_event evs[2];
+    int n = epoll_wait(s->epoll_fd, evs, 2, (int)timeout_ms);
+    if (n < 0) return (errno == EINTR) ? 0 : -1;
+    for (int i = 0; i < n; i++) {
+        if (evs[i].data.fd == s->wake_fd) {
+            uint64_t cnt;
+            ssize_t r = read(s->wake_fd, &cnt, sizeof(cnt));
+            (void)r;
+        }
+    }
+    return 0;
+}
+
 /**
  * Free memory of the session object
  */
 void ws_session_destroy(ws_session_t * s){
     if (!s) return;
-    if (!s->frame) return;
+    ws_session_events_close(s);
+    if (s->outq) {
+        while (s->out_count) ws_queue_remove(s, 0);
+        free(s->outq);
+        pthread_mutex_destroy(&s->out_lock);
+    }
+    if (s->zout) {
+        deflateEnd(s->zout);
+        free(s->zout);
+        pthread_mutex_destroy(&s->zout_lock);
+    }
+    if (s->zin) {
+        inflateEnd(s->zin);
+        free(s->zin);
+    }
+    free(s->inflated);
+    free(s->msg);
     free(s->frame);
     free(s);
 }
 
+/** ws_session_set_deflate
+ * Set up the compressor and the decompressor of a negotiated permessage-deflate.
+ * Returns 0 when enabled (or not negotiated), -1 on error.
+ */
+int ws_session_set_deflate(ws_session_t *s, const ws_upgrade_t *up, const ws_deflate_config_t *dc) {
+    if (!s || !up || !dc) return -1;
+    if (!up->deflate || s->zout) return 0;
+    z_stream *zout = calloc(1, sizeof(z_stream));
+    z_stream *zin = calloc(1, sizeof(z_stream));
+    int level = (dc->level >= 1 && dc->level <= 9) ? dc->level : Z_DEFAULT_COMPRESSION;
+    if (!zout || !zin) {
+        free(zout);
+        free(zin);
+        return -1;
+    }
+    if (deflateInit2(zout, level, Z_DEFLATED, -up->server_max_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(zout);
+        free(zin);
+        return -1;
+    }
+    if (inflateInit2(zin, -WS_DEFLATE_MAX_WINDOW_BITS) != Z_OK) {
+        deflateEnd(zout);
+        free(zout);
+        free(zin);
+        return -1;
+    }
+    pthread_mutex_init(&s->zout_lock, NULL);
+    s->zout = zout;
+    s->zin = zin;
+    s->deflate_threshold = dc->threshold;
+    s->deflate_out_reset = up->server_no_context_takeover ? 1 : 0;
+    s->deflate_in_reset = up->client_no_context_takeover ? 1 : 0;
+    return 0;
+}
+
 /**
  * Create session object
  */
 ws_session_t *ws_session_create(ClientContext *ctx, const WsProcessorApi_t *callbacks, void *user_data){
     ws_session_t *s= malloc(sizeof(ws_session_t));
+    if (!s) return NULL;
     ws_session_t defaults={
         .state = WS_STATE_READ_HEADER, // offset == 0, reed needed...
         .frame_offset = 0,
@@ -775,34 +1735,86 @@ ws_session_t *ws_session_create(ClientContext *ctx, const WsProcessorApi_t *call
         .ctx = ctx,
         .user_data = user_data,
         .frame = NULL,
+        .msg = NULL,
+        .outq = NULL,
+        .zout = NULL,
+        .zin = NULL,
+        .inflated = NULL,
+        .out_capacity = g_ws_outq_max_frames + WS_OUTQ_CONTROL_RESERVE,
+        .out_max_frames = g_ws_outq_max_frames,
+        .out_max_bytes = g_ws_outq_max_bytes,
+        .out_policy = g_ws_outq_policy,
+        .ping_interval = g_ws_ping_interval,
+        .pong_timeout = g_ws_pong_timeout,
+        .idle_timeout = g_ws_idle_timeout,
+        .epoll_fd = -1,
+        .wake_fd = -1,
         .onWsBinaryFrame = NULL,
-        .onWsTextFrame = NULL
+        .onWsTextFrame = NULL,
+        .onWsIdle = NULL
     };
     *s = defaults;
     s->frame = malloc(BUF_SIZE);
+    s->outq = calloc(s->out_capacity, sizeof(ws_frame_t *));
+    if (!s->frame || !s->outq) {
+        free(s->frame);
+        free(s->outq);
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->out_lock, NULL);
     if (callbacks){
         s->onWsBinaryFrame = callbacks->onWsBinaryFrame;
         s->onWsTextFrame = callbacks->onWsTextFrame;
+        s->onWsIdle = callbacks->onWsIdle;
     }
     return s;
 }
 
 /** ws_handle_ws_loop()
  * ws protocol's process loop.
+ * Runs the FSM while it has something to do, flushes the outbound queue,
+ * and sleeps in epoll when the socket has no more bytes. An idle session
+ * wakes only for the periodic tasks.
  */
 int ws_handle_ws_loop(ws_session_t *session) {
-    // PluginContext *pc, ClientContext *ctx, WsRequestParams *wsparams, const WsProcessorApi_t *callbacks
-    //(void)pc;
-    //(void)wsparams;
-    //ws_session_t *session = ws_session_create(ctx, callbacks, NULL);
     ws_measure_clear(session);
+    session->last_data_rx = time(NULL);
+    session->ping_sent_ms = 0;
+    if (ws_session_events_open(session)) {
+        g_host->errormsg("WebSocket epoll setup failed: %s", strerror(errno));
+        return -1;
+    }
     g_is_running++; // todo: atomically
 
     while (g_keep_running && session->state != WS_STATE_DONE) {
         int cont = ws_state_step(session);
         if (cont == 0 || session->state == WS_STATE_ERROR) break;
+        int pending = ws_flush_out(session);
+        if (pending < 0) {
+            g_host->debugmsg("WebSocket write error: %s", strerror(errno));
+            ws_measure(session, WSM_ERROR_PROTOCOL_ABORT);
+            break;
+        }
+        if (session->out_overflow) {
+            g_host->debugmsg("WebSocket client is too slow, outbound queue overflow");
+            break;
+        }
+        if (cont == WS_STEP_WAIT) {
+            if (ws_wait_events(session, pending > 0)) break;
+            if (ws_keepalive(session, time(NULL))) continue; // the close is flushed below
+            if (session->frame_offset == 0) {
+                session->state = WS_STATE_IDLE; // periodic tasks, then read
+            }
+        }
     }
 
+    ws_flush_out(session); // best effort, e.g. the last pong or close
+    // the session stays registered until its last reference, the senders
+    // are refused from now on, the wake fd is closed by ws_session_destroy()
+    pthread_mutex_lock(&session->out_lock);
+    session->out_closed = 1;
+    pthread_mutex_unlock(&session->out_lock);
     g_is_running--; // todo: atomically
     return 0;
 }
@@ -9,7 +9,9 @@
 #ifndef WS_H_
 #define WS_H_
 
+#include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include "plugin.h"
 
 typedef enum CommandResult_t {
@@ -19,6 +21,61 @@ typedef enum CommandResult_t {
     CR_ERROR
 } CommandResult_t;
 
+/**
+ * OPCODE related constants (RFC 6455, 5.2)
+ */
+#define WS_OP_CONTINUATION_FRAME    (0)
+#define WS_OP_TEXT_FRAME            (1)
+#define WS_OP_BINARY_FRAME          (2)
+#define WS_OP_CONNECTION_CLOSE      (8)
+#define WS_OP_PING                  (9)
+#define WS_OP_PONG                  (10)
+
+// Room in front of the payload for the longest server frame header.
+#define WS_FRAME_HEADROOM           (10)
+
+/**
+ * permessage-deflate (RFC 7692) settings of the server side.
+ */
+typedef struct {
+    int enabled;
+    int level;                  // zlib level, 1..9
+    int window_bits;            // server compressor window, 9..15
+    int context_takeover;       // 0: both sides reset the context after each message
+    size_t threshold;           // shorter messages are sent uncompressed
+} ws_deflate_config_t;
+
+/**
+ * Result of the upgrade request validation, the handshake response is built from it.
+ */
+typedef struct {
+    char accept_key[64];
+    char protocol[32];          // selected subprotocol, empty if none
+    int deflate;                // permessage-deflate negotiated
+    int server_no_context_takeover;
+    int client_no_context_takeover;
+    int server_max_window_bits;
+} ws_upgrade_t;
+
+/**
+ * Outbound queue overflow policy, when a slow client falls behind.
+ */
+typedef enum {
+    WS_QUEUE_DROP_OLDEST,       // drop the oldest queued data frame
+    WS_QUEUE_COALESCE,          // replace the newest queued frame of the same key (latest state wins)
+    WS_QUEUE_DISCONNECT,        // give up on the client, close the session
+    WS_QUEUE_POLICY_MAX
+} ws_queue_policy_t;
+
+/**
+ * Reasons of closing a session by the server, counted for the statistics.
+ */
+typedef enum {
+    WS_EVICT_PONG_TIMEOUT,      // no pong for the ping, a half-open connection
+    WS_EVICT_IDLE,              // no data frame from the client for too long
+    WS_EVICT_MAX
+} ws_evict_reason_t;
+
 #ifdef CMOCK_VERSION
 #define WS_EXPOSE_INTERNALS
 #endif
@@ -47,8 +104,8 @@ typedef enum {
     WSM_BYTES_TX,
     WSM_FRAME_RX,                   // some frame was decoded, rx
     WSM_FRAME_TX,
-    WSM_SLEEP_RX,                   // sleep due to read (timeout), fairly normal state..
-    WSM_SLEEP_TX,                   // sleep during write, an indicator of tx queue is full.
+    WSM_SLEEP_RX,                   // wait for readable socket, fairly normal state..
+    WSM_SLEEP_TX,                   // wait for writable socket, an indicator of tx queue is full.
     WSM_LL_PING,                    // Lower Layer PING received (at binary protocol layer)
     WSM_LL_PONG,                    // Lower layer PONG received.
     WSM_MEMORY_SHRINK,              // buffer reallocated to a shorter one
@@ -58,6 +115,10 @@ typedef enum {
     WSM_ERROR_MEMORY_ALLOCATION,    // an abort, based on free memory limitations
     WSM_ERROR_RESERVED,             // an abort based on protocol standard
     WSM_ERROR_PROTOCOL_ABORT,       // other protocol aborts
+    WSM_QUEUE_DROP,                 // outbound frame dropped due to the queue limit
+    WSM_QUEUE_COALESCE,             // outbound frame replaced by a newer one
+    WSM_ERROR_QUEUE_OVERFLOW,       // an abort, the client could not keep up with the outbound queue
+    WSM_RTT_MS,                     // round trip time of the last ping, not a counter
     WSM_MAX_ID
 } ws_measurement_id;
 
@@ -71,17 +132,46 @@ typedef struct{
     unsigned short avg[WSM_MAX_ID];
 }ws_measurement;
 
+// RTT histogram buckets, the upper bounds are in g_ws_rtt_bounds_ms
+#define WS_RTT_BUCKETS (8)
+
+/**
+ * Outbound frame. The payload is written after WS_FRAME_HEADROOM bytes,
+ * the header goes right in front of it, so framing never copies.
+ * Immutable after commit and shared by reference, a broadcast frame is
+ * built once and queued to every recipient. Released to the pool, or
+ * freed, when the last queue dropped it.
+ */
+// ws_frame_t flags: the frame refers to the compression context, the queue never drops it
+#define WS_FRAME_KEEP (0x01)
+
+typedef struct ws_frame_t {
+    int refcount;
+    size_t offset;              // frame start in data, header included
+    size_t len;                 // frame length, header included
+    size_t capacity;            // payload capacity after the headroom
+    uint32_t key;               // coalesce key, 0: none, see ws_frame_set_key()
+    unsigned char opcode;
+    unsigned char flags;
+    unsigned char data[];
+} ws_frame_t;
+
 #endif // WS_EXPOSE_INTERNALS
 
 struct ws_session_t;
 typedef struct ws_session_t ws_session_t;
+struct ws_frame_t;
+typedef struct ws_frame_t ws_frame_t;
 
 typedef CommandResult_t (*onWsTextFrame_fn)(struct ws_session_t * s, const char *txt, size_t len, void *user_data);
 typedef CommandResult_t (*onWsBinaryFrame_fn)(ClientContext* ctx, const unsigned char *buf, size_t len, void *user_data);
+// Called between frames from the session's thread, at least once per second.
+typedef void (*onWsIdle_fn)(struct ws_session_t *s, void *user_data);
 
 typedef struct {
     onWsBinaryFrame_fn onWsBinaryFrame;
     onWsTextFrame_fn onWsTextFrame;
+    onWsIdle_fn onWsIdle;
 } WsProcessorApi_t;
 
 
@@ -102,6 +192,9 @@ typedef struct ws_session_t {
     unsigned char opcode;
     unsigned char original_opcode;
     unsigned char *payload; //pointer into the frame, where payload starts.
+    unsigned char *msg;     // reassembled fragmented message
+    size_t msg_len;
+    size_t msg_capacity;
     char *frame;
     size_t frame_capacity;
     int frame_shrink_count;
@@ -110,9 +203,45 @@ typedef struct ws_session_t {
     time_t last_frame_memory_checked;
     time_t last_ping_sent;
     time_t last_aggregation;
+    // liveness
+    time_t last_data_rx;        // last data frame from the client
+    long long ping_sent_ms;     // monotonic time of the unanswered ping, 0 if none
+    int ping_interval;          // seconds
+    int pong_timeout;           // seconds, 0: never evicted
+    int idle_timeout;           // seconds, 0: never evicted
+    unsigned int rtt_ms;        // last round trip time
+    unsigned int rtt_hist[WS_RTT_BUCKETS];
+    // outbound queue, filled by any thread, flushed by the session thread on writability
+    pthread_mutex_t out_lock;
+    ws_frame_t **outq;          // ring buffer
+    size_t out_capacity;
+    size_t out_head;
+    size_t out_count;
+    size_t out_bytes;
+    size_t out_sent;            // bytes of the head frame already written
+    size_t out_max_frames;
+    size_t out_max_bytes;
+    ws_queue_policy_t out_policy;
+    unsigned char out_overflow;
+    unsigned char out_closed;   // the session loop ended, nothing is queued anymore
+    // readiness
+    int epoll_fd;
+    int wake_fd;
+    unsigned int epoll_events;  // events registered for the socket
+    // permessage-deflate, when negotiated
+    struct z_stream_s *zout;    // compressor, guarded by zout_lock
+    struct z_stream_s *zin;     // decompressor, session thread only
+    pthread_mutex_t zout_lock;
+    size_t deflate_threshold;
+    unsigned char deflate_out_reset;  // server_no_context_takeover
+    unsigned char deflate_in_reset;   // client_no_context_takeover
+    unsigned char msg_compressed;     // RSV1 of the message being received
+    unsigned char *inflated;
+    size_t inflated_capacity;
     //callbacks
     onWsTextFrame_fn onWsTextFrame;
     onWsBinaryFrame_fn onWsBinaryFrame;
+    onWsIdle_fn onWsIdle;
     //layers
     ClientContext *ctx; // lower layer
     void *user_data; // to the upper layer
@@ -120,7 +249,20 @@ typedef struct ws_session_t {
 
 #endif // WS_EXPOSE_INTERNALS
 
+/** ws_parse_upgrade
+ * Validates the HTTP upgrade request (method, Upgrade, Connection, version,
+ * key), selects a subprotocol from the NULL terminated list, and negotiates
+ * permessage-deflate. Returns the HTTP status of the handshake response:
+ * 101 on success, 400 or 426 (unsupported version) otherwise.
+ */
+int ws_parse_upgrade(const HttpRequest *req, const char *const *protocols, const ws_deflate_config_t *dc, ws_upgrade_t *up);
+int ws_upgrade_response(const ws_upgrade_t *up, int status, char *buf, size_t len);
+
 ws_session_t *ws_session_create(ClientContext *ctx, const WsProcessorApi_t *callbacks, void *user_data);
+/** ws_session_set_deflate
+ * Enables the negotiated compression on the session, before the loop starts.
+ */
+int ws_session_set_deflate(ws_session_t *s, const ws_upgrade_t *up, const ws_deflate_config_t *dc);
 void ws_session_destroy(ws_session_t * s);
 int ws_gen_acception_key(const char* guid, const char* input_key, char* out_buf, size_t out_buf_len);
 
@@ -134,6 +276,53 @@ ClientContext* ws_getClientContext(ws_session_t *);
 int ws_send_text_message(struct ws_session_t *s, const char *msg);
 int ws_send_binary_message(struct ws_session_t *s, const unsigned char *buf, size_t len);
 
+/** ws_frame_reserve, ws_frame_payload, ws_frame_commit
+ * Zero copy framing: reserve a frame, write the payload in place, then commit
+ * it with the opcode, the header is written into the headroom.
+ */
+ws_frame_t *ws_frame_reserve(size_t payload_capacity);
+unsigned char *ws_frame_payload(ws_frame_t *f);
+int ws_frame_commit(ws_frame_t *f, size_t payload_len, unsigned char opcode);
+
+/** ws_frame_create_text, ws_frame_create_binary
+ * Frame a message once, to send the same bytes to many sessions.
+ * The caller owns one reference, release it after queued to all recipients.
+ */
+ws_frame_t *ws_frame_create_text(const char *msg);
+ws_frame_t *ws_frame_create_binary(const unsigned char *buf, size_t len);
+void ws_frame_release(ws_frame_t *f);
+void ws_frame_pool_clear(void);
+
+/** ws_frame_set_key
+ * Coalesce key of a frame, before it is queued: with the WS_QUEUE_COALESCE
+ * policy a newer frame replaces only a queued one with the same key, e.g. the
+ * position of the same user. Frames without a key (0) are never replaced,
+ * the oldest data frame is dropped instead.
+ */
+#define WS_FRAME_KEY(kind, id) ((((uint32_t)(kind) & 0xFFu) << 24) | ((uint32_t)(id) & 0xFFFFFFu))
+void ws_frame_set_key(ws_frame_t *f, uint32_t key);
+
+/** ws_send_shared_frame
+ * Queue a shared frame on a session, the session takes its own reference.
+ */
+int ws_send_shared_frame(struct ws_session_t *s, ws_frame_t *f);
+
+/** ws_set_queue_config
+ * Outbound queue limits of the sessions created later.
+ */
+void ws_set_queue_config(size_t max_frames, size_t max_bytes, ws_queue_policy_t policy);
+
+/** ws_set_liveness_config
+ * Ping period and eviction thresholds of the sessions created later, in
+ * seconds. A zero ping interval keeps the default, a zero timeout disables
+ * that eviction.
+ */
+void ws_set_liveness_config(int ping_interval_sec, int pong_timeout_sec, int idle_timeout_sec);
+/** ws_evictions
+ * Number of sessions closed by the server for the reason, since started.
+ */
+unsigned long ws_evictions(ws_evict_reason_t reason);
+
 /** textual information about one session */
 int ws_measure_dump_str(ws_session_t *s, char *buf, size_t len);
 void ws_get_info(ws_session_t *s, int *flen);
@@ -0,0 +1,183 @@
+/*
+ * File:    wsgrid.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-27
+ *
+ * Spatial interest grid of the WebSocket plugin, see wsgrid.h.
+ */
+#include <stdlib.h>
+#include <math.h>
+#include "wsgrid.h"
+
+#define WSGRID_DEG2RAD (3.14159265358979323846 / 180.0)
+#define WSGRID_KM_PER_DEG (WSGRID_EARTH_RADIUS_KM * WSGRID_DEG2RAD)
+
+static int wsgrid_row(const wsgrid_t *g, double lat) {
+    int r = (int)((lat + 90.0) / g->cell_deg);
+    if (r < 0) r = 0;
+    if (r >= g->rows) r = g->rows - 1;
+    return r;
+}
+static int wsgrid_col(const wsgrid_t *g, double lon) {
+    int c = (int)floor((lon + 180.0) / g->cell_deg) % g->cols;
+    return c < 0 ? c + g->cols : c;
+}
+
+/** wsgrid_unlink
+ * Remove the entry from its cell list, called under the lock.
+ */
+static void wsgrid_unlink(wsgrid_t *g, int slot) {
+    wsgrid_entry_t *e = &g->entries[slot];
+    if (e->prev != WSGRID_NONE) g->entries[e->prev].next = e->next;
+    else g->heads[e->cell] = e->next;
+    if (e->next != WSGRID_NONE) g->entries[e->next].prev = e->prev;
+    e->cell = e->prev = e->next = WSGRID_NONE;
+    g->count--;
+}
+
+int wsgrid_init(wsgrid_t *g, double cell_deg, size_t capacity) {
+    if (!g || !(cell_deg > 0.0) || cell_deg > 180.0 || !capacity) return -1;
+    g->cell_deg = cell_deg;
+    g->rows = (int)ceil(180.0 / cell_deg);
+    g->cols = (int)ceil(360.0 / cell_deg);
+    g->capacity = capacity;
+    g->count = 0;
+    g->heads = malloc(sizeof(int) * (size_t)g->rows * g->cols);
+    g->entries = malloc(sizeof(wsgrid_entry_t) * capacity);
+    if (!g->heads || !g->entries) {
+        free(g->heads);
+        free(g->entries);
+        g->heads = NULL;
+        g->entries = NULL;
+        return -1;
+    }
+    for (int i = 0; i < g->rows * g->cols; i++) g->heads[i] = WSGRID_NONE;
+    for (size_t i = 0; i < capacity; i++) {
+        g->entries[i].cell = g->entries[i].prev = g->entries[i].next = WSGRID_NONE;
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    return 0;
+}
+
+void wsgrid_destroy(wsgrid_t *g) {
+    if (!g || !g->heads) return;
+    pthread_mutex_destroy(&g->lock);
+    free(g->heads);
+    free(g->entries);
+    g->heads = NULL;
+    g->entries = NULL;
+}
+
+int wsgrid_reserve(wsgrid_t *g, size_t capacity) {
+    if (!g || !g->heads) return -1;
+    int ret = 0;
+    pthread_mutex_lock(&g->lock);
+    if (capacity > g->capacity) {
+        size_t grown = g->capacity * 2;
+        while (grown < capacity) grown *= 2;
+        wsgrid_entry_t *p = realloc(g->entries, sizeof(wsgrid_entry_t) * grown);
+        if (p) {
+            for (size_t i = g->capacity; i < grown; i++) {
+                p[i].cell = p[i].prev = p[i].next = WSGRID_NONE;
+            }
+            g->entries = p;
+            g->capacity = grown;
+        } else {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return ret;
+}
+
+int wsgrid_update(wsgrid_t *g, size_t slot, double lat, double lon) {
+    if (!g || !g->heads) return -1;
+    if (!(lat >= -90.0 && lat <= 90.0 && lon >= -180.0 && lon <= 180.0)) return -1;
+    int cell = wsgrid_row(g, lat) * g->cols + wsgrid_col(g, lon);
+    pthread_mutex_lock(&g->lock);
+    if (slot >= g->capacity) {
+        pthread_mutex_unlock(&g->lock);
+        return -1;
+    }
+    wsgrid_entry_t *e = &g->entries[slot];
+    e->lat = lat;
+    e->lon = lon;
+    if (e->cell != cell) {
+        if (e->cell != WSGRID_NONE) wsgrid_unlink(g, (int)slot);
+        e->cell = cell;
+        e->prev = WSGRID_NONE;
+        e->next = g->heads[cell];
+        if (e->next != WSGRID_NONE) g->entries[e->next].prev = (int)slot;
+        g->heads[cell] = (int)slot;
+        g->count++;
+    }
+    pthread_mutex_unlock(&g->lock);
+    return 0;
+}
+
+void wsgrid_remove(wsgrid_t *g, size_t slot) {
+    if (!g || !g->heads) return;
+    pthread_mutex_lock(&g->lock);
+    if (slot < g->capacity && g->entries[slot].cell != WSGRID_NONE) wsgrid_unlink(g, (int)slot);
+    pthread_mutex_unlock(&g->lock);
+}
+
+int wsgrid_position(wsgrid_t *g, size_t slot, double *lat, double *lon) {
+    if (!g || !g->heads) return -1;
+    int ret = -1;
+    pthread_mutex_lock(&g->lock);
+    if (slot < g->capacity && g->entries[slot].cell != WSGRID_NONE) {
+        *lat = g->entries[slot].lat;
+        *lon = g->entries[slot].lon;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g->lock);
+    return ret;
+}
+
+double wsgrid_distance_km(double lat1, double lon1, double lat2, double lon2) {
+    double dlat = (lat2 - lat1) * WSGRID_DEG2RAD;
+    double dlon = (lon2 - lon1) * WSGRID_DEG2RAD;
+    double s1 = sin(dlat * 0.5), s2 = sin(dlon * 0.5);
+    double a = s1 * s1 + cos(lat1 * WSGRID_DEG2RAD) * cos(lat2 * WSGRID_DEG2RAD) * s2 * s2;
+    if (a > 1.0) a = 1.0;
+    return 2.0 * WSGRID_EARTH_RADIUS_KM * asin(sqrt(a));
+}
+
+/** wsgrid_query
+ * The rows come from the latitude extent of the circle. The columns from
+ * its widest longitude extent, asin(sin(d) / cos(lat)); all of them when
+ * the circle contains a pole. The longitude range wraps at the antimeridian.
+ */
+size_t wsgrid_query(wsgrid_t *g, double lat, double lon, double radius_km, size_t *out, size_t max) {
+    if (!g || !g->heads || !out || !max || !(radius_km >= 0.0)) return 0;
+    double dlat = radius_km / WSGRID_KM_PER_DEG;
+    double lat0 = lat - dlat, lat1 = lat + dlat;
+    int col0 = 0, ncols = g->cols;
+    if (lat0 > -90.0 && lat1 < 90.0) {
+        double s = sin(radius_km / WSGRID_EARTH_RADIUS_KM) / cos(lat * WSGRID_DEG2RAD);
+        if (s < 1.0) {
+            double dlon = asin(s) / WSGRID_DEG2RAD;
+            int span = (int)(2.0 * dlon / g->cell_deg) + 2;
+            if (span < g->cols) {
+                col0 = wsgrid_col(g, lon - dlon);
+                ncols = span;
+            }
+        }
+    }
+    int row0 = wsgrid_row(g, lat0 < -90.0 ? -90.0 : lat0);
+    int row1 = wsgrid_row(g, lat1 > 90.0 ? 90.0 : lat1);
+    size_t n = 0;
+    pthread_mutex_lock(&g->lock);
+    for (int r = row0; r <= row1 && n < max; r++) {
+        for (int k = 0; k < ncols && n < max; k++) {
+            int c = (col0 + k) % g->cols;
+            for (int i = g->heads[r * g->cols + c]; i != WSGRID_NONE && n < max; i = g->entries[i].next) {
+                const wsgrid_entry_t *e = &g->entries[i];
+                if (wsgrid_distance_km(lat, lon, e->lat, e->lon) <= radius_km) out[n++] = (size_t)i;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return n;
+}
@@ -0,0 +1,72 @@
+/*
+ * File:    wsgrid.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-27
+ *
+ * Spatial interest grid of the WebSocket plugin
+ * Key features:
+ *  Fixed lat/lon cells, each cell holds an intrusive list of the entries
+ *  in it. An entry is a session slot, moving it is O(1): unlink from the
+ *  old cell, link into the new one. The radius query visits only the
+ *  cells which can intersect the circle, then filters by great-circle
+ *  distance. Used to limit the position messages to the area of interest.
+ */
+#ifndef WSGRID_H
+#define WSGRID_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define WSGRID_EARTH_RADIUS_KM  (6371.0)
+#define WSGRID_NONE             (-1)
+
+typedef struct {
+    double lat, lon;
+    int cell;           // WSGRID_NONE when the slot is not in the grid
+    int prev, next;     // neighbours in the cell list
+} wsgrid_entry_t;
+
+typedef struct {
+    double cell_deg;
+    int rows, cols;
+    int *heads;             // first entry of each cell, rows * cols
+    wsgrid_entry_t *entries;
+    size_t capacity;        // number of slots
+    size_t count;           // slots in the grid
+    pthread_mutex_t lock;
+} wsgrid_t;
+
+/** wsgrid_init
+ * Create the grid for capacity slots, with cells of cell_deg degree.
+ * Returns 0 or -1.
+ */
+int wsgrid_init(wsgrid_t *g, double cell_deg, size_t capacity);
+void wsgrid_destroy(wsgrid_t *g);
+/** wsgrid_reserve
+ * Grow the grid to at least capacity slots, doubling, the slots in it stay
+ * in place. Cheap when it is big enough already.
+ */
+int wsgrid_reserve(wsgrid_t *g, size_t capacity);
+/** wsgrid_update
+ * Place or move a slot, O(1). Returns -1 for an invalid slot or position.
+ */
+int wsgrid_update(wsgrid_t *g, size_t slot, double lat, double lon);
+/** wsgrid_remove
+ * Take a slot out of the grid, O(1).
+ */
+void wsgrid_remove(wsgrid_t *g, size_t slot);
+/** wsgrid_position
+ * Position of a slot, returns -1 if it is not in the grid.
+ */
+int wsgrid_position(wsgrid_t *g, size_t slot, double *lat, double *lon);
+/** wsgrid_query
+ * Collect the slots within radius_km of the point, at most max of them.
+ * Returns the number of slots written to out.
+ */
+size_t wsgrid_query(wsgrid_t *g, double lat, double lon, double radius_km, size_t *out, size_t max);
+/** wsgrid_distance_km
+ * Great-circle distance of two points.
+ */
+double wsgrid_distance_km(double lat1, double lon1, double lat2, double lon2);
+
+#endif // WSGRID_H
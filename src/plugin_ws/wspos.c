@@ -0,0 +1,102 @@
+/*
+ * File:    wspos.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-26
+ *
+ * Binary position protocol of the WebSocket plugin, see wspos.h.
+ * Byte order is explicit, the records are never memcpy'd as structs.
+ */
+#include <string.h>
+#include "wspos.h"
+
+#define WSPOS_COORD_SCALE   (1e7)
+#define WSPOS_HEADING_SCALE (65536.0 / 360.0)
+
+static void wspos_put_u16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+static void wspos_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+static uint16_t wspos_get_u16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+static uint32_t wspos_get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/** wspos_quantize
+ * Round to the nearest step, limited to the range.
+ */
+static int32_t wspos_quantize(double v, double limit) {
+    if (v != v) return 0; // NaN
+    if (v > limit) v = limit;
+    if (v < -limit) v = -limit;
+    v *= WSPOS_COORD_SCALE;
+    return (int32_t)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+size_t wspos_message_size(size_t count) {
+    return WSPOS_HEADER_SIZE + count * WSPOS_RECORD_SIZE;
+}
+
+int wspos_encode_header(unsigned char *buf, size_t len, wspos_kind_t kind, size_t count) {
+    if (!buf || len < WSPOS_HEADER_SIZE || count > WSPOS_MAX_RECORDS) return -1;
+    buf[0] = (unsigned char)kind;
+    buf[1] = WSPOS_VERSION;
+    wspos_put_u16(buf + 2, (uint16_t)count);
+    return WSPOS_HEADER_SIZE;
+}
+
+int wspos_encode_record(unsigned char *buf, size_t len, const wspos_record_t *r) {
+    if (!buf || !r || len < WSPOS_RECORD_SIZE) return -1;
+    double lon = r->lon;
+    if (lon > 180.0 || lon < -180.0) {
+        lon -= 360.0 * (long)(lon / 360.0);
+        if (lon > 180.0) lon -= 360.0;
+        if (lon < -180.0) lon += 360.0;
+    }
+    double heading = r->heading;
+    if (heading != heading) heading = 0.0;
+    heading -= 360.0 * (long)(heading / 360.0);
+    if (heading < 0.0) heading += 360.0;
+    uint32_t h = (uint32_t)(heading * WSPOS_HEADING_SCALE + 0.5);
+    wspos_put_u32(buf, r->user_id);
+    wspos_put_u32(buf + 4, (uint32_t)wspos_quantize(r->lat, 90.0));
+    wspos_put_u32(buf + 8, (uint32_t)wspos_quantize(lon, 180.0));
+    wspos_put_u16(buf + 12, (uint16_t)(h & 0xFFFF));
+    wspos_put_u16(buf + 14, 0);
+    wspos_put_u32(buf + 16, r->timestamp);
+    return WSPOS_RECORD_SIZE;
+}
+
+int wspos_decode_header(const unsigned char *buf, size_t len, wspos_kind_t *kind, size_t *count) {
+    if (!buf || len < WSPOS_HEADER_SIZE) return -1;
+    if (buf[1] != WSPOS_VERSION) return -1;
+    size_t n = wspos_get_u16(buf + 2);
+    if (len != wspos_message_size(n)) return -1;
+    switch (buf[0]) {
+        case WSPOS_KIND_UPDATE_USER_POS:
+        case WSPOS_KIND_GET_USER_POS:
+        case WSPOS_KIND_USERS_POS:
+            break;
+        default:
+            return -1;
+    }
+    if (kind) *kind = (wspos_kind_t)buf[0];
+    if (count) *count = n;
+    return 0;
+}
+
+void wspos_decode_record(const unsigned char *buf, size_t index, wspos_record_t *r) {
+    const unsigned char *p = buf + WSPOS_HEADER_SIZE + index * WSPOS_RECORD_SIZE;
+    r->user_id = wspos_get_u32(p);
+    r->lat = (int32_t)wspos_get_u32(p + 4) / WSPOS_COORD_SCALE;
+    r->lon = (int32_t)wspos_get_u32(p + 8) / WSPOS_COORD_SCALE;
+    r->heading = wspos_get_u16(p + 12) / WSPOS_HEADING_SCALE;
+    r->timestamp = wspos_get_u32(p + 16);
+}
@@ -0,0 +1,76 @@
+/*
+ * File:    wspos.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-26
+ *
+ * Binary position protocol of the WebSocket plugin
+ * Key features:
+ *  The position messages are the most frequent ones, these can travel in
+ *  binary frames as fixed size little-endian records instead of JSON.
+ *  The client asks for it in the hello message ("pos_formats"), and the
+ *  server answers the selected one in user_data ("pos_format").
+ *  The same schema is implemented by www/j/PositionProtocol.js.
+ *
+ * Message: header, then count records.
+ *  offset size  header
+ *   0      1    kind, WSPOS_KIND_*
+ *   1      1    schema version, WSPOS_VERSION
+ *   2      2    record count (u16)
+ *  offset size  record
+ *   0      4    user id (u32)
+ *   4      4    latitude  (i32, 1e-7 degree)
+ *   8      4    longitude (i32, 1e-7 degree)
+ *  12      2    heading (u16, 360/65536 degree)
+ *  14      2    flags (u16, reserved, 0)
+ *  16      4    timestamp (u32, unix seconds)
+ */
+#ifndef WSPOS_H
+#define WSPOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WSPOS_VERSION       (1)
+#define WSPOS_FORMAT_NAME   "bin1"      // negotiated name of this schema version
+#define WSPOS_HEADER_SIZE   (4)
+#define WSPOS_RECORD_SIZE   (20)
+#define WSPOS_MAX_RECORDS   (0xFFFF)
+
+/** Message kinds, the values are the same as the ids of the JSON message types. */
+typedef enum {
+    WSPOS_KIND_UPDATE_USER_POS = 7, // client -> server: own position, one record
+    WSPOS_KIND_GET_USER_POS = 8,    // client -> server: one record, only the user id is used
+    WSPOS_KIND_USERS_POS = 9        // both: request with no record, answer with the records
+} wspos_kind_t;
+
+/** One decoded position record. */
+typedef struct {
+    uint32_t user_id;
+    double lat, lon;        // degree
+    double heading;         // degree, 0..360
+    uint32_t timestamp;     // unix seconds
+} wspos_record_t;
+
+/** wspos_message_size
+ * Size of a message with count records.
+ */
+size_t wspos_message_size(size_t count);
+/** wspos_encode_header
+ * Write the message header, returns WSPOS_HEADER_SIZE, or -1 if too short.
+ */
+int wspos_encode_header(unsigned char *buf, size_t len, wspos_kind_t kind, size_t count);
+/** wspos_encode_record
+ * Quantize and write one record, returns WSPOS_RECORD_SIZE, or -1 if too short.
+ */
+int wspos_encode_record(unsigned char *buf, size_t len, const wspos_record_t *r);
+/** wspos_decode_header
+ * Check the header against the message length. Returns 0 and the kind and
+ * the record count, -1 if the message is malformed or of another version.
+ */
+int wspos_decode_header(const unsigned char *buf, size_t len, wspos_kind_t *kind, size_t *count);
+/** wspos_decode_record
+ * Read the record at index, after wspos_decode_header() accepted the message.
+ */
+void wspos_decode_record(const unsigned char *buf, size_t index, wspos_record_t *r);
+
+#endif // WSPOS_H
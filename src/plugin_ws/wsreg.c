@@ -0,0 +1,264 @@
+/*
+ * File:    wsreg.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-29
+ *
+ * Session registry of the WebSocket plugin, see wsreg.h.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "wsreg.h"
+
+// the item follows the entry, aligned for any type
+#define WSREG_ITEM_OFFSET ((sizeof(wsreg_entry_t) + 15) & ~(size_t)15)
+#define WSREG_ITEM(e) ((void *)((char *)(e) + WSREG_ITEM_OFFSET))
+#define WSREG_ENTRY(item) ((wsreg_entry_t *)((char *)(item) - WSREG_ITEM_OFFSET))
+
+static size_t wsreg_hash_session(const wsreg_t *r, const void *session) {
+    uint64_t h = (uint64_t)(uintptr_t)session * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) & (r->buckets - 1);
+}
+static size_t wsreg_hash_user(const wsreg_t *r, int user_id) {
+    uint64_t h = (uint64_t)(unsigned int)user_id * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) & (r->buckets - 1);
+}
+
+static wsreg_entry_t *wsreg_lookup(const wsreg_t *r, const void *session) {
+    wsreg_entry_t *e = r->by_session[wsreg_hash_session(r, session)];
+    while (e && e->session != session) e = e->next_session;
+    return e;
+}
+
+static void wsreg_unlink_user(wsreg_t *r, wsreg_entry_t *e) {
+    if (e->user_id == WSREG_NO_USER) return;
+    wsreg_entry_t **p = &r->by_user[wsreg_hash_user(r, e->user_id)];
+    while (*p && *p != e) p = &(*p)->next_user;
+    if (*p) *p = e->next_user;
+    e->next_user = NULL;
+}
+
+static void *wsreg_acquire(wsreg_entry_t *e) {
+    if (!e) return NULL;
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_ACQ_REL);
+    return WSREG_ITEM(e);
+}
+
+/** wsreg_rehash
+ * Double the buckets of both indexes, under the write lock.
+ */
+static int wsreg_rehash(wsreg_t *r) {
+    size_t buckets = r->buckets * 2;
+    wsreg_entry_t **by_session = calloc(buckets, sizeof(wsreg_entry_t *));
+    wsreg_entry_t **by_user = calloc(buckets, sizeof(wsreg_entry_t *));
+    if (!by_session || !by_user) {
+        free(by_session);
+        free(by_user);
+        return -1;
+    }
+    free(r->by_session);
+    free(r->by_user);
+    r->by_session = by_session;
+    r->by_user = by_user;
+    r->buckets = buckets;
+    for (size_t i = 0; i < r->used; i++) {
+        wsreg_entry_t *e = r->slots[i];
+        if (!e) continue;
+        size_t k = wsreg_hash_session(r, e->session);
+        e->next_session = by_session[k];
+        by_session[k] = e;
+        if (e->user_id != WSREG_NO_USER) {
+            k = wsreg_hash_user(r, e->user_id);
+            e->next_user = by_user[k];
+            by_user[k] = e;
+        }
+    }
+    return 0;
+}
+
+/** wsreg_grow
+ * Double the slots, under the write lock.
+ */
+static int wsreg_grow(wsreg_t *r) {
+    size_t capacity = r->capacity * 2;
+    wsreg_entry_t **slots = realloc(r->slots, sizeof(wsreg_entry_t *) * capacity);
+    if (!slots) return -1;
+    r->slots = slots;
+    size_t *free_slots = realloc(r->free_slots, sizeof(size_t) * capacity);
+    if (!free_slots) return -1;
+    r->free_slots = free_slots;
+    for (size_t i = r->capacity; i < capacity; i++) slots[i] = NULL;
+    r->capacity = capacity;
+    return 0;
+}
+
+int wsreg_init(wsreg_t *r, size_t capacity, wsreg_free_fn free_item) {
+    if (!r) return -1;
+    memset(r, 0, sizeof(*r));
+    if (capacity < 16) capacity = 16;
+    r->buckets = 16;
+    while (r->buckets < capacity) r->buckets *= 2;
+    r->capacity = capacity;
+    r->by_session = calloc(r->buckets, sizeof(wsreg_entry_t *));
+    r->by_user = calloc(r->buckets, sizeof(wsreg_entry_t *));
+    r->slots = calloc(capacity, sizeof(wsreg_entry_t *));
+    r->free_slots = malloc(sizeof(size_t) * capacity);
+    if (!r->by_session || !r->by_user || !r->slots || !r->free_slots) {
+        free(r->by_session);
+        free(r->by_user);
+        free(r->slots);
+        free(r->free_slots);
+        memset(r, 0, sizeof(*r));
+        return -1;
+    }
+    r->free_item = free_item;
+    pthread_rwlock_init(&r->lock, NULL);
+    r->ready = 1;
+    return 0;
+}
+
+void wsreg_destroy(wsreg_t *r) {
+    if (!r || !r->ready) return;
+    for (size_t i = 0; i < r->used; i++) {
+        if (r->slots[i]) wsreg_release(WSREG_ITEM(r->slots[i]));
+    }
+    pthread_rwlock_destroy(&r->lock);
+    free(r->by_session);
+    free(r->by_user);
+    free(r->slots);
+    free(r->free_slots);
+    memset(r, 0, sizeof(*r));
+}
+
+void *wsreg_add(wsreg_t *r, const void *session, const void *init, size_t item_size) {
+    if (!r || !r->ready || !session) return NULL;
+    wsreg_entry_t *e = calloc(1, WSREG_ITEM_OFFSET + item_size);
+    if (!e) return NULL;
+    if (init) memcpy(WSREG_ITEM(e), init, item_size);
+    e->session = session;
+    e->user_id = WSREG_NO_USER;
+    e->refs = 1;
+    e->reg = r;
+    pthread_rwlock_wrlock(&r->lock);
+    if (wsreg_lookup(r, session) ||
+        (r->count >= r->buckets && wsreg_rehash(r)) ||
+        (!r->free_count && r->used == r->capacity && wsreg_grow(r))) {
+        pthread_rwlock_unlock(&r->lock);
+        free(e);
+        return NULL;
+    }
+    e->slot = r->free_count ? r->free_slots[--r->free_count] : r->used++;
+    r->slots[e->slot] = e;
+    size_t k = wsreg_hash_session(r, session);
+    e->next_session = r->by_session[k];
+    r->by_session[k] = e;
+    r->count++;
+    pthread_rwlock_unlock(&r->lock);
+    return WSREG_ITEM(e);
+}
+
+int wsreg_remove(wsreg_t *r, const void *session) {
+    if (!r || !r->ready) return -1;
+    pthread_rwlock_wrlock(&r->lock);
+    wsreg_entry_t **p = &r->by_session[wsreg_hash_session(r, session)];
+    while (*p && (*p)->session != session) p = &(*p)->next_session;
+    wsreg_entry_t *e = *p;
+    if (e) {
+        *p = e->next_session;
+        wsreg_unlink_user(r, e);
+        r->slots[e->slot] = NULL;
+        r->free_slots[r->free_count++] = e->slot;
+        r->count--;
+    }
+    pthread_rwlock_unlock(&r->lock);
+    if (!e) return -1;
+    wsreg_release(WSREG_ITEM(e));
+    return 0;
+}
+
+int wsreg_set_user(wsreg_t *r, const void *session, int user_id) {
+    if (!r || !r->ready) return -1;
+    pthread_rwlock_wrlock(&r->lock);
+    wsreg_entry_t *e = wsreg_lookup(r, session);
+    if (e && e->user_id != user_id) {
+        wsreg_unlink_user(r, e);
+        e->user_id = user_id;
+        if (user_id != WSREG_NO_USER) {
+            size_t k = wsreg_hash_user(r, user_id);
+            e->next_user = r->by_user[k];
+            r->by_user[k] = e;
+        }
+    }
+    pthread_rwlock_unlock(&r->lock);
+    return e ? 0 : -1;
+}
+
+void *wsreg_find(wsreg_t *r, const void *session) {
+    if (!r || !r->ready) return NULL;
+    pthread_rwlock_rdlock(&r->lock);
+    void *item = wsreg_acquire(wsreg_lookup(r, session));
+    pthread_rwlock_unlock(&r->lock);
+    return item;
+}
+
+void *wsreg_find_user(wsreg_t *r, int user_id) {
+    if (!r || !r->ready || user_id == WSREG_NO_USER) return NULL;
+    pthread_rwlock_rdlock(&r->lock);
+    wsreg_entry_t *e = r->by_user[wsreg_hash_user(r, user_id)];
+    while (e && e->user_id != user_id) e = e->next_user;
+    void *item = wsreg_acquire(e);
+    pthread_rwlock_unlock(&r->lock);
+    return item;
+}
+
+void *wsreg_get(wsreg_t *r, size_t slot) {
+    if (!r || !r->ready) return NULL;
+    void *item = NULL;
+    pthread_rwlock_rdlock(&r->lock);
+    if (slot < r->used) item = wsreg_acquire(r->slots[slot]);
+    pthread_rwlock_unlock(&r->lock);
+    return item;
+}
+
+void wsreg_release(void *item) {
+    if (!item) return;
+    wsreg_entry_t *e = WSREG_ENTRY(item);
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (e->reg->free_item) e->reg->free_item(item);
+        free(e);
+    }
+}
+
+size_t wsreg_slot(const void *item) {
+    return WSREG_ENTRY(item)->slot;
+}
+
+size_t wsreg_foreach(wsreg_t *r, wsreg_visit_fn fn, void *arg) {
+    if (!r || !r->ready || !fn) return 0;
+    size_t n = 0;
+    pthread_rwlock_rdlock(&r->lock);
+    for (size_t i = 0; i < r->used; i++) {
+        if (!r->slots[i]) continue;
+        n++;
+        if (fn(WSREG_ITEM(r->slots[i]), arg)) break;
+    }
+    pthread_rwlock_unlock(&r->lock);
+    return n;
+}
+
+size_t wsreg_count(wsreg_t *r) {
+    if (!r || !r->ready) return 0;
+    pthread_rwlock_rdlock(&r->lock);
+    size_t n = r->count;
+    pthread_rwlock_unlock(&r->lock);
+    return n;
+}
+
+size_t wsreg_capacity(wsreg_t *r) {
+    if (!r || !r->ready) return 0;
+    pthread_rwlock_rdlock(&r->lock);
+    size_t n = r->used;
+    pthread_rwlock_unlock(&r->lock);
+    return n;
+}
@@ -0,0 +1,104 @@
+/*
+ * File:    wsreg.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-29
+ *
+ * Session registry of the WebSocket plugin
+ * Key features:
+ *  Dynamically sized, the items (application contexts) are allocated by
+ *  the registry. Hashed by session and by user id, both lookups are O(1).
+ *  Every item has a stable slot number (used by the interest grid), freed
+ *  slots are reused.
+ *  The items are reference counted: a lookup returns an acquired item, it
+ *  stays valid until released, even if the session is removed meanwhile.
+ *  The last release calls the free callback. A read-write lock guards the
+ *  indexes, iteration holds the read lock, so a broadcast does not block
+ *  the other broadcasts, only connects and disconnects.
+ */
+#ifndef WSREG_H
+#define WSREG_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define WSREG_NO_USER   (-1)
+
+typedef void (*wsreg_free_fn)(void *item);
+// Visitor of wsreg_foreach, nonzero stops the iteration.
+typedef int (*wsreg_visit_fn)(void *item, void *arg);
+
+struct wsreg_t;
+typedef struct wsreg_entry_t {
+    const void *session;
+    int user_id;
+    size_t slot;
+    int refs;           // the registry holds one while the item is registered
+    struct wsreg_entry_t *next_session, *next_user;
+    struct wsreg_t *reg;
+} wsreg_entry_t;
+
+typedef struct wsreg_t {
+    pthread_rwlock_t lock;
+    wsreg_entry_t **by_session;
+    wsreg_entry_t **by_user;
+    size_t buckets;         // power of two
+    wsreg_entry_t **slots;
+    size_t *free_slots;     // stack of the released slot numbers
+    size_t free_count;
+    size_t used;            // slots ever used
+    size_t capacity;
+    size_t count;
+    wsreg_free_fn free_item;
+    int ready;              // set by wsreg_init, the slots move when growing
+} wsreg_t;
+
+/** wsreg_init
+ * Create the registry for capacity items, it grows when needed.
+ * free_item is called with the item after its last release, can be NULL.
+ * Returns 0 or -1.
+ */
+int wsreg_init(wsreg_t *r, size_t capacity, wsreg_free_fn free_item);
+/** wsreg_destroy
+ * Release the items still registered, nothing may hold them anymore.
+ */
+void wsreg_destroy(wsreg_t *r);
+/** wsreg_add
+ * Register a new session with an item of item_size bytes, initialized from
+ * init (zeroed if NULL) before the others can see it. The item belongs to
+ * the session's thread until wsreg_remove, it is not acquired.
+ * Returns NULL if the session is already registered or on error.
+ */
+void *wsreg_add(wsreg_t *r, const void *session, const void *init, size_t item_size);
+/** wsreg_remove
+ * Unregister the session and drop the registry's reference.
+ * Returns -1 if it was not registered.
+ */
+int wsreg_remove(wsreg_t *r, const void *session);
+/** wsreg_set_user
+ * Index the session by its user too, WSREG_NO_USER removes that index.
+ */
+int wsreg_set_user(wsreg_t *r, const void *session, int user_id);
+/** wsreg_find, wsreg_find_user, wsreg_get
+ * Acquired item of a session, of a user (any of its sessions) or of a slot,
+ * NULL if there is none. Release it with wsreg_release.
+ */
+void *wsreg_find(wsreg_t *r, const void *session);
+void *wsreg_find_user(wsreg_t *r, int user_id);
+void *wsreg_get(wsreg_t *r, size_t slot);
+void wsreg_release(void *item);
+/** wsreg_slot
+ * Slot number of an item, stable while it is registered.
+ */
+size_t wsreg_slot(const void *item);
+/** wsreg_foreach
+ * Visit the registered items under the read lock, returns the number of
+ * visited items. The visitor must not add or remove sessions.
+ */
+size_t wsreg_foreach(wsreg_t *r, wsreg_visit_fn fn, void *arg);
+size_t wsreg_count(wsreg_t *r);
+/** wsreg_capacity
+ * Upper bound of the slot numbers.
+ */
+size_t wsreg_capacity(wsreg_t *r);
+
+#endif // WSREG_H
@@ -0,0 +1,234 @@
+/*
+ * File:    wssync.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-28
+ *
+ * Delta synchronization of the WebSocket plugin, see wssync.h.
+ */
+#include <stdlib.h>
+#include "wssync.h"
+
+#define WSSYNC_MIN_BUCKETS (64)
+
+static size_t wssync_hash(const wssync_store_t *st, int id) {
+    uint64_t h = (uint64_t)(unsigned int)id * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) & (st->buckets - 1);
+}
+
+static int wssync_find(const wssync_store_t *st, int id) {
+    if (!st->buckets) return WSSYNC_NONE;
+    int i = st->by_id[wssync_hash(st, id)];
+    while (i != WSSYNC_NONE && st->entities[i].id != id) i = st->entities[i].next_id;
+    return i;
+}
+
+static void wssync_link_id(wssync_store_t *st, int i) {
+    size_t k = wssync_hash(st, st->entities[i].id);
+    st->entities[i].next_id = st->by_id[k];
+    st->by_id[k] = i;
+}
+
+/** wssync_relink_id
+ * The id index refers to the entity from as to, to is the next one in the
+ * chain when from leaves the index.
+ */
+static void wssync_relink_id(wssync_store_t *st, int from, int to) {
+    int *p = &st->by_id[wssync_hash(st, st->entities[from].id)];
+    while (*p != from) p = &st->entities[*p].next_id;
+    *p = to;
+}
+
+/** wssync_rehash
+ * Double the buckets of the id index, it is rebuilt from the entities.
+ */
+static int wssync_rehash(wssync_store_t *st) {
+    size_t buckets = st->buckets ? st->buckets * 2 : WSSYNC_MIN_BUCKETS;
+    int *by_id = malloc(sizeof(int) * buckets);
+    if (!by_id) return -1;
+    for (size_t k = 0; k < buckets; k++) by_id[k] = WSSYNC_NONE;
+    free(st->by_id);
+    st->by_id = by_id;
+    st->buckets = buckets;
+    for (size_t i = 0; i < st->count; i++) wssync_link_id(st, (int)i);
+    return 0;
+}
+
+static void wssync_unlink(wssync_store_t *st, int i) {
+    wssync_entity_t *e = &st->entities[i];
+    if (e->prev != WSSYNC_NONE) st->entities[e->prev].next = e->next;
+    else st->head = e->next;
+    if (e->next != WSSYNC_NONE) st->entities[e->next].prev = e->prev;
+    else st->tail = e->prev;
+    e->prev = e->next = WSSYNC_NONE;
+}
+
+/** wssync_append
+ * Give the entity the next version and link it as the newest.
+ */
+static uint32_t wssync_append(wssync_store_t *st, int i) {
+    wssync_entity_t *e = &st->entities[i];
+    e->version = ++st->clock;
+    e->prev = st->tail;
+    e->next = WSSYNC_NONE;
+    if (st->tail != WSSYNC_NONE) st->entities[st->tail].next = i;
+    else st->head = i;
+    st->tail = i;
+    return e->version;
+}
+
+/** wssync_drop
+ * Free the slot of an unlinked entity: the last one moves into its place.
+ */
+static void wssync_drop(wssync_store_t *st, int i) {
+    wssync_relink_id(st, i, st->entities[i].next_id);
+    int last = (int)--st->count;
+    if (i == last) return;
+    wssync_relink_id(st, last, i);
+    wssync_entity_t *e = &st->entities[i];
+    *e = st->entities[last];
+    if (e->prev != WSSYNC_NONE) st->entities[e->prev].next = i;
+    else st->head = i;
+    if (e->next != WSSYNC_NONE) st->entities[e->next].prev = i;
+    else st->tail = i;
+}
+
+/** wssync_purge
+ * Forget the oldest tombstones down to half of the limit, the horizon moves
+ * to the newest one forgotten. Called under the lock.
+ */
+static void wssync_purge(wssync_store_t *st) {
+    int i = st->head;
+    while (i != WSSYNC_NONE && st->tombstones > st->tombstone_max / 2) {
+        int next = st->entities[i].next;
+        if (st->entities[i].deleted) {
+            st->horizon = st->entities[i].version;
+            wssync_unlink(st, i);
+            if (next == (int)st->count - 1) next = i;   // moved by the drop
+            wssync_drop(st, i);
+            st->tombstones--;
+        }
+        i = next;
+    }
+}
+
+int wssync_init(wssync_store_t *st, size_t tombstone_max) {
+    if (!st) return -1;
+    st->entities = NULL;
+    st->count = st->capacity = 0;
+    st->by_id = NULL;
+    st->buckets = 0;
+    st->head = st->tail = WSSYNC_NONE;
+    st->clock = st->horizon = 0;
+    st->tombstones = 0;
+    st->tombstone_max = tombstone_max ? tombstone_max : WSSYNC_TOMBSTONE_MAX;
+    pthread_mutex_init(&st->lock, NULL);
+    return 0;
+}
+
+void wssync_destroy(wssync_store_t *st) {
+    if (!st || !st->tombstone_max) return;
+    pthread_mutex_destroy(&st->lock);
+    free(st->entities);
+    free(st->by_id);
+    st->entities = NULL;
+    st->by_id = NULL;
+    st->count = st->capacity = st->buckets = 0;
+    st->tombstone_max = 0;
+}
+
+uint32_t wssync_touch(wssync_store_t *st, int id) {
+    if (!st || !st->tombstone_max) return 0;
+    uint32_t version = 0;
+    pthread_mutex_lock(&st->lock);
+    int i = wssync_find(st, id);
+    if (i == WSSYNC_NONE) {
+        if (st->count == st->capacity) {
+            size_t capacity = st->capacity ? st->capacity * 2 : 64;
+            wssync_entity_t *p = realloc(st->entities, sizeof(wssync_entity_t) * capacity);
+            if (!p) {
+                pthread_mutex_unlock(&st->lock);
+                return 0;
+            }
+            st->entities = p;
+            st->capacity = capacity;
+        }
+        if (st->count >= st->buckets && wssync_rehash(st)) {
+            pthread_mutex_unlock(&st->lock);
+            return 0;
+        }
+        i = (int)st->count++;
+        st->entities[i].id = id;
+        st->entities[i].deleted = 0;
+        wssync_link_id(st, i);
+    } else {
+        wssync_unlink(st, i);
+        if (st->entities[i].deleted) {
+            st->entities[i].deleted = 0;
+            st->tombstones--;
+        }
+    }
+    version = wssync_append(st, i);
+    pthread_mutex_unlock(&st->lock);
+    return version;
+}
+
+uint32_t wssync_remove(wssync_store_t *st, int id) {
+    if (!st || !st->tombstone_max) return 0;
+    uint32_t version = 0;
+    pthread_mutex_lock(&st->lock);
+    int i = wssync_find(st, id);
+    if (i != WSSYNC_NONE && !st->entities[i].deleted) {
+        wssync_unlink(st, i);
+        st->entities[i].deleted = 1;
+        st->tombstones++;
+        version = wssync_append(st, i);
+        if (st->tombstones > st->tombstone_max) wssync_purge(st);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return version;
+}
+
+uint32_t wssync_version(wssync_store_t *st, int id) {
+    if (!st || !st->tombstone_max) return 0;
+    uint32_t version = 0;
+    pthread_mutex_lock(&st->lock);
+    int i = wssync_find(st, id);
+    if (i != WSSYNC_NONE && !st->entities[i].deleted) version = st->entities[i].version;
+    pthread_mutex_unlock(&st->lock);
+    return version;
+}
+
+/** wssync_delta
+ * The first change after since is searched from the newest end, so an up to
+ * date session costs nothing and a slightly behind one only its changes.
+ */
+size_t wssync_delta(wssync_store_t *st, uint32_t since, wssync_change_t *out, size_t max, uint32_t *upto, int *full) {
+    if (!st || !st->tombstone_max || !out || !max) return 0;
+    size_t n = 0;
+    pthread_mutex_lock(&st->lock);
+    int rebuild = since == 0 || since < st->horizon || since > st->clock;
+    if (rebuild) since = 0;
+    int i = st->tail;
+    while (i != WSSYNC_NONE && st->entities[i].prev != WSSYNC_NONE
+        && st->entities[st->entities[i].prev].version > since) {
+        i = st->entities[i].prev;
+    }
+    if (i != WSSYNC_NONE && st->entities[i].version <= since) i = WSSYNC_NONE;
+    uint32_t last = st->clock;
+    for (; i != WSSYNC_NONE; i = st->entities[i].next) {
+        const wssync_entity_t *e = &st->entities[i];
+        if (rebuild && e->deleted) continue;
+        if (n == max) {
+            last = st->entities[e->prev].version;
+            break;
+        }
+        out[n].id = e->id;
+        out[n].version = e->version;
+        out[n].deleted = e->deleted;
+        n++;
+    }
+    pthread_mutex_unlock(&st->lock);
+    if (upto) *upto = last;
+    if (full) *full = rebuild;
+    return n;
+}
@@ -0,0 +1,88 @@
+/*
+ * File:    wssync.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-28
+ *
+ * Delta synchronization of the WebSocket plugin
+ * Key features:
+ *  Every entity kind (the users now) has a store with a logical clock. A change gives the entity the next version and moves it
+ *  to the end of the store's version ordered list, a removal leaves a
+ *  tombstone. A session remembers the last version sent for each kind
+ *  (its version vector), so the delta is the tail of the list after that
+ *  version: O(changes), not O(entities). The entities are indexed by id
+ *  in hash chains, so a change does not scan the store.
+ *  Tombstones are limited; when older ones are purged, the sessions behind
+ *  the purge horizon get a full resend instead of a delta.
+ */
+#ifndef WSSYNC_H
+#define WSSYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define WSSYNC_NONE             (-1)
+#define WSSYNC_TOMBSTONE_MAX    (1024)
+
+typedef enum {
+    WSSYNC_USERS,
+    WSSYNC_KIND_MAX
+} wssync_kind_t;
+
+typedef struct {
+    int id;
+    uint32_t version;
+    int deleted;
+    int prev, next;     // version order
+    int next_id;        // chain of the id index
+} wssync_entity_t;
+
+typedef struct {
+    wssync_entity_t *entities;
+    size_t count, capacity;
+    int *by_id;         // id index, chains of entity numbers
+    size_t buckets;     // power of two, 0 until the first change
+    int head, tail;     // oldest, newest version
+    uint32_t clock;     // version of the last change
+    uint32_t horizon;   // tombstones up to this version are purged
+    size_t tombstones;
+    size_t tombstone_max;   // 0: not initialized
+    pthread_mutex_t lock;
+} wssync_store_t;
+
+/** One entry of a delta. */
+typedef struct {
+    int id;
+    uint32_t version;
+    int deleted;
+} wssync_change_t;
+
+/** Last version sent to a session, for each kind. 0: nothing sent yet. */
+typedef struct {
+    uint32_t sent[WSSYNC_KIND_MAX];
+} wssync_vector_t;
+
+int wssync_init(wssync_store_t *st, size_t tombstone_max);
+void wssync_destroy(wssync_store_t *st);
+/** wssync_touch
+ * The entity is created or changed, returns its new version (0 on error).
+ */
+uint32_t wssync_touch(wssync_store_t *st, int id);
+/** wssync_remove
+ * The entity is deleted, returns the version of the tombstone, 0 if unknown.
+ */
+uint32_t wssync_remove(wssync_store_t *st, int id);
+/** wssync_version
+ * Current version of an entity, 0 if unknown or deleted.
+ */
+uint32_t wssync_version(wssync_store_t *st, int id);
+/** wssync_delta
+ * Collect the changes after version since, oldest first, at most max.
+ * *full is set when the receiver has to rebuild its state: nothing was sent
+ * yet, or since is behind the purge horizon; then only the live entities
+ * are listed. *upto is the version the receiver is in sync with after
+ * these changes, store it in the version vector.
+ */
+size_t wssync_delta(wssync_store_t *st, uint32_t since, wssync_change_t *out, size_t max, uint32_t *upto, int *full);
+
+#endif // WSSYNC_H
@@ -608,6 +608,7 @@ void *housekeeper_thread(void *arg) {
         time_t now = time(NULL);
         housekeeper_plugins(now);
         housekeeper_server_clients(now);
+        cache_result_expire();
         for (int i = 0; i<5; i++) {
             if (g_housekeeper.running) {
                 sleep(1);
@@ -688,13 +689,17 @@ const PluginHostInterface g_plugin_host = {
     .http = {
         .send_response = send_response,
         .send_file = send_file,
-        /*
+        .send_data = send_data,
         .send_chunk_head = send_chunk_head,
         .send_chunk_end = send_chunk_end,
-        .send_chunks = send_chunks*/
+        .send_chunks = send_chunks,
+        .send_file_headers = send_file_headers,
+        .send_data_headers = send_data_headers
     },
     .ws = {
         .handshake = ws_hostside_handshake,
+        .register_messages = register_ws_messages,
+        .message_search = ws_message_search,
     },
     .map = {
         .start_map_context= start_map_context,
@@ -707,7 +712,9 @@ const PluginHostInterface g_plugin_host = {
         .create = image_create,
         .destroy = image_destroy,
         .get_buffer = image_get_buffer,
-        .write_row = image_write_row
+        .write_row = image_write_row,
+        .set_options = image_set_options,
+        .codecs = image_codecs
     },
     .cache = {
         .get_dir = cache_get_dir,
@@ -718,5 +725,14 @@ const PluginHostInterface g_plugin_host = {
         .file_rename = cache_file_rename,
         .file_exists_recent = cache_file_exists_recent,
         .file_write = cache_file_write,
+        .result_key = cache_result_key,
+        .result_generation = cache_result_generation,
+        .result_get = cache_result_get,
+        .result_data = cache_result_data,
+        .result_release = cache_result_release,
+        .result_put = cache_result_put,
+        .result_invalidate = cache_result_invalidate,
+        .result_invalidate_sql = cache_result_invalidate_sql,
+        .result_stats = cache_result_stats,
     }
 };
\ No newline at end of file
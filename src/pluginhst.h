@@ -28,6 +28,7 @@ extern PluginContext g_Plugins[MAX_PLUGIN];
 
 // other internal forwards
 void ws_hostside_handshake(PluginContext *pc, WsRequestParams* wsp, const char *msg);
+void register_ws_messages(PluginContext *pc, int count, const char *types[]);
 
 
 //MAP
@@ -42,6 +43,8 @@ int image_create(PluginContext *pc, Image *image, const char *filename, unsigned
 int image_destroy(PluginContext *pc, Image *image);
 void image_get_buffer(PluginContext *pc, Image *image, void** buffer);
 void image_write_row(PluginContext *pc, Image *image, void *row);
+int image_set_options(PluginContext *pc, Image *image, const ImageEncodeOptions *opt);
+unsigned int image_codecs(PluginContext *pc);
 
 void register_http_routes(PluginContext *ctx, int count, const char *routes[]);
 void register_ws_routes(PluginContext *ctx, int count, const char *routes[]);
@@ -0,0 +1,643 @@
+/*
+ * File:    resultcache.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-05
+ *
+ * In-memory result cache of the host, see resultcache.h.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "resultcache.h"
+
+#define CACHE_RESULT_MIN_BUCKETS    (256)
+#define CACHE_RESULT_TAG_BUCKETS    (64)
+#define CACHE_RESULT_TAGS_LEN       (256)
+#define CACHE_RESULT_WORD_LEN       (64)
+#define CACHE_RESULT_TAG_SIZE(len)  (sizeof(CacheResultTag) + (len) + 1)
+
+typedef struct CacheResultTag CacheResultTag;
+
+// An entry in the list of a tag, one for each tag of the entry.
+typedef struct CacheResultLink {
+    struct CacheResultLink *prev;
+    struct CacheResultLink *next;
+    CacheResultTag *tag;
+    CacheResult *entry;
+} CacheResultLink;
+
+// A table: its entries and its last invalidation. Kept while the memory
+// allows, the tables of a database are few.
+struct CacheResultTag {
+    CacheResultTag *hnext;          // bucket chain
+    CacheResultLink *entries;
+    unsigned long hash;
+    unsigned long generation;       // of the last invalidation, 0: never
+    size_t size;                    // accounted bytes
+    char name[];
+};
+
+struct CacheResult {
+    struct CacheResult *hnext;      // bucket chain
+    struct CacheResult *prev;       // LRU list, the most recent first
+    struct CacheResult *next;
+    unsigned long hash;
+    long long expires;              // ms, monotonic
+    int refs;                       // one is the cache's while it is linked
+    size_t size;                    // accounted bytes, the links included
+    size_t len;
+    const char *key;
+    const char *tags;               // ",t1,t2," or empty
+    CacheResultLink *links;         // while linked, one for each tag
+    size_t link_count;
+    char data[];                    // data, key, tags
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheResult **buckets;
+    size_t bucket_count;            // a power of 2
+    CacheResult *head;
+    CacheResult *tail;
+    CacheResultTag **tag_buckets;
+    size_t tag_bucket_count;        // a power of 2
+    size_t tag_count;
+    unsigned long generation;       // counts the invalidations
+    unsigned long horizon;          // older generations are stale, a tag could not be recorded
+    int ttl_sec;
+    CacheResultStats stats;
+} cache_result_t;
+
+static cache_result_t g_cache_result = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static long long cache_result_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long cache_result_hash(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/** cache_result_tag
+ * The tag of the table name (len bytes), created if create is set. Under
+ * the lock. Returns NULL if it is unknown, or no memory.
+ */
+static CacheResultTag *cache_result_tag(cache_result_t *c, const char *name, size_t len, int create) {
+    unsigned long hash = 2166136261UL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619UL;
+    }
+    CacheResultTag *g = c->tag_buckets[hash & (c->tag_bucket_count - 1)];
+    while (g && (g->hash != hash || strncmp(g->name, name, len) || g->name[len])) g = g->hnext;
+    if (g || !create) return g;
+    if (c->tag_count >= c->tag_bucket_count) {
+        size_t count = c->tag_bucket_count * 2;
+        CacheResultTag **buckets = calloc(count, sizeof(CacheResultTag *));
+        if (buckets) {
+            for (size_t i = 0; i < c->tag_bucket_count; i++) {
+                while (c->tag_buckets[i]) {
+                    CacheResultTag *m = c->tag_buckets[i];
+                    c->tag_buckets[i] = m->hnext;
+                    m->hnext = buckets[m->hash & (count - 1)];
+                    buckets[m->hash & (count - 1)] = m;
+                }
+            }
+            free(c->tag_buckets);
+            c->tag_buckets = buckets;
+            c->tag_bucket_count = count;
+        }
+    }
+    g = malloc(CACHE_RESULT_TAG_SIZE(len));
+    if (!g) return NULL;
+    memcpy(g->name, name, len);
+    g->name[len] = 0;
+    g->hash = hash;
+    g->generation = 0;
+    g->entries = NULL;
+    g->size = CACHE_RESULT_TAG_SIZE(len);
+    size_t i = hash & (c->tag_bucket_count - 1);
+    g->hnext = c->tag_buckets[i];
+    c->tag_buckets[i] = g;
+    c->tag_count++;
+    c->stats.bytes += g->size;
+    return g;
+}
+
+/** cache_result_tag_sweep
+ * Free the tags without entries, under the lock, when only they are left
+ * over the memory limit. Their invalidations are forgotten: the horizon
+ * moves past them, the reads begun before are stale. Returns how many.
+ */
+static size_t cache_result_tag_sweep(cache_result_t *c) {
+    size_t count = 0;
+    for (size_t i = 0; i < c->tag_bucket_count; i++) {
+        CacheResultTag **pp = &c->tag_buckets[i];
+        while (*pp) {
+            CacheResultTag *g = *pp;
+            if (g->entries) {
+                pp = &g->hnext;
+                continue;
+            }
+            *pp = g->hnext;
+            if (g->generation > c->horizon) c->horizon = g->generation;
+            c->stats.bytes -= g->size;
+            c->tag_count--;
+            free(g);
+            count++;
+        }
+    }
+    return count;
+}
+
+/** cache_result_unlink
+ * Take the entry out of the cache, under the lock. It is freed now, or by
+ * its last release.
+ */
+static void cache_result_unlink(cache_result_t *c, CacheResult *r) {
+    CacheResult **pp = &c->buckets[r->hash & (c->bucket_count - 1)];
+    while (*pp && *pp != r) pp = &(*pp)->hnext;
+    if (*pp) *pp = r->hnext;
+    for (size_t i = 0; i < r->link_count; i++) {
+        CacheResultLink *l = &r->links[i];
+        if (l->prev) l->prev->next = l->next;
+        else l->tag->entries = l->next;
+        if (l->next) l->next->prev = l->prev;
+    }
+    free(r->links);
+    r->links = NULL;
+    r->link_count = 0;
+    if (r->prev) r->prev->next = r->next;
+    else c->head = r->next;
+    if (r->next) r->next->prev = r->prev;
+    else c->tail = r->prev;
+    c->stats.bytes -= r->size;
+    c->stats.count--;
+    if (--r->refs == 0) free(r);
+}
+
+static CacheResult *cache_result_find(cache_result_t *c, const char *key, unsigned long hash) {
+    CacheResult *r = c->buckets[hash & (c->bucket_count - 1)];
+    while (r && (r->hash != hash || strcmp(r->key, key))) r = r->hnext;
+    return r;
+}
+
+/** cache_result_grow
+ * Double the buckets when the chains get long, under the lock.
+ */
+static void cache_result_grow(cache_result_t *c) {
+    size_t count = c->bucket_count * 2;
+    CacheResult **buckets = calloc(count, sizeof(CacheResult *));
+    if (!buckets) return;   // longer chains, still correct
+    for (CacheResult *r = c->head; r; r = r->next) {
+        size_t i = r->hash & (count - 1);
+        r->hnext = buckets[i];
+        buckets[i] = r;
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->bucket_count = count;
+}
+
+int cache_result_init(size_t memory_limit, int ttl_sec) {
+    cache_result_t *c = &g_cache_result;
+    pthread_mutex_lock(&c->lock);
+    if (!c->buckets) {
+        c->buckets = calloc(CACHE_RESULT_MIN_BUCKETS, sizeof(CacheResult *));
+        c->bucket_count = c->buckets ? CACHE_RESULT_MIN_BUCKETS : 0;
+    }
+    if (!c->tag_buckets) {
+        c->tag_buckets = calloc(CACHE_RESULT_TAG_BUCKETS, sizeof(CacheResultTag *));
+        c->tag_bucket_count = c->tag_buckets ? CACHE_RESULT_TAG_BUCKETS : 0;
+    }
+    c->stats.memory_limit = memory_limit ? memory_limit : CACHE_RESULT_MEMORY_DEFAULT;
+    c->ttl_sec = ttl_sec > 0 ? ttl_sec : CACHE_RESULT_TTL_DEFAULT;
+    int rc = c->buckets && c->tag_buckets ? 0 : -1;
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+void cache_result_destroy(void) {
+    cache_result_t *c = &g_cache_result;
+    pthread_mutex_lock(&c->lock);
+    while (c->head) cache_result_unlink(c, c->head);
+    free(c->buckets);
+    c->buckets = NULL;
+    c->bucket_count = 0;
+    for (size_t i = 0; i < c->tag_bucket_count; i++) {
+        while (c->tag_buckets[i]) {
+            CacheResultTag *g = c->tag_buckets[i];
+            c->tag_buckets[i] = g->hnext;
+            c->stats.bytes -= g->size;
+            free(g);
+        }
+    }
+    free(c->tag_buckets);
+    c->tag_buckets = NULL;
+    c->tag_bucket_count = 0;
+    c->tag_count = 0;
+    // the generation goes on, a read started before is still stale
+    c->horizon = c->generation;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/** cache_result_append
+ * Append len bytes to the key, keeps it terminated. Returns -1 if full.
+ */
+static int cache_result_append(char *key, size_t size, size_t *o, const char *s, size_t len) {
+    if (*o + len >= size) return -1;
+    memcpy(key + *o, s, len);
+    *o += len;
+    key[*o] = 0;
+    return 0;
+}
+
+int cache_result_key(char *key, size_t size, const char *query, const DbValue *params, int param_count) {
+    if (!key || !size || !query) return -1;
+    size_t o = 0;
+    char quote = 0;
+    int space = 0;
+    key[0] = 0;
+    while (isspace((unsigned char)*query)) query++;
+    for (; *query; query++) {
+        char ch = *query;
+        if (!quote && isspace((unsigned char)ch)) {
+            space = 1;
+            continue;
+        }
+        if (space) {
+            if (cache_result_append(key, size, &o, " ", 1)) return -1;
+            space = 0;
+        }
+        if (quote) {
+            if (ch == quote) quote = 0;
+        } else if (ch == '\'' || ch == '"' || ch == '`') {
+            quote = ch;
+        } else {
+            ch = (char)tolower((unsigned char)ch);
+        }
+        if (cache_result_append(key, size, &o, &ch, 1)) return -1;
+    }
+    for (int i = 0; params && i < param_count; i++) {
+        const DbValue *v = &params[i];
+        char tmp[48];
+        int n;
+        switch (v->type) {
+        case DB_TYPE_INT: n = snprintf(tmp, sizeof(tmp), "\x1fi%lld", v->i); break;
+        case DB_TYPE_DOUBLE: n = snprintf(tmp, sizeof(tmp), "\x1f" "d%.17g", v->d); break;
+        case DB_TYPE_TEXT: n = snprintf(tmp, sizeof(tmp), "\x1ft%zu:", v->len); break;
+        case DB_TYPE_BLOB: n = snprintf(tmp, sizeof(tmp), "\x1f" "b%zu:", v->len); break;
+        default: n = snprintf(tmp, sizeof(tmp), "\x1fn"); break;
+        }
+        if (cache_result_append(key, size, &o, tmp, (size_t)n)) return -1;
+        if (v->type == DB_TYPE_TEXT && v->s) {
+            if (cache_result_append(key, size, &o, v->s, v->len)) return -1;
+        } else if (v->type == DB_TYPE_BLOB && v->s) {
+            for (size_t j = 0; j < v->len; j++) {
+                snprintf(tmp, sizeof(tmp), "%02x", (unsigned char)v->s[j]);
+                if (cache_result_append(key, size, &o, tmp, 2)) return -1;
+            }
+        }
+    }
+    return (int)o;
+}
+
+static int cache_result_word_is(const char *word, const char *const *list) {
+    for (; *list; list++) {
+        if (!strcmp(word, *list)) return 1;
+    }
+    return 0;
+}
+
+/** cache_result_scan
+ * Collect the tables after FROM, JOIN, INTO, UPDATE, TABLE (and the rest
+ * of a FROM list). *writes tells if the statement changes something.
+ */
+static int cache_result_scan(const char *sql, char *tags, size_t size, int *writes) {
+    static const char *const table_before[] = { "from", "join", "into", "update", "table", "truncate", NULL };
+    static const char *const skip[] = { "table", "if", "not", "exists", "only", "ignore", "low_priority", NULL };
+    static const char *const list_end[] = { "where", "on", "using", "group", "order", "having", "limit", "union",
+        "join", "set", "values", "select", "natural", "left", "right", "inner", "outer", "cross", "straight_join", NULL };
+    static const char *const write_words[] = { "insert", "update", "delete", "replace", "drop", "alter",
+        "truncate", "create", NULL };
+    size_t o = 0;
+    int expect = 0;
+    int list = 0;
+    if (size) tags[0] = 0;
+    *writes = 0;
+    while (sql && *sql) {
+        char word[CACHE_RESULT_WORD_LEN];
+        size_t n = 0;
+        int quoted = 0;
+        unsigned char ch = (unsigned char)*sql;
+        if (isspace(ch)) {
+            sql++;
+            continue;
+        }
+        if (ch == '\'') {   // a literal
+            for (sql++; *sql && *sql != '\''; sql++) { }
+            if (*sql) sql++;
+            continue;
+        }
+        if (ch == '`' || ch == '"' || ch == '[') {   // a quoted identifier
+            char end = ch == '[' ? ']' : (char)ch;
+            for (sql++; *sql && *sql != end; sql++) {
+                if (n < sizeof(word) - 1) word[n++] = (char)tolower((unsigned char)*sql);
+            }
+            if (*sql) sql++;
+            quoted = 1;
+            // a schema prefix: `db`.`table`
+            if (*sql == '.') {
+                sql++;
+                continue;
+            }
+        } else if (isalnum(ch) || ch == '_' || ch == '$' || ch == '.') {
+            for (; isalnum((unsigned char)*sql) || *sql == '_' || *sql == '$' || *sql == '.'; sql++) {
+                if (*sql == '.') n = 0;   // db.table: the table
+                else if (n < sizeof(word) - 1) word[n++] = (char)tolower((unsigned char)*sql);
+            }
+        } else {
+            sql++;
+            if (ch == ',' && list) expect = 1;
+            else if (ch == '(' || ch == ')' || ch == ';') expect = list = 0;
+            continue;
+        }
+        word[n] = 0;
+        if (!n) continue;
+        if (!quoted && cache_result_word_is(word, write_words)) *writes = 1;
+        if (!quoted && cache_result_word_is(word, table_before)) {
+            list = 0;
+            expect = strcmp(word, "from") ? 1 : 2;
+            continue;
+        }
+        if (expect && !quoted && cache_result_word_is(word, skip)) continue;
+        if (expect) {
+            char entry[CACHE_RESULT_WORD_LEN + 2];
+            snprintf(entry, sizeof(entry), ",%s,", word);
+            if (!strstr(tags, entry) && o + strlen(entry) < size) {
+                o += (size_t)snprintf(tags + o, size - o, "%s", o ? entry + 1 : entry);
+            }
+            list = expect == 2;
+            expect = 0;
+            continue;
+        }
+        if (list && !quoted && cache_result_word_is(word, list_end)) list = 0;
+    }
+    return (int)o;
+}
+
+int cache_result_tags(const char *sql, char *tags, size_t size) {
+    int writes;
+    if (!tags || !size) return 0;
+    return cache_result_scan(sql, tags, size, &writes);
+}
+
+CacheResult *cache_result_get(const char *key) {
+    cache_result_t *c = &g_cache_result;
+    if (!key) return NULL;
+    unsigned long hash = cache_result_hash(key);
+    pthread_mutex_lock(&c->lock);
+    CacheResult *r = c->buckets ? cache_result_find(c, key, hash) : NULL;
+    if (r && r->expires <= cache_result_now_ms()) {
+        c->stats.expirations++;
+        cache_result_unlink(c, r);
+        r = NULL;
+    }
+    if (r) {
+        // to the front of the LRU list
+        if (r->prev) {
+            r->prev->next = r->next;
+            if (r->next) r->next->prev = r->prev;
+            else c->tail = r->prev;
+            r->prev = NULL;
+            r->next = c->head;
+            c->head->prev = r;
+            c->head = r;
+        }
+        r->refs++;
+        c->stats.hits++;
+    } else {
+        c->stats.misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return r;
+}
+
+const void *cache_result_data(const CacheResult *r, size_t *len) {
+    if (!r) return NULL;
+    if (len) *len = r->len;
+    return r->data;
+}
+
+void cache_result_release(CacheResult *r) {
+    if (!r) return;
+    pthread_mutex_lock(&g_cache_result.lock);
+    int last = --r->refs == 0;
+    pthread_mutex_unlock(&g_cache_result.lock);
+    if (last) free(r);
+}
+
+unsigned long cache_result_generation(void) {
+    pthread_mutex_lock(&g_cache_result.lock);
+    unsigned long generation = g_cache_result.generation;
+    pthread_mutex_unlock(&g_cache_result.lock);
+    return generation;
+}
+
+int cache_result_put(const char *key, const char *tags, const void *data, size_t len, int ttl_sec, unsigned long generation) {
+    cache_result_t *c = &g_cache_result;
+    char derived[CACHE_RESULT_TAGS_LEN];
+    if (!key || (!data && len)) return -1;
+    if (tags) {
+        // ",t1,t2," lower case, whatever the caller wrote
+        size_t o = 0;
+        derived[o++] = ',';
+        for (; *tags && o < sizeof(derived) - 2; tags++) {
+            if (!isspace((unsigned char)*tags)) derived[o++] = (char)tolower((unsigned char)*tags);
+        }
+        if (derived[o - 1] != ',') derived[o++] = ',';
+        derived[o] = 0;
+    } else {
+        int writes;
+        const char *end = strchr(key, '\x1f');
+        char sql[CACHE_RESULT_KEY_LEN];
+        snprintf(sql, sizeof(sql), "%.*s", end ? (int)(end - key) : (int)strlen(key), key);
+        cache_result_scan(sql, derived, sizeof(derived), &writes);
+    }
+    size_t key_len = strlen(key);
+    size_t tags_len = strlen(derived);
+    size_t link_count = 0;
+    for (size_t i = 1; i < tags_len; i++) {
+        if (derived[i] == ',') link_count++;
+    }
+    size_t size = sizeof(CacheResult) + len + 1 + key_len + 1 + tags_len + 1 +
+        link_count * sizeof(CacheResultLink);
+
+    pthread_mutex_lock(&c->lock);
+    if (!c->buckets || size > c->stats.memory_limit / 8) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    CacheResult *r = malloc(size);
+    CacheResultLink *links = link_count ? calloc(link_count, sizeof(CacheResultLink)) : NULL;
+    if (!r || (link_count && !links)) {
+        free(r);
+        free(links);
+        return -1;
+    }
+    memcpy(r->data, data, len);
+    r->data[len] = 0;
+    char *k = r->data + len + 1;
+    memcpy(k, key, key_len + 1);
+    char *t = k + key_len + 1;
+    memcpy(t, derived, tags_len + 1);
+    r->key = k;
+    r->tags = t;
+    r->len = len;
+    r->size = size;
+    r->hash = cache_result_hash(key);
+    r->refs = 1;
+    r->hnext = NULL;
+    r->prev = NULL;
+    r->links = links;
+    r->link_count = link_count;
+
+    pthread_mutex_lock(&c->lock);
+    int stale = generation < c->horizon;
+    int ready = c->buckets && c->tag_buckets;
+    size_t need = size;     // the entry and its new tags
+    for (size_t i = 0, o = 1; ready && !stale && i < link_count; i++) {
+        size_t n = strcspn(t + o, ",");
+        CacheResultTag *g = cache_result_tag(c, t + o, n, 0);
+        // a write since the read began, the data may be older than that
+        if (g) stale = g->generation > generation;
+        else need += CACHE_RESULT_TAG_SIZE(n);
+        o += n + 1;
+    }
+    if (ready && !stale) {
+        r->expires = cache_result_now_ms() + (long long)(ttl_sec > 0 ? ttl_sec : c->ttl_sec) * 1000;
+        CacheResult *old = cache_result_find(c, key, r->hash);
+        if (old) cache_result_unlink(c, old);
+        while (c->stats.bytes + need > c->stats.memory_limit) {
+            if (c->tail) {
+                c->stats.evictions++;
+                cache_result_unlink(c, c->tail);
+            } else if (!cache_result_tag_sweep(c)) {
+                break;
+            }
+        }
+        stale = generation < c->horizon;   // moved by a sweep
+    }
+    for (size_t i = 0, o = 1; ready && !stale && i < link_count; i++) {
+        size_t n = strcspn(t + o, ",");
+        links[i].tag = cache_result_tag(c, t + o, n, 1);
+        links[i].entry = r;
+        if (!links[i].tag) ready = 0;   // no memory
+        o += n + 1;
+    }
+    if (!ready || stale) {   // destroyed meanwhile, no memory, or stale
+        if (stale) c->stats.stale++;
+        pthread_mutex_unlock(&c->lock);
+        free(links);
+        free(r);
+        return -1;
+    }
+    if (c->stats.count >= c->bucket_count) cache_result_grow(c);
+    size_t i = r->hash & (c->bucket_count - 1);
+    r->hnext = c->buckets[i];
+    c->buckets[i] = r;
+    r->next = c->head;
+    if (c->head) c->head->prev = r;
+    else c->tail = r;
+    c->head = r;
+    for (i = 0; i < link_count; i++) {
+        CacheResultLink *l = &links[i];
+        l->prev = NULL;
+        l->next = l->tag->entries;
+        if (l->next) l->next->prev = l;
+        l->tag->entries = l;
+    }
+    c->stats.bytes += size;
+    c->stats.count++;
+    c->stats.puts++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+int cache_result_invalidate(const char *table) {
+    cache_result_t *c = &g_cache_result;
+    char name[CACHE_RESULT_WORD_LEN];
+    size_t n = 0;
+    int count = 0;
+    if (!table || !*table) return 0;
+    for (; *table && n < sizeof(name) - 1; table++) name[n++] = (char)tolower((unsigned char)*table);
+    pthread_mutex_lock(&c->lock);
+    if (!c->tag_buckets) {
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    // recorded even without entries: a read of the table may be under way
+    CacheResultTag *g = cache_result_tag(c, name, n, 1);
+    c->generation++;
+    if (g) g->generation = c->generation;
+    else c->horizon = c->generation;
+    while (g && g->entries) {
+        cache_result_unlink(c, g->entries->entry);
+        count++;
+    }
+    c->stats.invalidations += (unsigned long)count;
+    pthread_mutex_unlock(&c->lock);
+    return count;
+}
+
+int cache_result_invalidate_sql(const char *sql) {
+    char tags[CACHE_RESULT_TAGS_LEN];
+    int writes;
+    int count = 0;
+    if (!sql) return 0;
+    while (isspace((unsigned char)*sql) || *sql == '(') sql++;
+    if (!strncasecmp(sql, "select", 6)) return 0;   // the common case, no scan
+    if (cache_result_scan(sql, tags, sizeof(tags), &writes) <= 0 || !writes) return 0;
+    char *save = NULL;
+    for (char *t = strtok_r(tags, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        count += cache_result_invalidate(t);
+    }
+    return count;
+}
+
+void cache_result_expire(void) {
+    cache_result_t *c = &g_cache_result;
+    pthread_mutex_lock(&c->lock);
+    long long now = cache_result_now_ms();
+    CacheResult *r = c->head;
+    while (r) {
+        CacheResult *next = r->next;
+        if (r->expires <= now) {
+            c->stats.expirations++;
+            cache_result_unlink(c, r);
+        }
+        r = next;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void cache_result_stats(CacheResultStats *st) {
+    if (!st) return;
+    pthread_mutex_lock(&g_cache_result.lock);
+    *st = g_cache_result.stats;
+    pthread_mutex_unlock(&g_cache_result.lock);
+}
@@ -0,0 +1,107 @@
+/*
+ * File:    resultcache.h
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-05
+ *
+ * In-memory result cache of the host, shared by the plugins
+ * Key features:
+ *  Keyed by the normalized query text plus the bound parameters, see
+ *  cache_result_key. The value is an opaque byte block (a JSON response,
+ *  a CGI output), copied in once and served from memory.
+ *  Every entry has a TTL, the whole cache a memory limit: the least
+ *  recently used entries are evicted to stay under it. The tag lists and
+ *  the tables remembered for the invalidations count in it as well.
+ *  Every entry is tagged with the tables it was read from. A statement
+ *  which writes a table drops the entries tagged with it
+ *  (cache_result_invalidate_sql), so the db plugins keep it coherent with
+ *  their own writes; the TTL covers the writes of others. The entries are
+ *  listed by tag, an invalidation touches only the entries of its table.
+ *  A read which began before a write of its table may bring the old data:
+ *  the put carries the generation taken before the read, and it is refused
+ *  if a table of the entry was invalidated since.
+ *  A hit is a reference: the entry stays valid until it is released, even
+ *  if it is evicted or invalidated in the meantime.
+ */
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stddef.h>
+#include "dbresult.h"
+
+#define CACHE_RESULT_MEMORY_DEFAULT     (32 * 1024 * 1024)
+#define CACHE_RESULT_TTL_DEFAULT        (60)    // sec
+#define CACHE_RESULT_KEY_LEN            (1536)  // a query plus its parameters
+
+typedef struct CacheResult CacheResult;
+
+typedef struct {
+    size_t count;
+    size_t bytes;
+    size_t memory_limit;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long puts;
+    unsigned long evictions;        // to stay under the memory limit
+    unsigned long expirations;
+    unsigned long invalidations;
+    unsigned long stale;            // puts refused, a table was written during the read
+} CacheResultStats;
+
+/** cache_result_init
+ * memory_limit bytes for the entries (CACHE_RESULT_MEMORY_DEFAULT if 0),
+ * ttl_sec when put gives none (CACHE_RESULT_TTL_DEFAULT if 0).
+ * Returns 0 or -1.
+ */
+int cache_result_init(size_t memory_limit, int ttl_sec);
+/** cache_result_destroy
+ * Drop every entry. The ones still referenced are freed by their release.
+ */
+void cache_result_destroy(void);
+
+/** cache_result_key
+ * Key of a query: the text with the whitespace collapsed and lower case
+ * outside of the quotes, then the parameters with their type.
+ * Returns the length, or -1 if it does not fit into size (do not cache).
+ */
+int cache_result_key(char *key, size_t size, const char *query, const DbValue *params, int param_count);
+/** cache_result_tags
+ * The tables a statement reads or writes, as ",t1,t2,". Returns the length.
+ */
+int cache_result_tags(const char *sql, char *tags, size_t size);
+
+/** cache_result_generation
+ * The count of the invalidations so far. Take it with the key, before the
+ * data is read, and give it to cache_result_put.
+ */
+unsigned long cache_result_generation(void);
+/** cache_result_get
+ * The live entry of the key, or NULL. A hit must be released.
+ */
+CacheResult *cache_result_get(const char *key);
+const void *cache_result_data(const CacheResult *r, size_t *len);
+void cache_result_release(CacheResult *r);
+/** cache_result_put
+ * Store a copy of data under key, replacing the former one.
+ * tags: comma separated table names, NULL to take them from the query of
+ * the key. ttl_sec: 0 for the default. generation: cache_result_generation()
+ * before the read. Returns 0, or -1 if it is not cached (too large, no
+ * memory, or a table of the tags was invalidated since the generation).
+ */
+int cache_result_put(const char *key, const char *tags, const void *data, size_t len, int ttl_sec, unsigned long generation);
+/** cache_result_invalidate
+ * Drop the entries tagged with the table. Returns how many.
+ */
+int cache_result_invalidate(const char *table);
+/** cache_result_invalidate_sql
+ * If the statement writes (INSERT, UPDATE, DELETE, REPLACE, ...), drop the
+ * entries of the tables it touches. A plain SELECT does nothing.
+ * Returns how many entries were dropped.
+ */
+int cache_result_invalidate_sql(const char *sql);
+/** cache_result_expire
+ * Free the expired entries, from the housekeeper.
+ */
+void cache_result_expire(void);
+void cache_result_stats(CacheResultStats *st);
+
+#endif // RESULTCACHE_H
@@ -0,0 +1,240 @@
+/*
+ * File:    bench_db_user.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-03
+ *
+ * /user endpoint latency benchmark
+ * Key features:
+ *  An in-memory SQLite database stands in for MySQL, every statement pays
+ *  a simulated network round trip. Compares the former four sequential
+ *  queries of handle_user (user, region count, person stats, resources)
+ *  to the single batched statement of dbuser.h, and checks that both give
+ *  the same summary.
+ * Usage:
+ *  ./bench_db_user [requests rtt_us regions persons]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "plugin.h"
+#include "plugin_db/dbuser.h"
+
+#define BENCH_RESOURCES (12)
+
+static sqlite3 *g_db;
+static int g_rtt_us;
+static long g_round_trips;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/** bench_run
+ * Run a query like a db plugin does: bind, deliver the rows by
+ * db_query_row, one simulated round trip per statement.
+ */
+static int bench_run(DbQuery *q) {
+    sqlite3_stmt *stmt;
+    g_round_trips++;
+    if (g_rtt_us) usleep((useconds_t)g_rtt_us);
+    if (sqlite3_prepare_v2(g_db, q->query, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "prepare failed: %s\n", sqlite3_errmsg(g_db));
+        return -1;
+    }
+    for (int i = 0; i < q->param_count; i++) {
+        const DbValue *v = &q->params[i];
+        if (v->type == DB_TYPE_INT) sqlite3_bind_int64(stmt, i + 1, v->i);
+        else if (v->type == DB_TYPE_TEXT) sqlite3_bind_text(stmt, i + 1, v->s, (int)v->len, SQLITE_STATIC);
+        else sqlite3_bind_null(stmt, i + 1);
+    }
+    int n = sqlite3_column_count(stmt);
+    DbColumn columns[16];
+    DbValue values[16];
+    for (int i = 0; i < n && i < 16; i++) {
+        columns[i].name = sqlite3_column_name(stmt, i);
+        columns[i].type = DB_TYPE_TEXT;
+    }
+    DbRow row = { columns, (size_t)n, values, 0 };
+    db_query_begin(q, columns, (size_t)n);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        for (int i = 0; i < n; i++) {
+            const char *text = (const char *)sqlite3_column_text(stmt, i);
+            values[i] = db_value_parse(DB_TYPE_TEXT, text, (size_t)sqlite3_column_bytes(stmt, i));
+        }
+        if (db_query_row(q, &row)) break;
+        row.index++;
+    }
+    sqlite3_finalize(stmt);
+    return q->result_count;
+}
+
+static void bench_exec(const char *sql) {
+    char *err = NULL;
+    if (sqlite3_exec(g_db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, err);
+        sqlite3_free(err);
+        exit(1);
+    }
+}
+
+/** bench_setup
+ * The tables of handle_user, 100 users, the first one is measured.
+ */
+static void bench_setup(int regions, int persons) {
+    char sql[256];
+    bench_exec("CREATE TABLE users(id INTEGER PRIMARY KEY, nick TEXT, last_login TEXT, email TEXT, lat REAL, lon REAL, alt REAL, session_id TEXT);"
+               "CREATE INDEX users_session ON users(session_id);"
+               "CREATE TABLE user_regions(user_id INTEGER, region_id INTEGER);"
+               "CREATE INDEX user_regions_user ON user_regions(user_id);"
+               "CREATE TABLE region_resources(region_id INTEGER, resource_id INTEGER, quantity INTEGER);"
+               "CREATE INDEX region_resources_region ON region_resources(region_id);"
+               "CREATE TABLE resources(id INTEGER PRIMARY KEY, name TEXT);"
+               "CREATE TABLE entities(id INTEGER PRIMARY KEY, user_id INTEGER, status_id INTEGER);"
+               "CREATE INDEX entities_user ON entities(user_id);"
+               "CREATE TABLE persons(entity_id INTEGER, job_id INTEGER);"
+               "CREATE INDEX persons_entity ON persons(entity_id);"
+               "BEGIN");
+    for (int r = 1; r <= BENCH_RESOURCES; r++) {
+        snprintf(sql, sizeof(sql), "INSERT INTO resources VALUES(%d, 'res%d')", r, r);
+        bench_exec(sql);
+    }
+    int region = 0, entity = 0;
+    for (int u = 1; u <= 100; u++) {
+        snprintf(sql, sizeof(sql), "INSERT INTO users VALUES(%d, 'nick%d', '2025-07-01 10:00:00', 'u%d@geo', 47.5, 19.0, 120.0, 'S%d')", u, u, u, u);
+        bench_exec(sql);
+        for (int i = 0; i < regions; i++) {
+            region++;
+            snprintf(sql, sizeof(sql), "INSERT INTO user_regions VALUES(%d, %d)", u, region);
+            bench_exec(sql);
+            for (int r = 0; r < 3; r++) {
+                snprintf(sql, sizeof(sql), "INSERT INTO region_resources VALUES(%d, %d, %d)", region, 1 + (region + r) % BENCH_RESOURCES, 10 + r);
+                bench_exec(sql);
+            }
+        }
+        for (int i = 0; i < persons; i++) {
+            entity++;
+            snprintf(sql, sizeof(sql), "INSERT INTO entities VALUES(%d, %d, %d); INSERT INTO persons VALUES(%d, %d)",
+                entity, u, i % 7 == 0 ? 5 : 1, entity, 2 + i % 3);
+            bench_exec(sql);
+        }
+    }
+    bench_exec("COMMIT");
+}
+
+/** bench_sequential
+ * The former handle_user: four statements, one after the other.
+ */
+static int bench_sequential(const char *session_id, dbuser_summary_t *s) {
+    DbQuery q;
+    DbRow row;
+    memset(s, 0, sizeof(*s));
+    memset(&q, 0, sizeof(q));
+    q.flags = DB_QUERY_TYPED;
+    snprintf(q.query, sizeof(q.query), "SELECT id, nick, last_login, email, lat, lon, alt FROM users WHERE session_id = ?");
+    db_query_bind_text(&q, session_id);
+    if (bench_run(&q) < 1 || db_result_row(q.result, 0, &row)) {
+        db_result_free(q.result);
+        return -1;
+    }
+    s->found = 1;
+    s->user_id = (int)db_row_int(&row, 0, 0);
+    snprintf(s->nick, sizeof(s->nick), "%s", db_row_text(&row, 1));
+    snprintf(s->last_login, sizeof(s->last_login), "%s", db_row_text(&row, 2));
+    snprintf(s->email, sizeof(s->email), "%s", db_row_text(&row, 3));
+    s->lat = db_row_double(&row, 4, 0.0);
+    s->lon = db_row_double(&row, 5, 0.0);
+    s->alt = db_row_double(&row, 6, 0.0);
+    db_result_free(q.result);
+
+    memset(&q, 0, sizeof(q));
+    snprintf(q.query, sizeof(q.query), "SELECT COUNT(*) FROM user_regions WHERE user_id = %d", s->user_id);
+    if (bench_run(&q) > 0) s->region_count = atoi(q.rows[0]);
+
+    memset(&q, 0, sizeof(q));
+    snprintf(q.query, sizeof(q.query),
+        "SELECT "
+        "SUM(CASE WHEN p.job_id = 2 AND e.status_id != 5 THEN 1 ELSE 0 END),"
+        "SUM(CASE WHEN p.job_id = 3 AND e.status_id != 5 THEN 1 ELSE 0 END),"
+        "SUM(CASE WHEN e.status_id = 5 THEN 1 ELSE 0 END) "
+        "FROM persons p JOIN entities e ON p.entity_id = e.id "
+        "WHERE e.user_id = %d", s->user_id);
+    if (bench_run(&q) > 0) sscanf(q.rows[0], "%d|%d|%d", &s->workers, &s->soldiers, &s->dead);
+
+    memset(&q, 0, sizeof(q));
+    q.flags = DB_QUERY_TYPED;
+    snprintf(q.query, sizeof(q.query),
+        "SELECT rr.resource_id, res.name, SUM(rr.quantity) "
+        "FROM user_regions ur "
+        "JOIN region_resources rr ON rr.region_id = ur.region_id "
+        "JOIN resources res ON res.id = rr.resource_id "
+        "WHERE ur.user_id = %d "
+        "GROUP BY rr.resource_id, res.name", s->user_id);
+    int rows = bench_run(&q);
+    for (int i = 0; i < rows; i++) {
+        db_result_row(q.result, (size_t)i, &row);
+        s->resources_len += (size_t)snprintf(s->resources + s->resources_len, sizeof(s->resources) - s->resources_len,
+            "%s{\"id\":%lld,\"name\":\"%s\",\"quantity\":%s}",
+            i ? "," : "", db_row_int(&row, 0, 0), db_row_text(&row, 1), db_row_text(&row, 2));
+        s->resource_count++;
+    }
+    db_result_free(q.result);
+    return 0;
+}
+
+/** bench_batched
+ * The new handle_user: one statement.
+ */
+static int bench_batched(const char *session_id, dbuser_summary_t *s) {
+    DbQuery q;
+    memset(&q, 0, sizeof(q));
+    if (dbuser_summary_query(&q, s, session_id) || bench_run(&q) < 0 || !s->found) return -1;
+    return 0;
+}
+
+typedef int (*bench_fn)(const char *session_id, dbuser_summary_t *s);
+
+static void bench_measure(const char *name, bench_fn fn, int requests, char *body, size_t size) {
+    dbuser_summary_t s;
+    g_round_trips = 0;
+    double t0 = now_us();
+    for (int i = 0; i < requests; i++) {
+        if (fn("S1", &s)) {
+            fprintf(stderr, "%s failed\n", name);
+            exit(1);
+        }
+        dbuser_summary_json(&s, "S1", body, size);
+    }
+    double us = (now_us() - t0) / requests;
+    printf("%-10s %8.1f us/request %5.1f round trips/request\n", name, us, (double)g_round_trips / requests);
+}
+
+int main(int argc, char **argv) {
+    int requests = 200, regions = 40, persons = 300;
+    g_rtt_us = 250;
+    if (argc > 1) requests = atoi(argv[1]);
+    if (argc > 2) g_rtt_us = atoi(argv[2]);
+    if (argc > 3) regions = atoi(argv[3]);
+    if (argc > 4) persons = atoi(argv[4]);
+    if (requests < 1) requests = 1;
+
+    if (sqlite3_open(":memory:", &g_db) != SQLITE_OK) return 1;
+    bench_setup(regions, persons);
+    printf("requests %d, simulated round trip %d us, %d regions, %d persons per user\n",
+        requests, g_rtt_us, regions, persons);
+
+    static char body_seq[4096], body_batch[4096];
+    bench_measure("sequential", bench_sequential, requests, body_seq, sizeof(body_seq));
+    bench_measure("batched", bench_batched, requests, body_batch, sizeof(body_batch));
+    int same = strcmp(body_seq, body_batch) == 0;
+    printf("same response: %s\n", same ? "yes" : "NO");
+    if (!same) printf("%s\n%s\n", body_seq, body_batch);
+    sqlite3_close(g_db);
+    return same ? 0 : 1;
+}
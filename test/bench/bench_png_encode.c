@@ -0,0 +1,161 @@
+/*
+ * File:    bench_png_encode.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-20
+ *
+ * PNG encoder benchmark
+ * Key features:
+ *  Encodes the biome (RGB) and elevation (grayscale) textures with the
+ *  real image plugin, over a matrix of zlib level / strategy / row filters.
+ *  Prints encode time and output size for each setting.
+ * Usage:
+ *  ./bench_png_encode [width height repeat]
+ *  The map is loaded from ../var/mapdata.bin, or generated when missing.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "plugin_image/plugin_image.c"
+
+// mapgen.h conflicts with plugin.h (TerrainInfo), declare what we need like plugin_map.c does.
+#define BENCH_MAPGEN_FILENAME "../var/mapdata.bin"
+int mapgen_init(void);
+void mapgen_generate(void);
+TerrainInfo mapgen_get_terrain_info(float lat, float lon);
+
+static void bench_msg(const char *fmt, ...) { (void)fmt; }
+static void bench_err(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+static PluginHostInterface g_bench_host;
+
+typedef struct {
+    const char *name;
+    ImageFormat format;
+    int pixel_size;
+    unsigned char *pixels;
+} BenchImage;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/** Samples the map the same way as the texture plugin does. */
+static void bench_image_fill(BenchImage *bi, unsigned int width, unsigned int height) {
+    bi->pixels = malloc((size_t)bi->pixel_size * width * height);
+    unsigned char *p = bi->pixels;
+    for (unsigned int y = 0; y < height; y++) {
+        float lat = 90.0f - (180.0f / height) * y;
+        for (unsigned int x = 0; x < width; x++) {
+            float lon = -180.0f + (360.0f / width) * x;
+            TerrainInfo info = mapgen_get_terrain_info(lat, lon);
+            if (bi->format == ImageFormat_Grayscale) {
+                int elevation = info.elevation * 255.0f;
+                if (elevation < 0) elevation = 0;
+                if (elevation > 255) elevation = 255;
+                *p++ = elevation;
+            } else {
+                *p++ = info.r;
+                *p++ = info.g;
+                *p++ = info.b;
+            }
+        }
+    }
+}
+
+static int bench_encode(BenchImage *bi, unsigned int width, unsigned int height, const ImageEncodeOptions *opt, const char *filename, double *ms, long *size) {
+    Image img;
+    double t0 = now_ms();
+    if (image_create(NULL, &img, filename, width, height, ImageBackend_Png, bi->format, ImageBuffer_AoS)) return -1;
+    if (opt) image_set_options(NULL, &img, opt);
+    size_t stride = (size_t)bi->pixel_size * width;
+    for (unsigned int y = 0; y < height; y++) {
+        image_write_row(NULL, &img, bi->pixels + stride * y);
+    }
+    image_destroy(NULL, &img);
+    *ms = now_ms() - t0;
+    struct stat st;
+    if (stat(filename, &st)) return -2;
+    *size = (long)st.st_size;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int width = 1024, height = 512;
+    int repeat = 3;
+    if (argc > 2) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc > 3) repeat = atoi(argv[3]);
+    if (repeat < 1) repeat = 1;
+
+    g_bench_host.logmsg = bench_msg;
+    g_bench_host.debugmsg = bench_msg;
+    g_bench_host.errormsg = bench_err;
+    g_host = &g_bench_host;
+
+    struct stat mapst;
+    int have_map = !stat(BENCH_MAPGEN_FILENAME, &mapst);
+    if (mapgen_init()) {
+        fprintf(stderr, "mapgen_init failed\n");
+        return 1;
+    }
+    if (!have_map) {
+        fprintf(stderr, "No map file, generating...\n");
+        mapgen_generate();
+    }
+    BenchImage images[] = {
+        { "biome", ImageFormat_RGB, 3, NULL },
+        { "elevation", ImageFormat_Grayscale, 1, NULL },
+    };
+    const int image_count = sizeof(images) / sizeof(images[0]);
+    for (int i = 0; i < image_count; i++) bench_image_fill(&images[i], width, height);
+
+    static const int levels[] = { IMAGE_LEVEL_DEFAULT, 1, 3, 6, 9 };
+    static const struct { const char *name; unsigned int bits; } filters[] = {
+        { "default", IMAGE_FILTER_DEFAULT }, { "none", IMAGE_FILTER_NONE }, { "sub", IMAGE_FILTER_SUB },
+        { "up", IMAGE_FILTER_UP }, { "paeth", IMAGE_FILTER_PAETH }, { "all", IMAGE_FILTER_ALL },
+    };
+    static const char *strategies[] = { "default", "filtered", "huffman", "rle", "fixed" };
+
+    char filename[MAX_PATH];
+    printf("%-10s %5s %-9s %-8s %10s %10s\n", "image", "level", "strategy", "filter", "ms(min)", "bytes");
+    for (int i = 0; i < image_count; i++) {
+        snprintf(filename, sizeof(filename), "/tmp/bench_png_%s.png", images[i].name);
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            for (int s = ImageStrategy_Default; s <= ImageStrategy_Fixed; s++) {
+                for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+                    ImageEncodeOptions opt = { levels[l], (ImageCompressionStrategy)s, filters[f].bits, ImageCodec_Png };
+                    double best = 0.0;
+                    long size = 0;
+                    for (int r = 0; r < repeat; r++) {
+                        double ms;
+                        if (bench_encode(&images[i], width, height, &opt, filename, &ms, &size)) {
+                            fprintf(stderr, "encode failed: %s\n", filename);
+                            return 2;
+                        }
+                        if (r == 0 || ms < best) best = ms;
+                    }
+                    printf("%-10s %5d %-9s %-8s %10.2f %10ld\n", images[i].name, levels[l],
+                        strategies[s], filters[f].name, best, size);
+                }
+            }
+        }
+        remove(filename);
+        free(images[i].pixels);
+    }
+    // mapgen_finish() is not called, the benchmark never writes the map file.
+    return 0;
+}
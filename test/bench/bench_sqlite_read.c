@@ -0,0 +1,177 @@
+/*
+ * File:    bench_sqlite_read.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-07-04
+ *
+ * Concurrent SQLite read benchmark
+ * Key features:
+ *  A local database file with a regions table, read by several threads
+ *  through sqlitepool.h with cached prepared statements. Compares one
+ *  connection shared under a lock (no readers, as the sqlite plugin was
+ *  before) to a pool of WAL readers, optionally with a writer thread
+ *  updating the table in the meantime.
+ * Usage:
+ *  ./bench_sqlite_read [threads queries_per_thread rows writer db_file]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "plugin_db/sqlitepool.h"
+
+#define BENCH_RANGE (50)
+
+static const char *g_select = "SELECT lat, lon, elevation, population, name FROM regions WHERE id BETWEEN ? AND ?";
+static const char *g_update = "UPDATE regions SET population = population + 1 WHERE id = ?";
+
+static sqlitepool_t g_pool;
+static int g_rows;
+static int g_queries;
+static volatile int g_stop;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/** bench_stmt
+ * Cached statement of the connection, prepared on the first use.
+ */
+static sqlite3_stmt *bench_stmt(sqlitepool_conn_t *c, const char *sql) {
+    sqlite3_stmt *stmt = (sqlite3_stmt *)dbstmt_get(&c->stmts, sql);
+    if (stmt) return stmt;
+    if (sqlite3_prepare_v2(c->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "prepare failed: %s\n", sqlite3_errmsg(c->db));
+        return NULL;
+    }
+    return dbstmt_put(&c->stmts, sql, stmt) ? NULL : stmt;
+}
+
+static int bench_create(const char *file, int rows) {
+    sqlite3 *db;
+    char *err = NULL;
+    unlink(file);
+    if (sqlite3_open(file, &db) != SQLITE_OK) return -1;
+    int rc = sqlite3_exec(db,
+        "CREATE TABLE regions(id INTEGER PRIMARY KEY, lat REAL, lon REAL, elevation REAL, population INTEGER, name TEXT);"
+        "BEGIN", NULL, NULL, &err);
+    sqlite3_stmt *stmt = NULL;
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, "INSERT INTO regions VALUES(?, ?, ?, ?, ?, ?)", -1, &stmt, NULL);
+    for (int i = 0; rc == SQLITE_OK && i < rows; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "region%d", i);
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_double(stmt, 2, (i % 180) - 90.0);
+        sqlite3_bind_double(stmt, 3, (i % 360) - 180.0);
+        sqlite3_bind_double(stmt, 4, (i * 7) % 3000);
+        sqlite3_bind_int(stmt, 5, i * 13 % 100000);
+        sqlite3_bind_text(stmt, 6, name, -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_DONE) rc = SQLITE_ERROR;
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, "COMMIT", NULL, NULL, &err);
+    if (rc != SQLITE_OK) fprintf(stderr, "create failed: %s\n", err ? err : sqlite3_errmsg(db));
+    sqlite3_free(err);
+    sqlite3_close(db);
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+static void *bench_reader(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    long sum = 0;
+    for (int i = 0; i < g_queries; i++) {
+        int from = (int)(rand_r(&seed) % (unsigned int)g_rows);
+        sqlitepool_conn_t *c = sqlitepool_acquire(&g_pool, 0);
+        sqlite3_stmt *stmt = bench_stmt(c, g_select);
+        if (stmt) {
+            sqlite3_bind_int(stmt, 1, from);
+            sqlite3_bind_int(stmt, 2, from + BENCH_RANGE);
+            while (sqlite3_step(stmt) == SQLITE_ROW) sum += sqlite3_column_int(stmt, 3);
+            sqlite3_reset(stmt);
+        }
+        sqlitepool_release(&g_pool, c);
+    }
+    return (void *)sum;
+}
+
+static void *bench_writer(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    long writes = 0;
+    while (!g_stop) {
+        sqlitepool_conn_t *c = sqlitepool_acquire(&g_pool, 1);
+        sqlite3_stmt *stmt = bench_stmt(c, g_update);
+        if (stmt) {
+            sqlite3_bind_int(stmt, 1, (int)(rand_r(&seed) % (unsigned int)g_rows));
+            if (sqlite3_step(stmt) == SQLITE_DONE) writes++;
+            sqlite3_reset(stmt);
+        }
+        sqlitepool_release(&g_pool, c);
+    }
+    return (void *)writes;
+}
+
+static int bench(const char *name, const char *file, int threads, int readers, int writer) {
+    pthread_t tids[64];
+    pthread_t wtid;
+    void *ret;
+    if (sqlitepool_open(&g_pool, file, (size_t)readers, 0, 0)) {
+        fprintf(stderr, "%s: open failed\n", name);
+        return -1;
+    }
+    g_stop = 0;
+    if (writer) pthread_create(&wtid, NULL, bench_writer, (void *)1);
+    double t0 = now_us();
+    for (int i = 0; i < threads; i++) pthread_create(&tids[i], NULL, bench_reader, (void *)(size_t)(i + 2));
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    double us = now_us() - t0;
+    long writes = 0;
+    if (writer) {
+        g_stop = 1;
+        pthread_join(wtid, &ret);
+        writes = (long)ret;
+    }
+    printf("%-14s readers %2d: %9.0f queries/s, %5.1f us/query, %lu waits, %ld writes\n", name,
+        (int)g_pool.reader_count, threads * (double)g_queries * 1000000.0 / us, us / ((double)threads * g_queries),
+        g_pool.read_waits, writes);
+    sqlitepool_close(&g_pool);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int threads = 4;
+    int writer = 1;
+    const char *file = "bench_sqlite_read.db";
+    g_queries = 20000;
+    g_rows = 100000;
+    if (argc > 1) threads = atoi(argv[1]);
+    if (argc > 2) g_queries = atoi(argv[2]);
+    if (argc > 3) g_rows = atoi(argv[3]);
+    if (argc > 4) writer = atoi(argv[4]);
+    if (argc > 5) file = argv[5];
+    if (threads < 1 || threads > 64 || g_queries < 1 || g_rows < 1) {
+        fprintf(stderr, "usage: %s [threads(1..64) queries_per_thread rows writer db_file]\n", argv[0]);
+        return 1;
+    }
+    if (bench_create(file, g_rows)) return 1;
+    printf("%d threads x %d queries, %d rows, writer %s, %s\n", threads, g_queries, g_rows, writer ? "on" : "off", file);
+    bench("single", file, threads, 0, 0);
+    bench("pool", file, threads, threads, 0);
+    if (writer) {
+        bench("single+writer", file, threads, 0, 1);
+        bench("pool+writer", file, threads, threads, 1);
+    }
+    char path[512];
+    unlink(file);
+    snprintf(path, sizeof(path), "%s-wal", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s-shm", file);
+    unlink(path);
+    return 0;
+}
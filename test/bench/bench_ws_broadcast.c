@@ -0,0 +1,242 @@
+/*
+ * File:    bench_ws_broadcast.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-24
+ *
+ * WebSocket broadcast benchmark
+ * Key features:
+ *  Opens hundreds of loopback TCP sessions, each one driven by the real
+ *  ws session loop on its own thread, like geod does. A single client
+ *  thread reads all the peers in epoll and timestamps every delivery.
+ *  Compares the encode-once broadcast (one shared frame queued to every
+ *  session) to framing the message per recipient, and prints the sender
+ *  side cost and the delivery latency distribution.
+ * Usage:
+ *  ./bench_ws_broadcast [sessions messages payload_bytes]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "plugin_ws/ws.c"
+
+const PluginHostInterface *g_host;
+int g_is_running = 0;
+int g_keep_running = 1;
+int g_sleep_is_needed = 0;
+
+static void bench_msg(const char *fmt, ...) { (void)fmt; }
+static void bench_err(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+static PluginHostInterface g_bench_host;
+
+typedef struct {
+    int fd;                 // client side of the connection
+    ClientContext ctx;      // server side
+    ws_session_t *s;
+    pthread_t thread;
+    unsigned char rx[64 * 1024];
+    size_t rx_len;
+} BenchSession;
+
+typedef struct {
+    BenchSession *sessions;
+    int count;
+    int epoll_fd;
+    volatile long received;
+    double *latency_us;     // one per delivered frame
+    long latency_cap;
+} BenchClient;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void *bench_session_thread(void *arg) {
+    BenchSession *bs = (BenchSession *)arg;
+    ws_handle_ws_loop(bs->s);
+    return NULL;
+}
+
+/** Parses the complete frames of one peer, the payload starts with the send timestamp. */
+static void bench_client_parse(BenchClient *bc, BenchSession *bs, double t) {
+    size_t o = 0;
+    while (bs->rx_len - o >= 2) {
+        unsigned char *p = bs->rx + o;
+        size_t hl = 2, len = p[1] & 0x7F;
+        if (len == 126) {
+            if (bs->rx_len - o < 4) break;
+            len = ((size_t)p[2] << 8) | p[3];
+            hl = 4;
+        } else if (len == 127) {
+            if (bs->rx_len - o < 10) break;
+            len = ((size_t)p[6] << 24) | ((size_t)p[7] << 16) | ((size_t)p[8] << 8) | p[9];
+            hl = 10;
+        }
+        if (bs->rx_len - o < hl + len) break;
+        if ((p[0] & 0x0F) == WS_OP_TEXT_FRAME) {
+            double sent = strtod((const char *)p + hl + 1, NULL);
+            long i = __sync_fetch_and_add(&bc->received, 1);
+            if (i < bc->latency_cap) bc->latency_us[i] = t - sent;
+        }
+        o += hl + len;
+    }
+    memmove(bs->rx, bs->rx + o, bs->rx_len - o);
+    bs->rx_len -= o;
+}
+
+static void *bench_client_thread(void *arg) {
+    BenchClient *bc = (BenchClient *)arg;
+    struct epoll_event evs[64];
+    while (g_keep_running) {
+        int n = epoll_wait(bc->epoll_fd, evs, 64, 100);
+        double t = now_us();
+        for (int i = 0; i < n; i++) {
+            BenchSession *bs = &bc->sessions[evs[i].data.u32];
+            ssize_t r = read(bs->fd, bs->rx + bs->rx_len, sizeof(bs->rx) - bs->rx_len);
+            if (r > 0) {
+                bs->rx_len += r;
+                bench_client_parse(bc, bs, t);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int bench_connect(BenchSession *sessions, int count) {
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0 };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) || listen(ls, 128) ||
+        getsockname(ls, (struct sockaddr *)&addr, &alen)) {
+        perror("listen");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        BenchSession *bs = &sessions[i];
+        bs->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(bs->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            perror("connect");
+            return -1;
+        }
+        int one = 1;
+        setsockopt(bs->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        bs->ctx.socket_fd = accept(ls, NULL, NULL);
+        setsockopt(bs->ctx.socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(bs->ctx.socket_fd, F_SETFL, O_NONBLOCK);
+        fcntl(bs->fd, F_SETFL, O_NONBLOCK);
+        bs->s = ws_session_create(&bs->ctx, NULL, NULL);
+        bs->s->last_ping_sent = time(NULL) + 3600; // no ping frames in the measurement
+        bs->s->last_aggregation = time(NULL) + 3600;
+    }
+    close(ls);
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_report(const char *name, BenchClient *bc, long expected, double send_us_total, int messages) {
+    long n = bc->received < bc->latency_cap ? bc->received : bc->latency_cap;
+    qsort(bc->latency_us, n, sizeof(double), cmp_double);
+    printf("%-12s send/msg %9.1f us  delivered %ld/%ld  latency us p50 %8.1f p90 %8.1f p99 %8.1f max %8.1f\n",
+        name, send_us_total / messages, bc->received, expected,
+        n ? bc->latency_us[n / 2] : 0.0, n ? bc->latency_us[n * 9 / 10] : 0.0,
+        n ? bc->latency_us[n * 99 / 100] : 0.0, n ? bc->latency_us[n - 1] : 0.0);
+}
+
+/** One round: either one shared frame for all, or framing per recipient. */
+static void bench_round(const char *name, BenchSession *sessions, BenchClient *bc, int count, int messages, size_t payload, int shared) {
+    char *msg = malloc(payload + 1);
+    bc->received = 0;
+    double send_total = 0.0;
+    for (int m = 0; m < messages; m++) {
+        double t0 = now_us();
+        int o = snprintf(msg, payload + 1, "[%.3f,", t0);
+        memset(msg + o, 'x', payload - o - 1);
+        msg[payload - 1] = ']';
+        msg[payload] = 0;
+        if (shared) {
+            ws_frame_t *f = ws_frame_create_text(msg);
+            for (int i = 0; i < count; i++) ws_send_shared_frame(sessions[i].s, f);
+            ws_frame_release(f);
+        } else {
+            for (int i = 0; i < count; i++) ws_send_text_message(sessions[i].s, msg);
+        }
+        send_total += now_us() - t0;
+        usleep(2000); // a message rate which the clients can follow
+    }
+    long expected = (long)count * messages;
+    for (int w = 0; w < 200 && bc->received < expected; w++) usleep(10000);
+    bench_report(name, bc, expected, send_total, messages);
+    free(msg);
+}
+
+int main(int argc, char **argv) {
+    int count = 300, messages = 200;
+    size_t payload = 512;
+    if (argc > 1) count = atoi(argv[1]);
+    if (argc > 2) messages = atoi(argv[2]);
+    if (argc > 3) payload = (size_t)atoi(argv[3]);
+    if (count < 1) count = 1;
+    if (messages < 1) messages = 1;
+    if (payload < 32) payload = 32;
+
+    g_bench_host.logmsg = bench_msg;
+    g_bench_host.debugmsg = bench_msg;
+    g_bench_host.errormsg = bench_err;
+    g_host = &g_bench_host;
+
+    BenchSession *sessions = calloc(count, sizeof(BenchSession));
+    if (bench_connect(sessions, count)) return 1;
+    for (int i = 0; i < count; i++) {
+        pthread_create(&sessions[i].thread, NULL, bench_session_thread, &sessions[i]);
+    }
+
+    BenchClient bc = { .sessions = sessions, .count = count };
+    bc.latency_cap = (long)count * messages;
+    bc.latency_us = malloc(sizeof(double) * bc.latency_cap);
+    bc.epoll_fd = epoll_create1(0);
+    for (int i = 0; i < count; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        epoll_ctl(bc.epoll_fd, EPOLL_CTL_ADD, sessions[i].fd, &ev);
+    }
+    pthread_t client;
+    pthread_create(&client, NULL, bench_client_thread, &bc);
+
+    printf("sessions %d, messages %d, payload %zu bytes\n", count, messages, payload);
+    bench_round("per-session", sessions, &bc, count, messages, payload, 0);
+    bench_round("shared", sessions, &bc, count, messages, payload, 1);
+
+    // peers hang up, the session loops see EOF and exit
+    for (int i = 0; i < count; i++) shutdown(sessions[i].fd, SHUT_RDWR);
+    for (int i = 0; i < count; i++) {
+        pthread_join(sessions[i].thread, NULL);
+        ws_session_destroy(sessions[i].s);
+        close(sessions[i].ctx.socket_fd);
+        close(sessions[i].fd);
+    }
+    g_keep_running = 0;
+    pthread_join(client, NULL);
+    close(bc.epoll_fd);
+    free(bc.latency_us);
+    free(sessions);
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * File:    bench_ws_interest.c
+ * Author:  Barna Faragó MYND-ideal ltd.
+ * Created: 2025-06-27
+ *
+ * Area of interest benchmark
+ * Key features:
+ *  Simulates thousands of users walking around a few dozen hot spots,
+ *  every user sends a position update in every tick. Each update moves
+ *  the user in the interest grid, and a radius query finds who receives
+ *  it. Compares to everyone seeing everyone (deliveries grow with N^2),
+ *  and to filtering the same radius by a linear scan.
+ * Usage:
+ *  ./bench_ws_interest [users ticks radius_km cell_deg]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "plugin_ws/wsgrid.h"
+
+typedef struct {
+    double lat, lon;
+} BenchUser;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static double bench_rand(double lo, double hi) {
+    return lo + (hi - lo) * (rand() / (double)RAND_MAX);
+}
+
+/** Random walk step, the users stay on the map. */
+static void bench_move(BenchUser *u) {
+    u->lat += bench_rand(-0.05, 0.05);
+    u->lon += bench_rand(-0.05, 0.05);
+    if (u->lat > 89.0) u->lat = 89.0;
+    if (u->lat < -89.0) u->lat = -89.0;
+    if (u->lon > 180.0) u->lon -= 360.0;
+    if (u->lon < -180.0) u->lon += 360.0;
+}
+
+int main(int argc, char **argv) {
+    int users = 5000, ticks = 20;
+    double radius_km = 500.0, cell_deg = 2.0;
+    if (argc > 1) users = atoi(argv[1]);
+    if (argc > 2) ticks = atoi(argv[2]);
+    if (argc > 3) radius_km = atof(argv[3]);
+    if (argc > 4) cell_deg = atof(argv[4]);
+    if (users < 2) users = 2;
+    if (ticks < 1) ticks = 1;
+
+    srand(1);
+    BenchUser *u = malloc(sizeof(BenchUser) * users);
+    size_t *out = malloc(sizeof(size_t) * users);
+    wsgrid_t grid;
+    if (!u || !out || wsgrid_init(&grid, cell_deg, (size_t)users)) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+    // clustered population: hot spots with a spread of a few hundred km
+    enum { SPOTS = 40 };
+    BenchUser spots[SPOTS];
+    for (int i = 0; i < SPOTS; i++) {
+        spots[i].lat = bench_rand(-60.0, 70.0);
+        spots[i].lon = bench_rand(-180.0, 180.0);
+    }
+    for (int i = 0; i < users; i++) {
+        u[i].lat = spots[i % SPOTS].lat + bench_rand(-4.0, 4.0);
+        u[i].lon = spots[i % SPOTS].lon + bench_rand(-4.0, 4.0);
+        bench_move(&u[i]);
+        wsgrid_update(&grid, i, u[i].lat, u[i].lon);
+    }
+
+    double t_update = 0.0, t_query = 0.0, t_scan = 0.0;
+    long long deliveries = 0, scan_deliveries = 0;
+    for (int t = 0; t < ticks; t++) {
+        for (int i = 0; i < users; i++) {
+            bench_move(&u[i]);
+            double t0 = now_us();
+            wsgrid_update(&grid, i, u[i].lat, u[i].lon);
+            double t1 = now_us();
+            size_t n = wsgrid_query(&grid, u[i].lat, u[i].lon, radius_km, out, users);
+            double t2 = now_us();
+            t_update += t1 - t0;
+            t_query += t2 - t1;
+            deliveries += (long long)n - 1; // not to the sender
+        }
+        // the same filtering by a linear scan, on a sample of the senders
+        double t0 = now_us();
+        for (int i = 0; i < users; i += 50) {
+            for (int k = 0; k < users; k++) {
+                if (wsgrid_distance_km(u[i].lat, u[i].lon, u[k].lat, u[k].lon) <= radius_km) scan_deliveries++;
+            }
+        }
+        t_scan += now_us() - t0;
+    }
+    long long updates = (long long)users * ticks;
+    long long all = (long long)users * (users - 1);
+    int scanned = (users + 49) / 50;
+    printf("users %d, ticks %d, radius %.0f km, cells %.1f deg\n", users, ticks, radius_km, cell_deg);
+    printf("grid update      %10.3f us/op\n", t_update / updates);
+    printf("grid query       %10.3f us/op  (%.1f recipients)\n", t_query / updates, (double)deliveries / updates);
+    printf("linear scan      %10.3f us/op  (%.1f recipients)\n", t_scan / ((double)scanned * ticks),
+        (double)scan_deliveries / ((double)scanned * ticks) - 1.0);
+    printf("deliveries/tick  %10lld with interest, %lld everyone to everyone (%.1f%%)\n",
+        deliveries / ticks, all, 100.0 * (deliveries / ticks) / (double)all);
+
+    wsgrid_destroy(&grid);
+    free(out);
+    free(u);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#!/bin/bash
+# This script builds the benchmark programs.
+# It is purposefully simple and does not use any build system, like src/build.sh.
+# Run it from the test/bench folder, the binaries are placed here.
+CC=gcc
+CFLAGS="-std=c99 -O3 -march=native -ffast-math -funroll-loops -Wall -Wextra -g"
+SRC="../../src"
+INCLUDE_FLAGS="-I$SRC"
+
+# PNG encoder settings
+$CC $CFLAGS $INCLUDE_FLAGS -o bench_png_encode bench_png_encode.c $SRC/mapgen/mapgen.c $SRC/mapgen/perlin3d.c -lpng -lz -lpthread -lm
+
+# WebSocket broadcast fan-out
+$CC $CFLAGS $INCLUDE_FLAGS -o bench_ws_broadcast bench_ws_broadcast.c -lssl -lcrypto -lz -lpthread
+
+# Area of interest grid
+$CC $CFLAGS $INCLUDE_FLAGS -o bench_ws_interest bench_ws_interest.c $SRC/plugin_ws/wsgrid.c -lpthread -lm
+
+# /user endpoint, sequential vs batched queries on an SQLite stand-in
+$CC $CFLAGS $INCLUDE_FLAGS -o bench_db_user bench_db_user.c $SRC/plugin_db/dbuser.c $SRC/dbresult.c -lsqlite3
+
+# SQLite reads, one shared connection vs WAL reader pool
+$CC $CFLAGS $INCLUDE_FLAGS -o bench_sqlite_read bench_sqlite_read.c $SRC/plugin_db/sqlitepool.c $SRC/plugin_db/dbstmt.c -lsqlite3 -lpthread
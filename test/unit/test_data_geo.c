@@ -70,7 +70,6 @@ void test_geo_user_add_session_key_should_add_entry(void) {
     sync_mutex_t *m= NULL;
     geo_data_t d = {
         .session_index = {
-            .list = json_object_new_object(),
             .lock = (sync_mutex_t*)m  // dummy ptr for mock
         }
     };
@@ -79,8 +78,6 @@ void test_geo_user_add_session_key_should_add_entry(void) {
     json_indexlist_add_IgnoreAndReturn(0);
     int ret = geo_user_add_session_key(&dh, "abc123", 1);
     TEST_ASSERT_EQUAL(0, ret);
-
-    json_object_put(d.session_index.list);
 }
 
 /**
@@ -90,7 +87,6 @@ void test_geo_user_add_user_id_key_should_add_entry(void) {
     sync_mutex_t *m;
     geo_data_t d = {
         .userid_index = {
-            .list = json_object_new_object(),
             .lock = (sync_mutex_t*)m
         }
     };
@@ -100,8 +96,6 @@ void test_geo_user_add_user_id_key_should_add_entry(void) {
 
     int ret = geo_user_add_user_id_key(&dh, 42, 0);
     TEST_ASSERT_EQUAL(0, ret);
-
-    json_object_put(d.userid_index.list);
 }
 
 /**
@@ -111,18 +105,14 @@ void test_geo_user_delete_session_key_should_delete_existing(void) {
     sync_mutex_t *m;
     geo_data_t d = {
         .session_index = {
-            .list = json_object_new_object(),
             .lock = (sync_mutex_t*)m
         }
     };
     data_handle_t dh = { .instance = &d };
-    json_object_object_add(d.session_index.list, "abc", json_object_new_int(1));
 
     json_indexlist_delete_IgnoreAndReturn(0);
     int ret = geo_user_delete_session_key(&dh, "abc");
     TEST_ASSERT_EQUAL(0, ret);
-
-    json_object_put(d.session_index.list);
 }
 
 /**
@@ -132,7 +122,6 @@ void test_geo_user_delete_session_key_should_fail_on_lock_timeout(void) {
     sync_mutex_t *m;
     geo_data_t d = {
         .session_index = {
-            .list = json_object_new_object(),
             .lock = (sync_mutex_t*)m
         }
     };
@@ -141,8 +130,6 @@ void test_geo_user_delete_session_key_should_fail_on_lock_timeout(void) {
     json_indexlist_delete_IgnoreAndReturn(-1);
     int ret = geo_user_delete_session_key(&dh, "abc");
     TEST_ASSERT_EQUAL(-1, ret);
-
-    json_object_put(d.session_index.list);
 }
 
 /**
@@ -176,7 +163,8 @@ void test_geo_get_user_should_return_user_pointer(void) {
         .lock_users = (sync_mutex_t*)m
     };
     user_data_t u = { .id = 42 };
-    d.users[1] = u;
+    TEST_ASSERT_EQUAL(0, geo_users_reserve(&d, 2));
+    *geo_user_at(&d, 1) = u;
     data_handle_t dh = { .instance = &d };
 
     sync_mutex_lock_ExpectAndReturn(d.lock_users, DATA_GEO_LOCK_TIMEOUT, 0);
@@ -187,6 +175,7 @@ void test_geo_get_user_should_return_user_pointer(void) {
     TEST_ASSERT_EQUAL(0, ret);
     TEST_ASSERT_NOT_NULL(ptr);
     TEST_ASSERT_EQUAL(42, ptr->id);
+    geo_users_free(&d);
 }
 
 /**
@@ -196,19 +185,15 @@ void test_geo_user_delete_user_id_key_should_delete_existing(void) {
     sync_mutex_t *m;
     geo_data_t d = {
         .userid_index = {
-            .list = json_object_new_object(),
             .lock = (sync_mutex_t*)m
         }
     };
     data_handle_t dh = { .instance = &d };
-    json_object_object_add(d.userid_index.list, "42", json_object_new_int(1));
 
     json_indexlist_delete_IgnoreAndReturn(0);
     
     int ret = geo_user_delete_user_id_key(&dh, 42);
     TEST_ASSERT_EQUAL(0, ret);
-
-    json_object_put(d.userid_index.list);
 }
 
 /**
@@ -239,8 +224,9 @@ void test_geo_add_user_should_increase_user_count(void) {
     int index = geo_add_user(&dh, &u);
     TEST_ASSERT_EQUAL(0, index);
     TEST_ASSERT_EQUAL(1, d.users_count);
-    TEST_ASSERT_EQUAL_STRING("abc123", d.users[0].session_key);
-    TEST_ASSERT_EQUAL(10, d.users[0].id);
+    TEST_ASSERT_EQUAL_STRING("abc123", geo_user_at(&d, 0)->session_key);
+    TEST_ASSERT_EQUAL(10, geo_user_at(&d, 0)->id);
+    geo_users_free(&d);
 }
 
 /**
@@ -270,6 +256,7 @@ void test_geo_set_user_should_add_new_user(void) {
     int r = geo_set_user(&dh, &u);
     TEST_ASSERT_EQUAL(0, r);
     TEST_ASSERT_EQUAL(1, d.users_count);
+    geo_users_free(&d);
 }
 
 /**
@@ -280,8 +267,9 @@ void test_geo_set_user_should_update_existing_user_with_matching_keys(void) {
         .users_count = 1,
         .lock_users = (sync_mutex_t*)0x1234
     };
-    strcpy(d.users[0].session_key, "s1");
-    d.users[0].id = 1;
+    TEST_ASSERT_EQUAL(0, geo_users_reserve(&d, 1));
+    strcpy(geo_user_at(&d, 0)->session_key, "s1");
+    geo_user_at(&d, 0)->id = 1;
 
     data_handle_t dh = { .instance = &d };
 
@@ -298,7 +286,8 @@ void test_geo_set_user_should_update_existing_user_with_matching_keys(void) {
     sync_mutex_unlock_ExpectAndReturn(d.lock_users, 0);
     int r = geo_set_user(&dh, &u);
     TEST_ASSERT_EQUAL(0, r);
-    TEST_ASSERT_EQUAL(1, d.users[0].id);
+    TEST_ASSERT_EQUAL(1, geo_user_at(&d, 0)->id);
+    geo_users_free(&d);
 }
 
 /**
@@ -309,8 +298,9 @@ void test_geo_set_user_should_replace_user_on_id_conflict(void) {
         .users_count = 1,
         .lock_users = (sync_mutex_t*)0x1234
     };
-    strcpy(d.users[0].session_key, "s1");
-    d.users[0].id = 10;
+    TEST_ASSERT_EQUAL(0, geo_users_reserve(&d, 1));
+    strcpy(geo_user_at(&d, 0)->session_key, "s1");
+    geo_user_at(&d, 0)->id = 10;
 
     data_handle_t dh = { .instance = &d };
 
@@ -338,6 +328,7 @@ void test_geo_set_user_should_replace_user_on_id_conflict(void) {
     int r = geo_set_user(&dh, &u);
     TEST_ASSERT_EQUAL(0, r);
     //TEST_ASSERT_EQUAL(42, d.users[0].id); // json mocked, so nobody do it here.
+    geo_users_free(&d);
 }
 
 /**
@@ -348,7 +339,8 @@ void test_geo_set_user_should_update_existing_user_by_index(void) {
         .users_count = 1,
         .lock_users = (sync_mutex_t*)0x1234
     };
-    d.users[0].id = 10;
+    TEST_ASSERT_EQUAL(0, geo_users_reserve(&d, 1));
+    geo_user_at(&d, 0)->id = 10;
 
     data_handle_t dh = { .instance = &d };
 
@@ -367,6 +359,7 @@ void test_geo_set_user_should_update_existing_user_by_index(void) {
 
     int r = geo_set_user(&dh, &u);
     TEST_ASSERT_EQUAL(0, r);
-    TEST_ASSERT_EQUAL(42, d.users[0].id);
+    TEST_ASSERT_EQUAL(42, geo_user_at(&d, 0)->id);
+    geo_users_free(&d);
 }
 
@@ -32,7 +32,7 @@ void debugmsg(const char *fmt, ...) {
 //TEST_SOURCE_FILE("src/data_geo.c")
 
 
-#define MAX_TEST_USER (MAX_USERS)
+#define MAX_TEST_USER (1000) // over several arena chunks
 /**
  * Integration test for GEO, load-store
  * Add N records, store it to a temporary file
@@ -46,7 +46,9 @@ void test_data_geo_load_store(void){
     geo_init(&geo_data);
     for (int i=0 ; i< MAX_TEST_USER; i++){
         user_data_t u;
+        memset(&u, 0, sizeof(u));
         u.id = i;
+        snprintf(u.session_key, sizeof(u.session_key), "s%d", i);
         u.lat = (180.0 * random() / (double)RAND_MAX) - 90.0;
         u.lon = (360.0 * random() / (double)RAND_MAX) - 180.0;
         u.alt = (1.8 * random() / (double)RAND_MAX);
@@ -70,6 +72,38 @@ void test_data_geo_load_store(void){
     ret= geo_get_max_user(&dh, &numbers);
     TEST_ASSERT_EQUAL(0, ret);
     TEST_ASSERT_EQUAL(MAX_TEST_USER, numbers);
+    // the indexes are rebuilt from the users
+    user_data_t *u = geo_find_user_by_session(&dh, "s777");
+    TEST_ASSERT_NOT_NULL(u);
+    TEST_ASSERT_EQUAL(777, u->id);
+    TEST_ASSERT_EQUAL_STRING("user777", u->nick);
+    TEST_ASSERT_TRUE(u == geo_find_user_by_user_id(&dh, 777));
+    TEST_ASSERT_NULL(geo_find_user_by_session(&dh, "s1000"));
     geo_destroy(&geo_data);
     unlink("test.bin");
 }
+
+/**
+ * Requirement: a user pointer stays valid while the arena grows.
+ */
+void test_data_geo_user_pointer_stable(void){
+    data_handle_t dh;
+    struct geo_data_t geo_data;
+    dh.instance = &geo_data;
+    geo_init(&geo_data);
+    user_data_t u;
+    memset(&u, 0, sizeof(u));
+    u.id = 1;
+    strcpy(u.session_key, "first");
+    TEST_ASSERT_EQUAL(0, geo_add_user(&dh, &u));
+    user_data_t *first = geo_find_user_by_session(&dh, "first");
+    TEST_ASSERT_NOT_NULL(first);
+    for (int i = 2; i < 5 * GEO_USER_CHUNK; i++) {
+        u.id = i;
+        snprintf(u.session_key, sizeof(u.session_key), "s%d", i);
+        TEST_ASSERT_EQUAL(i - 1, geo_add_user(&dh, &u));
+    }
+    TEST_ASSERT_TRUE(first == geo_find_user_by_user_id(&dh, 1));
+    TEST_ASSERT_EQUAL_STRING("first", first->session_key);
+    geo_destroy(&geo_data);
+}
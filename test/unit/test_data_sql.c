@@ -1,12 +1,13 @@
 #define PLUGINHST_STATIC_LINKED
 #include "unity.h"
+#include <pthread.h>
+#include <unistd.h>
 #include "data.h"
 #include "data_sql.h"
 #include "plugin.h"
-#include "sync.h"
+#include "dbresult.h"
 
 #include "mock_plugin.h"
-#include "mock_sync.h"
 
 void errormsg(const char *fmt, ...) {
     // no-op, just for testing
@@ -35,16 +36,13 @@ void tearDown(void) {
  * Requirement: The system shall initialize the SQL data instance and register it using the data registration API.
  */
 void test_data_sql_init_registers_instance(void) {
-    sync_mutex_init_IgnoreAndReturn(0);
-    sync_cond_init_IgnoreAndReturn(0);
     data_sql_init();
 
     sql_data_t* instance = data_get_instance(g_data_descriptor_sql.name);
     TEST_ASSERT_NOT_NULL(instance);
     TEST_ASSERT_EQUAL(1, instance->initialized);
+    TEST_ASSERT_EQUAL(0, instance->outstanding);
 
-    sync_mutex_destroy_IgnoreAndReturn(0);
-    sync_cond_destroy_IgnoreAndReturn(0);
     data_sql_destroy();
 }
 
@@ -52,11 +50,7 @@ void test_data_sql_init_registers_instance(void) {
  * Requirement: The system shall unregister and free the SQL data instance during destruction.
  */
 void test_data_sql_destroy_unregisters_instance(void) {
-    sync_mutex_init_IgnoreAndReturn(0);
-    sync_cond_init_IgnoreAndReturn(0);
     data_sql_init();
-    sync_mutex_destroy_IgnoreAndReturn(0);
-    sync_cond_destroy_IgnoreAndReturn(0);
     data_sql_destroy();
     sql_data_t* instance = data_get_instance(g_data_descriptor_sql.name);
     TEST_ASSERT_NULL(instance);
@@ -91,10 +85,19 @@ void test_data_sql_execute_returns_error_if_no_plugin_context(void) {
 // how many times the function was called.
 int g_testfn_called =0;
 // simulate the callback for test
-void stubRequest(DbQuery *query, QueryResultProc result_proc, void *user_data){
+int stubRequest(DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data){
+    (void)priority;
     g_testfn_called++;
     query->result_count = 3; // test data.
+    snprintf(query->rows[0], sizeof(query->rows[0]), "1|a");
     result_proc(NULL, query, user_data);
+    return 0;
+}
+// simulate the full queue
+int stubRequestRejected(DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data){
+    (void)query; (void)priority; (void)result_proc; (void)user_data;
+    g_testfn_called++;
+    return -1;
 }
 /**
  * Requirement: The system shall return the query result row number >0 or 0 if the query was empty.
@@ -105,17 +108,250 @@ void test_data_sql_execute_success(void) {
     pc.db.request = stubRequest;
     pc.id = 1; // some valid id
     data_handle_t dh;
-    sql_internal_db_request_t req;
-    dh.instance = (void*)&req;
+    sql_data_t inst;
+    data_sql_instance_init(&inst);
+    dh.instance = (void*)&inst;
     g_testfn_called = 0;
 
     get_plugin_context_ExpectAndReturn("mysql", &pc);  // fix: set expectation
     plugin_start_ExpectAndReturn(1, 0); // id, int return ok.
-    sync_mutex_lock_IgnoreAndReturn(0);
-    sync_cond_signal_IgnoreAndReturn(0);
-    sync_mutex_unlock_IgnoreAndReturn(0);
     plugin_stop_Expect(1); // id (void return)
     int result = data_sql_execute(&dh, &dummy_query);
     TEST_ASSERT_EQUAL(1, g_testfn_called);
     TEST_ASSERT_EQUAL(3, result); // test datafom the dummy query
+    TEST_ASSERT_EQUAL(3, dummy_query.result_count);
+    TEST_ASSERT_EQUAL_STRING("1|a", dummy_query.rows[0]);
+    TEST_ASSERT_EQUAL(0, inst.outstanding);
+}
+
+/**
+ * Requirement: The system shall return DATA_SQL_REJECTED at once, without waiting, when the db queue rejects the request.
+ */
+void test_data_sql_execute_rejected(void) {
+    DbQuery dummy_query = {0};
+    PluginContext pc;
+    pc.db.request = stubRequestRejected;
+    pc.id = 1;
+    data_handle_t dh;
+    sql_data_t inst;
+    data_sql_instance_init(&inst);
+    dh.instance = (void*)&inst;
+    g_testfn_called = 0;
+
+    get_plugin_context_ExpectAndReturn("mysql", &pc);
+    plugin_start_ExpectAndReturn(1, 0);
+    plugin_stop_Expect(1);
+    int result = data_sql_execute_prio(&dh, &dummy_query, DB_PRIORITY_INTERACTIVE);
+    TEST_ASSERT_EQUAL(1, g_testfn_called);
+    TEST_ASSERT_EQUAL(DATA_SQL_REJECTED, result);
+    TEST_ASSERT_EQUAL(0, inst.outstanding);
+    TEST_ASSERT_EQUAL(0, inst.submitted);
+}
+
+// The fake db queue: the requests wait here until the test completes them.
+#define TEST_MAX_PENDING (8)
+typedef struct {
+    DbQuery *query;
+    QueryResultProc proc;
+    void *user_data;
+} test_pending_t;
+static test_pending_t g_pending[TEST_MAX_PENDING];
+static int g_pending_count;
+static pthread_mutex_t g_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int stubRequestQueued(DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data){
+    (void)priority;
+    pthread_mutex_lock(&g_pending_lock);
+    test_pending_t *p = &g_pending[g_pending_count++];
+    p->query = query;
+    p->proc = result_proc;
+    p->user_data = user_data;
+    pthread_mutex_unlock(&g_pending_lock);
+    return 0;
+}
+/** test_complete
+ * Complete a pending request, its result is the number in its query text.
+ */
+static void test_complete(int index) {
+    test_pending_t p = g_pending[index];
+    int n = atoi(p.query->query + 2);   // "q <n>"
+    p.query->result_count = n;
+    snprintf(p.query->rows[0], sizeof(p.query->rows[0]), "row %d", n);
+    p.proc(NULL, p.query, p.user_data);
+}
+
+typedef struct {
+    int calls;
+    int result;
+    data_sql_ticket_t *ticket;
+} test_done_t;
+
+static void test_done(data_sql_ticket_t *ticket, DbQuery *query, int result, void *user_data) {
+    test_done_t *d = (test_done_t *)user_data;
+    d->calls++;
+    d->result = result;
+    d->ticket = ticket;
+    TEST_ASSERT_EQUAL(result, query->result_count);
+}
+
+static void test_submit_setup(PluginContext *pc, data_handle_t *dh, sql_data_t *inst) {
+    pc->db.request = stubRequestQueued;
+    pc->id = 1;
+    data_sql_instance_init(inst);
+    dh->instance = (void*)inst;
+    g_pending_count = 0;
+    g_data_sql_abort = 0;   // set by data_sql_destroy
+}
+
+/**
+ * Requirement: The system shall keep many queries of one instance outstanding, and complete each into its own ticket, in any order.
+ */
+void test_data_sql_submit_outstanding(void) {
+    PluginContext pc;
+    data_handle_t dh;
+    sql_data_t inst;
+    test_submit_setup(&pc, &dh, &inst);
+    data_sql_ticket_t *tickets[3];
+    test_done_t done[3];
+    memset(done, 0, sizeof(done));
+    for (int i = 0; i < 3; i++) {
+        DbQuery q = {0};   // the ticket has its own copy
+        snprintf(q.query, sizeof(q.query), "q %d", 10 + i);
+        get_plugin_context_ExpectAndReturn("mysql", &pc);
+        plugin_start_ExpectAndReturn(1, 0);
+        plugin_stop_Expect(1);
+        TEST_ASSERT_EQUAL(0, data_sql_submit(&dh, &q, DB_PRIORITY_NORMAL, test_done, &done[i], &tickets[i]));
+        TEST_ASSERT_NOT_NULL(tickets[i]);
+    }
+    TEST_ASSERT_EQUAL(3, inst.outstanding);
+    TEST_ASSERT_EQUAL(3, inst.max_outstanding);
+    TEST_ASSERT_NULL(data_sql_ticket_query(tickets[0]));
+    TEST_ASSERT_EQUAL(DATA_SQL_TIMEOUT, data_sql_wait(tickets[0], 0));
+
+    // out of order
+    test_complete(2);
+    test_complete(0);
+    TEST_ASSERT_EQUAL(1, done[2].calls);
+    TEST_ASSERT_EQUAL(12, done[2].result);
+    TEST_ASSERT_EQUAL_PTR(tickets[2], done[2].ticket);
+    TEST_ASSERT_EQUAL(0, done[1].calls);
+    TEST_ASSERT_EQUAL(1, inst.outstanding);
+    TEST_ASSERT_EQUAL(10, data_sql_wait(tickets[0], 0));
+    TEST_ASSERT_EQUAL_STRING("row 10", data_sql_ticket_query(tickets[0])->rows[0]);
+    TEST_ASSERT_EQUAL_STRING("q 12", data_sql_ticket_query(tickets[2])->query);
+
+    // released before the completion: the callback still comes
+    data_sql_release(tickets[1]);
+    test_complete(1);
+    TEST_ASSERT_EQUAL(1, done[1].calls);
+    TEST_ASSERT_EQUAL(11, done[1].result);
+    data_sql_release(tickets[0]);
+    data_sql_release(tickets[2]);
+    TEST_ASSERT_EQUAL(0, inst.outstanding);
+    TEST_ASSERT_EQUAL(3, inst.completed);
+}
+
+/**
+ * Requirement: The system shall copy the bound parameters, the caller's query may go away after the submit.
+ */
+void test_data_sql_submit_copies_params(void) {
+    PluginContext pc;
+    data_handle_t dh;
+    sql_data_t inst;
+    test_submit_setup(&pc, &dh, &inst);
+    data_sql_ticket_t *ticket;
+    char key[16] = "ABC";
+    DbQuery q = {0};
+    snprintf(q.query, sizeof(q.query), "q 1 where session_id = ?");
+    db_query_bind_text(&q, key);
+    get_plugin_context_ExpectAndReturn("mysql", &pc);
+    plugin_start_ExpectAndReturn(1, 0);
+    plugin_stop_Expect(1);
+    TEST_ASSERT_EQUAL(0, data_sql_submit(&dh, &q, DB_PRIORITY_NORMAL, NULL, NULL, &ticket));
+    strcpy(key, "XYZ");
+    memset(&q, 0, sizeof(q));
+    DbQuery *pending = g_pending[0].query;
+    TEST_ASSERT_EQUAL(1, pending->param_count);
+    TEST_ASSERT_EQUAL_STRING("ABC", pending->params[0].s);
+    TEST_ASSERT_EQUAL(DB_QUERY_PREPARED, pending->flags & DB_QUERY_PREPARED);
+    test_complete(0);
+    TEST_ASSERT_EQUAL(1, data_sql_wait(ticket, 0));
+    data_sql_release(ticket);
+}
+
+typedef struct {
+    data_sql_ticket_t *ticket;
+    int result;
+} test_waiter_t;
+
+static void *test_waiter_main(void *arg) {
+    test_waiter_t *w = (test_waiter_t *)arg;
+    w->result = data_sql_wait(w->ticket, 5000);
+    return NULL;
+}
+static void *test_completer_main(void *arg) {
+    int count = *(int *)arg;
+    for (int i = count - 1; i >= 0; i--) {
+        usleep(1000);
+        test_complete(i);
+    }
+    return NULL;
+}
+
+/**
+ * Requirement: The system shall let several threads wait for their own outstanding queries at the same time.
+ */
+void test_data_sql_concurrent_waiters(void) {
+    PluginContext pc;
+    data_handle_t dh;
+    sql_data_t inst;
+    test_submit_setup(&pc, &dh, &inst);
+    int count = TEST_MAX_PENDING;
+    test_waiter_t waiters[TEST_MAX_PENDING];
+    pthread_t threads[TEST_MAX_PENDING];
+    for (int i = 0; i < count; i++) {
+        DbQuery q = {0};
+        snprintf(q.query, sizeof(q.query), "q %d", i);
+        get_plugin_context_ExpectAndReturn("mysql", &pc);
+        plugin_start_ExpectAndReturn(1, 0);
+        plugin_stop_Expect(1);
+        TEST_ASSERT_EQUAL(0, data_sql_submit(&dh, &q, DB_PRIORITY_NORMAL, NULL, NULL, &waiters[i].ticket));
+        waiters[i].result = -1;
+        pthread_create(&threads[i], NULL, test_waiter_main, &waiters[i]);
+    }
+    TEST_ASSERT_EQUAL(count, inst.outstanding);
+    pthread_t completer;
+    pthread_create(&completer, NULL, test_completer_main, &count);
+    pthread_join(completer, NULL);
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL(i, waiters[i].result);
+        char row[16];
+        snprintf(row, sizeof(row), "row %d", i);
+        TEST_ASSERT_EQUAL_STRING(row, data_sql_ticket_query(waiters[i].ticket)->rows[0]);
+        data_sql_release(waiters[i].ticket);
+    }
+    TEST_ASSERT_EQUAL(0, inst.outstanding);
+}
+
+/**
+ * Requirement: The system shall give up the blocking execute after the timeout, the late result shall not touch the caller's query.
+ */
+void test_data_sql_execute_timeout(void) {
+    PluginContext pc;
+    data_handle_t dh;
+    sql_data_t inst;
+    test_submit_setup(&pc, &dh, &inst);
+    DbQuery q = {0};
+    snprintf(q.query, sizeof(q.query), "q 5");
+    get_plugin_context_ExpectAndReturn("mysql", &pc);
+    plugin_start_ExpectAndReturn(1, 0);
+    plugin_stop_Expect(1);
+    TEST_ASSERT_EQUAL(DATA_SQL_TIMEOUT, data_sql_execute(&dh, &q));
+    TEST_ASSERT_EQUAL(-1, q.result_count);
+    TEST_ASSERT_EQUAL(1, inst.outstanding);
+    test_complete(0);   // late, frees the abandoned ticket
+    TEST_ASSERT_EQUAL(-1, q.result_count);
+    TEST_ASSERT_EQUAL_STRING("", q.rows[0]);
+    TEST_ASSERT_EQUAL(0, inst.outstanding);
 }
@@ -0,0 +1,317 @@
+/**
+ * File: test_dbpool.c
+ *
+ * Test of the database connection pool (dbpool.h).
+ * The backend is an in-process fake, the requests go through a
+ * PluginDbFunctions like the ones of the db plugins, so no database server
+ * is needed. Queries of the fake: "sleep <ms>", "fail", "rows <n>".
+ */
+#include "unity.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "plugin.h"
+#include "dbpool.h"
+#include "dbpool.c"
+
+typedef struct {
+    int alive;
+} fake_conn_t;
+
+static int g_fake_down;         // connect fails
+static int g_fake_connects;
+static int g_fake_running;      // queries in progress
+static int g_fake_max_running;
+static fake_conn_t *g_fake_last;
+
+static void *fake_connect(void *ctx) {
+    (void)ctx;
+    __atomic_add_fetch(&g_fake_connects, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&g_fake_down, __ATOMIC_ACQUIRE)) return NULL;
+    fake_conn_t *c = malloc(sizeof(fake_conn_t));
+    c->alive = 1;
+    __atomic_store_n(&g_fake_last, c, __ATOMIC_RELEASE);
+    return c;
+}
+static int fake_ping(void *conn, void *ctx) {
+    (void)ctx;
+    return __atomic_load_n(&((fake_conn_t *)conn)->alive, __ATOMIC_ACQUIRE) ? 0 : -1;
+}
+static int fake_execute(void *conn, DbQuery *q, void *ctx) {
+    (void)ctx;
+    if (!__atomic_load_n(&((fake_conn_t *)conn)->alive, __ATOMIC_ACQUIRE)) return DBPOOL_EXEC_BROKEN;
+    int running = __atomic_add_fetch(&g_fake_running, 1, __ATOMIC_ACQ_REL);
+    int max = __atomic_load_n(&g_fake_max_running, __ATOMIC_ACQUIRE);
+    while (running > max &&
+           !__atomic_compare_exchange_n(&g_fake_max_running, &max, running, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+    int rows = 0;
+    int arg = 0;
+    if (sscanf(q->query, "sleep %d", &arg) == 1) {
+        usleep((useconds_t)arg * 1000);
+    } else if (!strcmp(q->query, "fail")) {
+        rows = DBPOOL_EXEC_ERROR;
+    } else if (sscanf(q->query, "rows %d", &arg) == 1) {
+        for (rows = 0; rows < arg && rows < DB_QUERY_MAX_ROWS; rows++) {
+            snprintf(q->rows[rows], sizeof(q->rows[rows]), "%d|row", rows);
+        }
+    }
+    __atomic_sub_fetch(&g_fake_running, 1, __ATOMIC_ACQ_REL);
+    return rows;
+}
+static void fake_close(void *conn, void *ctx) {
+    (void)ctx;
+    free(conn);
+}
+
+static const dbpool_backend_t g_fake_backend = {
+    .connect = fake_connect,
+    .ping = fake_ping,
+    .execute = fake_execute,
+    .close = fake_close,
+};
+
+static dbpool_t g_pool;
+
+static int fake_db_request(DbQuery *query, DbPriority priority, QueryResultProc result_proc, void *user_data) {
+    return dbpool_submit(&g_pool, query, priority, result_proc, user_data);
+}
+static const PluginDbFunctions g_fake_db = { .request = fake_db_request };
+
+typedef struct {
+    DbQuery q;
+    int done;
+    int order;      // completion order
+} test_request_t;
+
+static int g_order;
+
+static void test_result(PCHANDLER pc, DbQuery *query, void *user_data) {
+    (void)pc;
+    (void)query;
+    test_request_t *r = (test_request_t *)user_data;
+    r->order = __atomic_add_fetch(&g_order, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+}
+static int test_send_prio(test_request_t *r, const char *query, DbPriority priority) {
+    memset(r, 0, sizeof(*r));
+    snprintf(r->q.query, sizeof(r->q.query), "%s", query);
+    return g_fake_db.request(&r->q, priority, test_result, r);
+}
+static void test_send(test_request_t *r, const char *query) {
+    TEST_ASSERT_EQUAL(0, test_send_prio(r, query, DB_PRIORITY_NORMAL));
+}
+static int test_wait(test_request_t *r, int timeout_ms) {
+    for (int t = 0; t < timeout_ms; t++) {
+        if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) return 0;
+        usleep(1000);
+    }
+    return -1;
+}
+static int test_wait_connected(size_t n, int timeout_ms) {
+    for (int t = 0; t < timeout_ms; t++) {
+        pthread_mutex_lock(&g_pool.lock);
+        size_t c = g_pool.connected;
+        pthread_mutex_unlock(&g_pool.lock);
+        if (c >= n) return 0;
+        usleep(1000);
+    }
+    return -1;
+}
+
+static void test_start_queue(size_t workers, unsigned int health_ms, size_t queue_size) {
+    dbpool_config_t config = {
+        .workers = workers,
+        .queue_size = queue_size,
+        .health_check_ms = health_ms,
+        .backoff_min_ms = 20,
+        .backoff_max_ms = 80,
+    };
+    TEST_ASSERT_EQUAL(0, dbpool_start(&g_pool, &config, &g_fake_backend));
+}
+static void test_start(size_t workers, unsigned int health_ms) {
+    test_start_queue(workers, health_ms, 32);
+}
+
+void setUp(void) {
+    g_fake_down = 0;
+    g_fake_connects = 0;
+    g_fake_running = 0;
+    g_fake_max_running = 0;
+    g_fake_last = NULL;
+    g_order = 0;
+}
+void tearDown(void) {
+    dbpool_stop(&g_pool);
+}
+
+void test_dbpool_results(void) {
+    test_request_t a, b;
+    test_start(2, 0);
+    test_send(&a, "rows 3");
+    test_send(&b, "fail");
+    TEST_ASSERT_EQUAL(0, test_wait(&a, 1000));
+    TEST_ASSERT_EQUAL(0, test_wait(&b, 1000));
+    TEST_ASSERT_EQUAL(3, a.q.result_count);
+    TEST_ASSERT_EQUAL_STRING("2|row", a.q.rows[2]);
+    TEST_ASSERT_EQUAL(-1, b.q.result_count);
+    dbpool_conn_stat_t stats[2];
+    TEST_ASSERT_EQUAL(2, dbpool_stats(&g_pool, stats, 2));
+    TEST_ASSERT_EQUAL(2, stats[0].queries + stats[1].queries);
+    TEST_ASSERT_EQUAL(1, stats[0].errors + stats[1].errors);
+}
+
+void test_dbpool_concurrent(void) {
+    test_request_t r[4];
+    test_start(4, 0);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(4, 1000));
+    for (int i = 0; i < 4; i++) test_send(&r[i], "sleep 100");
+    for (int i = 0; i < 4; i++) TEST_ASSERT_EQUAL(0, test_wait(&r[i], 1000));
+    TEST_ASSERT_EQUAL(4, g_fake_max_running);
+}
+
+void test_dbpool_slow_query_does_not_block(void) {
+    test_request_t slow, fast[8];
+    test_start(2, 0);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(2, 1000));
+    test_send(&slow, "sleep 500");
+    for (int i = 0; i < 8; i++) test_send(&fast[i], "rows 1");
+    for (int i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUAL(0, test_wait(&fast[i], 250));
+        TEST_ASSERT_EQUAL(1, fast[i].q.result_count);
+    }
+    TEST_ASSERT_EQUAL(0, __atomic_load_n(&slow.done, __ATOMIC_ACQUIRE));
+    TEST_ASSERT_EQUAL(0, test_wait(&slow, 1000));
+}
+
+void test_dbpool_reconnect_backoff(void) {
+    test_request_t r;
+    g_fake_down = 1;
+    test_start(1, 0);
+    // no connection: the request fails fast instead of waiting
+    test_send(&r, "rows 1");
+    TEST_ASSERT_EQUAL(0, test_wait(&r, 200));
+    TEST_ASSERT_EQUAL(-1, r.q.result_count);
+    usleep(300 * 1000);
+    // 20, 40, 80, 80 ms delays: only a few attempts, not a busy loop
+    int attempts = __atomic_load_n(&g_fake_connects, __ATOMIC_ACQUIRE);
+    TEST_ASSERT_TRUE(attempts >= 3);
+    TEST_ASSERT_TRUE(attempts <= 7);
+    dbpool_conn_stat_t stat;
+    dbpool_stats(&g_pool, &stat, 1);
+    TEST_ASSERT_EQUAL(0, stat.connected);
+    TEST_ASSERT_EQUAL(80, stat.backoff_ms);
+
+    __atomic_store_n(&g_fake_down, 0, __ATOMIC_RELEASE);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(1, 500));
+    test_send(&r, "rows 2");
+    TEST_ASSERT_EQUAL(0, test_wait(&r, 1000));
+    TEST_ASSERT_EQUAL(2, r.q.result_count);
+
+    // a lost connection is reconnected at once, counted
+    __atomic_store_n(&g_fake_last->alive, 0, __ATOMIC_RELEASE);
+    test_send(&r, "rows 2");
+    TEST_ASSERT_EQUAL(0, test_wait(&r, 1000));
+    TEST_ASSERT_EQUAL(-1, r.q.result_count);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(1, 500));
+    test_send(&r, "rows 2");
+    TEST_ASSERT_EQUAL(0, test_wait(&r, 1000));
+    TEST_ASSERT_EQUAL(2, r.q.result_count);
+    dbpool_stats(&g_pool, &stat, 1);
+    TEST_ASSERT_EQUAL(1, stat.connected);
+    TEST_ASSERT_EQUAL(1, stat.reconnects);
+    TEST_ASSERT_EQUAL(0, stat.backoff_ms);
+}
+
+void test_dbpool_health_check(void) {
+    test_start(1, 20);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(1, 500));
+    fake_conn_t *first = __atomic_load_n(&g_fake_last, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&first->alive, 0, __ATOMIC_RELEASE);
+    // the idle connection is pinged, found broken and replaced
+    dbpool_conn_stat_t stat = {0};
+    for (int t = 0; t < 500 && !stat.reconnects; t++) {
+        usleep(1000);
+        dbpool_stats(&g_pool, &stat, 1);
+    }
+    TEST_ASSERT_EQUAL(1, stat.reconnects);
+    TEST_ASSERT_EQUAL(2, __atomic_load_n(&g_fake_connects, __ATOMIC_ACQUIRE));
+    TEST_ASSERT_EQUAL(0, stat.queries);
+}
+
+void test_dbpool_stop_completes_queued(void) {
+    test_request_t slow, queued;
+    test_start(1, 0);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(1, 500));
+    test_send(&slow, "sleep 100");
+    usleep(20 * 1000);
+    test_send(&queued, "rows 1");
+    dbpool_stop(&g_pool);
+    TEST_ASSERT_EQUAL(1, slow.done);
+    TEST_ASSERT_EQUAL(1, queued.done);
+    TEST_ASSERT_EQUAL(-1, queued.q.result_count);
+    TEST_ASSERT_EQUAL(-1, dbpool_submit(&g_pool, &queued.q, DB_PRIORITY_NORMAL, test_result, &queued));
+}
+
+static int g_resubmit_rc;
+static void test_result_resubmit(PCHANDLER pc, DbQuery *query, void *user_data) {
+    // a completion which retries: it takes the pool lock
+    g_resubmit_rc = dbpool_submit(&g_pool, query, DB_PRIORITY_NORMAL, test_result, user_data);
+    test_result(pc, query, user_data);
+}
+
+void test_dbpool_stop_completion_resubmits(void) {
+    test_request_t slow, queued;
+    test_start(1, 0);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(1, 500));
+    test_send(&slow, "sleep 100");
+    usleep(20 * 1000);
+    memset(&queued, 0, sizeof(queued));
+    snprintf(queued.q.query, sizeof(queued.q.query), "rows 1");
+    TEST_ASSERT_EQUAL(0, g_fake_db.request(&queued.q, DB_PRIORITY_NORMAL, test_result_resubmit, &queued));
+    g_resubmit_rc = 0;
+    dbpool_stop(&g_pool);   // does not deadlock
+    TEST_ASSERT_EQUAL(1, queued.done);
+    TEST_ASSERT_EQUAL(-1, queued.q.result_count);
+    TEST_ASSERT_EQUAL(-1, g_resubmit_rc);
+}
+
+void test_dbpool_priority_and_rejection(void) {
+    test_request_t busy, bulk[3], normal, login, over;
+    test_start_queue(1, 0, 4);
+    TEST_ASSERT_EQUAL(0, test_wait_connected(1, 500));
+    // the only worker is busy, the others wait in the queue
+    test_send(&busy, "sleep 100");
+    usleep(20 * 1000);
+    TEST_ASSERT_EQUAL(0, test_send_prio(&bulk[0], "rows 1", DB_PRIORITY_BULK));
+    TEST_ASSERT_EQUAL(0, test_send_prio(&bulk[1], "rows 1", DB_PRIORITY_BULK));
+    TEST_ASSERT_EQUAL(0, test_send_prio(&bulk[2], "rows 1", DB_PRIORITY_BULK));
+    // bulk may fill 3 of the 4 places, the last one is kept
+    TEST_ASSERT_EQUAL(-1, test_send_prio(&over, "rows 1", DB_PRIORITY_BULK));
+    TEST_ASSERT_EQUAL(0, test_send_prio(&login, "rows 1", DB_PRIORITY_INTERACTIVE));
+    TEST_ASSERT_EQUAL(-1, test_send_prio(&normal, "rows 1", DB_PRIORITY_NORMAL));
+    TEST_ASSERT_EQUAL(0, over.done);
+    TEST_ASSERT_EQUAL(0, normal.done);
+
+    TEST_ASSERT_EQUAL(0, test_wait(&bulk[2], 1000));
+    TEST_ASSERT_EQUAL(0, test_wait(&login, 1000));
+    // the login overtakes the older bulk requests, those keep their order
+    TEST_ASSERT_EQUAL(2, login.order);
+    TEST_ASSERT_EQUAL(3, bulk[0].order);
+    TEST_ASSERT_EQUAL(5, bulk[2].order);
+
+    dbpool_queue_stat_t qs;
+    dbpool_queue_stats(&g_pool, &qs);
+    TEST_ASSERT_EQUAL(0, qs.depth);
+    TEST_ASSERT_EQUAL(4, qs.max_depth);
+    TEST_ASSERT_EQUAL(3, qs.submitted[DB_PRIORITY_BULK]);
+    TEST_ASSERT_EQUAL(1, qs.rejected[DB_PRIORITY_BULK]);
+    TEST_ASSERT_EQUAL(1, qs.rejected[DB_PRIORITY_NORMAL]);
+    TEST_ASSERT_EQUAL(0, qs.rejected[DB_PRIORITY_INTERACTIVE]);
+    TEST_ASSERT_EQUAL(1, qs.started[DB_PRIORITY_INTERACTIVE]);
+    // waited behind the 100 ms query
+    TEST_ASSERT_TRUE(qs.max_wait_us[DB_PRIORITY_BULK] >= 50000);
+}
@@ -0,0 +1,188 @@
+/**
+ * File: test_dbresult.c
+ *
+ * Test of the typed db result set and of the routing of the rows
+ * (dbresult.h): typed, streaming and the '|' joined compatibility rows.
+ */
+#include "unity.h"
+#include <string.h>
+#include <stdio.h>
+
+#include "plugin.h"
+#include "dbresult.h"
+#include "dbresult.c"
+
+static const DbColumn g_columns[] = {
+    { "id", DB_TYPE_INT },
+    { "nick", DB_TYPE_TEXT },
+    { "lat", DB_TYPE_DOUBLE },
+};
+
+/** test_deliver
+ * Deliver count rows like a db plugin: id, nick "n|<id>", lat (NULL for the odd ids).
+ */
+static int test_deliver(DbQuery *q, int count) {
+    DbValue values[3];
+    DbRow row = { g_columns, 3, values, 0 };
+    char id[16], nick[16], lat[16];
+    if (db_query_begin(q, g_columns, 3)) return -1;
+    for (int i = 0; i < count; i++) {
+        snprintf(id, sizeof(id), "%d", i);
+        snprintf(nick, sizeof(nick), "n|%d", i);
+        snprintf(lat, sizeof(lat), "%d.5", i);
+        values[0] = db_value_parse(DB_TYPE_INT, id, strlen(id));
+        values[1] = db_value_parse(DB_TYPE_TEXT, nick, strlen(nick));
+        values[2] = db_value_parse(DB_TYPE_DOUBLE, (i & 1) ? NULL : lat, strlen(lat));
+        int rc = db_query_row(q, &row);
+        if (rc < 0) return -1;
+        if (rc) break;
+        row.index++;
+    }
+    return q->result_count;
+}
+
+void setUp(void) {
+}
+void tearDown(void) {
+}
+
+void test_dbresult_typed(void) {
+    DbQuery q = {0};
+    q.flags = DB_QUERY_TYPED;
+    // more rows than the compatibility rows can hold, nothing truncated
+    TEST_ASSERT_EQUAL(100, test_deliver(&q, 100));
+    TEST_ASSERT_NOT_NULL(q.result);
+    TEST_ASSERT_EQUAL(0, q.flags & DB_QUERY_TRUNCATED);
+    TEST_ASSERT_EQUAL(100, q.result->row_count);
+    TEST_ASSERT_EQUAL(3, q.result->column_count);
+    TEST_ASSERT_EQUAL(1, db_result_column_index(q.result, "nick"));
+    TEST_ASSERT_EQUAL(-1, db_result_column_index(q.result, "none"));
+    TEST_ASSERT_EQUAL(DB_TYPE_DOUBLE, q.result->columns[2].type);
+
+    DbRow row;
+    TEST_ASSERT_EQUAL(0, db_result_row(q.result, 42, &row));
+    TEST_ASSERT_EQUAL(42, db_row_int(&row, 0, -1));
+    // the separator is data, not a delimiter
+    TEST_ASSERT_EQUAL_STRING("n|42", db_row_text(&row, 1));
+    TEST_ASSERT_FALSE(db_row_is_null(&row, 2));
+    TEST_ASSERT_TRUE(db_row_double(&row, 2, 0.0) == 42.5);
+    TEST_ASSERT_EQUAL_STRING("42", db_row_text(&row, 0));
+
+    // NULL aware, the default is given back
+    TEST_ASSERT_EQUAL(0, db_result_row(q.result, 43, &row));
+    TEST_ASSERT_TRUE(db_row_is_null(&row, 2));
+    TEST_ASSERT_TRUE(db_row_double(&row, 2, -1.0) == -1.0);
+    TEST_ASSERT_NULL(db_row_text(&row, 2));
+    // missing column
+    TEST_ASSERT_TRUE(db_row_is_null(&row, 3));
+    TEST_ASSERT_EQUAL(7, db_row_int(&row, 3, 7));
+    TEST_ASSERT_EQUAL(-1, db_result_row(q.result, 100, &row));
+    db_result_free(q.result);
+}
+
+void test_dbresult_conversions(void) {
+    DbResult *r = db_result_new(2);
+    TEST_ASSERT_NOT_NULL(r);
+    DbValue values[2];
+    values[0] = db_value_parse(DB_TYPE_TEXT, "12", 2);
+    values[1] = db_value_parse(DB_TYPE_INT, "-3", 2);
+    TEST_ASSERT_EQUAL(0, db_result_add_row(r, values));
+    DbRow row;
+    db_result_row(r, 0, &row);
+    TEST_ASSERT_EQUAL(12, db_row_int(&row, 0, 0));
+    TEST_ASSERT_TRUE(db_row_double(&row, 1, 0.0) == -3.0);
+    TEST_ASSERT_EQUAL_STRING("", r->columns[0].name);
+    db_result_free(r);
+    db_result_free(NULL);
+}
+
+typedef struct {
+    int rows;
+    int stop_at;
+    long long id_sum;
+} test_stream_t;
+
+static int test_row_proc(const DbRow *row, void *user_data) {
+    test_stream_t *t = (test_stream_t *)user_data;
+    TEST_ASSERT_EQUAL(3, row->column_count);
+    TEST_ASSERT_EQUAL_STRING("nick", row->columns[1].name);
+    t->id_sum += db_row_int(row, 0, 0);
+    t->rows++;
+    return t->rows == t->stop_at;
+}
+
+void test_dbresult_streaming(void) {
+    test_stream_t t = { 0, 0, 0 };
+    DbQuery q = {0};
+    q.flags = DB_QUERY_TYPED;   // the row_proc wins, nothing is collected
+    q.row_proc = test_row_proc;
+    q.row_user_data = &t;
+    TEST_ASSERT_EQUAL(1000, test_deliver(&q, 1000));
+    TEST_ASSERT_EQUAL(1000, t.rows);
+    TEST_ASSERT_EQUAL(999 * 1000 / 2, t.id_sum);
+    TEST_ASSERT_NULL(q.result);
+
+    // the consumer stops the query
+    memset(&t, 0, sizeof(t));
+    t.stop_at = 10;
+    TEST_ASSERT_EQUAL(10, test_deliver(&q, 1000));
+    TEST_ASSERT_EQUAL(10, t.rows);
+}
+
+void test_dbresult_compatibility_rows(void) {
+    DbQuery q = {0};
+    TEST_ASSERT_EQUAL(DB_QUERY_MAX_ROWS, test_deliver(&q, 3 * DB_QUERY_MAX_ROWS));
+    TEST_ASSERT_NULL(q.result);
+    TEST_ASSERT_EQUAL_STRING("0|n|0|0.5", q.rows[0]);
+    TEST_ASSERT_EQUAL_STRING("1|n|1|", q.rows[1]);
+    // the rows over the limit are reported, not silently lost
+    TEST_ASSERT_EQUAL(DB_QUERY_TRUNCATED, q.flags & DB_QUERY_TRUNCATED);
+    q.flags = 0;
+    TEST_ASSERT_EQUAL(2, test_deliver(&q, 2));
+    TEST_ASSERT_EQUAL(0, q.flags & DB_QUERY_TRUNCATED);
+}
+
+void test_dbresult_long_values(void) {
+    static char big[3 * DB_QUERY_MAX_ROW_LEN];
+    memset(big, 'x', sizeof(big) - 1);
+    DbColumn column = { "text", DB_TYPE_TEXT };
+    DbValue value = db_value_parse(DB_TYPE_TEXT, big, strlen(big));
+    DbRow row = { &column, 1, &value, 0 };
+
+    DbQuery q = {0};
+    q.flags = DB_QUERY_TYPED;
+    db_query_begin(&q, &column, 1);
+    TEST_ASSERT_EQUAL(0, db_query_row(&q, &row));
+    DbRow got;
+    db_result_row(q.result, 0, &got);
+    TEST_ASSERT_EQUAL(strlen(big), strlen(db_row_text(&got, 0)));
+    TEST_ASSERT_EQUAL(strlen(big), got.values[0].len);
+    db_result_free(q.result);
+
+    // the compatibility row is cut, and it is told
+    memset(&q, 0, sizeof(q));
+    db_query_begin(&q, &column, 1);
+    TEST_ASSERT_EQUAL(0, db_query_row(&q, &row));
+    TEST_ASSERT_EQUAL(1, q.result_count);
+    TEST_ASSERT_EQUAL(DB_QUERY_TRUNCATED, q.flags & DB_QUERY_TRUNCATED);
+}
+
+void test_dbresult_bind(void) {
+    DbQuery q = {0};
+    TEST_ASSERT_EQUAL(0, db_query_bind_text(&q, "it's"));
+    TEST_ASSERT_EQUAL(0, db_query_bind_int(&q, 42));
+    TEST_ASSERT_EQUAL(0, db_query_bind_double(&q, 1.5));
+    TEST_ASSERT_EQUAL(0, db_query_bind_text(&q, NULL));
+    TEST_ASSERT_EQUAL(DB_QUERY_PREPARED, q.flags & DB_QUERY_PREPARED);
+    TEST_ASSERT_EQUAL(4, q.param_count);
+    TEST_ASSERT_EQUAL(DB_TYPE_TEXT, q.params[0].type);
+    TEST_ASSERT_EQUAL_STRING("it's", q.params[0].s);
+    TEST_ASSERT_EQUAL(4, q.params[0].len);
+    TEST_ASSERT_EQUAL(42, q.params[1].i);
+    TEST_ASSERT_TRUE(q.params[2].d == 1.5);
+    TEST_ASSERT_EQUAL(DB_TYPE_NULL, q.params[3].type);
+    // no room for more than DB_QUERY_MAX_PARAMS
+    while (q.param_count < DB_QUERY_MAX_PARAMS) TEST_ASSERT_EQUAL(0, db_query_bind_null(&q));
+    TEST_ASSERT_EQUAL(-1, db_query_bind_int(&q, 1));
+    TEST_ASSERT_EQUAL(DB_QUERY_MAX_PARAMS, q.param_count);
+}
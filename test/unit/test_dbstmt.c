@@ -0,0 +1,96 @@
+/**
+ * File: test_dbstmt.c
+ *
+ * Test of the prepared statement cache (dbstmt.h): hits and misses,
+ * least recently used eviction, the statements are finalized exactly once.
+ * The statements are fake ones, counted by the free callback.
+ */
+#include "unity.h"
+#include <string.h>
+#include <stdlib.h>
+
+#include "dbstmt.h"
+#include "dbstmt.c"
+
+static int g_freed;
+
+static void fake_stmt_free(void *stmt) {
+    g_freed++;
+    free(stmt);
+}
+
+static void *fake_stmt(void) {
+    return malloc(1);
+}
+
+static dbstmt_cache_t g_cache;
+
+void setUp(void) {
+    g_freed = 0;
+    TEST_ASSERT_EQUAL(0, dbstmt_init(&g_cache, 3, fake_stmt_free));
+}
+void tearDown(void) {
+    dbstmt_destroy(&g_cache);
+}
+
+void test_dbstmt_get_put(void) {
+    TEST_ASSERT_NULL(dbstmt_get(&g_cache, "select 1"));
+    void *s1 = fake_stmt();
+    TEST_ASSERT_EQUAL(0, dbstmt_put(&g_cache, "select 1", s1));
+    TEST_ASSERT_EQUAL_PTR(s1, dbstmt_get(&g_cache, "select 1"));
+    TEST_ASSERT_EQUAL_PTR(s1, dbstmt_get(&g_cache, "select 1"));
+    TEST_ASSERT_NULL(dbstmt_get(&g_cache, "select 2"));
+    TEST_ASSERT_EQUAL(2, g_cache.hits);
+    TEST_ASSERT_EQUAL(2, g_cache.misses);
+    // the same text again replaces the old statement
+    void *s2 = fake_stmt();
+    TEST_ASSERT_EQUAL(0, dbstmt_put(&g_cache, "select 1", s2));
+    TEST_ASSERT_EQUAL(1, g_freed);
+    TEST_ASSERT_EQUAL(1, g_cache.count);
+    TEST_ASSERT_EQUAL_PTR(s2, dbstmt_get(&g_cache, "select 1"));
+}
+
+void test_dbstmt_lru_eviction(void) {
+    dbstmt_put(&g_cache, "a", fake_stmt());
+    dbstmt_put(&g_cache, "b", fake_stmt());
+    dbstmt_put(&g_cache, "c", fake_stmt());
+    // "a" is used again, so "b" is the least recently used one
+    TEST_ASSERT_NOT_NULL(dbstmt_get(&g_cache, "a"));
+    dbstmt_put(&g_cache, "d", fake_stmt());
+    TEST_ASSERT_EQUAL(1, g_freed);
+    TEST_ASSERT_EQUAL(3, g_cache.count);
+    TEST_ASSERT_NULL(dbstmt_get(&g_cache, "b"));
+    TEST_ASSERT_NOT_NULL(dbstmt_get(&g_cache, "a"));
+    TEST_ASSERT_NOT_NULL(dbstmt_get(&g_cache, "c"));
+    TEST_ASSERT_NOT_NULL(dbstmt_get(&g_cache, "d"));
+}
+
+void test_dbstmt_drop_and_clear(void) {
+    dbstmt_put(&g_cache, "a", fake_stmt());
+    dbstmt_put(&g_cache, "b", fake_stmt());
+    dbstmt_drop(&g_cache, "a");
+    dbstmt_drop(&g_cache, "none");
+    TEST_ASSERT_EQUAL(1, g_freed);
+    TEST_ASSERT_NULL(dbstmt_get(&g_cache, "a"));
+    TEST_ASSERT_NOT_NULL(dbstmt_get(&g_cache, "b"));
+    // a reconnect: everything is finalized, the cache is still usable
+    dbstmt_clear(&g_cache);
+    TEST_ASSERT_EQUAL(2, g_freed);
+    TEST_ASSERT_EQUAL(0, g_cache.count);
+    TEST_ASSERT_EQUAL(0, dbstmt_put(&g_cache, "a", fake_stmt()));
+    dbstmt_destroy(&g_cache);
+    TEST_ASSERT_EQUAL(3, g_freed);
+    // destroyed twice by the tearDown, no harm
+}
+
+void test_dbstmt_uninitialized(void) {
+    dbstmt_cache_t c;
+    memset(&c, 0, sizeof(c));
+    TEST_ASSERT_NULL(dbstmt_get(&c, "a"));
+    dbstmt_clear(&c);
+    dbstmt_destroy(&c);
+    // the statement is not leaked when it cannot be cached
+    c.free_stmt = fake_stmt_free;
+    TEST_ASSERT_EQUAL(-1, dbstmt_put(&c, "a", fake_stmt()));
+    TEST_ASSERT_EQUAL(1, g_freed);
+}
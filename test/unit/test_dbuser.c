@@ -0,0 +1,102 @@
+/**
+ * File: test_dbuser.c
+ *
+ * Test of the /user summary (dbuser.h): the rows of the batched query are
+ * fed like a db plugin streams them, the JSON comes from that one pass.
+ */
+#include "unity.h"
+#include <string.h>
+#include <stdio.h>
+
+#include "plugin.h"
+#include "dbresult.h"
+#include "dbuser.h"
+#include "dbuser.c"
+#include "dbresult.c"
+
+#define TEST_COLUMNS (9)
+static const DbColumn g_columns[TEST_COLUMNS] = {
+    { "kind", DB_TYPE_TEXT }, { "id", DB_TYPE_INT }, { "nick", DB_TYPE_TEXT },
+    { "last_login", DB_TYPE_TEXT }, { "email", DB_TYPE_TEXT }, { "lat", DB_TYPE_DOUBLE },
+    { "lon", DB_TYPE_DOUBLE }, { "alt", DB_TYPE_DOUBLE }, { "regions", DB_TYPE_INT },
+};
+
+/** test_row
+ * Deliver one row of text values, NULL for the missing ones.
+ */
+static int test_row(DbQuery *q, const char *const *texts) {
+    DbValue values[TEST_COLUMNS];
+    DbRow row = { g_columns, TEST_COLUMNS, values, 0 };
+    for (int i = 0; i < TEST_COLUMNS; i++) {
+        values[i] = db_value_parse(g_columns[i].type, texts[i], texts[i] ? strlen(texts[i]) : 0);
+    }
+    return db_query_row(q, &row);
+}
+
+static const char *g_user[TEST_COLUMNS] = { "u", "7", "bob", "2025-07-01", "b@geo", "47.5", "19.25", "100", "3" };
+static const char *g_persons[TEST_COLUMNS] = { "p", "4", "2", "1" };
+
+static DbQuery g_q;
+static dbuser_summary_t g_s;
+
+void setUp(void) {
+    memset(&g_q, 0, sizeof(g_q));
+    TEST_ASSERT_EQUAL(0, dbuser_summary_query(&g_q, &g_s, "S1"));
+    db_query_begin(&g_q, g_columns, TEST_COLUMNS);
+}
+void tearDown(void) {
+}
+
+void test_dbuser_query(void) {
+    TEST_ASSERT_EQUAL_STRING(dbuser_summary_sql, g_q.query);
+    TEST_ASSERT_EQUAL(DBUSER_QUERY_PARAMS, g_q.param_count);
+    TEST_ASSERT_EQUAL(DB_QUERY_PREPARED, g_q.flags & DB_QUERY_PREPARED);
+    TEST_ASSERT_EQUAL_STRING("S1", g_q.params[DBUSER_QUERY_PARAMS - 1].s);
+    TEST_ASSERT_NOT_NULL(g_q.row_proc);
+    TEST_ASSERT_FALSE(g_s.found);
+}
+
+void test_dbuser_summary_json(void) {
+    const char *r1[TEST_COLUMNS] = { "r", "1", "wood", "30" };
+    const char *r2[TEST_COLUMNS] = { "r", "2", "stone", "12" };
+    // the kinds may come in any order
+    TEST_ASSERT_EQUAL(0, test_row(&g_q, r1));
+    TEST_ASSERT_EQUAL(0, test_row(&g_q, g_user));
+    TEST_ASSERT_EQUAL(0, test_row(&g_q, g_persons));
+    TEST_ASSERT_EQUAL(0, test_row(&g_q, r2));
+    TEST_ASSERT_TRUE(g_s.found);
+    TEST_ASSERT_EQUAL(7, g_s.user_id);
+    TEST_ASSERT_EQUAL(3, g_s.region_count);
+    TEST_ASSERT_EQUAL(4, g_s.workers);
+    TEST_ASSERT_EQUAL(2, g_s.soldiers);
+    TEST_ASSERT_EQUAL(1, g_s.dead);
+    TEST_ASSERT_EQUAL(2, g_s.resource_count);
+
+    char body[1024];
+    TEST_ASSERT_TRUE(dbuser_summary_json(&g_s, "S1", body, sizeof(body)) > 0);
+    TEST_ASSERT_NOT_NULL(strstr(body, "\"nick\": \"bob\""));
+    TEST_ASSERT_NOT_NULL(strstr(body, "\"lon\": 19.2500"));
+    TEST_ASSERT_NOT_NULL(strstr(body, "\"resources\": [{\"id\":1,\"name\":\"wood\",\"quantity\":30},{\"id\":2,\"name\":\"stone\",\"quantity\":12}]"));
+    TEST_ASSERT_EQUAL(-1, dbuser_summary_json(&g_s, "S1", body, 64));
+}
+
+void test_dbuser_no_session(void) {
+    // no persons of an unknown session: the SUMs are NULL
+    const char *persons[TEST_COLUMNS] = { "p", NULL, NULL, NULL };
+    TEST_ASSERT_EQUAL(0, test_row(&g_q, persons));
+    TEST_ASSERT_FALSE(g_s.found);
+    TEST_ASSERT_EQUAL(0, g_s.workers);
+}
+
+void test_dbuser_resources_truncated(void) {
+    static char name[300];
+    memset(name, 'n', sizeof(name) - 1);
+    const char *r[TEST_COLUMNS] = { "r", "1", name, "1" };
+    test_row(&g_q, g_user);
+    for (int i = 0; i < 20; i++) TEST_ASSERT_EQUAL(0, test_row(&g_q, r));
+    TEST_ASSERT_TRUE(g_s.truncated);
+    TEST_ASSERT_TRUE(g_s.resource_count > 0 && g_s.resource_count < 20);
+    // whole items only, the array stays valid
+    TEST_ASSERT_EQUAL(strlen(g_s.resources), g_s.resources_len);
+    TEST_ASSERT_EQUAL('}', g_s.resources[g_s.resources_len - 1]);
+}
@@ -73,4 +73,35 @@ void test_json_indexlist_many_entries_should_be_fast(void) {
     printf("Lookup time for %d entries: %.3f sec\n", COUNT, elapsed);
 
     json_indexlist_destroy(&map);
-}
\ No newline at end of file
+}
+/**
+ * Requirement: the deleted keys are not found, their slots are reused.
+ */
+void test_json_indexlist_delete_and_readd_should_work(void) {
+    json_indexlist_t map = {0};
+    int ret = json_indexlist_init(&map);
+    TEST_ASSERT_EQUAL(0, ret);
+    char key[32];
+    size_t idx;
+    for (int round = 0; round < 100; ++round) {
+        for (int i = 0; i < 50; ++i) {
+            snprintf(key, sizeof(key), "key%d_%d", round, i);
+            TEST_ASSERT_EQUAL(0, json_indexlist_add(&map, key, i));
+        }
+        for (int i = 0; i < 50; ++i) {
+            snprintf(key, sizeof(key), "key%d_%d", round, i);
+            TEST_ASSERT_EQUAL(0, json_indexlist_delete(&map, key));
+            TEST_ASSERT_EQUAL(-1, json_indexlist_search(&map, key, &idx));
+        }
+    }
+    TEST_ASSERT_EQUAL(0, map.count);
+    // churn does not grow the table
+    TEST_ASSERT_TRUE(map.capacity <= 256);
+    TEST_ASSERT_EQUAL(0, json_indexlist_add(&map, "abc", 1));
+    TEST_ASSERT_EQUAL(0, json_indexlist_add(&map, "abc", 2));
+    TEST_ASSERT_EQUAL(0, json_indexlist_search(&map, "abc", &idx));
+    TEST_ASSERT_EQUAL(2, idx);
+    TEST_ASSERT_EQUAL(1, map.count);
+    TEST_ASSERT_EQUAL(-1, json_indexlist_delete(&map, "none"));
+    json_indexlist_destroy(&map);
+}
@@ -0,0 +1,78 @@
+/**
+ * File: test_mapgen.c
+ *
+ * Test of the map generator color class lookup.
+ * The lookup table must give the same class as the binary search over the
+ * latitude dependent elevation edges, for every representable i16 elevation
+ * and every latitude band of the generator.
+ */
+#include "unity.h"
+#include <string.h>
+
+#include "mapgen/mapgen.c"
+#include "mapgen/perlin3d.c"
+
+static float g_elevclass_saved[MAPGEN_ELEVCLASS_MAX];
+
+void setUp(void) {
+    memcpy(g_elevclass_saved, g_elevclass, sizeof(g_elevclass));
+}
+void tearDown(void) {
+    memcpy(g_elevclass, g_elevclass_saved, sizeof(g_elevclass));
+}
+
+/** Compares the table and the search for all 65536 elevations, returns the mismatch count. */
+static int test_compare_all(LatData *pLatData) {
+    int mismatch = 0;
+    for (int e = -32768; e <= 32767; e++) {
+        short elev = (short)e;
+        if (find_color_index_lut(pLatData, elev) != find_color_index(pLatData->edges, elev)) mismatch++;
+    }
+    return mismatch;
+}
+
+void test_mapgen_class_lut_exhaustive_all_latitudes(void) {
+    LatData latdata;
+    int mismatch = 0;
+    for (int i = -900; i <= 900; i++) {
+        init_lat_data(&latdata, i / 10.0f);
+        mismatch += test_compare_all(&latdata);
+    }
+    TEST_ASSERT_EQUAL(0, mismatch);
+}
+
+void test_mapgen_class_lut_n_matches_scalar(void) {
+    LatData latdata;
+    enum { COUNT = 4096 };
+    short elev[COUNT];
+    unsigned char cindex[COUNT];
+    init_lat_data(&latdata, 47.5f);
+    for (int i = 0; i < COUNT; i++) elev[i] = (short)(i * 16 - 32768);
+    find_color_index_n(&latdata, elev, cindex, COUNT);
+    for (int i = 0; i < COUNT; i++) {
+        TEST_ASSERT_EQUAL(find_color_index(latdata.edges, elev[i]), cindex[i]);
+    }
+}
+
+void test_mapgen_class_lut_saturated_and_equal_edges(void) {
+    LatData latdata;
+    // saturated edges at both ends, and several classes sharing one edge
+    g_elevclass[0] = -5.0f;
+    for (int i = 1; i < MAPGEN_ELEVCLASS_MAX - 1; i++) g_elevclass[i] = 0.25f;
+    g_elevclass[MAPGEN_ELEVCLASS_MAX - 1] = 5.0f;
+    init_lat_data(&latdata, 0.0f);
+    TEST_ASSERT_EQUAL(0, test_compare_all(&latdata));
+    init_lat_data(&latdata, -90.0f);
+    TEST_ASSERT_EQUAL(0, test_compare_all(&latdata));
+}
+
+void test_mapgen_class_lut_edges_on_bucket_bounds(void) {
+    LatData latdata;
+    // edges exactly on, and next to, the 256 step bucket boundaries
+    init_lat_data(&latdata, 0.0f);
+    for (int i = 0; i < MAPGEN_ELEVCLASS_MAX; i++) {
+        latdata.edges[i] = (short)(-32768 + (i + 1) * 4096 + (i % 3) - 1);
+    }
+    init_class_lut(&latdata);
+    TEST_ASSERT_EQUAL(0, test_compare_all(&latdata));
+}
@@ -0,0 +1,213 @@
+/**
+ * File: test_plugin_image.c
+ *
+ * Test of the image plugin encoders.
+ * The encoders have no global lock, each one owns its png_struct,
+ * error handler and allocator, so the concurrency test encodes from
+ * many threads at once and decodes every output to verify it.
+ */
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "plugin_image/plugin_image.c"
+
+static int g_error_count = 0;
+static void test_errormsg(const char *fmt, ...) {
+    (void)fmt;
+    __sync_fetch_and_add(&g_error_count, 1);
+}
+static void test_nomsg(const char *fmt, ...) {
+    (void)fmt;
+}
+static PluginHostInterface g_host_fns = {
+    .errormsg = test_errormsg,
+    .debugmsg = test_nomsg,
+    .logmsg = test_nomsg
+};
+
+#define TEST_THREADS (8)
+#define TEST_IMAGES_PER_THREAD (12)
+
+void setUp(void) {
+    g_host = &g_host_fns;
+    g_error_count = 0;
+}
+void tearDown(void) {
+    ImageMemBuffer_pool_clear();
+}
+
+static unsigned int test_channels(ImageFormat format) {
+    switch (format) {
+        case ImageFormat_Grayscale: return 1;
+        case ImageFormat_RGBA: return 4;
+        default: return 3;
+    }
+}
+static unsigned char test_pixel(int seed, unsigned int x, unsigned int y, unsigned int c) {
+    return (unsigned char)(seed * 31 + x * 7 + y * 13 + c * 101);
+}
+/** Encodes the test pattern, returns the image for the caller to inspect and destroy. */
+static int test_encode(Image *img, const char *filename, ImageBackendType backend, ImageFormat format,
+        unsigned int w, unsigned int h, int seed, const ImageEncodeOptions *opt) {
+    if (image_create(NULL, img, filename, w, h, backend, format, ImageBuffer_AoS)) return -1;
+    if (opt && image_set_options(NULL, img, opt)) return -2;
+    unsigned int ch = test_channels(format);
+    unsigned char *row = malloc(w * ch);
+    for (unsigned int y = 0; y < h; y++) {
+        for (unsigned int x = 0; x < w; x++) {
+            for (unsigned int c = 0; c < ch; c++) row[x * ch + c] = test_pixel(seed, x, y, c);
+        }
+        image_write_row(NULL, img, row);
+    }
+    free(row);
+    return 0;
+}
+/** Decodes a PNG from memory and compares it to the pattern, 0 when equal. */
+static int test_verify_png(const unsigned char *data, size_t size, ImageFormat format, unsigned int w, unsigned int h, int seed) {
+    png_image pimg;
+    memset(&pimg, 0, sizeof(pimg));
+    pimg.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&pimg, data, size)) return -1;
+    unsigned int ch = test_channels(format);
+    pimg.format = (ch == 1) ? PNG_FORMAT_GRAY : (ch == 4) ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+    if (pimg.width != w || pimg.height != h) {
+        png_image_free(&pimg);
+        return -2;
+    }
+    unsigned char *pixels = malloc(PNG_IMAGE_SIZE(pimg));
+    int ret = 0;
+    if (!png_image_finish_read(&pimg, NULL, pixels, 0, NULL)) ret = -3;
+    for (unsigned int y = 0; !ret && y < h; y++) {
+        for (unsigned int x = 0; !ret && x < w; x++) {
+            for (unsigned int c = 0; c < ch; c++) {
+                if (pixels[(y * w + x) * ch + c] != test_pixel(seed, x, y, c)) {
+                    ret = -4;
+                    break;
+                }
+            }
+        }
+    }
+    free(pixels);
+    return ret;
+}
+static int test_read_file(const char *filename, unsigned char **data, size_t *size) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return -1;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    *data = malloc(len);
+    *size = fread(*data, 1, len, fp);
+    fclose(fp);
+    return (*size == (size_t)len) ? 0 : -2;
+}
+
+typedef struct {
+    int id;
+    int failures;
+} test_thread_t;
+
+static void *test_encode_thread(void *arg) {
+    test_thread_t *t = (test_thread_t *)arg;
+    static const ImageFormat formats[] = { ImageFormat_RGB, ImageFormat_Grayscale, ImageFormat_RGBA };
+    for (int i = 0; i < TEST_IMAGES_PER_THREAD; i++) {
+        int seed = t->id * 100 + i;
+        ImageFormat format = formats[i % 3];
+        unsigned int w = 64 + (seed % 7) * 9, h = 48 + (seed % 5) * 11;
+        ImageEncodeOptions opt = IMAGE_ENCODE_DEFAULT;
+        opt.level = i % 10;
+        Image img;
+        if (i & 1) {
+            char filename[MAX_PATH];
+            snprintf(filename, sizeof(filename), "test_plugin_image_%d_%d.png", t->id, i);
+            if (test_encode(&img, filename, ImageBackend_Png, format, w, h, seed, &opt)) {
+                t->failures++;
+                continue;
+            }
+            image_destroy(NULL, &img);
+            unsigned char *data = NULL;
+            size_t size = 0;
+            if (test_read_file(filename, &data, &size) || test_verify_png(data, size, format, w, h, seed)) t->failures++;
+            free(data);
+            remove(filename);
+        } else {
+            if (test_encode(&img, NULL, ImageBackend_Memory, format, w, h, seed, &opt)) {
+                t->failures++;
+                continue;
+            }
+            ImageMemBuffer *buf = NULL;
+            image_get_buffer(NULL, &img, (void **)&buf);
+            if (!buf || test_verify_png(buf->data, buf->size, format, w, h, seed)) t->failures++;
+            image_destroy(NULL, &img);
+        }
+    }
+    return NULL;
+}
+
+void test_plugin_image_memory_png_decodes(void) {
+    Image img;
+    TEST_ASSERT_EQUAL(0, test_encode(&img, NULL, ImageBackend_Memory, ImageFormat_RGB, 100, 60, 1, NULL));
+    ImageMemBuffer *buf = NULL;
+    image_get_buffer(NULL, &img, (void **)&buf);
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_EQUAL(0, test_verify_png(buf->data, buf->size, ImageFormat_RGB, 100, 60, 1));
+    image_destroy(NULL, &img);
+    TEST_ASSERT_EQUAL(0, g_error_count);
+}
+
+void test_plugin_image_raw_header_and_rows(void) {
+    Image img;
+    ImageEncodeOptions opt = IMAGE_ENCODE_DEFAULT;
+    opt.codec = ImageCodec_Raw;
+    TEST_ASSERT_EQUAL(0, test_encode(&img, NULL, ImageBackend_Memory, ImageFormat_RGBA, 300, 2, 5, &opt));
+    ImageMemBuffer *buf = NULL;
+    image_get_buffer(NULL, &img, (void **)&buf);
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_EQUAL(sizeof(ImageRawHeader) + 300 * 2 * 4, buf->size);
+    TEST_ASSERT_EQUAL_MEMORY(IMAGE_RAW_MAGIC, buf->data, 4);
+    TEST_ASSERT_EQUAL(4, buf->data[5]);
+    TEST_ASSERT_EQUAL(300 & 0xFF, buf->data[8]);
+    TEST_ASSERT_EQUAL(300 >> 8, buf->data[9]);
+    TEST_ASSERT_EQUAL(2, buf->data[12]);
+    TEST_ASSERT_EQUAL(test_pixel(5, 299, 1, 3), buf->data[buf->size - 1]);
+    image_destroy(NULL, &img);
+}
+
+void test_plugin_image_libpng_error_does_not_abort(void) {
+    Image img;
+    // png_set_IHDR rejects a zero width, the error handler returns through setjmp
+    TEST_ASSERT_NOT_EQUAL(0, image_create(NULL, &img, NULL, 0, 10, ImageBackend_Memory, ImageFormat_RGB, ImageBuffer_AoS));
+    TEST_ASSERT_TRUE(g_error_count > 0);
+}
+
+void test_plugin_image_incomplete_image_fails(void) {
+    Image img;
+    TEST_ASSERT_EQUAL(0, image_create(NULL, &img, NULL, 10, 10, ImageBackend_Memory, ImageFormat_RGB, ImageBuffer_AoS));
+    unsigned char row[30] = {0};
+    image_write_row(NULL, &img, row);
+    ImageMemBuffer *buf = (ImageMemBuffer *)&img; // must be overwritten
+    image_get_buffer(NULL, &img, (void **)&buf);
+    TEST_ASSERT_NULL(buf);
+    image_destroy(NULL, &img);
+}
+
+void test_plugin_image_concurrent_encodes(void) {
+    pthread_t threads[TEST_THREADS];
+    test_thread_t ctx[TEST_THREADS];
+    for (int i = 0; i < TEST_THREADS; i++) {
+        ctx[i].id = i;
+        ctx[i].failures = 0;
+        TEST_ASSERT_EQUAL(0, pthread_create(&threads[i], NULL, test_encode_thread, &ctx[i]));
+    }
+    int failures = 0;
+    for (int i = 0; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += ctx[i].failures;
+    }
+    TEST_ASSERT_EQUAL(0, failures);
+    TEST_ASSERT_EQUAL(0, g_error_count);
+}
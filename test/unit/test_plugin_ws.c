@@ -11,9 +11,14 @@
 #include "../data.h"
 #include "../data_geo.h"
 #include "../data_sql.h"
+#include "../dbresult.h"
 
 #define WS_EXPOSE_INTERNALS
 #include "ws.h"
+#include "wspos.h"
+#include "wsgrid.h"
+#include "wssync.h"
+#include "wsreg.h"
 
 #include "mock_ws.h"
 #include "mock_data.h"
@@ -184,6 +189,19 @@ static int stub_ws_gen_acception_key(const char *guid, const char *key, char *ke
     return 0;
 }
 
+static int stub_ws_parse_upgrade(const HttpRequest *req, const char *const *protocols,
+     const ws_deflate_config_t *dc, ws_upgrade_t *up, int cmock_num_calls)
+{
+    memset(up, 0, sizeof(*up));
+    strcpy(up->accept_key, "fakekey");
+    return 101;
+}
+static int stub_ws_upgrade_response(const ws_upgrade_t *up, int status, char *buf, size_t len, int cmock_num_calls)
+{
+    return snprintf(buf, len, "HTTP/1.1 %d Switching Protocols\r\nUpgrade: websocket\r\n"
+        "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", status, up->accept_key);
+}
+
 void test_ws_ws_handler(){
     PluginContext pc;
     ClientContext ctx;
@@ -207,7 +225,10 @@ void test_ws_ws_handler(){
     g_returnSendMessage = 0;
     ws_send_text_message_StubWithCallback(stub_ws_send_text_message);
     ws_gen_acception_key_StubWithCallback(stub_ws_gen_acception_key);
+    ws_parse_upgrade_StubWithCallback(stub_ws_parse_upgrade);
+    ws_upgrade_response_StubWithCallback(stub_ws_upgrade_response);
     ws_session_create_IgnoreAndReturn(&ws);
+    ws_session_set_deflate_IgnoreAndReturn(0);
     ws_getClientContext_IgnoreAndReturn(&ctx);
     // this test can only validate the first phase of the communication, mock...
     ws_set_user_data_Ignore();
@@ -229,6 +250,73 @@ void test_ws_ws_handler(){
     close(pipefd[1]);
 }
 
+void test_ws_type_lookup(){
+    for (int i = 0; i < WST_MAX_ID; i++) {
+        TEST_ASSERT_EQUAL(i, wsapp_type_lookup(g_wstype_names[i]));
+    }
+    TEST_ASSERT_EQUAL(WST_HELLO, wsapp_type_lookup("HeLLo"));
+    TEST_ASSERT_EQUAL(WST_MAX_ID, wsapp_type_lookup("hello2"));
+    TEST_ASSERT_EQUAL(WST_MAX_ID, wsapp_type_lookup(""));
+}
+
+void test_ws_positions_binary_limit(){
+    user_data_t u;
+    memset(&u, 0, sizeof(u));
+    u.id = 7;
+    user_data_t *users[1] = { &u };
+    size_t len = 0;
+    unsigned char *buf = wsapp_positions_binary(users, 1, &len);
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_EQUAL(wspos_message_size(1), len);
+    free(buf);
+    // more than a message can count: not encoded, the records are not touched
+    TEST_ASSERT_NULL(wsapp_positions_binary(users, WSPOS_MAX_RECORDS + 1, &len));
+}
+
+/**
+ * A message type registered by another plugin through the host
+ */
+PluginContext g_stubPlugin;
+char g_stubPluginType[32];
+int stubPluginMessage(PluginContext *pc, ClientContext *ctx, const char *type, const char *msg, size_t len,
+    PluginWsReplyFn reply, void *reply_ctx){
+    snprintf(g_stubPluginType, sizeof(g_stubPluginType), "%s", type);
+    reply(reply_ctx, "{\"type\": \"regions\", \"regions\": []}");
+    return 0;
+}
+PluginContext *stubMessageSearch(const char *type){
+    return strcmp(type, "region_list") == 0 ? &g_stubPlugin : NULL;
+}
+int stubPluginStart(int id){
+    return 0;
+}
+void stubPluginStop(int id){
+}
+
+void test_ws_plugin_message(){
+    ClientContext ctx;
+    ws_session_t ws;
+    ws.ctx = &ctx;
+    AppContext_t app;
+    memset(&app, 0, sizeof(app));
+    app.ctx = &ctx;
+    app.s = &ws;
+    g_stubPlugin.ws.message_handler = stubPluginMessage;
+    g_host_fns.ws.message_search = stubMessageSearch;
+    g_host_fns.start = stubPluginStart;
+    g_host_fns.stop = stubPluginStop;
+
+    ws_send_text_message_StubWithCallback(stub_ws_send_text_message);
+    const char *msg = "{ \"type\": \"region_list\" }";
+    TEST_ASSERT_EQUAL(CR_PROCESSED, plugin_ws_OnTextFrame(app.s, msg, strlen(msg), (void*)&app));
+    TEST_ASSERT_EQUAL_STRING("region_list", g_stubPluginType);
+    TEST_ASSERT_NOT_NULL(strstr(g_last_sent_json, "\"type\": \"regions\""));
+
+    msg = "{ \"type\": \"region_lost\" }";
+    TEST_ASSERT_EQUAL(CR_UNKNOWN, plugin_ws_OnTextFrame(app.s, msg, strlen(msg), (void*)&app));
+    g_host_fns.ws.message_search = NULL;
+}
+
 /*
 // TODO: later if we have sql backand used.
 void test_ws_some_sql_backend(){
@@ -0,0 +1,230 @@
+/**
+ * File: test_resultcache.c
+ *
+ * Test of the in-memory result cache of the host (resultcache.h): the
+ * normalized keys, TTL, the memory limit, invalidation by table tag and
+ * the references which outlive an eviction, the put of a read which
+ * overlapped a write.
+ */
+#include "unity.h"
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "dbresult.h"
+#include "resultcache.h"
+#include "resultcache.c"
+
+static char g_key[CACHE_RESULT_KEY_LEN];
+
+/** test_put
+ * Cache data under the key of the query, the tags from the query.
+ */
+static int test_put(const char *query, const char *data, int ttl_sec) {
+    if (cache_result_key(g_key, sizeof(g_key), query, NULL, 0) < 0) return -1;
+    return cache_result_put(g_key, NULL, data, strlen(data) + 1, ttl_sec, cache_result_generation());
+}
+
+/** test_hit
+ * Cached text of the query or NULL, compared to expected.
+ */
+static int test_hit(const char *query, const char *expected) {
+    cache_result_key(g_key, sizeof(g_key), query, NULL, 0);
+    CacheResult *r = cache_result_get(g_key);
+    if (!r) return 0;
+    size_t len;
+    const char *data = cache_result_data(r, &len);
+    int same = expected && !strcmp(data, expected) && len == strlen(expected) + 1;
+    cache_result_release(r);
+    return same ? 1 : -1;
+}
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL(0, cache_result_init(64 * 1024, 60));
+    memset(&g_cache_result.stats, 0, sizeof(g_cache_result.stats));
+    g_cache_result.stats.memory_limit = 64 * 1024;
+}
+void tearDown(void) {
+    cache_result_destroy();
+}
+
+void test_resultcache_key(void) {
+    char a[CACHE_RESULT_KEY_LEN], b[CACHE_RESULT_KEY_LEN];
+    // whitespace and keyword case do not matter, the literals do
+    cache_result_key(a, sizeof(a), "  SELECT id\n FROM  Users WHERE nick='Bob'", NULL, 0);
+    cache_result_key(b, sizeof(b), "select id from users where nick='Bob' ", NULL, 0);
+    TEST_ASSERT_EQUAL_STRING(b, a);
+    TEST_ASSERT_EQUAL_STRING("select id from users where nick='Bob'", a);
+    cache_result_key(b, sizeof(b), "select id from users where nick='bob'", NULL, 0);
+    TEST_ASSERT_TRUE(strcmp(a, b) != 0);
+
+    // the parameters are part of the key, with their type
+    DbValue v = db_value_parse(DB_TYPE_INT, "12", 2);
+    cache_result_key(a, sizeof(a), "select * from t where id = ?", &v, 1);
+    v = db_value_parse(DB_TYPE_TEXT, "12", 2);
+    cache_result_key(b, sizeof(b), "select * from t where id = ?", &v, 1);
+    TEST_ASSERT_TRUE(strcmp(a, b) != 0);
+    cache_result_key(b, sizeof(b), "select * from t where id = ?", NULL, 0);
+    TEST_ASSERT_TRUE(strcmp(a, b) != 0);
+
+    // too long to be a key: not cached
+    char small[16];
+    TEST_ASSERT_EQUAL(-1, cache_result_key(small, sizeof(small), "select * from regions", NULL, 0));
+}
+
+void test_resultcache_tags(void) {
+    char tags[128];
+    cache_result_tags("SELECT u.id FROM users u, `geo`.`regions` r JOIN persons p ON p.id = u.id WHERE u.x IN (SELECT x FROM resources)", tags, sizeof(tags));
+    TEST_ASSERT_EQUAL_STRING(",users,regions,persons,resources,", tags);
+    cache_result_tags("INSERT INTO user_regions (a, b) VALUES (1, 2)", tags, sizeof(tags));
+    TEST_ASSERT_EQUAL_STRING(",user_regions,", tags);
+    cache_result_tags("select 'from x' as y", tags, sizeof(tags));
+    TEST_ASSERT_EQUAL_STRING("", tags);
+}
+
+void test_resultcache_get_put(void) {
+    TEST_ASSERT_EQUAL(0, test_hit("select * from users", NULL));
+    TEST_ASSERT_EQUAL(0, test_put("select * from users", "U1", 0));
+    TEST_ASSERT_EQUAL(1, test_hit("SELECT *  FROM users", "U1"));
+    // replaced
+    TEST_ASSERT_EQUAL(0, test_put("select * from users", "U2", 0));
+    TEST_ASSERT_EQUAL(1, test_hit("select * from users", "U2"));
+
+    CacheResultStats st;
+    cache_result_stats(&st);
+    TEST_ASSERT_EQUAL(1, st.count);
+    TEST_ASSERT_EQUAL(2, st.hits);
+    TEST_ASSERT_EQUAL(1, st.misses);
+    TEST_ASSERT_EQUAL(2, st.puts);
+}
+
+void test_resultcache_invalidate(void) {
+    test_put("select * from users", "U", 0);
+    test_put("select * from regions r join users u on u.id = r.owner", "RU", 0);
+    test_put("select * from regions", "R", 0);
+    // a read changes nothing
+    TEST_ASSERT_EQUAL(0, cache_result_invalidate_sql("SELECT * FROM users"));
+    TEST_ASSERT_EQUAL(2, cache_result_invalidate_sql("UPDATE Users SET nick = 'x' WHERE id = 1"));
+    TEST_ASSERT_EQUAL(0, test_hit("select * from users", NULL));
+    TEST_ASSERT_EQUAL(0, test_hit("select * from regions r join users u on u.id = r.owner", NULL));
+    TEST_ASSERT_EQUAL(1, test_hit("select * from regions", "R"));
+
+    // explicit tags
+    cache_result_key(g_key, sizeof(g_key), "cgi:test.php_a_1", NULL, 0);
+    TEST_ASSERT_EQUAL(0, cache_result_put(g_key, "cgi, Users", "C", 2, 0, cache_result_generation()));
+    TEST_ASSERT_EQUAL(1, cache_result_invalidate("users"));
+    TEST_ASSERT_EQUAL(1, cache_result_invalidate_sql("delete from regions where id = 3"));
+    CacheResultStats st;
+    cache_result_stats(&st);
+    TEST_ASSERT_EQUAL(0, st.count);
+    // only the tables are left, with their last invalidation
+    TEST_ASSERT_EQUAL(CACHE_RESULT_TAG_SIZE(5) + CACHE_RESULT_TAG_SIZE(7) + CACHE_RESULT_TAG_SIZE(3), st.bytes);
+    TEST_ASSERT_EQUAL(4, st.invalidations);
+}
+
+void test_resultcache_ttl(void) {
+    test_put("select 1 from t", "A", 1);
+    test_put("select 2 from t", "B", 60);
+    TEST_ASSERT_EQUAL(1, test_hit("select 1 from t", "A"));
+    g_cache_result.head->expires = cache_result_now_ms() - 1;   // "select 1", the recent one
+    TEST_ASSERT_EQUAL(0, test_hit("select 1 from t", NULL));
+    g_cache_result.head->expires = cache_result_now_ms() - 1;
+    cache_result_expire();
+    CacheResultStats st;
+    cache_result_stats(&st);
+    TEST_ASSERT_EQUAL(0, st.count);
+    TEST_ASSERT_EQUAL(2, st.expirations);
+}
+
+void test_resultcache_memory_limit(void) {
+    static char big[6 * 1024];
+    char query[64];
+    memset(big, 'x', sizeof(big) - 1);
+    for (int i = 0; i < 40; i++) {
+        snprintf(query, sizeof(query), "select %d from t", i);
+        TEST_ASSERT_EQUAL(0, test_put(query, big, 0));
+        if (i == 5) TEST_ASSERT_EQUAL(1, test_hit("select 0 from t", big));   // keep it recent
+    }
+    CacheResultStats st;
+    cache_result_stats(&st);
+    TEST_ASSERT_TRUE(st.bytes <= st.memory_limit);
+    TEST_ASSERT_TRUE(st.evictions > 0);
+    TEST_ASSERT_EQUAL(40, st.count + st.evictions);
+    TEST_ASSERT_EQUAL(1, test_hit("select 39 from t", big));
+    TEST_ASSERT_EQUAL(0, test_hit("select 1 from t", NULL));
+    // larger than an eighth of the memory: not cached
+    static char huge[10 * 1024];
+    memset(huge, 'y', sizeof(huge) - 1);
+    TEST_ASSERT_EQUAL(-1, test_put("select huge from t", huge, 0));
+}
+
+void test_resultcache_reference(void) {
+    test_put("select * from users", "U", 0);
+    cache_result_key(g_key, sizeof(g_key), "select * from users", NULL, 0);
+    CacheResult *r = cache_result_get(g_key);
+    TEST_ASSERT_NOT_NULL(r);
+    // dropped while in use: the data stays valid until the release
+    TEST_ASSERT_EQUAL(1, cache_result_invalidate("users"));
+    TEST_ASSERT_EQUAL_STRING("U", (const char *)cache_result_data(r, NULL));
+    cache_result_release(r);
+    TEST_ASSERT_EQUAL(0, test_hit("select * from users", NULL));
+}
+
+void test_resultcache_stale_put(void) {
+    // a read of users begins, a write of users ends before its put
+    unsigned long generation = cache_result_generation();
+    cache_result_key(g_key, sizeof(g_key), "select * from users u join regions r on r.owner = u.id", NULL, 0);
+    TEST_ASSERT_EQUAL(0, cache_result_invalidate_sql("update users set nick = 'x' where id = 1"));
+    TEST_ASSERT_EQUAL(-1, cache_result_put(g_key, NULL, "OLD", 4, 0, generation));
+    TEST_ASSERT_EQUAL(0, test_hit("select * from users u join regions r on r.owner = u.id", NULL));
+    // a write of another table does not matter
+    generation = cache_result_generation();
+    cache_result_invalidate("resources");
+    cache_result_key(g_key, sizeof(g_key), "select * from users", NULL, 0);
+    TEST_ASSERT_EQUAL(0, cache_result_put(g_key, NULL, "U", 2, 0, generation));
+    TEST_ASSERT_EQUAL(1, test_hit("select * from users", "U"));
+    CacheResultStats st;
+    cache_result_stats(&st);
+    TEST_ASSERT_EQUAL(1, st.stale);
+    TEST_ASSERT_EQUAL(1, st.count);
+}
+
+void test_resultcache_invalidate_by_tag(void) {
+    char query[64];
+    for (int i = 0; i < 8; i++) {
+        snprintf(query, sizeof(query), "select %d from %s", i, i % 2 ? "users" : "regions");
+        test_put(query, "X", 0);
+    }
+    // only the entries of the table are visited, the others stay linked
+    TEST_ASSERT_EQUAL(4, cache_result_invalidate("Users"));
+    TEST_ASSERT_NULL(cache_result_tag(&g_cache_result, "users", 5, 0)->entries);
+    TEST_ASSERT_NOT_NULL(cache_result_tag(&g_cache_result, "regions", 7, 0)->entries);
+    TEST_ASSERT_EQUAL(1, test_hit("select 0 from regions", "X"));
+    TEST_ASSERT_EQUAL(0, test_hit("select 1 from users", NULL));
+    // a replaced entry leaves the list of its tags
+    test_put("select 0 from regions", "Y", 0);
+    TEST_ASSERT_EQUAL(4, cache_result_invalidate("regions"));
+    CacheResultStats st;
+    cache_result_stats(&st);
+    TEST_ASSERT_EQUAL(0, st.count);
+}
+
+void test_resultcache_tag_memory(void) {
+    char query[64], tags[CACHE_RESULT_TAGS_LEN];
+    // small entries with many tags: the links and the tags count in the limit
+    for (int i = 0; i < 400; i++) {
+        snprintf(query, sizeof(query), "cgi:%d", i);
+        snprintf(tags, sizeof(tags), "a%d,b%d,c%d,d%d,e%d,f%d,g%d,h%d", i, i, i, i, i, i, i, i);
+        cache_result_key(g_key, sizeof(g_key), query, NULL, 0);
+        TEST_ASSERT_EQUAL(0, cache_result_put(g_key, tags, "x", 2, 0, cache_result_generation()));
+        CacheResultStats st;
+        cache_result_stats(&st);
+        TEST_ASSERT_TRUE(st.bytes <= st.memory_limit);
+    }
+    CacheResultStats st;
+    cache_result_stats(&st);
+    TEST_ASSERT_TRUE(st.evictions > 0);
+    // the tags of the evicted entries were swept, they would not fit
+    TEST_ASSERT_TRUE(g_cache_result.tag_count < 400 * 8);
+    TEST_ASSERT_TRUE(400 * 8 * CACHE_RESULT_TAG_SIZE(2) > st.memory_limit);
+}
@@ -0,0 +1,144 @@
+/**
+ * File: test_sqlitepool.c
+ *
+ * Test of the SQLite connection pool of the sqlite plugin (sqlitepool.h):
+ * WAL readers on a temporary database file, the writer for the rest,
+ * a reader never writes, and a thread waits for a free reader.
+ */
+#include "unity.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dbstmt.h"
+#include "dbstmt.c"
+#include "sqlitepool.h"
+#include "sqlitepool.c"
+
+static char g_file[64];
+static sqlitepool_t g_pool;
+
+static void test_unlink(void) {
+    char path[96];
+    unlink(g_file);
+    snprintf(path, sizeof(path), "%s-wal", g_file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s-shm", g_file);
+    unlink(path);
+}
+
+static int test_count(sqlitepool_conn_t *c) {
+    sqlite3_stmt *stmt;
+    int n = -1;
+    if (sqlite3_prepare_v2(c->db, "SELECT COUNT(*) FROM t", -1, &stmt, NULL) != SQLITE_OK) return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) n = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return n;
+}
+
+void setUp(void) {
+    snprintf(g_file, sizeof(g_file), "/tmp/test_sqlitepool_%d.db", (int)getpid());
+    test_unlink();
+    memset(&g_pool, 0, sizeof(g_pool));
+}
+void tearDown(void) {
+    sqlitepool_close(&g_pool);
+    test_unlink();
+}
+
+void test_sqlitepool_readers_wal(void) {
+    TEST_ASSERT_EQUAL(0, sqlitepool_open(&g_pool, g_file, 2, 4, 0));
+    TEST_ASSERT_EQUAL(1, g_pool.wal);
+    TEST_ASSERT_EQUAL(2, g_pool.reader_count);
+
+    sqlitepool_conn_t *w = sqlitepool_acquire(&g_pool, 1);
+    TEST_ASSERT_EQUAL_PTR(&g_pool.writer, w);
+    TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_exec(w->db, "CREATE TABLE t(a INTEGER); INSERT INTO t VALUES(1)", NULL, NULL, NULL));
+    sqlitepool_release(&g_pool, w);
+
+    sqlitepool_conn_t *r1 = sqlitepool_acquire(&g_pool, 0);
+    sqlitepool_conn_t *r2 = sqlitepool_acquire(&g_pool, 0);
+    TEST_ASSERT_TRUE(r1 != r2);
+    TEST_ASSERT_TRUE(r1->readonly && r2->readonly);
+    TEST_ASSERT_EQUAL(1, test_count(r1));
+    // a reader does not write
+    TEST_ASSERT_EQUAL(SQLITE_READONLY, sqlite3_exec(r1->db, "INSERT INTO t VALUES(2)", NULL, NULL, NULL));
+
+    // the writer commits while a reader is in a read transaction
+    TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_exec(r2->db, "BEGIN; SELECT COUNT(*) FROM t", NULL, NULL, NULL));
+    TEST_ASSERT_EQUAL(1, test_count(r2));
+    w = sqlitepool_acquire(&g_pool, 1);
+    TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_exec(w->db, "INSERT INTO t VALUES(2)", NULL, NULL, NULL));
+    sqlitepool_release(&g_pool, w);
+    TEST_ASSERT_EQUAL(1, test_count(r2));   // its snapshot
+    TEST_ASSERT_EQUAL(2, test_count(r1));
+    TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_exec(r2->db, "COMMIT", NULL, NULL, NULL));
+    TEST_ASSERT_EQUAL(2, test_count(r2));
+    sqlitepool_release(&g_pool, r1);
+    sqlitepool_release(&g_pool, r2);
+
+    unsigned long queries;
+    sqlitepool_stats(&g_pool, &queries, NULL, NULL);
+    TEST_ASSERT_EQUAL(4, queries);
+    TEST_ASSERT_EQUAL(2, g_pool.reads);
+    TEST_ASSERT_EQUAL(2, g_pool.writes);
+}
+
+void test_sqlitepool_no_readers(void) {
+    // an in-memory database can not be shared, everything goes to the writer
+    TEST_ASSERT_EQUAL(0, sqlitepool_open(&g_pool, ":memory:", 4, 0, 0));
+    TEST_ASSERT_EQUAL(0, g_pool.reader_count);
+    sqlitepool_conn_t *c = sqlitepool_acquire(&g_pool, 0);
+    TEST_ASSERT_EQUAL_PTR(&g_pool.writer, c);
+    TEST_ASSERT_FALSE(c->readonly);
+    sqlitepool_release(&g_pool, c);
+    sqlitepool_close(&g_pool);
+    TEST_ASSERT_NULL(sqlitepool_acquire(&g_pool, 0));
+
+    TEST_ASSERT_EQUAL(0, sqlitepool_open(&g_pool, g_file, 0, 0, 0));
+    TEST_ASSERT_EQUAL(0, g_pool.reader_count);
+    TEST_ASSERT_EQUAL(0, g_pool.wal);
+}
+
+static void *test_reader_thread(void *arg) {
+    (void)arg;
+    sqlitepool_conn_t *c = sqlitepool_acquire(&g_pool, 0);
+    int n = test_count(c);
+    sqlitepool_release(&g_pool, c);
+    return (void *)(size_t)n;
+}
+
+void test_sqlitepool_wait_for_reader(void) {
+    TEST_ASSERT_EQUAL(0, sqlitepool_open(&g_pool, g_file, 1, 0, 0));
+    sqlitepool_conn_t *w = sqlitepool_acquire(&g_pool, 1);
+    sqlite3_exec(w->db, "CREATE TABLE t(a INTEGER); INSERT INTO t VALUES(1), (2), (3)", NULL, NULL, NULL);
+    sqlitepool_release(&g_pool, w);
+
+    sqlitepool_conn_t *r = sqlitepool_acquire(&g_pool, 0);
+    pthread_t tid;
+    void *ret;
+    pthread_create(&tid, NULL, test_reader_thread, NULL);
+    // the thread blocks until the only reader is released
+    for (int i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&g_pool.lock);
+        unsigned long waits = g_pool.read_waits;
+        pthread_mutex_unlock(&g_pool.lock);
+        if (waits) break;
+        usleep(1000);
+    }
+    TEST_ASSERT_EQUAL(1, g_pool.read_waits);
+    sqlitepool_release(&g_pool, r);
+    pthread_join(tid, &ret);
+    TEST_ASSERT_EQUAL(3, (int)(size_t)ret);
+}
+
+void test_sqlitepool_is_read(void) {
+    TEST_ASSERT_TRUE(sqlitepool_is_read("SELECT 1"));
+    TEST_ASSERT_TRUE(sqlitepool_is_read("  select * from t"));
+    TEST_ASSERT_TRUE(sqlitepool_is_read("(SELECT 1) UNION ALL SELECT 2"));
+    TEST_ASSERT_FALSE(sqlitepool_is_read("INSERT INTO t VALUES(1)"));
+    TEST_ASSERT_FALSE(sqlitepool_is_read("WITH x AS (SELECT 1) DELETE FROM t"));
+    TEST_ASSERT_FALSE(sqlitepool_is_read(NULL));
+}
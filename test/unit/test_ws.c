@@ -27,6 +27,8 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h> 
+#include <sys/socket.h>
+#include <zlib.h>
 
 #include "../plugin.h"
 #include "../http.h"
@@ -411,4 +413,758 @@ void test_ws_state_step_known_opcodes(void) {
     free(s.frame);
     close(pipefd[0]);
     close(pipefd[1]);
-}
\ No newline at end of file
+}
+static int g_text_frames = 0;
+static CommandResult_t test_on_text(struct ws_session_t *s, const char *txt, size_t len, void *user_data){
+    (void)txt; (void)len; (void)user_data;
+    g_text_frames++;
+    ws_send_text_message(s, "ack"); // queued, flushed by the loop
+    return CR_PROCESSED;
+}
+
+/**
+ * Requirement: the session loop shall be driven by socket readiness, process
+ * the frames, flush the queued responses and exit on close frame.
+ */
+void test_ws_handle_ws_loop_socketpair(void) {
+    int sv[2];
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    ClientContext ctx = {0};
+    ctx.socket_fd = sv[0];
+    WsProcessorApi_t api = { .onWsTextFrame = test_on_text };
+    ws_session_t *s = ws_session_create(&ctx, &api, NULL);
+    TEST_ASSERT_NOT_NULL(s);
+
+    unsigned char frame[] = { 0x81, 0x82, 0x01, 0x02, 0x03, 0x04, 'h' ^ 0x01, 'i' ^ 0x02 };
+    write(sv[1], frame, sizeof(frame));
+    write(sv[1], frame, sizeof(frame));
+    unsigned char close_frame[] = { 0x88, 0x80, 0, 0, 0, 0 };
+    write(sv[1], close_frame, sizeof(close_frame));
+
+    g_text_frames = 0;
+    TEST_ASSERT_EQUAL(0, ws_handle_ws_loop(s));
+    TEST_ASSERT_EQUAL(2, g_text_frames);
+    TEST_ASSERT_EQUAL(0, s->out_count);
+
+    unsigned char rx[64];
+    ssize_t n = read(sv[1], rx, sizeof(rx));
+    TEST_ASSERT_EQUAL(2 * (5 + 4) + 2, n); // "ack" from the handler, then the echo response, twice, close echo
+    TEST_ASSERT_EQUAL_UINT8(0x81, rx[0]);
+    TEST_ASSERT_EQUAL_UINT8(3, rx[1]);
+    TEST_ASSERT_EQUAL_MEMORY("ack", &rx[2], 3);
+    TEST_ASSERT_EQUAL_MEMORY("hi", &rx[7], 2);
+
+    ws_session_destroy(s);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static ws_session_t *test_queue_session(ClientContext *ctx, ws_queue_policy_t policy) {
+    ws_set_queue_config(4, 0, policy);
+    ws_session_t *s = ws_session_create(ctx, NULL, NULL);
+    ws_set_queue_config(0, 0, WS_QUEUE_DROP_OLDEST);
+    return s;
+}
+static char test_queue_nth(ws_session_t *s, size_t n) {
+    ws_frame_t *e = s->outq[(s->out_head + n) % s->out_capacity];
+    return (char)e->data[e->offset + 2];
+}
+
+/**
+ * Requirement: a slow client shall not block the sender, the bounded queue
+ * drops the oldest data frame, but keeps the control frames.
+ */
+void test_ws_queue_drop_oldest(void) {
+    ClientContext ctx = {0};
+    ws_session_t *s = test_queue_session(&ctx, WS_QUEUE_DROP_OLDEST);
+    char msg[2] = "a";
+    for (int i = 0; i < 6; i++) {
+        msg[0] = 'a' + i;
+        TEST_ASSERT_EQUAL(0, ws_send_text_message(s, msg));
+    }
+    char ping_msg[] = { 0x89, 0x00 };
+    TEST_ASSERT_EQUAL(0, ws_send_frame(s, ping_msg, sizeof(ping_msg)));
+    TEST_ASSERT_EQUAL(5, s->out_count); // 4 data + ping
+    TEST_ASSERT_EQUAL('c', test_queue_nth(s, 0));
+    TEST_ASSERT_EQUAL('f', test_queue_nth(s, 3));
+    TEST_ASSERT_EQUAL(2, s->measure.actual[WSM_QUEUE_DROP].counter);
+    ws_session_destroy(s);
+}
+
+static int test_queue_keyed(ws_session_t *s, char c, uint32_t key) {
+    char msg[2] = { c, 0 };
+    ws_frame_t *f = ws_frame_create_text(msg);
+    ws_frame_set_key(f, key);
+    int ret = ws_send_shared_frame(s, f);
+    ws_frame_release(f);
+    return ret;
+}
+
+/**
+ * Requirement: coalesce policy keeps the latest state of the same key, and
+ * never drops the frame which is partially written to the socket.
+ */
+void test_ws_queue_coalesce(void) {
+    ClientContext ctx = {0};
+    ws_session_t *s = test_queue_session(&ctx, WS_QUEUE_COALESCE);
+    test_queue_keyed(s, 'a', WS_FRAME_KEY(1, 1));
+    test_queue_keyed(s, 'b', WS_FRAME_KEY(1, 2));
+    test_queue_keyed(s, 'c', 0);
+    test_queue_keyed(s, 'd', WS_FRAME_KEY(1, 2));
+    s->out_sent = 1; // head in flight
+    TEST_ASSERT_EQUAL(0, test_queue_keyed(s, 'x', WS_FRAME_KEY(1, 2)));
+    TEST_ASSERT_EQUAL(4, s->out_count);
+    TEST_ASSERT_EQUAL('a', test_queue_nth(s, 0));
+    TEST_ASSERT_EQUAL('b', test_queue_nth(s, 1));
+    TEST_ASSERT_EQUAL('c', test_queue_nth(s, 2));
+    TEST_ASSERT_EQUAL('x', test_queue_nth(s, 3));
+    TEST_ASSERT_EQUAL(1, s->measure.actual[WSM_QUEUE_COALESCE].counter);
+    s->out_sent = 0;
+    ws_session_destroy(s);
+}
+
+/**
+ * Requirement: coalesce policy never replaces a frame of another key, e.g. a
+ * chat message with a position, the oldest data frame is dropped instead.
+ */
+void test_ws_queue_coalesce_other_key(void) {
+    ClientContext ctx = {0};
+    ws_session_t *s = test_queue_session(&ctx, WS_QUEUE_COALESCE);
+    test_queue_keyed(s, 'a', WS_FRAME_KEY(1, 1));
+    test_queue_keyed(s, 'b', 0);
+    test_queue_keyed(s, 'c', WS_FRAME_KEY(1, 2));
+    test_queue_keyed(s, 'd', 0);
+    s->out_sent = 1; // head in flight
+    TEST_ASSERT_EQUAL(0, test_queue_keyed(s, 'x', WS_FRAME_KEY(1, 3)));
+    TEST_ASSERT_EQUAL(0, test_queue_keyed(s, 'y', 0));
+    TEST_ASSERT_EQUAL(4, s->out_count);
+    TEST_ASSERT_EQUAL('a', test_queue_nth(s, 0));
+    TEST_ASSERT_EQUAL('d', test_queue_nth(s, 1));
+    TEST_ASSERT_EQUAL('x', test_queue_nth(s, 2));
+    TEST_ASSERT_EQUAL('y', test_queue_nth(s, 3));
+    TEST_ASSERT_EQUAL(0, s->measure.actual[WSM_QUEUE_COALESCE].counter);
+    TEST_ASSERT_EQUAL(2, s->measure.actual[WSM_QUEUE_DROP].counter);
+    s->out_sent = 0;
+    ws_session_destroy(s);
+}
+
+/**
+ * Requirement: disconnect policy marks the session, the loop closes it.
+ */
+void test_ws_queue_disconnect(void) {
+    ClientContext ctx = {0};
+    ws_session_t *s = test_queue_session(&ctx, WS_QUEUE_DISCONNECT);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL(0, ws_send_text_message(s, "data"));
+    }
+    TEST_ASSERT_EQUAL(-1, ws_send_text_message(s, "data"));
+    TEST_ASSERT_EQUAL(1, s->out_overflow);
+    TEST_ASSERT_EQUAL(-1, ws_send_text_message(s, "late"));
+    TEST_ASSERT_EQUAL(4, s->out_count);
+    ws_session_destroy(s);
+}
+
+/**
+ * Requirement: a broadcast frame is built once and shared by the queues,
+ * it is freed when the last session released it.
+ */
+void test_ws_shared_frame_refcount(void) {
+    ClientContext ctx = {0};
+    ws_session_t *s1 = ws_session_create(&ctx, NULL, NULL);
+    ws_session_t *s2 = ws_session_create(&ctx, NULL, NULL);
+    ws_frame_t *f = ws_frame_create_text("hello");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(7, f->len);
+    TEST_ASSERT_EQUAL_UINT8(0x81, f->data[f->offset]);
+    TEST_ASSERT_EQUAL_UINT8(5, f->data[f->offset + 1]);
+    TEST_ASSERT_EQUAL(0, ws_send_shared_frame(s1, f));
+    TEST_ASSERT_EQUAL(0, ws_send_shared_frame(s2, f));
+    TEST_ASSERT_EQUAL(3, f->refcount);
+    TEST_ASSERT_TRUE(s1->outq[s1->out_head] == s2->outq[s2->out_head]);
+    ws_frame_release(f);
+    ws_session_destroy(s1);
+    TEST_ASSERT_EQUAL(1, f->refcount);
+    ws_session_destroy(s2); // frees the frame
+}
+
+/**
+ * RFC 6455 conformance
+ * A client peer on a socketpair sends masked frames to a real session loop,
+ * the delivered messages and the server's control replies are checked.
+ */
+typedef struct {
+    int count;
+    size_t len;
+    unsigned char opcode;
+    unsigned long sum;
+    char text[64];
+} test_rx_t;
+static test_rx_t g_rx;
+
+static CommandResult_t test_rx_text(struct ws_session_t *s, const char *txt, size_t len, void *user_data){
+    (void)s; (void)user_data;
+    g_rx.count++;
+    g_rx.len = len;
+    g_rx.opcode = WS_OP_TEXT_FRAME;
+    snprintf(g_rx.text, sizeof(g_rx.text), "%.*s", (int)len, txt);
+    return CR_UNKNOWN; // no echo
+}
+static CommandResult_t test_rx_binary(ClientContext *ctx, const unsigned char *buf, size_t len, void *user_data){
+    (void)ctx; (void)user_data;
+    g_rx.count++;
+    g_rx.len = len;
+    g_rx.opcode = WS_OP_BINARY_FRAME;
+    g_rx.sum = 0;
+    for (size_t i = 0; i < len; i++) g_rx.sum = g_rx.sum * 31 + buf[i];
+    return CR_UNKNOWN;
+}
+
+/** Builds a masked client frame, returns its length. */
+static size_t test_client_frame(unsigned char *out, int fin, unsigned char opcode, const unsigned char *payload, size_t len) {
+    static const unsigned char mask[4] = { 0xA1, 0x5B, 0x3C, 0xD7 };
+    size_t o = 0;
+    out[o++] = (fin ? 0x80 : 0) | opcode;
+    if (len <= 125) {
+        out[o++] = 0x80 | (unsigned char)len;
+    } else if (len <= 0xFFFF) {
+        out[o++] = 0x80 | 126;
+        out[o++] = (len >> 8) & 0xFF;
+        out[o++] = len & 0xFF;
+    } else {
+        out[o++] = 0x80 | 127;
+        for (int i = 7; i >= 0; i--) out[o++] = (i < 4) ? (len >> (8 * i)) & 0xFF : 0;
+    }
+    memcpy(out + o, mask, 4);
+    o += 4;
+    for (size_t i = 0; i < len; i++) out[o + i] = payload[i] ^ mask[i % 4];
+    return o + len;
+}
+
+typedef struct {
+    int fd;
+    const unsigned char *buf;
+    size_t len;
+} test_writer_t;
+static void *test_writer_thread(void *arg) {
+    test_writer_t *w = (test_writer_t *)arg;
+    size_t o = 0;
+    while (o < w->len) {
+        ssize_t n = write(w->fd, w->buf + o, w->len - o);
+        if (n <= 0) break;
+        o += n;
+    }
+    return NULL;
+}
+
+// permessage-deflate negotiated for the sessions of test_run_session(), if set
+static const ws_upgrade_t *g_test_deflate = NULL;
+static const ws_deflate_config_t g_test_deflate_config = { 1, 6, 15, 1, 64 };
+
+/** Runs the session loop on the client byte stream, returns the loop result and the server output. */
+static int test_run_session(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_cap, ssize_t *out_len) {
+    int sv[2];
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    ClientContext ctx = {0};
+    ctx.socket_fd = sv[0];
+    WsProcessorApi_t api = { .onWsTextFrame = test_rx_text, .onWsBinaryFrame = test_rx_binary };
+    ws_session_t *s = ws_session_create(&ctx, &api, NULL);
+    s->last_ping_sent = time(NULL); // no server ping in the output
+    if (g_test_deflate) TEST_ASSERT_EQUAL(0, ws_session_set_deflate(s, g_test_deflate, &g_test_deflate_config));
+    memset(&g_rx, 0, sizeof(g_rx));
+    test_writer_t w = { sv[1], in, in_len };
+    pthread_t t;
+    pthread_create(&t, NULL, test_writer_thread, &w);
+    int ret = ws_handle_ws_loop(s);
+    int err = (s->state == WS_STATE_ERROR);
+    pthread_join(t, NULL);
+    ws_session_destroy(s);
+    close(sv[0]);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    *out_len = read(sv[1], out, out_cap);
+    close(sv[1]);
+    return err ? -1 : ret;
+}
+
+void test_ws_rfc_fragmented_with_interleaved_ping(void) {
+    unsigned char in[256], out[256];
+    size_t o = 0;
+    o += test_client_frame(in + o, 0, WS_OP_TEXT_FRAME, (const unsigned char *)"Hel", 3);
+    o += test_client_frame(in + o, 1, WS_OP_PING, (const unsigned char *)"p1", 2);
+    o += test_client_frame(in + o, 0, WS_OP_CONTINUATION_FRAME, (const unsigned char *)"lo, ", 4);
+    o += test_client_frame(in + o, 1, WS_OP_CONTINUATION_FRAME, (const unsigned char *)"world", 5);
+    const unsigned char code[2] = { 0x03, 0xE8 }; // 1000
+    o += test_client_frame(in + o, 1, WS_OP_CONNECTION_CLOSE, code, 2);
+    ssize_t n = 0;
+    TEST_ASSERT_EQUAL(0, test_run_session(in, o, out, sizeof(out), &n));
+    TEST_ASSERT_EQUAL(1, g_rx.count);
+    TEST_ASSERT_EQUAL_STRING("Hello, world", g_rx.text);
+    // pong with the ping data, then the close echo, both unmasked
+    TEST_ASSERT_EQUAL(4 + 4, n);
+    TEST_ASSERT_EQUAL_UINT8(0x8A, out[0]);
+    TEST_ASSERT_EQUAL_UINT8(2, out[1]);
+    TEST_ASSERT_EQUAL_MEMORY("p1", &out[2], 2);
+    TEST_ASSERT_EQUAL_UINT8(0x88, out[4]);
+    TEST_ASSERT_EQUAL_UINT8(2, out[5]);
+    TEST_ASSERT_EQUAL_MEMORY(code, &out[6], 2);
+}
+
+void test_ws_rfc_large_frames(void) {
+    static const size_t sizes[] = { 125, 126, 300, 65535, 65536, 200000 };
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        size_t len = sizes[k];
+        unsigned char *payload = malloc(len);
+        unsigned char *in = malloc(len + 32);
+        unsigned long sum = 0;
+        for (size_t i = 0; i < len; i++) {
+            payload[i] = (unsigned char)(i * 7 + k);
+            sum = sum * 31 + payload[i];
+        }
+        size_t o = test_client_frame(in, 1, WS_OP_BINARY_FRAME, payload, len);
+        o += test_client_frame(in + o, 1, WS_OP_CONNECTION_CLOSE, NULL, 0);
+        unsigned char out[16];
+        ssize_t n = 0;
+        TEST_ASSERT_EQUAL(0, test_run_session(in, o, out, sizeof(out), &n));
+        TEST_ASSERT_EQUAL(1, g_rx.count);
+        TEST_ASSERT_EQUAL(len, g_rx.len);
+        TEST_ASSERT_EQUAL(sum, g_rx.sum);
+        free(payload);
+        free(in);
+    }
+}
+
+void test_ws_rfc_large_fragmented_binary(void) {
+    size_t len = 3 * 70000;
+    unsigned char *payload = malloc(len);
+    unsigned char *in = malloc(len + 64);
+    unsigned long sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        payload[i] = (unsigned char)(i ^ (i >> 8));
+        sum = sum * 31 + payload[i];
+    }
+    size_t o = 0;
+    o += test_client_frame(in + o, 0, WS_OP_BINARY_FRAME, payload, 70000);
+    o += test_client_frame(in + o, 0, WS_OP_CONTINUATION_FRAME, payload + 70000, 70000);
+    o += test_client_frame(in + o, 1, WS_OP_CONTINUATION_FRAME, payload + 140000, 70000);
+    o += test_client_frame(in + o, 1, WS_OP_CONNECTION_CLOSE, NULL, 0);
+    unsigned char out[16];
+    ssize_t n = 0;
+    TEST_ASSERT_EQUAL(0, test_run_session(in, o, out, sizeof(out), &n));
+    TEST_ASSERT_EQUAL(1, g_rx.count);
+    TEST_ASSERT_EQUAL(WS_OP_BINARY_FRAME, g_rx.opcode);
+    TEST_ASSERT_EQUAL(len, g_rx.len);
+    TEST_ASSERT_EQUAL(sum, g_rx.sum);
+    free(payload);
+    free(in);
+}
+
+void test_ws_rfc_protocol_errors(void) {
+    unsigned char in[512], out[64];
+    unsigned char big[126] = {0};
+    ssize_t n = 0;
+    size_t o;
+    // continuation without a started message
+    o = test_client_frame(in, 1, WS_OP_CONTINUATION_FRAME, (const unsigned char *)"x", 1);
+    TEST_ASSERT_EQUAL(-1, test_run_session(in, o, out, sizeof(out), &n));
+    // new data frame inside a fragmented message
+    o = test_client_frame(in, 0, WS_OP_TEXT_FRAME, (const unsigned char *)"a", 1);
+    o += test_client_frame(in + o, 1, WS_OP_TEXT_FRAME, (const unsigned char *)"b", 1);
+    TEST_ASSERT_EQUAL(-1, test_run_session(in, o, out, sizeof(out), &n));
+    TEST_ASSERT_EQUAL(0, g_rx.count);
+    // fragmented control frame
+    o = test_client_frame(in, 0, WS_OP_PING, (const unsigned char *)"a", 1);
+    TEST_ASSERT_EQUAL(-1, test_run_session(in, o, out, sizeof(out), &n));
+    // control frame payload over 125
+    o = test_client_frame(in, 1, WS_OP_PING, big, sizeof(big));
+    TEST_ASSERT_EQUAL(-1, test_run_session(in, o, out, sizeof(out), &n));
+    // reserved opcode
+    o = test_client_frame(in, 1, 0x3, (const unsigned char *)"a", 1);
+    TEST_ASSERT_EQUAL(-1, test_run_session(in, o, out, sizeof(out), &n));
+}
+
+/**
+ * Requirement: the word/SIMD masking equals the RFC byte loop for every
+ * length, start alignment and mask phase.
+ */
+void test_ws_mask_bytes_matches_reference(void) {
+    const unsigned char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    unsigned char buf[300], ref[300];
+    for (size_t align = 0; align < 8; align++) {
+        for (size_t phase = 0; phase < 4; phase++) {
+            for (size_t len = 0; len < 200; len++) {
+                for (size_t i = 0; i < len; i++) buf[align + i] = ref[i] = (unsigned char)(i * 13 + len);
+                ws_mask_bytes(buf + align, len, mask, phase);
+                for (size_t i = 0; i < len; i++) ref[i] ^= mask[(phase + i) % 4];
+                if (len) TEST_ASSERT_EQUAL_MEMORY(ref, buf + align, len);
+            }
+        }
+    }
+}
+
+/**
+ * Requirement: the header is written into the headroom, the payload stays in place.
+ */
+void test_ws_build_frame_headroom(void) {
+    static const struct { size_t len; size_t hl; unsigned char b1; } cases[] = {
+        { 0, 2, 0 }, { 125, 2, 125 }, { 126, 4, 126 }, { 65535, 4, 126 }, { 65536, 10, 127 }
+    };
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        ws_frame_t *f = ws_frame_reserve(cases[k].len);
+        unsigned char *payload = ws_frame_payload(f);
+        if (cases[k].len) memset(payload, 'z', cases[k].len);
+        TEST_ASSERT_EQUAL(0, ws_frame_commit(f, cases[k].len, WS_OP_BINARY_FRAME));
+        unsigned char *frame = f->data + f->offset;
+        TEST_ASSERT_EQUAL(cases[k].hl + cases[k].len, f->len);
+        TEST_ASSERT_TRUE(frame + cases[k].hl == payload);
+        TEST_ASSERT_EQUAL_UINT8(0x82, frame[0]);
+        TEST_ASSERT_EQUAL_UINT8(cases[k].b1, frame[1]);
+        if (cases[k].hl == 4) {
+            TEST_ASSERT_EQUAL(cases[k].len, ((size_t)frame[2] << 8) | frame[3]);
+        } else if (cases[k].hl == 10) {
+            TEST_ASSERT_EQUAL_UINT8(0x01, frame[7]);
+            TEST_ASSERT_EQUAL_UINT8(0x00, frame[9]);
+        }
+        ws_frame_release(f);
+    }
+    unsigned char small[3];
+    unsigned char *frame = NULL;
+    size_t flen = 0;
+    TEST_ASSERT_EQUAL(-1, ws_build_frame(small + 1, 200, WS_OP_TEXT_FRAME, 1, &frame, &flen));
+    ws_frame_pool_clear();
+}
+
+/**
+ * Opening handshake (RFC 6455 4.2.1) and extension negotiation (RFC 7692).
+ */
+static void test_request(HttpRequest *req, const char *const *headers) {
+    memset(req, 0, sizeof(*req));
+    strcpy(req->method, "GET");
+    for (int i = 0; headers[i]; i += 2) {
+        strcpy(req->headers[req->header_count].key, headers[i]);
+        strcpy(req->headers[req->header_count].value, headers[i + 1]);
+        req->header_count++;
+    }
+}
+#define TEST_UPGRADE_HEADERS \
+    "Host", "localhost:8009", "Upgrade", "websocket", "Connection", "keep-alive, Upgrade", \
+    "Sec-WebSocket-Version", "13", "Sec-WebSocket-Key", "dGhlIHNhbXBsZSBub25jZQ=="
+
+void test_ws_parse_upgrade_valid(void) {
+    static const char *const protocols[] = { "geo", "chat", NULL };
+    const char *const headers[] = { TEST_UPGRADE_HEADERS,
+        "Sec-WebSocket-Protocol", "foo, chat, geo", NULL };
+    HttpRequest req;
+    ws_upgrade_t up;
+    char resp[512];
+    test_request(&req, headers);
+    TEST_ASSERT_EQUAL(101, ws_parse_upgrade(&req, protocols, &g_test_deflate_config, &up));
+    TEST_ASSERT_EQUAL_STRING("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", up.accept_key);
+    TEST_ASSERT_EQUAL_STRING("chat", up.protocol);
+    TEST_ASSERT_EQUAL(0, up.deflate);
+    TEST_ASSERT_TRUE(ws_upgrade_response(&up, 101, resp, sizeof(resp)) > 0);
+    TEST_ASSERT_NOT_NULL(strstr(resp, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+    TEST_ASSERT_NOT_NULL(strstr(resp, "Sec-WebSocket-Protocol: chat\r\n"));
+    TEST_ASSERT_NULL(strstr(resp, "Extensions"));
+    TEST_ASSERT_EQUAL_STRING("\r\n\r\n", resp + strlen(resp) - 4);
+}
+
+void test_ws_parse_upgrade_invalid(void) {
+    HttpRequest req;
+    ws_upgrade_t up;
+    char resp[256];
+    const char *const no_upgrade[] = { "Host", "h", "Connection", "Upgrade",
+        "Sec-WebSocket-Version", "13", "Sec-WebSocket-Key", "dGhlIHNhbXBsZSBub25jZQ==", NULL };
+    test_request(&req, no_upgrade);
+    TEST_ASSERT_EQUAL(400, ws_parse_upgrade(&req, NULL, NULL, &up));
+    const char *const no_host[] = { "Upgrade", "websocket", "Connection", "Upgrade",
+        "Sec-WebSocket-Version", "13", "Sec-WebSocket-Key", "dGhlIHNhbXBsZSBub25jZQ==", NULL };
+    test_request(&req, no_host);
+    TEST_ASSERT_EQUAL(400, ws_parse_upgrade(&req, NULL, NULL, &up));
+    const char *const old_version[] = { "Host", "h", "Upgrade", "websocket", "Connection", "Upgrade",
+        "Sec-WebSocket-Version", "8", "Sec-WebSocket-Key", "dGhlIHNhbXBsZSBub25jZQ==", NULL };
+    test_request(&req, old_version);
+    TEST_ASSERT_EQUAL(426, ws_parse_upgrade(&req, NULL, NULL, &up));
+    TEST_ASSERT_TRUE(ws_upgrade_response(&up, 426, resp, sizeof(resp)) > 0);
+    TEST_ASSERT_NOT_NULL(strstr(resp, "Sec-WebSocket-Version: 13\r\n"));
+    static const char *const bad_keys[] = {
+        "dGhlIHNhbXBsZSBub25jZQ=", "dGhlIHNhbXBsZSBub25jZQ=x", "dGhlIHNhbXBsZSBub25jZR==", "dGhlIHNhbXBsZS*ub25jZQ==", NULL };
+    for (int i = 0; bad_keys[i]; i++) {
+        const char *const bad_key[] = { "Host", "h", "Upgrade", "websocket", "Connection", "Upgrade",
+            "Sec-WebSocket-Version", "13", "Sec-WebSocket-Key", bad_keys[i], NULL };
+        test_request(&req, bad_key);
+        TEST_ASSERT_EQUAL(400, ws_parse_upgrade(&req, NULL, NULL, &up));
+    }
+    const char *const valid[] = { TEST_UPGRADE_HEADERS, NULL };
+    test_request(&req, valid);
+    strcpy(req.method, "POST");
+    TEST_ASSERT_EQUAL(400, ws_parse_upgrade(&req, NULL, NULL, &up));
+}
+
+void test_ws_parse_upgrade_deflate_offers(void) {
+    HttpRequest req;
+    ws_upgrade_t up;
+    char resp[512];
+    // the first offer asks for a window zlib can not do, the second one is taken
+    const char *const offers[] = { TEST_UPGRADE_HEADERS, "Sec-WebSocket-Extensions",
+        "permessage-deflate; server_max_window_bits=8, permessage-deflate; server_max_window_bits=\"10\"; client_max_window_bits", NULL };
+    test_request(&req, offers);
+    TEST_ASSERT_EQUAL(101, ws_parse_upgrade(&req, NULL, &g_test_deflate_config, &up));
+    TEST_ASSERT_EQUAL(1, up.deflate);
+    TEST_ASSERT_EQUAL(10, up.server_max_window_bits);
+    TEST_ASSERT_EQUAL(0, up.server_no_context_takeover);
+    TEST_ASSERT_TRUE(ws_upgrade_response(&up, 101, resp, sizeof(resp)) > 0);
+    TEST_ASSERT_NOT_NULL(strstr(resp, "Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=10\r\n"));
+    // unknown and duplicated parameters decline the offer
+    const char *const unknown[] = { TEST_UPGRADE_HEADERS, "Sec-WebSocket-Extensions",
+        "permessage-deflate; foo, permessage-deflate; client_no_context_takeover; client_no_context_takeover, x-webkit-deflate-frame", NULL };
+    test_request(&req, unknown);
+    TEST_ASSERT_EQUAL(101, ws_parse_upgrade(&req, NULL, &g_test_deflate_config, &up));
+    TEST_ASSERT_EQUAL(0, up.deflate);
+    // the client's no context takeover is echoed, disabled in the config: nothing is negotiated
+    const char *const nct[] = { TEST_UPGRADE_HEADERS, "Sec-WebSocket-Extensions",
+        "permessage-deflate; client_no_context_takeover; server_no_context_takeover", NULL };
+    test_request(&req, nct);
+    TEST_ASSERT_EQUAL(101, ws_parse_upgrade(&req, NULL, &g_test_deflate_config, &up));
+    TEST_ASSERT_EQUAL(1, up.deflate);
+    TEST_ASSERT_TRUE(ws_upgrade_response(&up, 101, resp, sizeof(resp)) > 0);
+    TEST_ASSERT_NOT_NULL(strstr(resp, "permessage-deflate; server_no_context_takeover; client_no_context_takeover\r\n"));
+    ws_deflate_config_t off = g_test_deflate_config;
+    off.enabled = 0;
+    TEST_ASSERT_EQUAL(101, ws_parse_upgrade(&req, NULL, &off, &up));
+    TEST_ASSERT_EQUAL(0, up.deflate);
+}
+
+/**
+ * permessage-deflate: compressed frames have RSV1 and decode with the shared
+ * context, short messages go uncompressed.
+ */
+static int test_inflate(z_stream *z, const unsigned char *in, size_t len, unsigned char *out, size_t cap) {
+    unsigned char buf[4096];
+    memcpy(buf, in, len);
+    memcpy(buf + len, "\x00\x00\xff\xff", 4);
+    z->next_in = buf;
+    z->avail_in = (uInt)(len + 4);
+    z->next_out = out;
+    z->avail_out = (uInt)cap;
+    if (inflate(z, Z_SYNC_FLUSH) != Z_OK) return -1;
+    return (int)(cap - z->avail_out);
+}
+
+void test_ws_deflate_send(void) {
+    ClientContext ctx = {0};
+    ws_session_t *s = ws_session_create(&ctx, NULL, NULL);
+    ws_upgrade_t up = { .deflate = 1, .server_max_window_bits = 15 };
+    TEST_ASSERT_EQUAL(0, ws_session_set_deflate(s, &up, &g_test_deflate_config));
+    char msg[600];
+    for (size_t i = 0; i < sizeof(msg) - 1; i++) msg[i] = "position,"[i % 9];
+    msg[sizeof(msg) - 1] = 0;
+    TEST_ASSERT_EQUAL(0, ws_send_text_message(s, msg));
+    TEST_ASSERT_EQUAL(0, ws_send_text_message(s, msg));
+    TEST_ASSERT_EQUAL(0, ws_send_text_message(s, "short"));
+    TEST_ASSERT_EQUAL(3, s->out_count);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    TEST_ASSERT_EQUAL(Z_OK, inflateInit2(&z, -15));
+    unsigned char out[1024];
+    size_t first_len = 0;
+    for (int k = 0; k < 2; k++) {
+        ws_frame_t *f = s->outq[(s->out_head + k) % s->out_capacity];
+        unsigned char *frame = f->data + f->offset;
+        TEST_ASSERT_EQUAL_UINT8(0xC1, frame[0]); // FIN, RSV1, text
+        size_t hl = (frame[1] == 126) ? 4 : 2;
+        size_t plen = (hl == 4) ? (((size_t)frame[2] << 8) | frame[3]) : frame[1];
+        TEST_ASSERT_TRUE(plen < 100);
+        TEST_ASSERT_TRUE(f->flags & WS_FRAME_KEEP);
+        TEST_ASSERT_EQUAL(strlen(msg), test_inflate(&z, frame + hl, plen, out, sizeof(out)));
+        TEST_ASSERT_EQUAL_MEMORY(msg, out, strlen(msg));
+        if (k == 0) first_len = plen;
+        else TEST_ASSERT_TRUE(plen < first_len); // the second refers to the first
+    }
+    inflateEnd(&z);
+    ws_frame_t *f = s->outq[(s->out_head + 2) % s->out_capacity];
+    TEST_ASSERT_EQUAL_UINT8(0x81, f->data[f->offset]);
+    TEST_ASSERT_EQUAL_MEMORY("short", f->data + f->offset + 2, 5);
+    ws_session_destroy(s);
+    ws_frame_pool_clear();
+}
+
+void test_ws_deflate_receive(void) {
+    // the client compresses two messages with one context, the second refers to the first
+    static const char text[] = "{\"type\":\"position\",\"lat\":47.4979,\"lon\":19.0402}";
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    TEST_ASSERT_EQUAL(Z_OK, deflateInit2(&z, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+    unsigned char in[1024], out[256], c[256];
+    size_t o = 0;
+    for (int k = 0; k < 2; k++) {
+        z.next_in = (Bytef *)text;
+        z.avail_in = sizeof(text) - 1;
+        z.next_out = c;
+        z.avail_out = sizeof(c);
+        TEST_ASSERT_EQUAL(Z_OK, deflate(&z, Z_SYNC_FLUSH));
+        size_t clen = sizeof(c) - z.avail_out - 4;
+        size_t fl = test_client_frame(in + o, 1, WS_OP_TEXT_FRAME, c, clen);
+        in[o] |= 0x40; // RSV1
+        o += fl;
+    }
+    deflateEnd(&z);
+    o += test_client_frame(in + o, 1, WS_OP_CONNECTION_CLOSE, NULL, 0);
+    ws_upgrade_t up = { .deflate = 1, .server_max_window_bits = 15 };
+    ssize_t n = 0;
+    g_test_deflate = &up;
+    int ret = test_run_session(in, o, out, sizeof(out), &n);
+    g_test_deflate = NULL;
+    TEST_ASSERT_EQUAL(0, ret);
+    TEST_ASSERT_EQUAL(2, g_rx.count);
+    TEST_ASSERT_EQUAL_STRING(text, g_rx.text);
+    // without negotiation RSV1 is a protocol error
+    TEST_ASSERT_EQUAL(-1, test_run_session(in, o, out, sizeof(out), &n));
+    TEST_ASSERT_EQUAL(0, g_rx.count);
+    ws_frame_pool_clear();
+}
+
+/** Queued frame n of a session, its payload and length. */
+static const unsigned char *test_queued_payload(ws_session_t *s, size_t n, unsigned char *opcode, size_t *len) {
+    ws_frame_t *f = s->outq[(s->out_head + n) % s->out_capacity];
+    *opcode = f->opcode;
+    *len = f->len - 2; // short control frames, two byte header
+    return f->data + f->offset + 2;
+}
+
+/**
+ * Requirement: the server shall ping the idle client with its send time,
+ * and measure the RTT from the echoing pong into the statistics.
+ */
+void test_ws_ping_rtt(void) {
+    ClientContext ctx = {0};
+    ws_session_t *s = ws_session_create(&ctx, NULL, NULL);
+    s->state = WS_STATE_IDLE;
+    TEST_ASSERT_EQUAL(1, ws_state_step(s));
+    TEST_ASSERT_EQUAL(1, s->out_count);
+    unsigned char opcode;
+    size_t len;
+    test_queued_payload(s, 0, &opcode, &len);
+    TEST_ASSERT_EQUAL(WS_OP_PING, opcode);
+    TEST_ASSERT_EQUAL(8, len);
+    TEST_ASSERT_TRUE(s->ping_sent_ms > 0);
+    // no second ping while the first one is unanswered
+    s->last_ping_sent = 0;
+    s->state = WS_STATE_IDLE;
+    ws_state_step(s);
+    TEST_ASSERT_EQUAL(1, s->out_count);
+
+    // an unsolicited pong does not count
+    unsigned char in[32];
+    s->frame_offset = test_client_frame((unsigned char *)s->frame, 1, WS_OP_PONG, (const unsigned char *)"x", 1);
+    s->state = WS_STATE_BUFFER_INSPECT;
+    ws_state_step(s);
+    TEST_ASSERT_TRUE(s->ping_sent_ms > 0);
+
+    // the echo of the ping, sent 30 ms earlier
+    s->ping_sent_ms -= 30;
+    for (int i = 0; i < 8; i++) in[i] = (unsigned char)((unsigned long long)s->ping_sent_ms >> (56 - 8 * i));
+    s->frame_offset = test_client_frame((unsigned char *)s->frame, 1, WS_OP_PONG, in, 8);
+    s->state = WS_STATE_BUFFER_INSPECT;
+    ws_state_step(s);
+    TEST_ASSERT_EQUAL(0, s->ping_sent_ms);
+    TEST_ASSERT_TRUE(s->rtt_ms >= 30 && s->rtt_ms < 50);
+    TEST_ASSERT_EQUAL(s->rtt_ms, s->measure.actual[WSM_RTT_MS].counter);
+    TEST_ASSERT_EQUAL(1, s->rtt_hist[2]); // 25..50 ms
+    TEST_ASSERT_EQUAL(2, s->measure.actual[WSM_LL_PONG].counter);
+
+    char buf[BUF_SIZE];
+    ws_measure_dump_str(s, buf, sizeof(buf));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "<50:1"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, ">=1000:0"));
+    // a short buffer is truncated, not overrun
+    TEST_ASSERT_EQUAL(15, ws_measure_dump_str(s, buf, 16));
+    ws_session_destroy(s);
+}
+
+/**
+ * Requirement: a session whose ping is not answered in time (half-open
+ * connection), or which sends no data for too long, shall be closed with
+ * 1001 and counted.
+ */
+void test_ws_liveness_eviction(void) {
+    ClientContext ctx = {0};
+    ws_set_liveness_config(10, 30, 60);
+    ws_session_t *s = ws_session_create(&ctx, NULL, NULL);
+    ws_set_liveness_config(0, 30, 0);
+    TEST_ASSERT_EQUAL(60, s->idle_timeout);
+    unsigned long pong_timeouts = ws_evictions(WS_EVICT_PONG_TIMEOUT);
+    unsigned long idle = ws_evictions(WS_EVICT_IDLE);
+
+    // alive: recent data, the ping is not late yet
+    s->last_data_rx = time(NULL);
+    s->ping_sent_ms = ws_now_ms() - 29000;
+    s->last_ping_sent = time(NULL);
+    s->state = WS_STATE_IDLE;
+    TEST_ASSERT_EQUAL(1, ws_state_step(s));
+    TEST_ASSERT_EQUAL(0, s->out_count);
+
+    s->ping_sent_ms = ws_now_ms() - 31000;
+    s->state = WS_STATE_IDLE;
+    TEST_ASSERT_EQUAL(0, ws_state_step(s));
+    TEST_ASSERT_EQUAL(WS_STATE_DONE, s->state);
+    TEST_ASSERT_EQUAL(pong_timeouts + 1, ws_evictions(WS_EVICT_PONG_TIMEOUT));
+    unsigned char opcode;
+    size_t len;
+    const unsigned char *p = test_queued_payload(s, 0, &opcode, &len);
+    TEST_ASSERT_EQUAL(WS_OP_CONNECTION_CLOSE, opcode);
+    TEST_ASSERT_EQUAL(2, len);
+    TEST_ASSERT_EQUAL_UINT8(0xE9, p[1]);
+
+    // answered pings, but no data
+    s->ping_sent_ms = 0;
+    s->last_data_rx = time(NULL) - 61;
+    s->state = WS_STATE_IDLE;
+    TEST_ASSERT_EQUAL(0, ws_state_step(s));
+    TEST_ASSERT_EQUAL(idle + 1, ws_evictions(WS_EVICT_IDLE));
+    ws_session_destroy(s);
+
+    // disabled timeouts never evict
+    s = ws_session_create(&ctx, NULL, NULL);
+    TEST_ASSERT_EQUAL(0, s->idle_timeout);
+    s->last_data_rx = 0;
+    s->last_ping_sent = time(NULL);
+    s->state = WS_STATE_IDLE;
+    TEST_ASSERT_EQUAL(1, ws_state_step(s));
+    ws_session_destroy(s);
+    ws_set_liveness_config(0, 0, 0);
+}
+
+/**
+ * Requirement: a peer which stalls in the middle of a frame is evicted too,
+ * the liveness does not wait for a frame boundary.
+ */
+void test_ws_liveness_partial_frame_stall(void) {
+    int sv[2];
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    ClientContext ctx = {0};
+    ctx.socket_fd = sv[0];
+    ws_set_liveness_config(1, 1, 0);
+    ws_session_t *s = ws_session_create(&ctx, NULL, NULL);
+    ws_set_liveness_config(0, 0, 0);
+    unsigned long pong_timeouts = ws_evictions(WS_EVICT_PONG_TIMEOUT);
+    // the header and the mask of a 5 byte text frame, then nothing
+    unsigned char partial[] = { 0x81, 0x85, 0x01, 0x02, 0x03, 0x04, 'h' ^ 0x01 };
+    TEST_ASSERT_EQUAL(sizeof(partial), write(sv[1], partial, sizeof(partial)));
+
+    TEST_ASSERT_EQUAL(0, ws_handle_ws_loop(s));
+    TEST_ASSERT_EQUAL(WS_STATE_DONE, s->state);
+    TEST_ASSERT_EQUAL(pong_timeouts + 1, ws_evictions(WS_EVICT_PONG_TIMEOUT));
+    // the ping went out during the stall, then the close with 1001
+    unsigned char rx[64];
+    ssize_t n = read(sv[1], rx, sizeof(rx));
+    TEST_ASSERT_EQUAL(2 + 8 + 2 + 2, n);
+    TEST_ASSERT_EQUAL_UINT8(0x89, rx[0]);
+    TEST_ASSERT_EQUAL_UINT8(0x88, rx[10]);
+    TEST_ASSERT_EQUAL_UINT8(0xE9, rx[13]);
+    ws_session_destroy(s);
+    close(sv[0]);
+    close(sv[1]);
+}
@@ -0,0 +1,143 @@
+/**
+ * File: test_wsgrid.c
+ *
+ * Test of the spatial interest grid of the WebSocket plugin.
+ * The radius queries are compared to a brute force scan, also around
+ * the poles and across the antimeridian, while the entries move.
+ */
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "wsgrid.h"
+#include "wsgrid.c"
+
+#define TEST_SLOTS (3000)
+
+static wsgrid_t g_grid;
+static double g_lat[TEST_SLOTS], g_lon[TEST_SLOTS];
+static unsigned int g_seed = 1;
+
+static double test_rand(double lo, double hi) {
+    g_seed = g_seed * 1103515245u + 12345u;
+    return lo + (hi - lo) * ((g_seed >> 8) & 0xFFFFFF) / (double)0xFFFFFF;
+}
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL(0, wsgrid_init(&g_grid, 2.0, TEST_SLOTS));
+}
+void tearDown(void) {
+    wsgrid_destroy(&g_grid);
+}
+
+/** Compares a query to the brute force result, the order does not matter. */
+static void test_check_query(double lat, double lon, double radius_km) {
+    static size_t out[TEST_SLOTS];
+    static unsigned char hit[TEST_SLOTS];
+    size_t n = wsgrid_query(&g_grid, lat, lon, radius_km, out, TEST_SLOTS);
+    memset(hit, 0, sizeof(hit));
+    for (size_t i = 0; i < n; i++) {
+        TEST_ASSERT_TRUE(out[i] < TEST_SLOTS);
+        TEST_ASSERT_EQUAL(0, hit[out[i]]);
+        hit[out[i]] = 1;
+    }
+    size_t expected = 0;
+    for (size_t i = 0; i < TEST_SLOTS; i++) {
+        if (g_lat[i] > 90.0) continue; // removed
+        int inside = wsgrid_distance_km(lat, lon, g_lat[i], g_lon[i]) <= radius_km;
+        expected += inside;
+        TEST_ASSERT_EQUAL(inside, hit[i]);
+    }
+    TEST_ASSERT_EQUAL(expected, n);
+}
+
+static void test_place_all(void) {
+    for (size_t i = 0; i < TEST_SLOTS; i++) {
+        g_lat[i] = test_rand(-90.0, 90.0);
+        g_lon[i] = test_rand(-180.0, 180.0);
+        TEST_ASSERT_EQUAL(0, wsgrid_update(&g_grid, i, g_lat[i], g_lon[i]));
+    }
+}
+
+void test_wsgrid_distance(void) {
+    TEST_ASSERT_TRUE(wsgrid_distance_km(0, 0, 0, 0) < 1e-9);
+    double d = wsgrid_distance_km(47.4979, 19.0402, 48.2082, 16.3738); // Budapest - Vienna
+    TEST_ASSERT_TRUE(d > 212.0 && d < 216.0);
+    d = wsgrid_distance_km(0, 179.5, 0, -179.5);
+    TEST_ASSERT_TRUE(d > 110.0 && d < 112.0);
+}
+
+void test_wsgrid_query_matches_brute_force(void) {
+    test_place_all();
+    TEST_ASSERT_EQUAL(TEST_SLOTS, g_grid.count);
+    static const double radius[] = { 0.0, 50.0, 300.0, 1500.0, 8000.0, 21000.0 };
+    for (int q = 0; q < 40; q++) {
+        double lat = test_rand(-90.0, 90.0), lon = test_rand(-180.0, 180.0);
+        test_check_query(lat, lon, radius[q % 6]);
+    }
+}
+
+void test_wsgrid_poles_and_antimeridian(void) {
+    test_place_all();
+    test_check_query(89.9, 10.0, 500.0);
+    test_check_query(-89.5, -170.0, 800.0);
+    test_check_query(85.0, 0.0, 600.0);     // the circle contains the pole
+    test_check_query(10.0, 179.8, 700.0);
+    test_check_query(-20.0, -179.9, 400.0);
+    test_check_query(0.0, 180.0, 1000.0);
+    test_check_query(90.0, 0.0, 100.0);
+}
+
+void test_wsgrid_move_and_remove(void) {
+    test_place_all();
+    for (int step = 0; step < 20; step++) {
+        for (size_t i = 0; i < TEST_SLOTS; i += 3) {
+            if ((i + step) % 7 == 0) {
+                wsgrid_remove(&g_grid, i);
+                g_lat[i] = 100.0;
+                continue;
+            }
+            g_lat[i] = test_rand(-90.0, 90.0);
+            g_lon[i] = test_rand(-180.0, 180.0);
+            TEST_ASSERT_EQUAL(0, wsgrid_update(&g_grid, i, g_lat[i], g_lon[i]));
+        }
+        test_check_query(test_rand(-60.0, 60.0), test_rand(-180.0, 180.0), 2000.0);
+    }
+    size_t in = 0;
+    for (size_t i = 0; i < TEST_SLOTS; i++) in += g_lat[i] <= 90.0;
+    TEST_ASSERT_EQUAL(in, g_grid.count);
+    double lat, lon;
+    TEST_ASSERT_EQUAL(-1, wsgrid_position(&g_grid, TEST_SLOTS, &lat, &lon));
+    wsgrid_remove(&g_grid, 5);
+    TEST_ASSERT_EQUAL(-1, wsgrid_position(&g_grid, 5, &lat, &lon));
+    TEST_ASSERT_EQUAL(0, wsgrid_update(&g_grid, 5, 1.5, -2.5));
+    TEST_ASSERT_EQUAL(0, wsgrid_position(&g_grid, 5, &lat, &lon));
+    TEST_ASSERT_TRUE(lat == 1.5 && lon == -2.5);
+}
+
+void test_wsgrid_rejects_invalid(void) {
+    TEST_ASSERT_EQUAL(-1, wsgrid_update(&g_grid, TEST_SLOTS, 0.0, 0.0));
+    TEST_ASSERT_EQUAL(-1, wsgrid_update(&g_grid, 0, 91.0, 0.0));
+    TEST_ASSERT_EQUAL(-1, wsgrid_update(&g_grid, 0, 0.0, -181.0));
+    TEST_ASSERT_EQUAL(0, wsgrid_update(&g_grid, 0, 90.0, 180.0));
+    size_t out[4];
+    TEST_ASSERT_EQUAL(1, wsgrid_query(&g_grid, 90.0, -180.0, 1.0, out, 4));
+    wsgrid_t bad;
+    TEST_ASSERT_EQUAL(-1, wsgrid_init(&bad, 0.0, 10));
+    TEST_ASSERT_EQUAL(-1, wsgrid_init(&bad, 1.0, 0));
+}
+
+void test_wsgrid_reserve(void) {
+    TEST_ASSERT_EQUAL(0, wsgrid_update(&g_grid, 7, 10.0, 20.0));
+    TEST_ASSERT_EQUAL(-1, wsgrid_update(&g_grid, TEST_SLOTS + 10, 10.0, 20.0));
+    TEST_ASSERT_EQUAL(0, wsgrid_reserve(&g_grid, TEST_SLOTS * 2));
+    TEST_ASSERT_EQUAL(0, wsgrid_reserve(&g_grid, 10));   // never shrinks
+    TEST_ASSERT_EQUAL(TEST_SLOTS * 2, g_grid.capacity);
+    double lat, lon;
+    TEST_ASSERT_EQUAL(-1, wsgrid_position(&g_grid, TEST_SLOTS + 10, &lat, &lon));
+    TEST_ASSERT_EQUAL(0, wsgrid_update(&g_grid, TEST_SLOTS + 10, 10.5, 20.5));
+    size_t out[4];
+    TEST_ASSERT_EQUAL(2, wsgrid_query(&g_grid, 10.0, 20.0, 200.0, out, 4));
+    TEST_ASSERT_EQUAL(0, wsgrid_position(&g_grid, 7, &lat, &lon));
+    TEST_ASSERT_TRUE(lat == 10.0 && lon == 20.0);
+}
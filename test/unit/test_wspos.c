@@ -0,0 +1,105 @@
+/**
+ * File: test_wspos.c
+ *
+ * Test of the binary position protocol (wspos.h).
+ * The golden message is what www/j/PositionProtocol.js encodes for the
+ * same record, so the two implementations of the schema stay in sync.
+ */
+#include "unity.h"
+#include <string.h>
+
+#include "wspos.h"
+#include "wspos.c"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+// Unity is built without double support
+static int test_near(double v, double expected, double eps) {
+    double d = v - expected;
+    return d <= eps && d >= -eps;
+}
+
+static const unsigned char g_golden[] = {
+    0x09, 0x01, 0x01, 0x00,
+    0x04, 0x03, 0x02, 0x01, 0xb8, 0x9a, 0x4f, 0x1c, 0x30, 0xb2, 0xa6, 0xf4,
+    0x00, 0x40, 0x00, 0x00, 0x80, 0xe1, 0x4e, 0x68
+};
+
+void test_wspos_encode_matches_client(void) {
+    wspos_record_t r = { 0x01020304, 47.4979, -19.0402, 90.0, 1750000000 };
+    unsigned char buf[64];
+    TEST_ASSERT_EQUAL(sizeof(g_golden), wspos_message_size(1));
+    TEST_ASSERT_EQUAL(WSPOS_HEADER_SIZE, wspos_encode_header(buf, sizeof(buf), WSPOS_KIND_USERS_POS, 1));
+    TEST_ASSERT_EQUAL(WSPOS_RECORD_SIZE, wspos_encode_record(buf + WSPOS_HEADER_SIZE, sizeof(buf) - WSPOS_HEADER_SIZE, &r));
+    TEST_ASSERT_EQUAL_MEMORY(g_golden, buf, sizeof(g_golden));
+}
+
+void test_wspos_decode_golden(void) {
+    wspos_kind_t kind;
+    size_t count = 0;
+    wspos_record_t r;
+    TEST_ASSERT_EQUAL(0, wspos_decode_header(g_golden, sizeof(g_golden), &kind, &count));
+    TEST_ASSERT_EQUAL(WSPOS_KIND_USERS_POS, kind);
+    TEST_ASSERT_EQUAL(1, count);
+    wspos_decode_record(g_golden, 0, &r);
+    TEST_ASSERT_EQUAL_UINT32(0x01020304, r.user_id);
+    TEST_ASSERT_TRUE(test_near(r.lat, 47.4979, 1e-7));
+    TEST_ASSERT_TRUE(test_near(r.lon, -19.0402, 1e-7));
+    TEST_ASSERT_TRUE(test_near(r.heading, 90.0, 1e-9));
+    TEST_ASSERT_EQUAL_UINT32(1750000000, r.timestamp);
+}
+
+void test_wspos_round_trip_precision(void) {
+    unsigned char buf[WSPOS_HEADER_SIZE + 50 * WSPOS_RECORD_SIZE];
+    size_t o = wspos_encode_header(buf, sizeof(buf), WSPOS_KIND_USERS_POS, 50);
+    for (int i = 0; i < 50; i++) {
+        wspos_record_t r = { (uint32_t)i, -90.0 + i * 3.6012345, -180.0 + i * 7.3456789, i * 7.3, 1000u * i };
+        o += wspos_encode_record(buf + o, sizeof(buf) - o, &r);
+    }
+    TEST_ASSERT_EQUAL(sizeof(buf), o);
+    size_t count = 0;
+    TEST_ASSERT_EQUAL(0, wspos_decode_header(buf, sizeof(buf), NULL, &count));
+    TEST_ASSERT_EQUAL(50, count);
+    for (int i = 0; i < 50; i++) {
+        wspos_record_t r;
+        wspos_decode_record(buf, i, &r);
+        TEST_ASSERT_EQUAL_UINT32(i, r.user_id);
+        TEST_ASSERT_TRUE(test_near(r.lat, -90.0 + i * 3.6012345, 0.51e-7));
+        TEST_ASSERT_TRUE(test_near(r.lon, -180.0 + i * 7.3456789, 0.51e-7));
+        TEST_ASSERT_TRUE(test_near(r.heading, i * 7.3, 360.0 / 65536));
+        TEST_ASSERT_EQUAL_UINT32(1000u * i, r.timestamp);
+    }
+}
+
+void test_wspos_limits(void) {
+    unsigned char buf[WSPOS_HEADER_SIZE + WSPOS_RECORD_SIZE];
+    wspos_record_t r = { 1, 95.0, 190.0, -90.0, 0 };
+    wspos_encode_header(buf, sizeof(buf), WSPOS_KIND_UPDATE_USER_POS, 1);
+    wspos_encode_record(buf + WSPOS_HEADER_SIZE, WSPOS_RECORD_SIZE, &r);
+    wspos_decode_record(buf, 0, &r);
+    TEST_ASSERT_TRUE(test_near(r.lat, 90.0, 1e-9));       // clamped
+    TEST_ASSERT_TRUE(test_near(r.lon, -170.0, 1e-7));     // wrapped
+    TEST_ASSERT_TRUE(test_near(r.heading, 270.0, 1e-9));  // normalized
+    TEST_ASSERT_EQUAL(-1, wspos_encode_record(buf, WSPOS_RECORD_SIZE - 1, &r));
+    TEST_ASSERT_EQUAL(-1, wspos_encode_header(buf, sizeof(buf), WSPOS_KIND_USERS_POS, WSPOS_MAX_RECORDS + 1));
+}
+
+void test_wspos_decode_rejects_malformed(void) {
+    unsigned char buf[sizeof(g_golden)];
+    memcpy(buf, g_golden, sizeof(buf));
+    TEST_ASSERT_EQUAL(-1, wspos_decode_header(buf, 3, NULL, NULL));
+    TEST_ASSERT_EQUAL(-1, wspos_decode_header(buf, sizeof(buf) - 1, NULL, NULL));
+    buf[1] = WSPOS_VERSION + 1;
+    TEST_ASSERT_EQUAL(-1, wspos_decode_header(buf, sizeof(buf), NULL, NULL));
+    buf[1] = WSPOS_VERSION;
+    buf[0] = 3;
+    TEST_ASSERT_EQUAL(-1, wspos_decode_header(buf, sizeof(buf), NULL, NULL));
+    buf[0] = WSPOS_KIND_USERS_POS;
+    buf[2] = 2;
+    TEST_ASSERT_EQUAL(-1, wspos_decode_header(buf, sizeof(buf), NULL, NULL));
+    const unsigned char empty[] = { WSPOS_KIND_USERS_POS, WSPOS_VERSION, 0, 0 };
+    size_t count = 1;
+    TEST_ASSERT_EQUAL(0, wspos_decode_header(empty, sizeof(empty), NULL, &count));
+    TEST_ASSERT_EQUAL(0, count);
+}
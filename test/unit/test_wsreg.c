@@ -0,0 +1,206 @@
+/**
+ * File: test_wsreg.c
+ *
+ * Test of the session registry (wsreg.h).
+ * The stress test runs connect/disconnect threads against lookup and
+ * broadcast threads: an item must never be freed while it is acquired, and
+ * every item must be freed exactly once.
+ */
+#include "unity.h"
+#include <string.h>
+#include <pthread.h>
+
+#include "wsreg.h"
+#include "wsreg.c"
+
+#define ITEM_MAGIC  (0x5e55104e)
+
+typedef struct {
+    int magic;
+    int user_id;
+} test_item_t;
+
+static const test_item_t g_item_init = { ITEM_MAGIC, WSREG_NO_USER };
+
+static int g_freed;
+static int g_bad_free;     // freed twice or not an item, counted: the threads can not assert
+
+static void test_free_item(void *item) {
+    test_item_t *t = (test_item_t *)item;
+    if (t->magic != ITEM_MAGIC) __atomic_add_fetch(&g_bad_free, 1, __ATOMIC_RELAXED);
+    t->magic = 0;
+    __atomic_add_fetch(&g_freed, 1, __ATOMIC_RELAXED);
+}
+
+void setUp(void) {
+    g_freed = 0;
+    g_bad_free = 0;
+}
+void tearDown(void) {
+    TEST_ASSERT_EQUAL(0, g_bad_free);
+}
+
+void test_wsreg_add_find_remove(void) {
+    wsreg_t r;
+    int sessions[40];
+    TEST_ASSERT_EQUAL(0, wsreg_init(&r, 4, test_free_item));
+    for (int i = 0; i < 40; i++) {
+        test_item_t *t = wsreg_add(&r, &sessions[i], &g_item_init, sizeof(test_item_t));
+        TEST_ASSERT_NOT_NULL(t);
+        TEST_ASSERT_EQUAL(ITEM_MAGIC, t->magic);
+        TEST_ASSERT_EQUAL(i, wsreg_slot(t));     // grown over the initial capacity
+        TEST_ASSERT_EQUAL(0, wsreg_set_user(&r, &sessions[i], 1000 + i));
+    }
+    TEST_ASSERT_NULL(wsreg_add(&r, &sessions[3], &g_item_init, sizeof(test_item_t)));
+    TEST_ASSERT_EQUAL(40, wsreg_count(&r));
+    for (int i = 0; i < 40; i++) {
+        test_item_t *t = wsreg_find(&r, &sessions[i]);
+        TEST_ASSERT_NOT_NULL(t);
+        TEST_ASSERT_EQUAL(i, wsreg_slot(t));
+        wsreg_release(t);
+        t = wsreg_find_user(&r, 1000 + i);
+        TEST_ASSERT_NOT_NULL(t);
+        TEST_ASSERT_EQUAL(i, wsreg_slot(t));
+        wsreg_release(t);
+    }
+    TEST_ASSERT_NULL(wsreg_find_user(&r, 999));
+
+    // a removed item lives until the last release, its slot is reused
+    test_item_t *held = wsreg_get(&r, 7);
+    TEST_ASSERT_EQUAL(0, wsreg_remove(&r, &sessions[7]));
+    TEST_ASSERT_EQUAL(-1, wsreg_remove(&r, &sessions[7]));
+    TEST_ASSERT_NULL(wsreg_find(&r, &sessions[7]));
+    TEST_ASSERT_NULL(wsreg_find_user(&r, 1007));
+    TEST_ASSERT_NULL(wsreg_get(&r, 7));
+    TEST_ASSERT_EQUAL(0, g_freed);
+    TEST_ASSERT_EQUAL(ITEM_MAGIC, held->magic);
+    wsreg_release(held);
+    TEST_ASSERT_EQUAL(1, g_freed);
+    test_item_t *t = wsreg_add(&r, &sessions[7], &g_item_init, sizeof(test_item_t));
+    TEST_ASSERT_EQUAL(7, wsreg_slot(t));
+
+    // user index follows the changes
+    TEST_ASSERT_EQUAL(0, wsreg_set_user(&r, &sessions[7], 1003));
+    TEST_ASSERT_EQUAL(0, wsreg_remove(&r, &sessions[3]));
+    t = wsreg_find_user(&r, 1003);
+    TEST_ASSERT_NOT_NULL(t);
+    TEST_ASSERT_EQUAL(7, wsreg_slot(t));
+    wsreg_release(t);
+    TEST_ASSERT_EQUAL(0, wsreg_set_user(&r, &sessions[7], WSREG_NO_USER));
+    TEST_ASSERT_NULL(wsreg_find_user(&r, 1003));
+
+    TEST_ASSERT_EQUAL(39, wsreg_count(&r));
+    wsreg_destroy(&r);
+    TEST_ASSERT_EQUAL(41, g_freed);
+}
+
+static int test_count_visit(void *item, void *arg) {
+    if (((test_item_t *)item)->magic == ITEM_MAGIC) (*(int *)arg)++;
+    return 0;
+}
+
+void test_wsreg_foreach(void) {
+    wsreg_t r;
+    int sessions[10];
+    wsreg_init(&r, 0, test_free_item);
+    for (int i = 0; i < 10; i++) {
+        wsreg_add(&r, &sessions[i], &g_item_init, sizeof(test_item_t));
+    }
+    wsreg_remove(&r, &sessions[2]);
+    wsreg_remove(&r, &sessions[5]);
+    int visited = 0;
+    TEST_ASSERT_EQUAL(8, wsreg_foreach(&r, test_count_visit, &visited));
+    TEST_ASSERT_EQUAL(8, visited);
+    wsreg_destroy(&r);
+    TEST_ASSERT_EQUAL(10, g_freed);
+}
+
+/**
+ * Stress: every connection thread owns a few sessions and keeps
+ * connecting, logging in and disconnecting them. The readers look them up
+ * by session, user and slot, and broadcast to all of them.
+ */
+#define STRESS_CONNECTORS   (4)
+#define STRESS_READERS      (4)
+#define STRESS_SESSIONS     (32)    // per connector
+#define STRESS_ROUNDS       (2000)
+
+static wsreg_t g_stress;
+static int g_stress_sessions[STRESS_CONNECTORS][STRESS_SESSIONS];
+static int g_stress_running;
+static int g_stress_added;
+static int g_stress_lost;  // a session neither added nor removed
+
+static void *stress_connector(void *arg) {
+    int c = (int)(size_t)arg;
+    unsigned int seed = (unsigned int)c * 7919u + 1;
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        int k = rand_r(&seed) % STRESS_SESSIONS;
+        void *session = &g_stress_sessions[c][k];
+        test_item_t init = { ITEM_MAGIC, c * STRESS_SESSIONS + k };
+        test_item_t *t = wsreg_add(&g_stress, session, &init, sizeof(test_item_t));
+        if (t) {
+            wsreg_set_user(&g_stress, session, t->user_id);
+            __atomic_add_fetch(&g_stress_added, 1, __ATOMIC_RELAXED);
+        } else if (wsreg_remove(&g_stress, session)) {
+            __atomic_add_fetch(&g_stress_lost, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static int stress_visit(void *item, void *arg) {
+    (void)arg;
+    test_item_t *t = (test_item_t *)item;
+    return t->magic != ITEM_MAGIC; // never stops while the items are valid
+}
+
+static void *stress_reader(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg * 104729u + 3;
+    size_t bad = 0;
+    while (__atomic_load_n(&g_stress_running, __ATOMIC_ACQUIRE)) {
+        int c = rand_r(&seed) % STRESS_CONNECTORS;
+        int k = rand_r(&seed) % STRESS_SESSIONS;
+        test_item_t *t = wsreg_find(&g_stress, &g_stress_sessions[c][k]);
+        if (t && t->magic != ITEM_MAGIC) bad++;
+        wsreg_release(t);
+        t = wsreg_find_user(&g_stress, c * STRESS_SESSIONS + k);
+        if (t && t->magic != ITEM_MAGIC) bad++;
+        wsreg_release(t);
+        size_t cap = wsreg_capacity(&g_stress);
+        t = cap ? wsreg_get(&g_stress, (size_t)rand_r(&seed) % cap) : NULL;
+        if (t && t->magic != ITEM_MAGIC) bad++;
+        wsreg_release(t);
+        wsreg_foreach(&g_stress, stress_visit, NULL);
+    }
+    return (void *)bad;
+}
+
+void test_wsreg_stress(void) {
+    pthread_t connectors[STRESS_CONNECTORS], readers[STRESS_READERS];
+    TEST_ASSERT_EQUAL(0, wsreg_init(&g_stress, 8, test_free_item));
+    g_stress_running = 1;
+    g_stress_added = 0;
+    g_stress_lost = 0;
+    for (int i = 0; i < STRESS_READERS; i++) {
+        pthread_create(&readers[i], NULL, stress_reader, (void *)(size_t)i);
+    }
+    for (int i = 0; i < STRESS_CONNECTORS; i++) {
+        pthread_create(&connectors[i], NULL, stress_connector, (void *)(size_t)i);
+    }
+    for (int i = 0; i < STRESS_CONNECTORS; i++) pthread_join(connectors[i], NULL);
+    __atomic_store_n(&g_stress_running, 0, __ATOMIC_RELEASE);
+    size_t bad = 0;
+    for (int i = 0; i < STRESS_READERS; i++) {
+        void *ret;
+        pthread_join(readers[i], &ret);
+        bad += (size_t)ret;
+    }
+    TEST_ASSERT_EQUAL(0, bad);
+    TEST_ASSERT_EQUAL(0, g_stress_lost);
+    size_t left = wsreg_count(&g_stress);
+    TEST_ASSERT_TRUE(wsreg_capacity(&g_stress) <= STRESS_CONNECTORS * STRESS_SESSIONS);
+    TEST_ASSERT_EQUAL(g_stress_added - (int)left, g_freed);
+    wsreg_destroy(&g_stress);
+    TEST_ASSERT_EQUAL(g_stress_added, g_freed);
+}
@@ -0,0 +1,196 @@
+/**
+ * File: test_wssync.c
+ *
+ * Test of the delta synchronization (wssync.h).
+ * A scripted sequence of changes is replayed against a store, with two
+ * sessions syncing in between; every sync has to deliver exactly the
+ * minimal delta: each changed entity once, at its last version.
+ */
+#include "unity.h"
+#include <string.h>
+
+#include "wssync.h"
+#include "wssync.c"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+typedef enum {
+    STEP_TOUCH,
+    STEP_REMOVE,
+    STEP_SYNC,      // arg: session, expect: "id,id,-id" (removed ones negative)
+    STEP_REFRESH    // arg: session, its vector is reset
+} step_op_t;
+
+typedef struct {
+    step_op_t op;
+    int arg;
+    const char *expect;
+    int full;
+} step_t;
+
+/** test_replay
+ * Replay the steps, compare every sync to its expected change list.
+ */
+static void test_replay(wssync_store_t *st, const step_t *steps, size_t n) {
+    wssync_vector_t sessions[2];
+    memset(sessions, 0, sizeof(sessions));
+    for (size_t k = 0; k < n; k++) {
+        const step_t *s = &steps[k];
+        switch (s->op) {
+            case STEP_TOUCH: TEST_ASSERT_TRUE(wssync_touch(st, s->arg) > 0); break;
+            case STEP_REMOVE: wssync_remove(st, s->arg); break;
+            case STEP_REFRESH: sessions[s->arg].sent[WSSYNC_USERS] = 0; break;
+            case STEP_SYNC: {
+                wssync_change_t out[32];
+                uint32_t upto = 0;
+                int full = -1;
+                uint32_t *since = &sessions[s->arg].sent[WSSYNC_USERS];
+                size_t c = wssync_delta(st, *since, out, 32, &upto, &full);
+                char got[128] = "";
+                for (size_t i = 0; i < c; i++) {
+                    TEST_ASSERT_TRUE(out[i].version > (full ? 0 : *since));
+                    TEST_ASSERT_TRUE(out[i].version <= upto);
+                    if (i) TEST_ASSERT_TRUE(out[i].version > out[i - 1].version);
+                    snprintf(got + strlen(got), sizeof(got) - strlen(got), "%s%d", i ? "," : "",
+                        out[i].deleted ? -out[i].id : out[i].id);
+                }
+                TEST_ASSERT_EQUAL_STRING_MESSAGE(s->expect, got, "delta of a scripted sync");
+                TEST_ASSERT_EQUAL(s->full, full);
+                *since = upto;
+                break;
+            }
+        }
+    }
+}
+
+void test_wssync_scripted_deltas(void) {
+    static const step_t steps[] = {
+        { STEP_TOUCH, 1, NULL, 0 },
+        { STEP_TOUCH, 2, NULL, 0 },
+        { STEP_TOUCH, 3, NULL, 0 },
+        { STEP_SYNC, 0, "1,2,3", 1 },       // first sync is full
+        { STEP_SYNC, 0, "", 0 },            // nothing changed
+        { STEP_TOUCH, 2, NULL, 0 },
+        { STEP_TOUCH, 2, NULL, 0 },
+        { STEP_TOUCH, 1, NULL, 0 },
+        { STEP_SYNC, 0, "2,1", 0 },         // each changed entity once
+        { STEP_REMOVE, 3, NULL, 0 },
+        { STEP_REMOVE, 3, NULL, 0 },        // already removed: no change
+        { STEP_TOUCH, 4, NULL, 0 },
+        { STEP_SYNC, 0, "-3,4", 0 },
+        { STEP_SYNC, 1, "2,1,4", 1 },       // a new session skips tombstones
+        { STEP_REMOVE, 4, NULL, 0 },
+        { STEP_TOUCH, 4, NULL, 0 },         // revived
+        { STEP_SYNC, 1, "4", 0 },
+        { STEP_SYNC, 0, "4", 0 },
+        { STEP_REFRESH, 0, NULL, 0 },
+        { STEP_SYNC, 0, "2,1,4", 1 },       // refresh is the full resend
+        { STEP_SYNC, 0, "", 0 },
+        { STEP_SYNC, 1, "", 0 },
+    };
+    wssync_store_t st;
+    TEST_ASSERT_EQUAL(0, wssync_init(&st, 0));
+    test_replay(&st, steps, sizeof(steps) / sizeof(steps[0]));
+    TEST_ASSERT_EQUAL(0, wssync_version(&st, 3));
+    TEST_ASSERT_EQUAL(st.clock, wssync_version(&st, 4));
+    wssync_destroy(&st);
+}
+
+void test_wssync_delta_in_chunks(void) {
+    wssync_store_t st;
+    wssync_init(&st, 0);
+    for (int id = 1; id <= 10; id++) wssync_touch(&st, id);
+    wssync_remove(&st, 5);
+    wssync_change_t out[4];
+    uint32_t since = 0, upto = 0;
+    int full = 0, chunks = 0;
+    char got[64] = "";
+    size_t c;
+    // 9 live entities, 4 per message: only the first chunk rebuilds, the rest
+    // continues as a delta and ends with the tombstone of entity 5
+    while ((c = wssync_delta(&st, since, out, 4, &upto, &full)) > 0) {
+        TEST_ASSERT_EQUAL(chunks == 0, full);
+        for (size_t i = 0; i < c; i++) {
+            snprintf(got + strlen(got), sizeof(got) - strlen(got), "%s%d", *got ? "," : "",
+                out[i].deleted ? -out[i].id : out[i].id);
+        }
+        since = upto;
+        chunks++;
+    }
+    TEST_ASSERT_EQUAL_STRING("1,2,3,4,6,7,8,9,10,-5", got);
+    TEST_ASSERT_EQUAL(3, chunks);
+    TEST_ASSERT_EQUAL(st.clock, since);
+    wssync_destroy(&st);
+}
+
+void test_wssync_purge_horizon_forces_full(void) {
+    wssync_store_t st;
+    wssync_init(&st, 4);
+    for (int id = 1; id <= 20; id++) wssync_touch(&st, id);
+    wssync_change_t out[32];
+    uint32_t early = 0, late = 0;
+    int full = 0;
+    wssync_delta(&st, 0, out, 32, &early, &full);
+    for (int id = 1; id <= 5; id++) wssync_remove(&st, id);    // over the limit: purged
+    TEST_ASSERT_TRUE(st.tombstones <= 2);
+    TEST_ASSERT_TRUE(st.horizon > early);
+    TEST_ASSERT_EQUAL(17, st.count);
+    size_t c = wssync_delta(&st, early, out, 32, &late, &full);
+    TEST_ASSERT_EQUAL(1, full);     // behind the horizon
+    TEST_ASSERT_EQUAL(15, c);
+    for (size_t i = 0; i < c; i++) {
+        TEST_ASSERT_EQUAL(0, out[i].deleted);
+        TEST_ASSERT_EQUAL(6 + (int)i, out[i].id);
+    }
+    // in sync after the full resend, the list is still in version order
+    TEST_ASSERT_EQUAL(0, wssync_delta(&st, late, out, 32, &late, &full));
+    TEST_ASSERT_EQUAL(0, full);
+    wssync_touch(&st, 7);
+    wssync_remove(&st, 20);
+    c = wssync_delta(&st, late, out, 32, &late, &full);
+    TEST_ASSERT_EQUAL(2, c);
+    TEST_ASSERT_EQUAL(7, out[0].id);
+    TEST_ASSERT_EQUAL(20, out[1].id);
+    TEST_ASSERT_EQUAL(1, out[1].deleted);
+    wssync_destroy(&st);
+}
+
+void test_wssync_up_to_date_is_free(void) {
+    wssync_store_t st;
+    wssync_init(&st, 0);
+    wssync_change_t out[1];
+    uint32_t upto = 7;
+    int full = 0;
+    TEST_ASSERT_EQUAL(0, wssync_delta(&st, 0, out, 1, &upto, &full));
+    TEST_ASSERT_EQUAL(0, upto);
+    TEST_ASSERT_EQUAL(0, wssync_remove(&st, 1));     // unknown entity
+    TEST_ASSERT_EQUAL(1, wssync_touch(&st, 1));
+    TEST_ASSERT_EQUAL(1, wssync_delta(&st, 0, out, 1, &upto, &full));
+    TEST_ASSERT_EQUAL(0, wssync_delta(&st, upto, out, 1, &upto, &full));
+    TEST_ASSERT_EQUAL(1, upto);
+    wssync_destroy(&st);
+}
+
+void test_wssync_id_index(void) {
+    wssync_store_t st;
+    wssync_init(&st, 16);
+    // over the first buckets, with negative and colliding looking ids
+    for (int id = -100; id < 200; id++) wssync_touch(&st, id * 1024);
+    TEST_ASSERT_TRUE(st.buckets >= st.count);
+    for (int id = -100; id < 0; id++) wssync_remove(&st, id * 1024);   // purges, entities move
+    TEST_ASSERT_TRUE(st.count < 300);
+    for (int id = -100; id < 200; id++) {
+        uint32_t v = wssync_version(&st, id * 1024);
+        if (id < 0) TEST_ASSERT_EQUAL(0, v);
+        else TEST_ASSERT_TRUE(v > 0);
+    }
+    // every entity is found in the index where it is stored
+    for (size_t i = 0; i < st.count; i++) {
+        TEST_ASSERT_EQUAL((int)i, wssync_find(&st, st.entities[i].id));
+    }
+    uint32_t v = wssync_touch(&st, -50 * 1024);    // revived after purged
+    TEST_ASSERT_EQUAL(v, wssync_version(&st, -50 * 1024));
+    TEST_ASSERT_EQUAL(WSSYNC_NONE, wssync_find(&st, 7));
+    wssync_destroy(&st);
+}
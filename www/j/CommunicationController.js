@@ -1,3 +1,5 @@
+import { POS_FORMAT_NAME, PosKind, encodePositions, decodePositions } from './PositionProtocol.js';
+
 const INITIAL_RECONNECT_DELAY_MS = 2000;
 const MAX_RECONNECT_DELAY_MS = 30000;
 const MAX_RECONNECT_ATTEMPTS = 5;
@@ -10,6 +12,7 @@ export class CommunicationController {
         this.socket = null;
         this.reconnectDelay = INITIAL_RECONNECT_DELAY_MS;
         this.manualClose = false;
+        this.posFormat = 'json'; // negotiated in hello, the server answers it in user_data
 
         this.messageHandlers = [];
         this.closeHandlers = [];
@@ -91,6 +94,8 @@ export class CommunicationController {
     connect() {
         console.log("[Comm] Connecting to", this.url);
         this.socket = new WebSocket(this.url);
+        this.socket.binaryType = 'arraybuffer';
+        this.posFormat = 'json';
 
         this.socket.onopen = () => {
             console.log("[Comm] Connection established");
@@ -106,7 +111,19 @@ export class CommunicationController {
         };
 
         this.socket.onmessage = (event) => {
+            if (event.data instanceof ArrayBuffer) {
+                const positions = decodePositions(event.data);
+                if (positions) {
+                    this.messageHandlers.forEach(cb => cb(positions));
+                } else {
+                    console.warn("[Comm] Invalid binary message");
+                }
+                return;
+            }
             const message = JSON.parse(event.data);
+            if (message.type === 'user_data' && message.pos_format) {
+                this.posFormat = message.pos_format;
+            }
             if (message.type === 'ping') {
                 if (this.pingTimeout) {
                     clearTimeout(this.pingTimeout);
@@ -157,7 +174,42 @@ export class CommunicationController {
     }
     sendHello() {
         if (this.isOpen()) {
-            this.send({ type: 'hello' });
+            this.send({ type: 'hello', pos_formats: [POS_FORMAT_NAME, 'json'] });
+        }
+    }
+    // The server sends {type: 'sync', kind, full, version, changed, removed}
+    // deltas periodically; a refresh asks for everything again (full: true).
+    requestRefresh() {
+        this.send({ type: 'refresh' });
+    }
+    sendBinary(buf) {
+        if (this.isOpen()) {
+            this.socket.send(buf);
+        } else {
+            console.warn("[Comm] Cannot send, socket not open");
+        }
+    }
+    // Position messages go in the negotiated format, the answers arrive as
+    // {type: 'users_pos', users: [...]} either way.
+    sendUserPos(lat, lon, heading = 0, alt = undefined) {
+        if (this.posFormat === POS_FORMAT_NAME) {
+            this.sendBinary(encodePositions(PosKind.UPDATE_USER_POS, [{ lat, lon, heading }]));
+        } else {
+            this.send({ type: 'update_user_pos', lat, lon, heading, ...(alt !== undefined ? { alt } : {}) });
+        }
+    }
+    requestUserPos(userId) {
+        if (this.posFormat === POS_FORMAT_NAME) {
+            this.sendBinary(encodePositions(PosKind.GET_USER_POS, [{ user_id: userId }]));
+        } else {
+            this.send({ type: 'get_user_pos', user_id: userId });
+        }
+    }
+    requestUsersPos() {
+        if (this.posFormat === POS_FORMAT_NAME) {
+            this.sendBinary(encodePositions(PosKind.USERS_POS));
+        } else {
+            this.send({ type: 'users_pos' });
         }
     }
     sendPong() {
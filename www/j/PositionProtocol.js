@@ -0,0 +1,75 @@
+// Binary position protocol, the schema of src/plugin_ws/wspos.h.
+// Fixed size little-endian records, the message kinds are the ids of the JSON types.
+
+export const POS_FORMAT_NAME = 'bin1';
+export const POS_VERSION = 1;
+export const POS_HEADER_SIZE = 4;
+export const POS_RECORD_SIZE = 20;
+
+export const PosKind = Object.freeze({
+    UPDATE_USER_POS: 7,
+    GET_USER_POS: 8,
+    USERS_POS: 9,
+});
+
+const KIND_TYPES = {
+    [PosKind.UPDATE_USER_POS]: 'update_user_pos',
+    [PosKind.GET_USER_POS]: 'get_user_pos',
+    [PosKind.USERS_POS]: 'users_pos',
+};
+
+const COORD_SCALE = 1e7;
+const HEADING_SCALE = 65536 / 360;
+
+function clamp(v, limit) {
+    if (!Number.isFinite(v)) return 0;
+    return Math.max(-limit, Math.min(limit, v));
+}
+
+/**
+ * Encodes a message of the given kind with the records
+ * ({user_id, lat, lon, heading, timestamp}), returns an ArrayBuffer.
+ */
+export function encodePositions(kind, records = []) {
+    const buf = new ArrayBuffer(POS_HEADER_SIZE + records.length * POS_RECORD_SIZE);
+    const dv = new DataView(buf);
+    dv.setUint8(0, kind);
+    dv.setUint8(1, POS_VERSION);
+    dv.setUint16(2, records.length, true);
+    records.forEach((r, i) => {
+        const o = POS_HEADER_SIZE + i * POS_RECORD_SIZE;
+        const heading = ((Number(r.heading) || 0) % 360 + 360) % 360;
+        dv.setUint32(o, r.user_id || 0, true);
+        dv.setInt32(o + 4, Math.round(clamp(r.lat, 90) * COORD_SCALE), true);
+        dv.setInt32(o + 8, Math.round(clamp(r.lon, 180) * COORD_SCALE), true);
+        dv.setUint16(o + 12, Math.round(heading * HEADING_SCALE) & 0xFFFF, true);
+        dv.setUint16(o + 14, 0, true);
+        dv.setUint32(o + 16, r.timestamp || 0, true);
+    });
+    return buf;
+}
+
+/**
+ * Decodes a binary message into the same shape as the JSON one:
+ * {type, users: [{user_id, lat, lon, heading, timestamp}]}, or null if malformed.
+ */
+export function decodePositions(buf) {
+    if (!(buf instanceof ArrayBuffer) || buf.byteLength < POS_HEADER_SIZE) return null;
+    const dv = new DataView(buf);
+    const type = KIND_TYPES[dv.getUint8(0)];
+    const count = dv.getUint16(2, true);
+    if (!type || dv.getUint8(1) !== POS_VERSION) return null;
+    if (buf.byteLength !== POS_HEADER_SIZE + count * POS_RECORD_SIZE) return null;
+    const users = [];
+    for (let i = 0; i < count; i++) {
+        const o = POS_HEADER_SIZE + i * POS_RECORD_SIZE;
+        users.push({
+            user_id: dv.getUint32(o, true),
+            lat: dv.getInt32(o + 4, true) / COORD_SCALE,
+            lon: dv.getInt32(o + 8, true) / COORD_SCALE,
+            heading: dv.getUint16(o + 12, true) / HEADING_SCALE,
+            timestamp: dv.getUint32(o + 16, true),
+        });
+    }
+    return { type, users };
+}